@@ -0,0 +1,811 @@
+// dfsbench.c - Load Generator and Benchmark for COMP8567 DFS
+// Starts S1-S4 on localhost with a temporary HOME directory, runs a number of virtual
+// clients against S1 over the same framed protocol as w25clients, and reports the
+// throughput and latency percentiles of each operation. Since the servers and their
+// storage are created afresh for every run, any change can be measured the same way.
+//
+//     dfsbench [--clients N] [--duration SECONDS] [--rate OPS] [--mix OP=WEIGHT,...]
+//              [--size SIZE|MIN-MAX|lognormal:MEDIAN,SIGMA] [--types .pdf,.txt,...]
+//              [--files N] [--port N] [--bin DIR] [--seed N] [--no-spawn] [--keep]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <limits.h>
+
+#define SERVER_IP "127.0.0.1"
+#define BENCH_PORT 17010          // S1 of the spawned system; S2, S3 and S4 take the next three.
+#define DFS_PORT 7010             // S1 of an already running system (--no-spawn).
+#define BUFSIZE 1024
+#define RELAY_CHUNK (64 * 1024)   // Bytes received per call when draining a reply.
+#define CLIENTS_MAX 1024
+#define TYPES_MAX 8
+#define START_TIMEOUT_MS 5000     // How long the spawned servers get to start listening.
+
+// Binary framing, as in w25clients.c. A framed message is a frame_hdr in network byte order,
+// fields_len bytes of typed fields (type byte, 16-bit length, value), then payload_len bytes
+// of raw data such as file contents.
+#define FRAME_MAGIC 0x44465331u     // "DFS1"
+#define FRAME_VERSION 1
+#define FRAME_FIELDS_MAX 2048       // Largest field area accepted in one message.
+#define FRAME_ERROR 0x01            // Reply flag: the request failed, FIELD_TEXT says why.
+
+enum { OP_UPLOADF = 1, OP_DOWNLF, OP_REMOVEF, OP_DOWNLTAR, OP_DISPFNAMES, OP_REPLY, OP_STAT, OP_LIST, OP_STATS };
+enum { FIELD_PATH = 1, FIELD_NAME, FIELD_TYPE, FIELD_TEXT, FIELD_SIZE, FIELD_MTIME, FIELD_OFFSET, FIELD_TRACE };
+
+struct frame_hdr {
+    uint32_t magic;
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t version;
+    uint32_t req_id;          // Chosen by the requester and echoed in the reply.
+    uint32_t fields_len;
+    uint64_t payload_len;
+};
+
+// A received message: the decoded header and its field area.
+struct frame {
+    int opcode;
+    int flags;
+    uint32_t req_id;
+    long payload_len;
+    int fields_len;
+    char fields[FRAME_FIELDS_MAX];
+};
+
+// Latency histograms, as in the servers: HIST_SUB buckets per power of two microseconds,
+// so a quantile read from one is within about 3% of the true value.
+#define HIST_SUB 16
+#define HIST_BUCKETS (40 * HIST_SUB)       // Up to 2^43 us.
+
+struct hist {
+    unsigned long count;
+    unsigned long sum_us;
+    unsigned long bucket[HIST_BUCKETS];
+};
+
+// Results of one operation, shared by all clients.
+struct op_result {
+    unsigned long errors, bytes;
+    struct hist latency;
+};
+
+static const char *op_names[] = { "", "uploadf", "downlf", "removef", "downltar", "dispfnames" };
+#define OP_BENCH_MAX OP_DISPFNAMES
+
+// The workload. Weights give the share of each operation in the mix; a downlf or removef
+// issued while its client has no files left becomes an uploadf instead.
+static int weight[OP_BENCH_MAX + 1] = { 0, 30, 50, 5, 5, 10 };
+static int weight_sum;
+static int nclients = 8;
+static int duration = 10;                  // Seconds measured, after the files are preloaded.
+static double rate = 0;                    // Requests per second over all clients; 0 is a closed loop.
+static int preload = 20;                   // Files each client uploads before measuring.
+static long size_min = 4096, size_max = 4096;
+static double size_median = 0, size_sigma = 0;   // Lognormal sizes, when size_median > 0.
+static char types[TYPES_MAX][16] = { ".pdf", ".txt", ".zip", ".c" };
+static int ntypes = 4;
+static int port = 0;
+static unsigned long seed = 1;
+static char *payload;                      // Random bytes that uploads are cut from.
+static long payload_len;
+
+static struct op_result results[OP_BENCH_MAX + 1];
+static pthread_barrier_t ready;            // Clients wait here until all have preloaded.
+static volatile int stop = 0;
+static long bench_start;                   // When measuring started.
+
+// One virtual client: its connection to S1, its own directory and the files it has stored.
+struct client {
+    int id;
+    int sock;
+    uint32_t next_req_id;
+    unsigned long rng;
+    char dir[64];             // ~S1/bench/c<id>
+    int nfiles, cap, serial;
+    char (*files)[32];        // Names of its stored files.
+};
+
+// Servers started by this run.
+static pid_t server_pid[4];
+static char home[64];
+
+void usage(void);
+int parse_mix(const char *);
+int parse_size(const char *);
+int parse_types(const char *);
+long parse_bytes(const char *);
+int spawn_servers(const char *, int);
+void stop_servers(int);
+int wait_listening(int, int);
+int connect_s1(void);
+void *client_run(void *);
+long client_op(struct client *, int);
+void report(double);
+unsigned long rng_next(unsigned long *);
+double rng_unit(unsigned long *);
+long pick_size(struct client *);
+long now_us(void);
+int request(struct client *, int, int, const char*, int, const char*, long);
+long reply(struct client *, int *);
+int drain(int, long);
+int send_all(int, const char*, long);
+int recv_all(int, void*, long);
+int frame_add(char*, int, int, const char*);
+int frame_pack(char*, int, int, uint32_t, const char*, int, long);
+int frame_send(int, int, int, uint32_t, const char*, int, long);
+int frame_recv(int, struct frame*);
+void hist_record(struct hist*, long);
+double hist_quantile(const struct hist*, double);
+
+int main(int argc, char *argv[]) {
+    char self[512], bindir[512];
+    int spawn = 1, keep = 0;
+
+    // The servers are looked for beside dfsbench unless --bin says otherwise.
+    snprintf(self, sizeof(self), "%s", argv[0]);
+    snprintf(bindir, sizeof(bindir), "%s", strchr(argv[0], '/') ? dirname(self) : ".");
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        int bad = 0;
+        if (strcmp(arg, "--no-spawn") == 0) {
+            spawn = 0;
+            continue;
+        }
+        if (strcmp(arg, "--keep") == 0) {
+            keep = 1;
+            continue;
+        }
+        if (!val) {
+            usage();
+            return 1;
+        }
+        i++;
+        if (strcmp(arg, "--clients") == 0)
+            bad = (nclients = atoi(val)) <= 0 || nclients > CLIENTS_MAX;
+        else if (strcmp(arg, "--duration") == 0)
+            bad = (duration = atoi(val)) <= 0;
+        else if (strcmp(arg, "--rate") == 0)
+            bad = (rate = atof(val)) < 0;
+        else if (strcmp(arg, "--mix") == 0)
+            bad = parse_mix(val) != 0;
+        else if (strcmp(arg, "--size") == 0)
+            bad = parse_size(val) != 0;
+        else if (strcmp(arg, "--types") == 0)
+            bad = parse_types(val) != 0;
+        else if (strcmp(arg, "--files") == 0)
+            bad = (preload = atoi(val)) < 0;
+        else if (strcmp(arg, "--port") == 0)
+            bad = (port = atoi(val)) <= 0;
+        else if (strcmp(arg, "--seed") == 0)
+            seed = strtoul(val, NULL, 10);
+        else if (strcmp(arg, "--bin") == 0)
+            snprintf(bindir, sizeof(bindir), "%s", val);
+        else
+            bad = 1;
+        if (bad) {
+            usage();
+            return 1;
+        }
+    }
+    for (int op = 1; op <= OP_BENCH_MAX; op++)
+        weight_sum += weight[op];
+    if (port == 0)
+        port = spawn ? BENCH_PORT : DFS_PORT;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (spawn && spawn_servers(bindir, port) != 0) {
+        stop_servers(keep);
+        return 1;
+    }
+
+    // Uploads are cut from one buffer of random bytes, so no time goes to making data.
+    payload_len = size_median > 0 ? (long)(size_median * exp(4 * size_sigma)) : size_max;
+    if (payload_len < size_max)
+        payload_len = size_max;
+    payload = malloc(payload_len > 0 ? payload_len : 1);
+    if (!payload) {
+        printf("Out of memory.\n");
+        stop_servers(keep);
+        return 1;
+    }
+    unsigned long r = seed;
+    for (long i = 0; i < payload_len; i++)
+        payload[i] = rng_next(&r);
+
+    printf("dfsbench: %d clients, %d s, %s, %d files preloaded per client, S1 on port %d\n",
+           nclients, duration, rate > 0 ? "open loop" : "closed loop", preload, port);
+    if (rate > 0)
+        printf("          target rate %.1f requests/s\n", rate);
+
+    // Every client preloads its files, then all of them start measuring together.
+    static struct client clients[CLIENTS_MAX];
+    pthread_t tids[CLIENTS_MAX];
+    pthread_barrier_init(&ready, NULL, nclients + 1);
+    for (int i = 0; i < nclients; i++) {
+        struct client *c = &clients[i];
+        c->id = i;
+        c->rng = seed * 0x9e3779b97f4a7c15UL + i + 1;
+        c->next_req_id = 1;
+        snprintf(c->dir, sizeof(c->dir), "~S1/bench/c%d", i);
+        if (pthread_create(&tids[i], NULL, client_run, c) != 0) {
+            perror("dfsbench: pthread_create");
+            stop_servers(keep);
+            return 1;
+        }
+    }
+    pthread_barrier_wait(&ready);
+    bench_start = now_us();
+    sleep(duration);
+    stop = 1;
+    for (int i = 0; i < nclients; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = (now_us() - bench_start) / 1e6;
+
+    report(elapsed);
+    stop_servers(keep);
+    return 0;
+}
+
+// usage: Prints the command line options.
+void usage(void) {
+    printf("Usage: dfsbench [options]\n"
+           "  --clients N          virtual clients, each with its own connection (8)\n"
+           "  --duration SECONDS   how long to measure (10)\n"
+           "  --rate OPS           open loop at OPS requests/s in total; closed loop if 0 (0)\n"
+           "  --mix OP=W,...       weights of uploadf, downlf, removef, downltar, dispfnames\n"
+           "                       (uploadf=30,downlf=50,removef=5,downltar=5,dispfnames=10)\n"
+           "  --size SPEC          upload sizes: N, MIN-MAX (uniform) or lognormal:MEDIAN,SIGMA;\n"
+           "                       sizes take k and m suffixes (4k)\n"
+           "  --types LIST         file types uploaded, e.g. .pdf,.txt (.pdf,.txt,.zip,.c)\n"
+           "  --files N            files each client uploads before measuring (20)\n"
+           "  --port N             S1's port; the spawned S2-S4 use the next three (%d)\n"
+           "  --bin DIR            where S1-S4 are (the directory of dfsbench)\n"
+           "  --seed N             seed for the workload (1)\n"
+           "  --no-spawn           use servers that are already running (S1 on %d)\n"
+           "  --keep               keep the temporary HOME of the spawned servers\n",
+           BENCH_PORT, DFS_PORT);
+}
+
+// parse_mix: Sets the operation weights from "op=weight,...". Operations left out get 0.
+int parse_mix(const char *spec) {
+    char buf[256], *save;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    memset(weight, 0, sizeof(weight));
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int op;
+        if (!eq)
+            return -1;
+        *eq = '\0';
+        for (op = 1; op <= OP_BENCH_MAX && strcmp(item, op_names[op]) != 0; op++)
+            ;
+        if (op > OP_BENCH_MAX || atoi(eq + 1) < 0) {
+            printf("Unknown operation in --mix: %s\n", item);
+            return -1;
+        }
+        weight[op] = atoi(eq + 1);
+    }
+    int sum = 0;
+    for (int op = 1; op <= OP_BENCH_MAX; op++)
+        sum += weight[op];
+    return sum > 0 ? 0 : -1;
+}
+
+// parse_bytes: Reads a size such as 512, 4k or 2m. Returns -1 if it is not one.
+long parse_bytes(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0)
+        return -1;
+    if (*end == 'k' || *end == 'K')
+        v *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+        v *= 1024 * 1024, end++;
+    return *end ? -1 : (long)v;
+}
+
+// parse_size: Sets the upload size distribution: a fixed size, a uniform MIN-MAX range or
+// lognormal:MEDIAN,SIGMA.
+int parse_size(const char *spec) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    if (strncmp(buf, "lognormal:", 10) == 0) {
+        char *comma = strchr(buf + 10, ',');
+        if (!comma)
+            return -1;
+        *comma = '\0';
+        size_median = parse_bytes(buf + 10);
+        size_sigma = atof(comma + 1);
+        size_min = 0;
+        size_max = 0;
+        return size_median > 0 && size_sigma >= 0 ? 0 : -1;
+    }
+    char *dash = strchr(buf, '-');
+    if (dash)
+        *dash = '\0';
+    size_min = parse_bytes(buf);
+    size_max = dash ? parse_bytes(dash + 1) : size_min;
+    size_median = 0;
+    return size_min >= 0 && size_max >= size_min ? 0 : -1;
+}
+
+// parse_types: Sets the file types uploaded from a comma-separated list of extensions.
+int parse_types(const char *spec) {
+    char buf[256], *save;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    ntypes = 0;
+    for (char *t = strtok_r(buf, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        if (t[0] != '.' || strlen(t) >= sizeof(types[0]) || ntypes == TYPES_MAX)
+            return -1;
+        strcpy(types[ntypes++], t);
+    }
+    return ntypes > 0 ? 0 : -1;
+}
+
+// spawn_servers: Starts S1-S4 from bindir with a new temporary HOME, S1 on port and the
+// backends on the three ports after it, and waits until all of them accept connections.
+// Their output goes to a log file each in that HOME. Returns -1 if any failed to start.
+int spawn_servers(const char *bindir, int port) {
+    static const char *names[] = { "S2", "S3", "S4", "S1" };
+    char path[PATH_MAX + 8], routes[128], dir[PATH_MAX];
+    // The servers run in their HOME, so a relative bindir is resolved first.
+    if (!realpath(bindir, dir)) {
+        perror(bindir);
+        return -1;
+    }
+    snprintf(home, sizeof(home), "/tmp/dfsbench.XXXXXX");
+    if (!mkdtemp(home)) {
+        perror("dfsbench: mkdtemp");
+        home[0] = '\0';
+        return -1;
+    }
+    snprintf(routes, sizeof(routes), "%s/routes", home);
+    FILE *fp = fopen(routes, "w");
+    if (!fp) {
+        perror(routes);
+        return -1;
+    }
+    fprintf(fp, ".pdf ~S2 pdf.tar 127.0.0.1:%d\n.txt ~S3 text.tar 127.0.0.1:%d\n"
+                ".zip ~S4 zip.tar 127.0.0.1:%d\n", port + 1, port + 2, port + 3);
+    fclose(fp);
+    setenv("HOME", home, 1);
+    setenv("DFS_ROUTES", routes, 1);
+    // Per-request log lines would be part of what is measured; they can be asked for.
+    setenv("DFS_LOG_LEVEL", "warn", 0);
+
+    // The backends first, so that S1 finds them up.
+    for (int i = 0; i < 4; i++) {
+        int p = i < 3 ? port + 1 + i : port;
+        char portarg[16];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        snprintf(portarg, sizeof(portarg), "%d", p);
+        if (access(path, X_OK) != 0) {
+            printf("dfsbench: %s not found; use --bin to say where the servers are.\n", path);
+            return -1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            char log[128];
+            snprintf(log, sizeof(log), "%s/%s.log", home, names[i]);
+            if (chdir(home) != 0 || !freopen(log, "w", stdout) || dup2(fileno(stdout), 2) < 0)
+                _exit(1);
+            execl(path, names[i], "--port", portarg, (char *)NULL);
+            perror(path);
+            _exit(1);
+        }
+        server_pid[i] = pid;
+        if (pid < 0 || wait_listening(p, START_TIMEOUT_MS) != 0) {
+            printf("dfsbench: %s did not start on port %d; see %s/%s.log\n", names[i], p, home, names[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// stop_servers: Stops the servers started by spawn_servers() and removes their HOME, unless
+// keep is set.
+void stop_servers(int keep) {
+    for (int i = 0; i < 4; i++)
+        if (server_pid[i] > 0)
+            kill(server_pid[i], SIGTERM);
+    for (int i = 0; i < 4; i++)
+        if (server_pid[i] > 0)
+            waitpid(server_pid[i], NULL, 0);
+    if (!home[0])
+        return;
+    if (keep) {
+        printf("Server files and logs kept in %s\n", home);
+        return;
+    }
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", home);
+    system(cmd);
+}
+
+// wait_listening: Waits up to ms milliseconds for a server to accept connections on port.
+int wait_listening(int port, int ms) {
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    for (int waited = 0; waited < ms; waited += 20) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int ok = sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (sock >= 0)
+            close(sock);
+        if (ok)
+            return 0;
+        usleep(20 * 1000);
+    }
+    return -1;
+}
+
+// connect_s1: Opens a connection to S1. Returns the socket, or -1.
+int connect_s1(void) {
+    struct sockaddr_in addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, SERVER_IP, &addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    // Requests are small and each waits for its reply, so none should wait on Nagle.
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+// client_run: Thread body of a virtual client. It uploads its preloaded files, waits at the
+// barrier for the others, then issues requests drawn from the mix until the run is over.
+// In a closed loop the next request goes as soon as the last one is answered; in an open
+// loop requests are due at Poisson arrival times and their latency counts from when they
+// were due, so a slow server is charged for the requests queued behind a slow one.
+void *client_run(void *arg) {
+    struct client *c = arg;
+    c->sock = connect_s1();
+    for (int i = 0; i < preload && c->sock >= 0; i++)
+        client_op(c, OP_UPLOADF);
+    if (c->sock < 0)
+        printf("Client %d could not connect to S1.\n", c->id);
+    pthread_barrier_wait(&ready);
+
+    double per_client = rate / nclients;
+    long due = now_us();
+    while (!stop && c->sock >= 0) {
+        long start = now_us();
+        if (per_client > 0) {
+            due += (long)(-log(1 - rng_unit(&c->rng)) / per_client * 1e6);
+            if (due > start)
+                usleep(due - start);
+            if (stop)
+                break;
+            start = due;
+        }
+        // Draw an operation from the mix.
+        int op = 1;
+        long pick = rng_next(&c->rng) % weight_sum;
+        while (pick >= weight[op])
+            pick -= weight[op++];
+        if ((op == OP_DOWNLF || op == OP_REMOVEF) && c->nfiles == 0)
+            op = OP_UPLOADF;
+        long bytes = client_op(c, op);
+        long us = now_us() - start;
+        if (bytes < 0)
+            __atomic_fetch_add(&results[op].errors, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_add(&results[op].bytes, bytes, __ATOMIC_RELAXED);
+        hist_record(&results[op].latency, us);
+        if (bytes == -2) {
+            // The connection broke; start a new one.
+            close(c->sock);
+            c->sock = connect_s1();
+        }
+    }
+    if (c->sock >= 0)
+        close(c->sock);
+    free(c->files);
+    return NULL;
+}
+
+// client_op: Runs one request of the given operation for client c and waits for its whole
+// reply. Returns the bytes of file data moved, -1 if the request failed, or -2 if the
+// connection to S1 was lost.
+long client_op(struct client *c, int op) {
+    char path[128];
+    int err = 0;
+    long len;
+    if (op == OP_UPLOADF) {
+        if (c->nfiles == c->cap) {
+            c->cap = c->cap ? c->cap * 2 : 64;
+            c->files = realloc(c->files, c->cap * sizeof(*c->files));
+            if (!c->files) {
+                printf("Out of memory.\n");
+                exit(1);
+            }
+        }
+        char *name = c->files[c->nfiles];
+        snprintf(name, sizeof(*c->files), "f%d%s", c->serial++, types[rng_next(&c->rng) % ntypes]);
+        long size = pick_size(c);
+        long off = payload_len > size ? rng_next(&c->rng) % (payload_len - size + 1) : 0;
+        if (request(c, OP_UPLOADF, FIELD_NAME, name, FIELD_PATH, c->dir, size) != 0 ||
+            send_all(c->sock, payload + off, size) != 0 || (len = reply(c, &err)) < 0 ||
+            drain(c->sock, len) != 0)
+            return -2;
+        if (err)
+            return -1;
+        c->nfiles++;
+        return size;
+    }
+    if (op == OP_DOWNLF || op == OP_REMOVEF) {
+        int i = rng_next(&c->rng) % c->nfiles;
+        snprintf(path, sizeof(path), "%s/%s", c->dir, c->files[i]);
+        if (request(c, op, FIELD_PATH, path, 0, NULL, 0) != 0 || (len = reply(c, &err)) < 0 ||
+            drain(c->sock, len) != 0)
+            return -2;
+        if (op == OP_REMOVEF && !err)
+            memcpy(c->files[i], c->files[--c->nfiles], sizeof(*c->files));
+        return err ? -1 : len;
+    }
+    if (op == OP_DOWNLTAR)
+        len = request(c, op, FIELD_TYPE, types[rng_next(&c->rng) % ntypes], 0, NULL, 0);
+    else
+        len = request(c, op, FIELD_PATH, c->dir, 0, NULL, 0);
+    if (len != 0 || (len = reply(c, &err)) < 0 || drain(c->sock, len) != 0)
+        return -2;
+    return err ? -1 : len;
+}
+
+// report: Prints the throughput and latency percentiles of each operation over elapsed seconds.
+void report(double elapsed) {
+    unsigned long total = 0, errors = 0;
+    struct hist all;
+    memset(&all, 0, sizeof(all));
+    printf("\n%-11s %9s %7s %10s %9s %9s %9s %9s %9s %9s\n", "op", "requests", "errors", "req/s",
+           "MB/s", "mean ms", "p50 ms", "p90 ms", "p99 ms", "p999 ms");
+    for (int op = 1; op <= OP_BENCH_MAX; op++) {
+        const struct op_result *r = &results[op];
+        const struct hist *h = &r->latency;
+        if (h->count == 0)
+            continue;
+        for (int i = 0; i < HIST_BUCKETS; i++)
+            all.bucket[i] += h->bucket[i];
+        all.count += h->count;
+        all.sum_us += h->sum_us;
+        total += h->count;
+        errors += r->errors;
+        printf("%-11s %9lu %7lu %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n", op_names[op], h->count,
+               r->errors, h->count / elapsed, r->bytes / elapsed / 1048576, h->sum_us / 1e3 / h->count,
+               hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3, hist_quantile(h, 0.99) / 1e3,
+               hist_quantile(h, 0.999) / 1e3);
+    }
+    if (total > 0)
+        printf("%-11s %9lu %7lu %10.1f %9s %9.3f %9.3f %9.3f %9.3f %9.3f\n", "total", total, errors,
+               total / elapsed, "", all.sum_us / 1e3 / all.count, hist_quantile(&all, 0.5) / 1e3,
+               hist_quantile(&all, 0.9) / 1e3, hist_quantile(&all, 0.99) / 1e3,
+               hist_quantile(&all, 0.999) / 1e3);
+    printf("\n%.1f s measured.\n", elapsed);
+}
+
+// rng_next: Returns the next number of a splitmix64 sequence with state *s.
+unsigned long rng_next(unsigned long *s) {
+    unsigned long z = (*s += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+// rng_unit: Returns a number drawn uniformly from [0, 1).
+double rng_unit(unsigned long *s) {
+    return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// pick_size: Draws the size of an upload from the configured distribution.
+long pick_size(struct client *c) {
+    if (size_median > 0) {
+        // Box-Muller gives a normal deviate; its exponential is lognormal.
+        double u = 1 - rng_unit(&c->rng), v = rng_unit(&c->rng);
+        double z = sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+        long size = (long)(size_median * exp(size_sigma * z));
+        return size < payload_len ? size : payload_len;
+    }
+    if (size_max == size_min)
+        return size_min;
+    return size_min + rng_next(&c->rng) % (size_max - size_min + 1);
+}
+
+// now_us: Microseconds on the monotonic clock.
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// request: Sends a framed request for client c with one or two typed fields (field2 = 0 for
+// none). payload_len announces the upload data the caller sends next.
+int request(struct client *c, int opcode, int field, const char *value, int field2, const char *value2,
+            long payload_len) {
+    char fields[FRAME_FIELDS_MAX];
+    int len = field ? frame_add(fields, 0, field, value) : 0;
+    if (field2)
+        len = frame_add(fields, len, field2, value2);
+    if (len < 0)
+        return -1;
+    return frame_send(c->sock, opcode, 0, c->next_req_id++, fields, len, payload_len);
+}
+
+// reply: Receives the reply to client c's last request and sets *err if it reports a
+// failure. Returns the size of the payload that follows, or -1 if the connection failed.
+long reply(struct client *c, int *err) {
+    struct frame f;
+    if (frame_recv(c->sock, &f) != 0 || f.opcode != OP_REPLY || f.req_id != c->next_req_id - 1)
+        return -1;
+    *err = (f.flags & FRAME_ERROR) != 0;
+    return f.payload_len;
+}
+
+// drain: Receives and discards len bytes of payload.
+int drain(int sock, long len) {
+    static __thread char buf[RELAY_CHUNK];
+    while (len > 0) {
+        ssize_t n = recv(sock, buf, len < RELAY_CHUNK ? len : RELAY_CHUNK, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// send_all: Sends all len bytes, retrying after short writes.
+int send_all(int sock, const char *buf, long len) {
+    long sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, buf + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// recv_all: Receives exactly len bytes. Returns 0 on success, -1 if the peer went away.
+int recv_all(int sock, void *buf, long len) {
+    long got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// frame_add: Appends a typed field to a field area of len bytes and returns the new length,
+// or -1 if it does not fit.
+int frame_add(char *fields, int len, int type, const char *value) {
+    int vlen = strlen(value);
+    if (len < 0 || vlen > 0xffff || len + 3 + vlen > FRAME_FIELDS_MAX)
+        return -1;
+    fields[len] = type;
+    fields[len + 1] = vlen >> 8;
+    fields[len + 2] = vlen & 0xff;
+    memcpy(fields + len + 3, value, vlen);
+    return len + 3 + vlen;
+}
+
+// frame_pack: Encodes a message header and its field area into out, which must have room for
+// a header and FRAME_FIELDS_MAX bytes. Returns the encoded length, or -1 if the fields are
+// too long.
+int frame_pack(char *out, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    struct frame_hdr h;
+    if (fields_len < 0 || fields_len > FRAME_FIELDS_MAX)
+        return -1;
+    h.magic = htonl(FRAME_MAGIC);
+    h.opcode = opcode;
+    h.flags = flags;
+    h.version = htons(FRAME_VERSION);
+    h.req_id = htonl(req_id);
+    h.fields_len = htonl(fields_len);
+    h.payload_len = htobe64(payload_len);
+    memcpy(out, &h, sizeof(h));
+    if (fields_len > 0)
+        memcpy(out + sizeof(h), fields, fields_len);
+    return sizeof(h) + fields_len;
+}
+
+// frame_send: Sends a message header and its field area in one write; the caller sends
+// the payload_len bytes of payload after it.
+int frame_send(int sock, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    char out[sizeof(struct frame_hdr) + FRAME_FIELDS_MAX];
+    long len = frame_pack(out, opcode, flags, req_id, fields, fields_len, payload_len), sent = 0;
+    if (len < 0)
+        return -1;
+    // With a payload to follow, MSG_MORE holds the header back so the two share a segment.
+    while (sent < len) {
+        ssize_t n = send(sock, out + sent, len - sent, payload_len > 0 ? MSG_MORE : 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// frame_recv: Receives a message header and its field area, leaving the payload on the
+// socket. Returns -1 at end of stream or if the header is not a valid frame.
+int frame_recv(int sock, struct frame *f) {
+    struct frame_hdr h;
+    if (recv_all(sock, &h, sizeof(h)) != 0)
+        return -1;
+    if (ntohl(h.magic) != FRAME_MAGIC || ntohs(h.version) != FRAME_VERSION ||
+        ntohl(h.fields_len) > FRAME_FIELDS_MAX || (int64_t)be64toh(h.payload_len) < 0)
+        return -1;
+    f->opcode = h.opcode;
+    f->flags = h.flags;
+    f->req_id = ntohl(h.req_id);
+    f->fields_len = ntohl(h.fields_len);
+    f->payload_len = be64toh(h.payload_len);
+    return recv_all(sock, f->fields, f->fields_len);
+}
+
+// hist_record: Adds a value of us microseconds to histogram h. Values below HIST_SUB get a
+// bucket each; above that, each power of two is split into HIST_SUB equal buckets.
+void hist_record(struct hist *h, long us) {
+    unsigned long v = us < 0 ? 0 : us;
+    int i = v;
+    if (v >= HIST_SUB) {
+        int e = 63 - __builtin_clzl(v);
+        i = (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+    }
+    if (i >= HIST_BUCKETS)
+        i = HIST_BUCKETS - 1;
+    __atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+// hist_quantile: The value, in microseconds, below which a fraction q of the values recorded
+// in h fall. It is reported as the middle of the bucket it lies in.
+double hist_quantile(const struct hist *h, double q) {
+    unsigned long n = h->count, seen = 0, rank = q * n + 0.5;
+    if (n == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen < rank)
+            continue;
+        if (i < HIST_SUB)
+            return i;
+        int shift = i / HIST_SUB - 1;
+        return ((double)(HIST_SUB + i % HIST_SUB) + 0.5) * (1L << shift);
+    }
+    return 0;
+}
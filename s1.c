@@ -2,6 +2,7 @@
 // This server acts as the main hub for handling file operations in a distributed file system.
 // It accepts connections from clients and routes commands (upload, download, remove, etc.) to the appropriate handlers,
 // which may process the file locally (for .c files) or forward the request to dedicated backend servers for other file types.#include <stdio.h>
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,11 +18,447 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <netinet/tcp.h> 
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <pwd.h>  // For getpwuid
+#include <stdint.h>
+#include <endian.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sched.h>
 
 #define PORT 7010
-#define BACKLOG 10
+#define BACKLOG 128               // Connections waiting to be accepted, e.g. a batch client opening many at once.
 #define BUFSIZE 1024
+#define TAR_BLOCK 512
+#define RELAY_CHUNK (64 * 1024)   // Bytes spliced per step when relaying a payload.
+#define PIPELINE_MAX 32           // Framed requests a client may have in progress at once.
+
+// Cached .c tar archive state, shared by all forked client handlers.
+// ns_generation is bumped whenever a .c file is stored or removed; the archive
+// in $HOME/cfiles.tar is reused for as long as it was built at the current generation.
+struct tar_cache {
+    unsigned long ns_generation;
+    unsigned long tar_generation;
+};
+static struct tar_cache *tar_cache;
+
+// Backends on this host are reached over their AF_UNIX sockets unless DFS_TRANSPORT=tcp.
+static int local_transport = 1;
+
+// Routing. Each file type stored outside S1 maps to a route: its backend pool and the
+// virtual root ("~S2") that stands in for "~S1" in the paths sent there. The table is read
+// at startup from the file named by DFS_ROUTES, one route per line:
+//     <.ext> <~root> <archive name> <host:port[+replica...]> [host:port ...]
+// and otherwise holds the built-in PDF/TXT/ZIP routes. Extensions are looked up through a
+// perfect hash, so routing a request costs one hash and one string compare. A pool of several
+// backends shards the type: each object lives on the backend that wins it by rendezvous
+// hashing of its ~S1 path. A backend may list replicas after its primary, joined with '+':
+// writes go to the primary, which copies them to the replicas in the background, and reads
+// are spread over all of them. SIGHUP makes S1 reload the table for the clients that follow.
+#define ROUTE_MAX 32              // File types that can be routed to backends.
+#define ROUTE_POOL_MAX 16         // Backends in one route's pool.
+#define ROUTE_SLOTS 128           // Size of the perfect hash table, a power of two.
+#define REPLICA_MAX 4             // Replicas of one backend.
+
+// One server of a backend: its primary or one of its replicas.
+struct endpoint {
+    char name[64];            // "host:port" as configured.
+    int port;
+    struct sockaddr_in addr;
+    int local;                // Runs on this host, so its AF_UNIX socket can be tried.
+    int health;               // Its slot in the health table, or -1.
+};
+
+// One backend of a route's pool.
+struct backend {
+    char name[64];            // The primary's "host:port"; placement is based on it.
+    int nep;
+    struct endpoint ep[1 + REPLICA_MAX];   // The primary, then its replicas.
+};
+
+struct route {
+    char ext[16];
+    char root[16];
+    char tar_name[32];        // Archive name reported for downltar of this type.
+    int npool;
+    struct backend pool[ROUTE_POOL_MAX];
+};
+
+static const char *default_routes =
+    ".pdf ~S2 pdf.tar 127.0.0.1:7100\n"
+    ".txt ~S3 text.tar 127.0.0.1:7200\n"
+    ".zip ~S4 zip.tar 127.0.0.1:7300\n";
+static struct route routes[ROUTE_MAX];
+static int nroutes = 0;
+static struct route loading[ROUTE_MAX];        // Table being parsed, installed if it is valid.
+static int nloading;
+static volatile sig_atomic_t reload_routes = 0;
+static unsigned read_rr;                        // Rotates reads over a backend's replicas.
+static __thread int read_primary = 0;           // Send reads to the primary first.
+
+// Backend health. Every backend server has a circuit breaker in a table shared by all forked
+// client handlers and the prober process. A failed connect opens the breaker: requests skip
+// that server at once, or go to a replica, until retry_at. Then one request (or probe) is let
+// through; if it fails too, the wait doubles, up to BREAKER_MAX_MS. A successful connect
+// closes the breaker. The prober connects to every server each probe_ms (DFS_PROBE_MS,
+// 0 disables it), so a server is marked down before a client waits on it and marked up
+// again without any client having to try it.
+#define HEALTH_MAX 64             // Backend servers whose health is tracked.
+#define BREAKER_BASE_MS 500       // Wait after the first failure.
+#define BREAKER_MAX_MS 30000      // Longest wait between tries.
+#define CONNECT_TIMEOUT_MS 1000   // A TCP connect to a backend gives up after this long.
+
+struct health {
+    struct endpoint ep;       // Copied, so the prober needs no routes.
+    int down;                 // The breaker is open.
+    int fails;                // Consecutive failed connects.
+    long retry_at;            // When an open breaker lets the next try through (ms, monotonic).
+};
+struct health_table {
+    int count;
+    struct health h[HEALTH_MAX];
+};
+static struct health_table *health;
+static int probe_ms = 1000;
+
+// Striping. An upload of at least stripe_min bytes (DFS_STRIPE_MIN, off by default) whose type
+// has several backends is cut into stripe_size chunks (DFS_STRIPE_SIZE) stored round-robin
+// across the pool as hidden objects "<path>.<i>.stripe". S1 records where they went in a
+// manifest under $HOME/S1/.stripes, and a download fetches up to STRIPE_WINDOW stripes at once.
+#define STRIPE_WINDOW 8
+static long stripe_min = 0;
+static long stripe_size = 16L * 1024 * 1024;
+
+// Flow control of downloads relayed from a backend to a client (relay_bounded). S1 reads the
+// backend into a RELAY_BUF buffer per connection and stops reading it above RELAY_HIGH until
+// the client has taken it down to RELAY_LOW. Backends answer one request at a time, so if a
+// backend is still being held back relay_spool_ms (DFS_RELAY_SPOOL_MS; -1 never) after its
+// first pause, the rest of its reply is spooled to an unlinked file under $HOME/S1 instead,
+// which frees it for other work.
+// A client that takes nothing for client_stall_ms (DFS_CLIENT_STALL_MS) while data waits for it
+// is dropped.
+#define RELAY_BUF (256 * 1024)
+#define RELAY_HIGH (RELAY_BUF * 3 / 4)
+#define RELAY_LOW (RELAY_BUF / 4)
+static long relay_spool_ms = 100;
+static long client_stall_ms = 30000;
+
+// Request memory. What a request needs only while it runs (its frame, batch list, name lists
+// and reply text) is carved from an arena and given back all at once when the request ends.
+// An arena is a chain of blocks of at least ARENA_BLOCK bytes; returned arenas keep up to
+// ARENA_KEEP bytes of them and wait on a free list for the next request, so once a process
+// has served requests of a given size it serves more without calling malloc(). Relay buffers
+// are POOL_BUF bytes, page-aligned, carved POOL_SLAB at a time from one mapping and likewise
+// kept on a free list. ARENA_READY arenas and a slab are made ready before any handler is
+// forked, so a handler starts with them.
+#define ARENA_BLOCK (128 * 1024)
+#define ARENA_KEEP (1024 * 1024)
+#define ARENA_READY 4             // Enough for a client pipelining a few requests.
+#define POOL_BUF RELAY_BUF
+#define POOL_SLAB 8
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    _Alignas(16) char data[];
+};
+
+struct arena {
+    struct arena_block *first, *cur;
+    struct arena *next;       // On the free list.
+};
+static struct arena *arena_free;
+static void *pool_free;       // Free buffers, linked through their first word.
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct arena *arena;   // The current request's.
+
+// Quality of service. A request is bulk if it moves at least qos_bulk_min bytes
+// (DFS_QOS_BULK_MIN, 1 MB by default), as large uploads, downloads and tar archives do, and
+// interactive otherwise. A client, told apart by its address, may have at most
+// qos_limit[class] requests of each class running at once (DFS_CLIENT_INTERACTIVE,
+// DFS_CLIENT_BULK); further ones wait to be admitted. The relays of all handlers share the
+// network by weighted fair queuing, as in the backends: each class has a virtual time,
+// advanced by the bytes it moves over its weight (DFS_QOS_WEIGHT for interactive requests, 16
+// by default, and 1 for bulk). A class more than a quantum ahead of another busy class waits
+// for it, for at most QOS_WAIT_MAX_MS per quantum. Every request costs at least a quantum. The
+// state is shared by the forked handlers. Each connection's part of it is recorded, so that
+// it can be taken back however the handler exits.
+#define QOS_QUANTUM (64 * 1024)       // Bytes a bulk relay moves between scheduling checks.
+#define QOS_WAIT_MAX_MS 20            // Longest a class is held back per quantum.
+#define QOS_BULK_MIN (1024 * 1024)
+#define QOS_CLIENT_INTERACTIVE 128    // Default limits per client.
+#define QOS_CLIENT_BULK 4
+#define QOS_CONNS 1024                // Connections tracked for the limits.
+
+enum { QOS_INTERACTIVE, QOS_BULK, QOS_CLASSES };
+struct qos_conn {
+    pid_t pid;                           // Handler serving the connection, 0 if free.
+    uint32_t addr;                       // Client address, in network byte order.
+    int running[QOS_CLASSES];            // Requests admitted.
+    int active[QOS_CLASSES];             // Of those, in progress for the scheduler, by class.
+};
+struct qos {
+    pthread_mutex_t lock;                // Robust: a handler may die holding it.
+    pthread_cond_t cond;
+    int active[QOS_CLASSES];             // Requests of each class in progress.
+    double vtime[QOS_CLASSES];           // Bytes moved over the class's weight.
+    unsigned long waits[QOS_CLASSES];    // Quanta held back for the other class.
+    unsigned long queued[QOS_CLASSES];   // Requests that waited to be admitted.
+    struct qos_conn conn[QOS_CONNS];
+};
+static struct qos *qos;
+static long qos_bulk_min = QOS_BULK_MIN;
+static int qos_weight = 16;
+static int qos_limit[QOS_CLASSES] = { QOS_CLIENT_INTERACTIVE, QOS_CLIENT_BULK };
+static int qos_slot = -1;                // This handler's entry in qos->conn, -1 if none.
+static __thread int qos_class = -1;      // Scheduling class of this thread's request, -1 if none.
+static __thread int qos_admitted = -1;   // Class it was admitted as.
+
+// A striped object, as described by its manifest.
+struct stripes {
+    long size;
+    long stripe;                    // Bytes per stripe; the last one may be shorter.
+    long mtime;
+    int count;
+    const struct backend **where;   // Backend holding each stripe.
+};
+
+// One stripe being fetched by a download thread.
+struct stripe_fetch {
+    const struct backend *b;
+    char path[BUFSIZE + 32];
+    long len;
+    int fd;                         // Descriptor passed by a local backend, or -1.
+    long off;
+    char *buf;                      // Otherwise the stripe's data.
+    int ok;
+    pthread_t tid;
+    int threaded;                   // tid is to be joined; else it was fetched inline.
+};
+static unsigned char route_slot[ROUTE_SLOTS];   // Index into routes plus one, 0 if free.
+static uint32_t route_seed;
+
+// Binary framing. A framed message is a frame_hdr in network byte order, fields_len bytes
+// of typed fields (type byte, 16-bit length, value), then payload_len bytes of raw data
+// such as file contents. Connections that do not start with FRAME_MAGIC are served with
+// the old text commands.
+#define FRAME_MAGIC 0x44465331u     // "DFS1"
+#define FRAME_VERSION 1
+#define FRAME_FIELDS_MAX 2048       // Largest field area accepted in one message.
+#define FRAME_ERROR 0x01            // Reply flag: the request failed, FIELD_TEXT says why.
+#define FRAME_BATCH 0x02            // Request flag: the payload lists one path per line.
+#define FRAME_MORE 0x04             // Reply flag: one item of a batch, more replies follow.
+#define FRAME_FD 0x08               // Request: a local peer may answer with a descriptor. Reply: the
+                                    // payload is not inline but in the attached descriptor.
+#define FRAME_TREE 0x10             // Request flag on dispfnames: list every file below the path,
+                                    // relative to it, however deep and however many.
+#define BATCH_MAX_BYTES (1024 * 1024)   // Largest path list accepted in one batch.
+#define LOCAL_SOCK_NAME "dfs-%d"    // Abstract AF_UNIX name of the server on a TCP port.
+
+enum { OP_UPLOADF = 1, OP_DOWNLF, OP_REMOVEF, OP_DOWNLTAR, OP_DISPFNAMES, OP_REPLY, OP_STAT, OP_LIST, OP_STATS };
+enum { FIELD_PATH = 1, FIELD_NAME, FIELD_TYPE, FIELD_TEXT, FIELD_SIZE, FIELD_MTIME, FIELD_OFFSET, FIELD_TRACE };
+
+struct frame_hdr {
+    uint32_t magic;
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t version;
+    uint32_t req_id;          // Chosen by the requester and echoed in the reply.
+    uint32_t fields_len;
+    uint64_t payload_len;
+};
+
+// A received message: the decoded header and its field area.
+struct frame {
+    int opcode;
+    int flags;
+    uint32_t req_id;
+    long payload_len;
+    int fields_len;
+    char fields[FRAME_FIELDS_MAX];
+};
+
+static __thread int framed = 0;              // The current request from the client was framed.
+static __thread uint32_t frame_req_id = 0;   // Its request id, echoed in replies and passed to backends.
+static __thread const char *batch_path = NULL;   // Item of a batch being answered, if any.
+
+// Pipelining. A framed client may send further requests without waiting for replies; each
+// downlf, removef and dispfnames runs on its own thread so that backend round-trips overlap,
+// and replies go back in completion order, matched by req_id. reply_lock keeps one reply's
+// header and payload together on the client socket; the thread that writes a reply takes it
+// at the first byte and gives it up when the request is finished.
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int reply_held = 0;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_cond = PTHREAD_COND_INITIALIZER;
+static int inflight = 0;            // Requests currently running on worker threads.
+
+// Logging. A log line is formatted by the calling thread into a ring of its own and written
+// to stdout by a flusher thread, so a request never waits on stdout or the stdio lock. When
+// a ring is full the line is dropped and counted instead of blocking. DFS_LOG_LEVEL (error,
+// warn, info, debug or off) filters lines before any formatting, which leaves a disabled
+// LOG() costing one compare. DFS_LOG_SAMPLE=N keeps the per-request lines (LOG_REQ) of only
+// one request in N.
+#define LOG_RING 128              // Lines a thread can have waiting to be written.
+#define LOG_LINE 256              // Longest line; longer ones are cut.
+#define LOG_FLUSH_US 5000         // How often the flusher looks for new lines.
+enum { LL_ERROR, LL_WARN, LL_INFO, LL_DEBUG };
+#define LOG(level, ...) do { if ((level) <= log_level) log_write(level, __VA_ARGS__); } while (0)
+#define LOG_REQ(...) do { if (LL_INFO <= log_level && log_this) log_write(LL_INFO, __VA_ARGS__); } while (0)
+
+struct log_ring {
+    unsigned long head;       // Next slot the owning thread fills.
+    unsigned long tail;       // Next slot the flusher writes out.
+    unsigned long dropped;    // Lines lost to a full ring since the last flush.
+    int free;                 // The owning thread exited; another may take the ring over.
+    struct log_ring *next;
+    char line[LOG_RING][LOG_LINE];
+};
+static int log_level = LL_INFO;
+static int log_sample = 1;
+static unsigned long log_seq;
+static __thread int log_this = 1;          // The current request's lines are kept.
+static __thread struct log_ring *log_mine;
+static struct log_ring *log_rings;         // Every ring of this process; rings are never freed.
+static int log_flusher = 0;                // This process has started its flusher.
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;         // Taking and adding rings.
+static pthread_mutex_t log_flush_lock = PTHREAD_MUTEX_INITIALIZER;   // Writing them out.
+static pthread_key_t log_key;
+
+// Metrics. Each request is counted per opcode with its bytes in and out and whether it
+// failed, and its latency goes into a log-linear histogram: HIST_SUB buckets per power of
+// two microseconds, so a quantile read from it is within about 3% of the true value. The
+// part of a request spent waiting on backends is recorded apart from the rest, which is
+// network transfer and processing. "stats" returns all of it in the Prometheus text format,
+// and DFS_STATS_FILE names a file it is also written to every DFS_STATS_INTERVAL seconds.
+#define HIST_SUB 16
+#define HIST_BUCKETS (40 * HIST_SUB)       // Up to 2^43 us.
+#define STATS_INTERVAL 10
+#define STATS_MAX (32 * 1024)              // Room for the formatted metrics.
+
+struct hist {
+    unsigned long count;
+    unsigned long sum_us;
+    unsigned long bucket[HIST_BUCKETS];
+};
+struct op_metrics {
+    unsigned long requests, errors, bytes_in, bytes_out;
+    struct hist latency;
+};
+struct metrics {
+    struct op_metrics op[OP_STATS + 1];
+    struct hist wait;         // Waits on backends.
+    struct hist rest;         // Latency minus waits.
+    unsigned long relay_pauses, relay_spooled, relay_stalls;   // Of relay_bounded.
+    unsigned long connections;   // Accepted.
+    unsigned long arena_allocs, arena_mallocs;   // Carved from arenas; malloc()s for them.
+    unsigned long pool_gets, pool_slabs;         // Relay buffers taken; slabs mapped for them.
+};
+static struct metrics *metrics;
+
+// Workers. "--workers <n>" runs n accepting processes instead of one, each with its own
+// SO_REUSEPORT listener and pinned to a CPU of its own, so the kernel spreads connections
+// across them and a connection is served on its worker's CPU from accept to close. Each
+// worker and its handlers count into a metrics shard of their own, summed only when the
+// metrics are read; the scheduler, health table and tar cache stay shared, since they must
+// see every client.
+#define WORKERS_MAX 64
+static struct metrics *metrics_shards;   // WORKERS_MAX of them; worker i counts into [i].
+static int nworkers = 1;
+static int listeners[WORKERS_MAX];       // One per worker, opened before they are forked.
+static int nlisteners = 0;
+static int worker_index = -1;            // This process's worker, or -1 if it is not one.
+static pid_t helper_pids[2];             // The prober and the metrics dumper.
+
+// Hot upgrade. SIGUSR2 starts a successor from the binary at argv[0] and hands it the
+// listeners, so no connection is refused while the two change over. Everything the
+// processes share (the health table, the metrics, the scheduler and the tar cache) lives in
+// one memfd that goes along too, so breakers, counters and queued clients carry over and the
+// old handlers are scheduled with the new ones. Once the successor is ready the old S1 stops
+// accepting and exits when its last handler has.
+#define SHARED_MAGIC 0x48534644u     // "DFSH"
+#define UPGRADE_WAIT_MS 10000        // How long a successor may take to get ready.
+#define SHARED_PARTS 4
+struct shared_hdr {
+    uint32_t magic;
+    size_t part[SHARED_PARTS];       // Sizes of what follows; another layout starts afresh.
+};
+static int shared_fd = -1;
+static int shared_inherited = 0;     // The shared state is the predecessor's.
+static volatile sig_atomic_t upgrade_requested = 0;
+static char **upgrade_argv;
+static int upgrade_peer = -1;        // Socket to the predecessor, until it is told we are ready.
+// The request being measured on this thread.
+static __thread struct { int op, error; long start, wait_us, bytes_in, bytes_out; } req;
+static const char *op_names[] = { "", "uploadf", "downlf", "removef", "downltar", "dispfnames",
+                                   "reply", "stat", "list", "stats" };
+
+// Tracing. With DFS_TRACE_FILE set, each request gets a trace id and the stages it goes
+// through are recorded as spans: accept (from a new connection to its first request), parse
+// (from the first byte of a request to its handler), connect, first byte (the wait for a
+// backend's reply) and transfer. The id goes to the backends in FIELD_TRACE with a flow id,
+// so that their spans (parse, disk open, disk read, disk write) show up linked to the call
+// that caused them. When a request ends its spans are appended to the file, in one write(),
+// as Chrome trace events in the JSON array format, which chrome://tracing and Perfetto load;
+// S1 and the backends can share one file. DFS_TRACE_SAMPLE=N traces one request in N. A
+// stage repeated within a request, such as a read per chunk, is kept as one span from its
+// first start to its last end, with the number of calls and the time spent in them.
+#define TRACE_SPANS 32            // Spans kept per request.
+#define TRACE_EVENT 256           // Room for one formatted event.
+
+struct span {
+    const char *name;         // A string constant; repeats are found by address.
+    char ph;                  // 'X' for a span, 's' or 'f' for the two ends of a flow.
+    long start, end, busy_us;
+    int calls;
+    unsigned long flow;
+};
+static int trace_fd = -1;
+static int trace_sample = 1;
+static unsigned long trace_seq;
+static int trace_pid;                      // Process that has named itself in the file.
+static long accepted_at;                   // When the connection being served was accepted.
+static __thread long trace_arrived;        // When the current request's first byte was seen.
+// The request being traced on this thread; id is 0 if it is not traced.
+static __thread struct { unsigned long id; int nspans; struct span span[TRACE_SPANS]; } trace;
+
+struct frame_job {
+    int sock;
+    struct frame f;
+    char *batch;              // Path list of a batch request, NULL otherwise.
+    long arrived;             // When its first byte was seen.
+    struct arena *arena;      // The request's, which holds the job itself.
+};
+
+// A framed upload whose data has been relayed to its backend. The backend's reply is awaited
+// on a thread of its own, so the client's next upload is read off the connection meanwhile;
+// the request's metrics, trace and log sampling move to that thread with it.
+struct upload_job {
+    int client_sock, sock;
+    uint32_t req_id;
+    int log_this, qos_class, qos_admitted;
+    long arrived;
+    const struct route *r;
+    struct arena *arena;      // Holds the job.
+    char vpath[BUFSIZE];
+    __typeof__(req) req;
+    __typeof__(trace) trace;
+};
+
+// The relative paths found below a directory, for a FRAME_TREE listing.
+struct tree_list {
+    char **names;
+    int count, cap;
+};
 
 // Helper function to get the HOME directory reliably.
 // It first checks the environment variable "HOME", and if not found, falls back to system information.
@@ -36,63 +473,357 @@ char* get_home_dir() {
 
 // Function prototypes for handling client operations and file forwarding.
 void prcclient(int client_sock);
-void handle_upload(int, char*);
-void forward_file(const char*, const char*, int);
-void handle_download(int, char*);
-void handle_remove(int, char*);
-void handle_downltar(int, char*);
-void handle_dispfnames(int, char*);
-int collect_files_from_server(const char *path, int port, char *buffer);
+int handle_frame(int);
+void dispatch_frame(int, const struct frame*, char*);
+void *frame_worker(void*);
+void wait_workers(int);
+void reply_begin(void);
+void reply_end(void);
+void handle_upload(int, const char*, const char*, long);
+int forward_start(int, const char*, const struct backend*, long);
+void upload_finish(int, int, const struct route*, const char*);
+int upload_detach(int, int, const struct route*, const char*);
+void *upload_worker(void*);
+void handle_download(int, const char*);
+void handle_remove(int, const char*);
+void handle_downltar(int, const char*);
+void handle_downltar_all(int, const char*, const struct route*);
+void handle_dispfnames(int, const char*);
+void handle_listtree(int, const char*);
+int tree_add(struct tree_list*, const char*);
+void tree_walk(struct tree_list*, const char*, const char*, int);
+int send_all(int, const char*, long);
+int recv_all(int, void*, long);
+int frame_add(char*, int, int, const char*);
+int frame_get(const struct frame*, int, char*, int);
+int frame_pack(char*, int, int, uint32_t, const char*, int, long);
+int frame_send(int, int, int, uint32_t, const char*, int, long);
+int frame_recv(int, struct frame*);
+int is_framed(int);
+socklen_t local_addr(struct sockaddr_un*, int);
+void reply_status(int, int, const char*);
+int reply_size(int, long);
+void reply_text(int, const char*);
+int reply_frame(int, int, const char*, int, long);
+void reply_stat(int, long, long);
+void handle_batch(int, int, char*);
+int endpoint_connect(const struct endpoint*);
+int backend_connect(const struct backend*, int);
+int endpoint_parse(struct endpoint*, const char*, int);
+long now_ms(void);
+int health_slot(const struct endpoint*);
+int health_allow(int);
+void health_report(int, int);
+void health_probe_loop(void);
+int connect_timeout(int, const struct sockaddr*, socklen_t, int);
+int backend_open(const struct backend*, int, int, int, const char*, long, int);
+int backend_open_fields(const struct backend*, int, int, const char*, int, long, int);
+long backend_reply_fd(int, int*, long*);
+long send_from_fd(int, int, long, long);
+int frame_recv_fd(int, struct frame*, int*);
+void transport_bench(const char*, int);
+long relay_batch(int, int, const char*);
+long backend_reply(int, char*, int);
+long relay_payload(int, int, long);
+long relay_bounded(int, int, long);
+struct arena *arena_get(void);
+void *arena_alloc(struct arena*, size_t);
+char *arena_strdup(struct arena*, const char*);
+void arena_put(struct arena*);
+void *pool_get(void);
+void pool_put(void*);
+void qos_init(void);
+void qos_lock(void);
+int qos_wait(const struct timespec*);
+double qos_share(int);
+int qos_ahead(int);
+int qos_class_of(int, long);
+void qos_attach(uint32_t);
+void qos_detach(pid_t);
+void qos_admit(int);
+void qos_begin(int);
+void qos_size(long);
+void qos_charge(long);
+void qos_leave(void);
+void on_sigchld(int);
+int collect_files_from_server(const char *path, const struct route *r, const struct backend *b, char *buffer, long cap);
+uint32_t route_hash(const char*, uint32_t);
+int route_parse(char*, int);
+int routes_load(int);
+void on_sighup(int);
+uint64_t route_score(const struct backend*, const char*);
+int route_rank(const struct route*, const char*, const struct backend**);
+void rebalance(const char*);
+const struct route *route_lookup(const char*);
+const struct backend *route_backend(const struct route*, const char*);
+int append_sorted(char*, long, char*);
+void stripe_manifest(const char*, char*, size_t);
+int stripe_load(const struct route*, const char*, struct stripes*);
+int stripe_upload(int, const struct route*, const char*, long);
+void stripe_download(int, const struct stripes*, const char*);
+void *stripe_fetch_run(void*);
+void stripe_fetch_start(struct stripe_fetch*);
+int stripe_remove(const struct route*, const char*, const struct stripes*);
+int stripe_list(const char*, const char*, char*, long);
+void bump_generation(void);
+void log_init(void);
+void log_write(int, const char*, ...) __attribute__((format(printf, 2, 3)));
+void log_request(void);
+void log_flush(int);
+void log_exit(void);
+void log_forked(void);
+void log_release(void*);
+struct log_ring *log_attach(void);
+void *log_flush_run(void*);
+long metrics_now(void);
+void hist_record(struct hist*, long);
+double hist_quantile(const struct hist*, double);
+void metrics_begin(int);
+void metrics_wait(const char*, long);
+void metrics_end(void);
+void trace_init(void);
+void trace_begin(void);
+int trace_pass(char*, int);
+void trace_span(const char*, long, long);
+void trace_end(void);
+int metrics_format(char*, int);
+void metrics_total(struct metrics*);
+int listen_on(int, int);
+void accept_loop(int);
+void workers_run(void);
+pid_t worker_start(int);
+void worker_pin(int);
+void shared_init(int);
+void on_sigusr2(int);
+int upgrade_inherit(void);
+int upgrade_start(void);
+void upgrade_drain(void);
+void metrics_dump(const char*);
+void handle_stats(int);
 
 // Main function: sets up the server socket, accepts client connections,
 // forks a new process for each client, and calls prcclient() to process commands.
-int main() {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t sin_size;
-    pid_t pid;
+int main(int argc, char *argv[]) {
+    upgrade_argv = argv;
+    log_init();
+    trace_init();
+    char *transport = getenv("DFS_TRANSPORT");
+    if (transport && strcmp(transport, "tcp") == 0)
+        local_transport = 0;
+    if (getenv("DFS_PROBE_MS"))
+        probe_ms = atoi(getenv("DFS_PROBE_MS"));
+    // Backend health, the metrics, the scheduler and the tar cache are shared with the forked
+    // handlers, and with the successor on an upgrade. The health table is mapped before the
+    // routes fill it in.
+    shared_init(upgrade_inherit());
+    metrics = &metrics_shards[0];
+    // The scheduler's per-client limits.
+    qos_init();
+    // Arenas and a slab of relay buffers, for every handler to inherit.
+    struct arena *ready[ARENA_READY];
+    for (int i = 0; i < ARENA_READY; i++)
+        ready[i] = arena_get();
+    for (int i = 0; i < ARENA_READY; i++)
+        arena_put(ready[i]);
+    pool_put(pool_get());
+    routes_load(0);
+    if (getenv("DFS_STRIPE_MIN"))
+        stripe_min = atol(getenv("DFS_STRIPE_MIN"));
+    if (getenv("DFS_STRIPE_SIZE") && atol(getenv("DFS_STRIPE_SIZE")) > 0)
+        stripe_size = atol(getenv("DFS_STRIPE_SIZE"));
+    if (getenv("DFS_RELAY_SPOOL_MS"))
+        relay_spool_ms = atol(getenv("DFS_RELAY_SPOOL_MS"));
+    if (getenv("DFS_CLIENT_STALL_MS") && atol(getenv("DFS_CLIENT_STALL_MS")) > 0)
+        client_stall_ms = atol(getenv("DFS_CLIENT_STALL_MS"));
+
+    // "--port <n>" listens on another port, e.g. for a second system beside the usual one.
+    // "--workers <n>" accepts in n processes, one per CPU. They may be given in either order.
+    int port = PORT;
+    while (argc >= 3 && (strcmp(argv[1], "--port") == 0 || strcmp(argv[1], "--workers") == 0)) {
+        if (strcmp(argv[1], "--port") == 0) {
+            port = atoi(argv[2]);
+        } else {
+            nworkers = atoi(argv[2]);
+            if (nworkers < 1)
+                nworkers = 1;
+            if (nworkers > WORKERS_MAX)
+                nworkers = WORKERS_MAX;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    // "--transport-bench <~S1/path> [iterations]" times backend fetches over each transport.
+    if (argc >= 3 && strcmp(argv[1], "--transport-bench") == 0) {
+        transport_bench(argv[2], argc > 3 ? atoi(argv[3]) : 1000);
+        return 0;
+    }
+    // "--rebalance [.ext]" moves objects to the shards that own them under the current routes.
+    if (argc >= 2 && strcmp(argv[1], "--rebalance") == 0) {
+        rebalance(argc > 2 ? argv[2] : NULL);
+        return 0;
+    }
+
+    // A successor has been handed its predecessor's listeners, one per worker.
+    if (nlisteners > 0) {
+        nworkers = nlisteners;
+    } else if ((listeners[0] = listen_on(port, 0)) < 0) {
+        exit(1);
+    } else if (nworkers > 1) {
+        // SO_REUSEPORT would let a second S1 share the port with the workers; taking it
+        // without first makes sure no one else holds it.
+        close(listeners[0]);
+        for (nlisteners = 0; nlisteners < nworkers; nlisteners++)
+            if ((listeners[nlisteners] = listen_on(port, 1)) < 0)
+                exit(1);
+    } else {
+        nlisteners = 1;
+    }
+
+    // A client that goes away mid-transfer must not take its handler down with it.
+    signal(SIGPIPE, SIG_IGN);
+    // SIGHUP interrupts accept() so the routes are reloaded before the next client.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sighup;
+    sigaction(SIGHUP, &sa, NULL);
+    // SIGCHLD does too, so a handler's admitted requests are given back as soon as it exits.
+    sa.sa_handler = on_sigchld;
+    sigaction(SIGCHLD, &sa, NULL);
+    // SIGUSR2 hands S1 over to a new instance of its binary.
+    sa.sa_handler = on_sigusr2;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    printf("\n S1 Main Server started. Listening on port %d", port);
+    if (nworkers > 1)
+        printf(" with %d workers", nworkers);
+    printf("...\n");
+
+    // Health probes run in a process of their own, which goes away with S1.
+    pid_t parent = getpid();
+    if (probe_ms > 0 && (helper_pids[0] = fork()) == 0) {
+        for (int i = 0; i < nlisteners; i++)
+            close(listeners[i]);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent)
+            exit(0);
+        health_probe_loop();
+        exit(0);
+    }
+    // So is the periodic dump of the metrics to DFS_STATS_FILE.
+    if (getenv("DFS_STATS_FILE") && (helper_pids[1] = fork()) == 0) {
+        for (int i = 0; i < nlisteners; i++)
+            close(listeners[i]);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent)
+            exit(0);
+        int interval = getenv("DFS_STATS_INTERVAL") ? atoi(getenv("DFS_STATS_INTERVAL")) : 0;
+        while (1) {
+            sleep(interval > 0 ? interval : STATS_INTERVAL);
+            metrics_dump(getenv("DFS_STATS_FILE"));
+        }
+    }
+
+    // The predecessor, if any, stops accepting once this is sent.
+    if (upgrade_peer >= 0) {
+        if (send(upgrade_peer, "R", 1, MSG_NOSIGNAL) != 1)
+            exit(1);
+        close(upgrade_peer);
+        upgrade_peer = -1;
+    }
+    if (nworkers > 1)
+        workers_run();
+    else
+        accept_loop(listeners[0]);
+    return 0;
+}
+
+// listen_on: Opens the listening socket on port; with reuseport set, one of several that
+// share it. Returns the socket, or -1 on error.
+int listen_on(int port, int reuseport) {
+    struct sockaddr_in server_addr;
+    int server_sock;
 
     // Create socket
     if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         perror("S1: socket");
-        exit(1);
+        return -1;
     }
 
     // Setup the server address structure.
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = INADDR_ANY;
     memset(&(server_addr.sin_zero), 0, 8);
 
+    // A restarted S1 must be able to take its port back while old connections linger.
+    int one = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Workers bind a listener each to the same port; the kernel picks one per connection.
+    if (reuseport && setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("S1: SO_REUSEPORT");
+        close(server_sock);
+        return -1;
+    }
+
     // Bind the socket to the specified port and interface.
     if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
         perror("S1: bind");
         close(server_sock);
-        exit(1);
+        return -1;
     }
 
     // Listen for incoming connections.
     if (listen(server_sock, BACKLOG) == -1) {
         perror("S1: listen");
-        exit(1);
+        close(server_sock);
+        return -1;
     }
+    return server_sock;
+}
 
-    printf("\n S1 Main Server started. Listening on port %d...\n", PORT);
+// accept_loop: Accepts clients on server_sock for good, forking a handler for each.
+void accept_loop(int server_sock) {
+    struct sockaddr_in client_addr;
+    socklen_t sin_size;
+    int client_sock, one = 1;
+    pid_t pid;
 
     // Main loop to accept incoming client connections.
     while (1) {
+        if (reload_routes) {
+            reload_routes = 0;
+            routes_load(1);
+        }
+        // A worker is told to drain by the supervisor, which starts the successor.
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            if (worker_index >= 0 || upgrade_start() == 0)
+                upgrade_drain();
+        }
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) // Reap any zombie processes.
+            qos_detach(pid);
         sin_size = sizeof(struct sockaddr_in);
         client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &sin_size);
         if (client_sock == -1) {
-            perror("S1: accept");
+            if (errno != EINTR)
+                perror("S1: accept");
             continue;
         }
 
-        printf(" New client connected.\n");
+        LOG(LL_DEBUG, " New client connected.\n");
+        __atomic_fetch_add(&metrics->connections, 1, __ATOMIC_RELAXED);
+        accepted_at = metrics_now();
+        // Replies are written as soon as they are ready, often several back to back when
+        // requests are pipelined, so none should wait on Nagle for the previous one's ACK.
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
         // Fork a new process to handle the client connection.
         if ((pid = fork()) == 0) {
             close(server_sock); // Child process closes listening socket.
+            signal(SIGCHLD, SIG_DFL);
+            read_rr = getpid();
+            qos_attach(client_addr.sin_addr.s_addr);
             prcclient(client_sock); // Process client commands.
             close(client_sock);
             exit(0); // Terminate child process.
@@ -100,84 +831,599 @@ int main() {
 
 
         close(client_sock); // Parent process closes connected socket.
-        while (waitpid(-1, NULL, WNOHANG) > 0); // Reap any zombie processes.
     }
+}
 
-    return 0;
+// workers_run: Starts the workers and keeps them running: one that exits is started again
+// on the same listener. On SIGHUP the supervisor reloads the routes itself, which gives any
+// new server its health slot, and then passes the signal on to every worker, since each
+// holds its own copy of the routes. On an upgrade they are all told to drain.
+void workers_run(void) {
+    pid_t pids[WORKERS_MAX] = { 0 };
+    pid_t pid;
+
+    while (1) {
+        for (int i = 0; i < nworkers; i++)
+            if (pids[i] <= 0 && (pids[i] = worker_start(i)) < 0)
+                sleep(1);
+        if (reload_routes) {
+            reload_routes = 0;
+            routes_load(1);
+            for (int i = 0; i < nworkers; i++)
+                if (pids[i] > 0)
+                    kill(pids[i], SIGHUP);
+        }
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            if (upgrade_start() == 0) {
+                for (int i = 0; i < nworkers; i++)
+                    if (pids[i] > 0)
+                        kill(pids[i], SIGUSR2);
+                upgrade_drain();
+            }
+        }
+        if ((pid = waitpid(-1, NULL, 0)) <= 0)
+            continue;
+        for (int i = 0; i < nworkers; i++)
+            if (pids[i] == pid) {
+                LOG(LL_WARN, "Worker %d exited, starting it again.\n", i);
+                pids[i] = 0;
+            }
+    }
+}
+
+// worker_start: Forks worker i, which accepts on its listener until S1 goes away or the worker
+// is told to drain. Returns its pid, or -1 if it could not be forked.
+pid_t worker_start(int i) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+        exit(0);
+    worker_index = i;
+    helper_pids[0] = helper_pids[1] = 0;
+    worker_pin(i);
+    metrics = &metrics_shards[i];
+    for (int j = 0; j < nlisteners; j++)
+        if (j != i)
+            close(listeners[j]);
+    accept_loop(listeners[i]);
+    exit(0);
+}
+
+// worker_pin: Pins this process, and the handlers it forks, to the i-th CPU it may run on.
+void worker_pin(int i) {
+    cpu_set_t allowed, one;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0)
+        return;
+    int n = i % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            sched_setaffinity(0, sizeof(one), &one);
+            return;
+        }
 }
 
 
+
+
 // prcclient: Processes commands from a connected client in a loop.
-// It receives commands and dispatches them to the appropriate handler function.
+// A request is either a frame (arguments in typed fields, upload size in the header) or a
+// legacy text command; both are decoded here and dispatched to the same handlers.
 void prcclient(int client_sock) {
     char buffer[BUFSIZE];
 
     while (1) {
+        framed = is_framed(client_sock);
+        trace_arrived = metrics_now();
+        // Text commands expect their reply next, so anything still in flight goes first.
+        if (framed <= 0)
+            wait_workers(0);
+        if (framed < 0) {
+            LOG(LL_DEBUG, "Client disconnected.\n");
+            break;
+        }
+        if (framed) {
+            if (handle_frame(client_sock) != 0) {
+                LOG(LL_WARN, "Malformed frame, closing connection.\n");
+                break;
+            }
+            continue;
+        }
+
         memset(buffer, 0, BUFSIZE);
         int bytes = recv(client_sock, buffer, BUFSIZE - 1, 0);
         if (bytes <= 0) {
-            printf("Client disconnected.\n");
+            LOG(LL_DEBUG, "Client disconnected.\n");
             break;
         }
         buffer[bytes] = '\0';
-        printf("Command received: %s\n", buffer);
+        arena = arena_get();
+        log_request();
+        trace_begin();
+        LOG_REQ("Command received: %s\n", buffer);
         
         // Route the command to the corresponding handler based on its prefix.
         if (strncmp(buffer, "uploadf ", 8) == 0) {
-            handle_upload(client_sock, buffer);
+            metrics_begin(OP_UPLOADF);
+            char filename[256] = "", dest_path[512] = "";
+            long filesize = 0;
+            sscanf(buffer, "uploadf %255s %511s", filename, dest_path);
+            // The file size follows the command as a raw long.
+            if (recv_all(client_sock, &filesize, sizeof(long)) != 0)
+                break;
+            req.bytes_in = filesize;
+            qos_admit(qos_class_of(OP_UPLOADF, filesize));
+            handle_upload(client_sock, filename, dest_path, filesize);
         }
         else if (strncmp(buffer, "downlf ", 7) == 0) {
-            handle_download(client_sock, buffer);
+            metrics_begin(OP_DOWNLF);
+            char filepath[512] = "";
+            sscanf(buffer, "downlf %511s", filepath);
+            qos_admit(qos_class_of(OP_DOWNLF, 0));
+            handle_download(client_sock, filepath);
         }
         else if (strncmp(buffer, "removef ", 8) == 0) {
-            handle_remove(client_sock, buffer);
+            metrics_begin(OP_REMOVEF);
+            char filepath[512] = "";
+            sscanf(buffer, "removef %511s", filepath);
+            qos_admit(qos_class_of(OP_REMOVEF, 0));
+            handle_remove(client_sock, filepath);
         }
         else if (strncmp(buffer, "downltar ", 9) == 0) {
-            handle_downltar(client_sock, buffer);
+            metrics_begin(OP_DOWNLTAR);
+            char filetype[10] = "";
+            sscanf(buffer, "downltar %9s", filetype);
+            qos_admit(qos_class_of(OP_DOWNLTAR, 0));
+            handle_downltar(client_sock, filetype);
         }
         else if (strncmp(buffer, "dispfnames ", 11) == 0) {
-            handle_dispfnames(client_sock, buffer);
+            metrics_begin(OP_DISPFNAMES);
+            char dirpath[512] = "";
+            sscanf(buffer, "dispfnames %511s", dirpath);
+            qos_admit(qos_class_of(OP_DISPFNAMES, 0));
+            handle_dispfnames(client_sock, dirpath);
+        }
+        else if (strcmp(buffer, "stats") == 0) {
+            metrics_begin(OP_STATS);
+            qos_admit(qos_class_of(OP_STATS, 0));
+            handle_stats(client_sock);
         }
         else {
             char *msg = "Invalid command.\n";
             send(client_sock, msg, strlen(msg), 0);
         }
+        reply_end();
+        qos_leave();
+        metrics_end();
+        arena_put(arena);
+        arena = NULL;
+    }
+    arena_put(arena);
+    arena = NULL;
+    wait_workers(0);
+}
+
+// handle_frame: Decodes one framed request and dispatches it. Returns -1 if the frame is
+// malformed, after which nothing more can be read from the connection reliably.
+// Uploads and downltar are served inline, since they stream from the client connection or
+// share the tar cache; other requests are handed to a worker thread and the next frame is
+// read at once.
+int handle_frame(int client_sock) {
+    struct arena *a = arena_get();
+    struct frame_job *job = arena_alloc(a, sizeof(*job));
+    if (!job || frame_recv(client_sock, &job->f) != 0) {
+        arena_put(a);
+        return -1;
+    }
+    job->arena = a;
+    job->sock = client_sock;
+    job->batch = NULL;
+    job->arrived = trace_arrived;
+    struct frame *f = &job->f;
+    frame_req_id = f->req_id;
+
+    if (f->flags & FRAME_BATCH) {
+        // A batch carries its path list as the payload; read it before moving on.
+        if (f->payload_len > BATCH_MAX_BYTES) {
+            relay_payload(client_sock, -1, f->payload_len);
+            reply_status(client_sock, 0, "Batch too large.\n");
+            reply_end();
+            arena_put(a);
+            return 0;
+        }
+        job->batch = arena_alloc(a, f->payload_len + 1);
+        if (!job->batch || recv_all(client_sock, job->batch, f->payload_len) != 0) {
+            arena_put(a);
+            return -1;
+        }
+        job->batch[f->payload_len] = '\0';
+    }
+    else if (f->opcode != OP_UPLOADF && f->payload_len > 0) {
+        // Only uploads carry a payload.
+        arena_put(a);
+        return -1;
+    }
+    if (f->opcode == OP_DOWNLF || f->opcode == OP_REMOVEF || f->opcode == OP_DISPFNAMES ||
+        job->batch) {
+        pthread_t tid;
+        wait_workers(PIPELINE_MAX - 1);
+        pthread_mutex_lock(&inflight_lock);
+        inflight++;
+        pthread_mutex_unlock(&inflight_lock);
+        if (pthread_create(&tid, NULL, frame_worker, job) == 0) {
+            pthread_detach(tid);
+            return 0;
+        }
+        // No thread to spare: serve the request here instead.
+        pthread_mutex_lock(&inflight_lock);
+        inflight--;
+        pthread_mutex_unlock(&inflight_lock);
+    }
+    arena = a;
+    dispatch_frame(client_sock, f, job->batch);
+    reply_end();
+    arena = NULL;
+    arena_put(a);
+    return 0;
+}
+
+// dispatch_frame: Runs one decoded request against its handler. batch is the path list of a
+// batch request.
+void dispatch_frame(int client_sock, const struct frame *f, char *batch) {
+    char path[512] = "", name[256] = "", type[10] = "";
+    frame_get(f, FIELD_PATH, path, sizeof(path));
+    log_request();
+    trace_begin();
+    LOG_REQ("Frame received: op %d, id %u, path %s\n", f->opcode, f->req_id, batch ? "(batch)" : path);
+    metrics_begin(f->opcode);
+    req.bytes_in = f->payload_len;
+    qos_admit(qos_class_of(f->opcode, f->payload_len));
+
+    if (batch) {
+        handle_batch(client_sock, f->opcode, batch);
+    }
+    else if (f->opcode == OP_UPLOADF) {
+        frame_get(f, FIELD_NAME, name, sizeof(name));
+        handle_upload(client_sock, name, path, f->payload_len);
+    }
+    else if (f->opcode == OP_DOWNLF) {
+        handle_download(client_sock, path);
+    }
+    else if (f->opcode == OP_REMOVEF) {
+        handle_remove(client_sock, path);
+    }
+    else if (f->opcode == OP_DOWNLTAR) {
+        frame_get(f, FIELD_TYPE, type, sizeof(type));
+        handle_downltar(client_sock, type);
+    }
+    else if (f->opcode == OP_DISPFNAMES && (f->flags & FRAME_TREE)) {
+        handle_listtree(client_sock, path);
+    }
+    else if (f->opcode == OP_DISPFNAMES) {
+        handle_dispfnames(client_sock, path);
+    }
+    else if (f->opcode == OP_STATS) {
+        handle_stats(client_sock);
+    }
+    else {
+        reply_status(client_sock, 0, "Invalid command.\n");
+    }
+    qos_leave();
+    metrics_end();
+}
+
+// frame_worker: Thread body for a pipelined request. framed and frame_req_id are per
+// thread, so the handlers tag this request's reply and backend frames with its own id.
+void *frame_worker(void *arg) {
+    struct frame_job *job = arg;
+    framed = 1;
+    frame_req_id = job->f.req_id;
+    trace_arrived = job->arrived;
+    arena = job->arena;
+    dispatch_frame(job->sock, &job->f, job->batch);
+    reply_end();
+    arena = NULL;
+    arena_put(job->arena);
+    pthread_mutex_lock(&inflight_lock);
+    inflight--;
+    pthread_cond_broadcast(&inflight_cond);
+    pthread_mutex_unlock(&inflight_lock);
+    return NULL;
+}
+
+// wait_workers: Blocks until at most max pipelined requests are still running.
+void wait_workers(int max) {
+    pthread_mutex_lock(&inflight_lock);
+    while (inflight > max)
+        pthread_cond_wait(&inflight_cond, &inflight_lock);
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+// reply_begin: Claims the client socket for the calling thread's reply, if not yet held.
+void reply_begin(void) {
+    if (!reply_held) {
+        pthread_mutex_lock(&reply_lock);
+        reply_held = 1;
+    }
+}
+
+// reply_end: Releases the client socket once the current request is fully answered.
+void reply_end(void) {
+    if (reply_held) {
+        reply_held = 0;
+        pthread_mutex_unlock(&reply_lock);
+    }
+}
+
+// send_all: Sends all len bytes, retrying after short writes.
+int send_all(int sock, const char *buf, long len) {
+    long sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, buf + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// recv_all: Receives exactly len bytes. Returns 0 on success, -1 if the peer went away.
+int recv_all(int sock, void *buf, long len) {
+    long got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// frame_add: Appends a typed field to a field area of len bytes and returns the new length,
+// or -1 if it does not fit.
+int frame_add(char *fields, int len, int type, const char *value) {
+    int vlen = strlen(value);
+    if (len < 0 || vlen > 0xffff || len + 3 + vlen > FRAME_FIELDS_MAX)
+        return -1;
+    fields[len] = type;
+    fields[len + 1] = vlen >> 8;
+    fields[len + 2] = vlen & 0xff;
+    memcpy(fields + len + 3, value, vlen);
+    return len + 3 + vlen;
+}
+
+// frame_get: Copies the value of a field into out as a string. Returns -1 if the field is
+// missing, malformed or longer than outsz - 1.
+int frame_get(const struct frame *f, int type, char *out, int outsz) {
+    int off = 0;
+    while (off + 3 <= f->fields_len) {
+        int vlen = ((unsigned char)f->fields[off + 1] << 8) | (unsigned char)f->fields[off + 2];
+        if (off + 3 + vlen > f->fields_len)
+            return -1;
+        if (f->fields[off] == type) {
+            if (vlen >= outsz || memchr(f->fields + off + 3, '\0', vlen))
+                return -1;
+            memcpy(out, f->fields + off + 3, vlen);
+            out[vlen] = '\0';
+            return 0;
+        }
+        off += 3 + vlen;
+    }
+    return -1;
+}
+
+// frame_pack: Encodes a message header and its field area into out, which must have room for
+// a header and FRAME_FIELDS_MAX bytes. Returns the encoded length, or -1 if the fields are
+// too long.
+int frame_pack(char *out, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    struct frame_hdr h;
+    if (fields_len < 0 || fields_len > FRAME_FIELDS_MAX)
+        return -1;
+    h.magic = htonl(FRAME_MAGIC);
+    h.opcode = opcode;
+    h.flags = flags;
+    h.version = htons(FRAME_VERSION);
+    h.req_id = htonl(req_id);
+    h.fields_len = htonl(fields_len);
+    h.payload_len = htobe64(payload_len);
+    memcpy(out, &h, sizeof(h));
+    if (fields_len > 0)
+        memcpy(out + sizeof(h), fields, fields_len);
+    return sizeof(h) + fields_len;
+}
+
+// frame_send: Sends a message header and its field area in one write; the caller sends
+// the payload_len bytes of payload after it.
+int frame_send(int sock, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    char out[sizeof(struct frame_hdr) + FRAME_FIELDS_MAX];
+    long len = frame_pack(out, opcode, flags, req_id, fields, fields_len, payload_len), sent = 0;
+    if (len < 0)
+        return -1;
+    // With a payload to follow, MSG_MORE holds the header back so the two share a segment
+    // instead of the payload waiting on Nagle for the header's delayed ACK.
+    while (sent < len) {
+        ssize_t n = send(sock, out + sent, len - sent, payload_len > 0 ? MSG_MORE : 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// frame_recv: Receives a message header and its field area, leaving the payload on the
+// socket. Returns -1 at end of stream or if the header is not a valid frame.
+int frame_recv(int sock, struct frame *f) {
+    return frame_recv_fd(sock, f, NULL);
+}
+
+// frame_recv_fd: frame_recv() that also accepts a descriptor sent with the header as
+// SCM_RIGHTS; *fd is set to it, or to -1 if none came. fd may be NULL.
+int frame_recv_fd(int sock, struct frame *f, int *fd) {
+    struct frame_hdr h;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg;
+    ssize_t n;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd) {
+        *fd = -1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+    }
+    do
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+    if (fd) {
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+                memcpy(fd, CMSG_DATA(c), sizeof(int));
+    }
+    if (recv_all(sock, (char *)&h + n, sizeof(h) - n) != 0)
+        return -1;
+    if (ntohl(h.magic) != FRAME_MAGIC || ntohs(h.version) != FRAME_VERSION ||
+        ntohl(h.fields_len) > FRAME_FIELDS_MAX || (int64_t)be64toh(h.payload_len) < 0)
+        return -1;
+    f->opcode = h.opcode;
+    f->flags = h.flags;
+    f->req_id = ntohl(h.req_id);
+    f->fields_len = ntohl(h.fields_len);
+    f->payload_len = be64toh(h.payload_len);
+    return recv_all(sock, f->fields, f->fields_len);
+}
+
+// local_addr: Fills in the AF_UNIX address of the server listening on TCP port, in the
+// abstract namespace so that no socket file is left behind. Returns the address length.
+socklen_t local_addr(struct sockaddr_un *addr, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, LOCAL_SOCK_NAME, port);
+    return sizeof(sa_family_t) + 1 + n;
+}
+
+// is_framed: Peeks at the start of the next message to tell a framed request from a text
+// command. Returns 1 for a frame, 0 for text and -1 if the peer closed the connection.
+int is_framed(int sock) {
+    uint32_t magic;
+    ssize_t n = recv(sock, &magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+    if (n <= 0)
+        return -1;
+    return n == sizeof(magic) && ntohl(magic) == FRAME_MAGIC;
+}
+
+// reply_frame: Sends the reply header for the current request. Inside a batch it also names
+// the item in FIELD_PATH and sets FRAME_MORE, since the final reply of the batch follows.
+int reply_frame(int sock, int flags, const char *fields, int len, long payload_len) {
+    char all[FRAME_FIELDS_MAX];
+    req.bytes_out += payload_len;
+    if (!batch_path)
+        return frame_send(sock, OP_REPLY, flags, frame_req_id, fields, len, payload_len);
+    int n = frame_add(all, 0, FIELD_PATH, batch_path);
+    if (n < 0 || n + len > FRAME_FIELDS_MAX)
+        return -1;
+    if (len > 0)
+        memcpy(all + n, fields, len);
+    return frame_send(sock, OP_REPLY, flags | FRAME_MORE, frame_req_id, all, n + len, payload_len);
+}
+
+// reply_status: Answers a request with a status message: the bare text for text clients,
+// or a reply frame carrying it in FIELD_TEXT (flagged FRAME_ERROR unless ok).
+void reply_status(int sock, int ok, const char *msg) {
+    if (!ok)
+        req.error = 1;
+    reply_begin();
+    if (!framed) {
+        send(sock, msg, strlen(msg), 0);
+        return;
+    }
+    char fields[FRAME_FIELDS_MAX];
+    int len = frame_add(fields, 0, FIELD_TEXT, msg);
+    reply_frame(sock, ok ? 0 : FRAME_ERROR, fields, len < 0 ? 0 : len, 0);
+}
+
+// reply_size: Announces a payload of size bytes, which the caller sends next: a raw long for
+// text clients, a reply frame otherwise. A negative size reports the object as missing.
+int reply_size(int sock, long size) {
+    if (size < 0)
+        req.error = 1;
+    else if (!framed)
+        req.bytes_out += size;
+    reply_begin();
+    if (!framed) {
+        return send_all(sock, (const char *)&size, sizeof(long));
+    }
+    if (size < 0) {
+        reply_status(sock, 0, "File not found.\n");
+        return 0;
     }
+    return reply_frame(sock, 0, NULL, 0, size);
 }
 
+// reply_stat: Answers a stat request with the object's size and modification time.
+void reply_stat(int sock, long size, long mtime) {
+    char fields[64], num[24];
+    snprintf(num, sizeof(num), "%ld", size);
+    int len = frame_add(fields, 0, FIELD_SIZE, num);
+    snprintf(num, sizeof(num), "%ld", mtime);
+    len = frame_add(fields, len, FIELD_MTIME, num);
+    reply_frame(sock, 0, fields, len, 0);
+}
+
+// reply_text: Sends a text result such as a file list. Framed clients get its length first.
+void reply_text(int sock, const char *text) {
+    if (!framed)
+        req.bytes_out += strlen(text);
+    reply_begin();
+    if (framed)
+        reply_frame(sock, 0, NULL, 0, strlen(text));
+    send_all(sock, text, strlen(text));
+}
 
-// create_directories: Creates all necessary parent directories for the given file path.
-// It extracts the directory part of the full path and executes a system command to create it.
+// bump_generation: Marks the local .c namespace as changed so the next downltar .c
+// regenerates the cached archive instead of serving the stale one.
+void bump_generation(void) {
+    __atomic_fetch_add(&tar_cache->ns_generation, 1, __ATOMIC_RELEASE);
+}
 
+// create_directories: Creates all necessary parent directories for the given file path,
+// as mkdir -p would. Each is made in-process: a directory upload reaches here once per file.
 void create_directories(const char* full_path) {
     char path[BUFSIZE];
-    strcpy(path, full_path);
-    char *p = strrchr(path, '/');
-    if (p)
+    snprintf(path, sizeof(path), "%s", full_path);
+    for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
         *p = '\0';
-    char cmd[BUFSIZE];
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s", path);
-    system(cmd);
+        mkdir(path, 0755);
+        *p = '/';
+    }
 }
 
-// handle_upload: Processes an upload command.
-// It expects a command string containing the filename and destination path.
-// Files ending with .c are stored locally; other types are temporarily saved and then forwarded to a backend.
-void handle_upload(int client_sock, char *cmd) {
-    char filename[256], dest_path[512];
-    sscanf(cmd, "uploadf %s %s", filename, dest_path);
-
+// handle_upload: Processes an upload of filesize bytes, which follow on the client socket.
+// Files ending with .c are stored locally; other types are streamed on to a backend.
+// Rejected uploads are still read off the socket so the next request starts in step.
+void handle_upload(int client_sock, const char *filename, const char *dest_path, long filesize) {
     // Reject if destination does not start with the expected marker "~S1".
     if (strncmp(dest_path, "~S1", 3) != 0) {
-            char *msg = "Destination must start with ~S1.\n";
-            send(client_sock, msg, strlen(msg), 0);
+            relay_payload(client_sock, -1, filesize);
+            reply_status(client_sock, 0, "Destination must start with ~S1.\n");
             return;
         }
 
-    // Receive the file size from the client.
-    long filesize;
-    recv(client_sock, &filesize, sizeof(long), 0);
-
     const char *ext = strrchr(filename, '.');
     char *home = get_home_dir();
 
@@ -188,232 +1434,1412 @@ void handle_upload(int client_sock, char *cmd) {
         // dest_path+1 converts "~S1/folder" to "S1/folder".
         snprintf(save_path, sizeof(save_path), "%s/%s/%s", home, dest_path + 1, filename);
         create_directories(save_path);
-        printf("Trying to save (S1): %s\n", save_path);
+        LOG_REQ("Trying to save (S1): %s\n", save_path);
 
         FILE *fp = fopen(save_path, "wb");
         if (!fp) {
             perror("fopen failed in S1 for .c file");
-            char *msg = "Failed to save file.\n";
-            send(client_sock, msg, strlen(msg), 0);
+            relay_payload(client_sock, -1, filesize);
+            reply_status(client_sock, 0, "Failed to save file.\n");
             return;
         }
         char buffer[BUFSIZE];
         long received = 0;
         // Receive file data and write to file until the full file is received.
         while (received < filesize) {
-            int n = recv(client_sock, buffer, BUFSIZE, 0);
+            int n = recv(client_sock, buffer, filesize - received < BUFSIZE ? filesize - received : BUFSIZE, 0);
+            if (n <= 0)
+                break;
             fwrite(buffer, 1, n, fp);
             received += n;
         }
         fclose(fp);
-        char *msg = "File stored successfully.\n";
-        send(client_sock, msg, strlen(msg), 0);
+        bump_generation();
+        reply_status(client_sock, 1, "File stored successfully.\n");
         return;
     } else {
-        // For non-.c files, save temporarily then forward to backend.
-        char temp_path[BUFSIZE];
-        snprintf(temp_path, sizeof(temp_path), "/tmp/forwarded_%d_%s", getpid(), filename);
-        printf("Writing non-.c file to temporary path: %s\n", temp_path);
-
-        FILE *fp = fopen(temp_path, "wb");
-        if (!fp) {
-            perror("fopen failed in /tmp for non-.c file");
-            char *msg = "Failed to save file to temporary location.\n";
-            send(client_sock, msg, strlen(msg), 0);
-            return;
-        }
-        char buffer[BUFSIZE];
-        long received = 0;
-        while (received < filesize) {
-            int n = recv(client_sock, buffer, BUFSIZE, 0);
-            fwrite(buffer, 1, n, fp);
-            received += n;
-        }
-        fclose(fp);
-
-        int port = 0;
-        // Determine the backend server's port based on the file extension.
-        if (ext && strcmp(ext, ".pdf") == 0)
-            port = 7100;
-        else if (ext && strcmp(ext, ".txt") == 0)
-            port = 7200;
-        else if (ext && strcmp(ext, ".zip") == 0)
-            port = 7300;
-        else {
-            char *msg = "Unsupported file type.\n";
-            send(client_sock, msg, strlen(msg), 0);
-            remove(temp_path);
+        // Find the backend for the file type.
+        const struct route *r = route_lookup(ext);
+        if (!r) {
+            relay_payload(client_sock, -1, filesize);
+            reply_status(client_sock, 0, "Unsupported file type.\n");
             return;
         }
     
-        char target_path[BUFSIZE];
+        char vpath[BUFSIZE], target_path[BUFSIZE + 16];
         // Construct the target path for backend storage.
-        // The transformation converts "~S1/..." to "~S(backend)/...".
-        snprintf(target_path, sizeof(target_path), "~S%d%s/%s",
-                 port == 7100 ? 2 : port == 7200 ? 3 : 4,
-                 dest_path + 3, filename);
-        printf("➡ Forwarding file from %s to backend (target: %s, port: %d)\n", temp_path, target_path, port);
-        forward_file(temp_path, target_path, port);
-        remove(temp_path);
-        char *msg = "File stored successfully.\n";
-        send(client_sock, msg, strlen(msg), 0);
-    }
-}
-
-// forward_file: Establishes a connection to the designated backend server and forwards the file.
-// It sends an "uploadf" command along with the destination path, file size, and file data.
-void forward_file(const char *filepath, const char *dest_path, int port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in servaddr;
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-    inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
-
-    // Connect to the backend server.
-    if (connect(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-        perror("Forward file connect failed");
-        return;
+        // The transformation converts "~S1/..." to the route's root, e.g. "~S2/...".
+        snprintf(vpath, sizeof(vpath), "%s/%s", dest_path, filename);
+        snprintf(target_path, sizeof(target_path), "%s%s", r->root, vpath + 3);
+        if (stripe_min > 0 && filesize >= stripe_min && r->npool > 1) {
+            LOG_REQ("➡ Striping %ld bytes across %d backends (target: %s)\n", filesize, r->npool, target_path);
+            if (stripe_upload(client_sock, r, vpath, filesize) == 0)
+                reply_status(client_sock, 1, "File stored successfully.\n");
+            else
+                reply_status(client_sock, 0, "Failed to store file on backend.\n");
+            return;
+        }
+        const struct backend *b = route_backend(r, vpath);
+        LOG_REQ("➡ Forwarding %ld bytes to backend (target: %s, backend: %s)\n", filesize, target_path, b->name);
+        int sock = forward_start(client_sock, target_path, b, filesize);
+        // A framed client may have more uploads queued behind this one, as uploaddir does:
+        // they go on to their backends while this one is still being stored.
+        if (sock >= 0 && framed && upload_detach(client_sock, sock, r, vpath) == 0)
+            return;
+        upload_finish(client_sock, sock, r, vpath);
     }
-    char cmd[BUFSIZE];
-    snprintf(cmd, sizeof(cmd), "uploadf %s", dest_path);
-    send(sock, cmd, strlen(cmd), 0);
-    usleep(100000);  // Brief pause to allow the backend server to prepare.
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        perror("Forward file fopen failed");
+}
+
+// upload_finish: Completes an upload relayed to a backend on sock (-1 if that failed): waits
+// for the backend to store it and answers the client.
+void upload_finish(int client_sock, int sock, const struct route *r, const char *vpath) {
+    struct stripes old;
+    long rc = sock >= 0 ? backend_reply(sock, NULL, 0) : -1;
+    if (sock >= 0)
         close(sock);
-        return;
-    }
-    // Determine the file size and send it.
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    send(sock, &fsize, sizeof(long), 0);
-    char buffer[BUFSIZE];
-    int bytes;
-    // Forward the file data in chunks.
-    while ((bytes = fread(buffer, 1, BUFSIZE, fp)) > 0) {
-        send(sock, buffer, bytes, 0);
+    if (rc == 0) {
+        // A striped version of the file is now out of date.
+        if (stripe_load(r, vpath, &old) == 0)
+            stripe_remove(r, vpath, &old);
+        reply_status(client_sock, 1, "File stored successfully.\n");
+    } else {
+        reply_status(client_sock, 0, "Failed to store file on backend.\n");
     }
-    fclose(fp);
-    close(sock);
 }
 
-// handle_download: Processes a download request from the client.
-// For .c files stored in S1, the file is sent directly. For other file types,
-// the request is forwarded to the corresponding backend server.
-void handle_download(int client_sock, char *cmd) {
-    char filepath[512];
-    sscanf(cmd, "downlf %s", filepath);
-    const char *ext = strrchr(filepath, '.');
-    long err = -1;  // error indicator
-
-    // If file extension is not provided, immediately send error indicator.
-    if (!ext) {
-        send(client_sock, &err, sizeof(long), 0);
-        return;
+// upload_detach: Hands the rest of the current upload, relayed to a backend on sock, to a
+// worker thread. Returns 0 if the worker now owns the request, -1 to finish it here.
+int upload_detach(int client_sock, int sock, const struct route *r, const char *vpath) {
+    // The job outlives the current request's arena, so it takes one of its own.
+    struct arena *a = arena_get();
+    struct upload_job *job = arena_alloc(a, sizeof(*job));
+    pthread_t tid;
+    if (!job) {
+        arena_put(a);
+        return -1;
+    }
+    job->arena = a;
+    job->client_sock = client_sock;
+    job->sock = sock;
+    job->req_id = frame_req_id;
+    job->log_this = log_this;
+    job->arrived = trace_arrived;
+    job->r = r;
+    snprintf(job->vpath, sizeof(job->vpath), "%s", vpath);
+    job->req = req;
+    job->trace = trace;
+    job->qos_class = qos_class;
+    job->qos_admitted = qos_admitted;
+    wait_workers(PIPELINE_MAX - 1);
+    pthread_mutex_lock(&inflight_lock);
+    inflight++;
+    pthread_mutex_unlock(&inflight_lock);
+    if (pthread_create(&tid, NULL, upload_worker, job) != 0) {
+        pthread_mutex_lock(&inflight_lock);
+        inflight--;
+        pthread_mutex_unlock(&inflight_lock);
+        arena_put(a);
+        return -1;
     }
+    pthread_detach(tid);
+    // The worker records the request once it completes.
+    req.op = 0;
+    trace.id = 0;
+    qos_class = qos_admitted = -1;
+    return 0;
+}
 
-    char *home = get_home_dir();
+// upload_worker: Thread body for a detached upload.
+void *upload_worker(void *arg) {
+    struct upload_job *job = arg;
+    framed = 1;
+    frame_req_id = job->req_id;
+    log_this = job->log_this;
+    trace_arrived = job->arrived;
+    req = job->req;
+    trace = job->trace;
+    qos_class = job->qos_class;
+    qos_admitted = job->qos_admitted;
+    arena = job->arena;
+    upload_finish(job->client_sock, job->sock, job->r, job->vpath);
+    reply_end();
+    qos_leave();
+    metrics_end();
+    arena = NULL;
+    arena_put(job->arena);
+    pthread_mutex_lock(&inflight_lock);
+    inflight--;
+    pthread_cond_broadcast(&inflight_cond);
+    pthread_mutex_unlock(&inflight_lock);
+    return NULL;
+}
 
-    if (strcmp(ext, ".c") == 0) {
-        // Build absolute path for .c files stored locally in S1.
-        char real_path[512];
-        snprintf(real_path, sizeof(real_path), "%s/%s", home, filepath + 1);
-        FILE *fp = fopen(real_path, "rb");
-        if (!fp) {
-            // File not found: send error indicator.
-            send(client_sock, &err, sizeof(long), 0);
-            return;
+// route_hash: FNV-1a hash of an extension, starting from seed.
+uint32_t route_hash(const char *ext, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (; *ext; ext++)
+        h = (h ^ (unsigned char)*ext) * 16777619u;
+    return h;
+}
+
+// route_parse: Adds the route described by one configuration line to the table being loaded.
+// Returns -1, after saying why, if the line is malformed; blank lines and '#' comments are skipped.
+int route_parse(char *line, int lineno) {
+    char *save, *tok[3 + ROUTE_POOL_MAX + 1];
+    int n = 0;
+    char *hash = strchr(line, '#');
+    if (hash)
+        *hash = '\0';
+    for (char *t = strtok_r(line, " \t\r\n", &save); t && n < 3 + ROUTE_POOL_MAX + 1;
+         t = strtok_r(NULL, " \t\r\n", &save))
+        tok[n++] = t;
+    if (n == 0)
+        return 0;
+    if (n < 4 || n > 3 + ROUTE_POOL_MAX || tok[0][0] != '.' || strcmp(tok[0], ".c") == 0 ||
+        tok[1][0] != '~' || strlen(tok[0]) >= sizeof(routes[0].ext) ||
+        strlen(tok[1]) >= sizeof(routes[0].root) || strlen(tok[2]) >= sizeof(routes[0].tar_name)) {
+        printf("Routes line %d: expected <.ext> <~root> <archive> <host:port>...\n", lineno);
+        return -1;
+    }
+    if (nloading == ROUTE_MAX) {
+        printf("Routes line %d: more than %d routes\n", lineno, ROUTE_MAX);
+        return -1;
+    }
+    struct route *r = &loading[nloading];
+    memset(r, 0, sizeof(*r));
+    strcpy(r->ext, tok[0]);
+    strcpy(r->root, tok[1]);
+    strcpy(r->tar_name, tok[2]);
+    for (int i = 3; i < n; i++) {
+        struct backend *b = &r->pool[r->npool];
+        char *save2;
+        for (char *t = strtok_r(tok[i], "+", &save2); t; t = strtok_r(NULL, "+", &save2)) {
+            if (b->nep == 1 + REPLICA_MAX) {
+                printf("Routes line %d: more than %d replicas\n", lineno, REPLICA_MAX);
+                return -1;
+            }
+            if (endpoint_parse(&b->ep[b->nep++], t, lineno) != 0)
+                return -1;
         }
-        // Determine the file size and send it.
-        fseek(fp, 0, SEEK_END);
-        long fsize = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        send(client_sock, &fsize, sizeof(long), 0);
-        char buffer[BUFSIZE];
-        int n;
-        // Stream the file data to the client.
-        while ((n = fread(buffer, 1, BUFSIZE, fp)) > 0) {
-            send(client_sock, buffer, n, 0);
+        if (b->nep == 0) {
+            printf("Routes line %d: empty backend\n", lineno);
+            return -1;
         }
-        fclose(fp);
-    } else {
-        // For non-.c files, forward the request to the appropriate backend server.
-        int port = 0;
-        char corrected_path[512];
-        if (strcmp(ext, ".pdf") == 0) {
-            port = 7100;
-            snprintf(corrected_path, sizeof(corrected_path), "~S2%s", filepath + 3);
-        } else if (strcmp(ext, ".txt") == 0) {
-            port = 7200;
-            snprintf(corrected_path, sizeof(corrected_path), "~S3%s", filepath + 3);
-        } else if (strcmp(ext, ".zip") == 0) {
-            port = 7300;
-            snprintf(corrected_path, sizeof(corrected_path), "~S4%s", filepath + 3);
+        strcpy(b->name, b->ep[0].name);
+        r->npool++;
+    }
+    nloading++;
+    return 0;
+}
+
+// endpoint_parse: Fills in e from a "host:port" address, resolved once here rather than on
+// every request. Returns -1, after saying why, if the address is unusable.
+int endpoint_parse(struct endpoint *e, const char *spec, int lineno) {
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || colon - spec >= (long)sizeof(host) || atoi(colon + 1) <= 0 ||
+        strlen(spec) >= sizeof(e->name)) {
+        printf("Routes line %d: bad backend address %s\n", lineno, spec);
+        return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    strcpy(e->name, spec);
+    e->port = atoi(colon + 1);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        printf("Routes line %d: cannot resolve %s\n", lineno, host);
+        return -1;
+    }
+    memcpy(&e->addr, res->ai_addr, sizeof(e->addr));
+    freeaddrinfo(res);
+    e->addr.sin_port = htons(e->port);
+    e->local = (ntohl(e->addr.sin_addr.s_addr) >> 24) == 127;
+    e->health = health_slot(e);
+    return 0;
+}
+
+// now_ms: Milliseconds on the monotonic clock, which all of S1's processes share.
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// health_slot: Returns the health table slot of server e, taking a free one the first time
+// the server appears in the routes. Only the process that forks the handlers or the workers
+// takes slots, so it is the only writer of new slots; a slot is filled in before the count
+// makes it visible. Workers load the routes after it and only look their servers up.
+// Returns -1 when the table is full or was never mapped, or a worker finds a server the
+// supervisor has not seen, and the server is then always tried.
+int health_slot(const struct endpoint *e) {
+    if (!health)
+        return -1;
+    int n = __atomic_load_n(&health->count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++)
+        if (strcmp(health->h[i].ep.name, e->name) == 0)
+            return i;
+    if (n == HEALTH_MAX || worker_index >= 0)
+        return -1;
+    memset(&health->h[n], 0, sizeof(health->h[n]));
+    health->h[n].ep = *e;
+    health->h[n].ep.health = n;
+    __atomic_store_n(&health->count, n + 1, __ATOMIC_RELEASE);
+    return n;
+}
+
+// health_allow: Tells whether the server in slot i may be tried now. While its breaker is
+// open only one caller gets through once retry_at has passed: it moves retry_at on by a
+// connect timeout, so the others keep failing fast while it tries.
+int health_allow(int i) {
+    if (i < 0)
+        return 1;
+    struct health *h = &health->h[i];
+    if (!__atomic_load_n(&h->down, __ATOMIC_ACQUIRE))
+        return 1;
+    long now = now_ms(), at = __atomic_load_n(&h->retry_at, __ATOMIC_ACQUIRE);
+    return now >= at && __atomic_compare_exchange_n(&h->retry_at, &at, now + CONNECT_TIMEOUT_MS, 0,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// health_report: Records the outcome of a connect to the server in slot i, opening or
+// closing its breaker.
+void health_report(int i, int ok) {
+    if (i < 0)
+        return;
+    struct health *h = &health->h[i];
+    if (ok) {
+        __atomic_store_n(&h->fails, 0, __ATOMIC_RELEASE);
+        if (__atomic_exchange_n(&h->down, 0, __ATOMIC_ACQ_REL))
+            LOG(LL_INFO, "Backend %s is up again\n", h->ep.name);
+        return;
+    }
+    int fails = __atomic_add_fetch(&h->fails, 1, __ATOMIC_ACQ_REL);
+    long wait = BREAKER_BASE_MS;
+    for (int k = 1; k < fails && wait < BREAKER_MAX_MS; k++)
+        wait *= 2;
+    if (wait > BREAKER_MAX_MS)
+        wait = BREAKER_MAX_MS;
+    __atomic_store_n(&h->retry_at, now_ms() + wait, __ATOMIC_RELEASE);
+    if (!__atomic_exchange_n(&h->down, 1, __ATOMIC_ACQ_REL))
+        LOG(LL_WARN, "Backend %s is down, failing fast for %ld ms\n", h->ep.name, wait);
+}
+
+// health_probe_loop: Body of the prober process. Every probe_ms it connects to each server
+// whose breaker allows a try and records the result.
+void health_probe_loop(void) {
+    while (1) {
+        usleep(probe_ms * 1000);
+        int n = __atomic_load_n(&health->count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < n; i++) {
+            if (!health_allow(i))
+                continue;
+            int sock = endpoint_connect(&health->h[i].ep);
+            health_report(i, sock >= 0);
+            if (sock >= 0)
+                close(sock);
+        }
+    }
+}
+
+// routes_load: Builds the routing table from DFS_ROUTES or the built-in routes, then searches
+// for a hash seed under which every extension gets a slot of its own. An unusable
+// configuration makes S1 exit at startup; on a reload the current table is kept instead.
+// Returns 0 if the new table was installed.
+int routes_load(int reload) {
+    char line[BUFSIZE];
+    int lineno = 0, bad = 0;
+    const char *conf = getenv("DFS_ROUTES");
+    nloading = 0;
+    if (conf) {
+        FILE *fp = fopen(conf, "r");
+        if (!fp) {
+            perror(conf);
+            bad = 1;
+        }
+        while (fp && fgets(line, sizeof(line), fp))
+            bad |= route_parse(line, ++lineno);
+        if (fp)
+            fclose(fp);
+    } else {
+        for (const char *p = default_routes; *p; ) {
+            int len = strcspn(p, "\n");
+            snprintf(line, sizeof(line), "%.*s", len, p);
+            bad |= route_parse(line, ++lineno);
+            p += len + (p[len] == '\n');
+        }
+    }
+    for (int i = 0; i < nloading && !bad; i++)
+        for (int j = 0; j < i; j++)
+            if (strcmp(loading[i].ext, loading[j].ext) == 0) {
+                printf("Routes: %s is listed twice\n", loading[i].ext);
+                bad = 1;
+            }
+    if (bad && !reload)
+        exit(1);
+    if (bad) {
+        printf("Routes not reloaded; keeping the current table\n");
+        return -1;
+    }
+    memcpy(routes, loading, nloading * sizeof(struct route));
+    nroutes = nloading;
+
+    for (route_seed = 0; ; route_seed++) {
+        int ok = 1;
+        memset(route_slot, 0, sizeof(route_slot));
+        for (int i = 0; i < nroutes && ok; i++) {
+            unsigned char *slot = &route_slot[route_hash(routes[i].ext, route_seed) & (ROUTE_SLOTS - 1)];
+            if (*slot)
+                ok = 0;
+            else
+                *slot = i + 1;
+        }
+        if (ok)
+            break;
+    }
+    for (int i = 0; i < nroutes; i++) {
+        printf(" Route %-6s -> %s", routes[i].ext, routes[i].root);
+        for (int j = 0; j < routes[i].npool; j++)
+            for (int e = 0; e < routes[i].pool[j].nep; e++)
+                printf("%s%s", e ? "+" : " ", routes[i].pool[j].ep[e].name);
+        printf("\n");
+    }
+    return 0;
+}
+
+// on_sighup: Asks the accept loop to reload the routes.
+void on_sighup(int sig) {
+    (void)sig;
+    reload_routes = 1;
+}
+
+// route_lookup: Returns the route for a file extension such as ".pdf", or NULL if files of
+// that type are not stored on a backend.
+const struct route *route_lookup(const char *ext) {
+    if (!ext)
+        return NULL;
+    int slot = route_slot[route_hash(ext, route_seed) & (ROUTE_SLOTS - 1)];
+    if (slot == 0 || strcmp(routes[slot - 1].ext, ext) != 0)
+        return NULL;
+    return &routes[slot - 1];
+}
+
+// route_score: Rendezvous score of backend b for the object at vpath, an FNV-1a hash of the
+// backend's name and the path passed through a 64-bit finalizer so that scores spread evenly.
+uint64_t route_score(const struct backend *b, const char *vpath) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = b->name; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ '|') * 1099511628211ULL;
+    for (const char *p = vpath; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// route_rank: Fills order with the backends of route r, best first, for the object at virtual
+// path vpath (its ~S1 path) and returns how many there are. The first backend owns the
+// object; adding a backend to the pool only moves the objects the new one wins.
+int route_rank(const struct route *r, const char *vpath, const struct backend **order) {
+    uint64_t score[ROUTE_POOL_MAX];
+    for (int i = 0; i < r->npool; i++) {
+        uint64_t sc = r->npool > 1 ? route_score(&r->pool[i], vpath) : 0;
+        int j = i;
+        // Insertion sort; pools are small.
+        while (j > 0 && score[j - 1] < sc) {
+            score[j] = score[j - 1];
+            order[j] = order[j - 1];
+            j--;
+        }
+        score[j] = sc;
+        order[j] = &r->pool[i];
+    }
+    return r->npool;
+}
+
+// route_backend: Returns the backend of route r that owns the object at virtual path vpath.
+const struct backend *route_backend(const struct route *r, const char *vpath) {
+    const struct backend *order[ROUTE_POOL_MAX];
+    route_rank(r, vpath, order);
+    return order[0];
+}
+
+// endpoint_connect: Connects to server e. For a server on this host its AF_UNIX socket is
+// tried first: it skips the loopback TCP stack and lets a backend pass file descriptors.
+// TCP is the fallback. Returns the socket, or -1 on failure.
+int endpoint_connect(const struct endpoint *b) {
+    int sock;
+    if (local_transport && b->local) {
+        struct sockaddr_un addr;
+        socklen_t len = local_addr(&addr, b->port);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, len) == 0)
+            return sock;
+        if (sock >= 0)
+            close(sock);
+    }
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    if (connect_timeout(sock, (const struct sockaddr *)&b->addr, sizeof(b->addr), CONNECT_TIMEOUT_MS) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// connect_timeout: connect() that gives up after ms milliseconds, so an unreachable host
+// costs a request at most that long. The socket is left blocking. Returns 0 or -1.
+int connect_timeout(int sock, const struct sockaddr *addr, socklen_t len, int ms) {
+    int fl = fcntl(sock, F_GETFL);
+    fcntl(sock, F_SETFL, fl | O_NONBLOCK);
+    int rc = connect(sock, addr, len);
+    if (rc < 0 && errno == EINPROGRESS) {
+        struct pollfd p = { sock, POLLOUT, 0 };
+        int err = 0;
+        socklen_t el = sizeof(err);
+        if (poll(&p, 1, ms) == 1 && getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &el) == 0 && err == 0)
+            rc = 0;
+    }
+    fcntl(sock, F_SETFL, fl);
+    return rc;
+}
+
+// backend_connect: Connects to backend b. Writes go to its primary. Reads are spread over the
+// primary and its replicas, starting from a different one each time, and fail over to the
+// next when a connect() fails; with read_primary set they start from the primary. Servers
+// whose breaker is open are skipped, so a request for a backend that is down fails at once.
+int backend_connect(const struct backend *b, int read) {
+    int start = 0, tries = read ? b->nep : 1;
+    if (read && b->nep > 1 && !read_primary)
+        start = __atomic_fetch_add(&read_rr, 1, __ATOMIC_RELAXED) % b->nep;
+    for (int i = 0; i < tries; i++) {
+        const struct endpoint *e = &b->ep[(start + i) % b->nep];
+        if (!health_allow(e->health))
+            continue;
+        int sock = endpoint_connect(e);
+        health_report(e->health, sock >= 0);
+        if (sock >= 0)
+            return sock;
+    }
+    return -1;
+}
+
+// backend_open: Connects to backend b and sends it a framed request with the given
+// flags, whose only field is value (a path or an archive type), or none if field is 0; any
+// payload is sent by the caller. A non-zero
+// timeout (seconds) bounds every later receive. Returns the socket, or -1 on failure.
+int backend_open(const struct backend *b, int opcode, int flags, int field, const char *value,
+                 long payload_len, int timeout) {
+    char fields[FRAME_FIELDS_MAX];
+    int len = field ? frame_add(fields, 0, field, value) : 0;
+    if (len < 0)
+        return -1;
+    return backend_open_fields(b, opcode, flags, fields, len, payload_len, timeout);
+}
+
+// backend_open_fields: Like backend_open(), for a request carrying an encoded field area.
+int backend_open_fields(const struct backend *b, int opcode, int flags, const char *fields, int len,
+                        long payload_len, int timeout) {
+    int read = opcode == OP_DOWNLF || opcode == OP_STAT || opcode == OP_DISPFNAMES || opcode == OP_DOWNLTAR;
+    long t0 = metrics_now();
+    int sock = backend_connect(b, read);
+    metrics_wait("connect", t0);
+    if (sock < 0)
+        return -1;
+    if (timeout > 0) {
+        struct timeval tv;
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+    }
+    char traced[FRAME_FIELDS_MAX];
+    if (trace.id) {
+        memcpy(traced, fields, len);
+        fields = traced;
+        len = trace_pass(traced, len);
+    }
+    if (frame_send(sock, opcode, flags, frame_req_id, fields, len, payload_len) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// backend_reply: Receives a backend's reply frame. Returns the size of the payload that
+// follows it, or -1 if the backend reported an error or could not be read. The reply's
+// status text, if any, is copied to text.
+long backend_reply(int sock, char *text, int textsz) {
+    struct frame f;
+    if (text)
+        text[0] = '\0';
+    long t0 = metrics_now();
+    int rc = frame_recv(sock, &f);
+    metrics_wait("first byte", t0);
+    if (rc != 0 || f.opcode != OP_REPLY)
+        return -1;
+    if (text)
+        frame_get(&f, FIELD_TEXT, text, textsz);
+    return (f.flags & FRAME_ERROR) ? -1 : f.payload_len;
+}
+
+// backend_reply_fd: Receives the reply to a downlf sent with FRAME_FD. If the backend passed
+// a descriptor, *fd is set to it and *off to where the object starts in it, and nothing more
+// is read from the socket; otherwise *fd is -1 and the payload follows inline. Returns the
+// object size, or -1 on error.
+long backend_reply_fd(int sock, int *fd, long *off) {
+    struct frame f;
+    char num[24];
+    *off = 0;
+    long t0 = metrics_now();
+    int rc = frame_recv_fd(sock, &f, fd);
+    metrics_wait("first byte", t0);
+    if (rc != 0 || f.opcode != OP_REPLY || (f.flags & FRAME_ERROR) ||
+        ((f.flags & FRAME_FD) && (*fd < 0 || frame_get(&f, FIELD_OFFSET, num, sizeof(num)) != 0))) {
+        if (*fd >= 0)
+            close(*fd);
+        *fd = -1;
+        return -1;
+    }
+    if (!(f.flags & FRAME_FD) && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+    if (*fd >= 0)
+        *off = atol(num);
+    return f.payload_len;
+}
+
+// send_from_fd: Sends len bytes of fd starting at off to the client with sendfile(), so the
+// data goes from the page cache to the socket without passing through S1's memory.
+// Returns the number of bytes sent.
+long send_from_fd(int client_sock, int fd, long off, long len) {
+    off_t pos = off;
+    long sent = 0;
+    qos_size(len);
+    while (sent < len) {
+        long want = len - sent < QOS_QUANTUM ? len - sent : QOS_QUANTUM;
+        qos_charge(want);
+        ssize_t n = sendfile(client_sock, fd, &pos, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    return sent;
+}
+
+// relay_payload: Moves len bytes from one socket to another through a pipe with splice(),
+// so payloads pass through S1 without being copied into user space. With to < 0, or once
+// the destination fails, the rest is read and dropped to keep the source in step.
+// Returns the number of bytes delivered to the destination.
+long relay_payload(int from, int to, long len) {
+    int pipefd[2] = { -1, -1 };
+    char buf[BUFSIZE];
+    long moved = 0, delivered = 0;
+    // Each call gets its own pipe, as relays may run on several threads at once.
+    if (to >= 0 && pipe(pipefd) != 0)
+        pipefd[0] = pipefd[1] = -1;
+    if (to >= 0)
+        qos_size(len);
+    while (moved < len) {
+        long want = len - moved < RELAY_CHUNK ? len - moved : RELAY_CHUNK;
+        if (to >= 0)
+            qos_charge(want);
+        if (to >= 0 && pipefd[0] >= 0) {
+            ssize_t n = splice(from, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n <= 0)
+                break;
+            moved += n;
+            while (n > 0) {
+                // Only hint MORE while the payload continues, or its tail sits corked.
+                ssize_t k = splice(pipefd[0], NULL, to, NULL, n,
+                                   SPLICE_F_MOVE | (moved < len ? SPLICE_F_MORE : 0));
+                if (k <= 0) {
+                    // The destination is gone: empty the pipe and drop the rest.
+                    while (n > 0 && (k = read(pipefd[0], buf, n < BUFSIZE ? n : BUFSIZE)) > 0)
+                        n -= k;
+                    to = -1;
+                    break;
+                }
+                n -= k;
+                delivered += k;
+            }
         } else {
-            // Unsupported file type.
-            send(client_sock, &err, sizeof(long), 0);
-            return;
+            int n = recv(from, buf, want < BUFSIZE ? want : BUFSIZE, 0);
+            if (n <= 0)
+                break;
+            moved += n;
+            if (to >= 0 && send_all(to, buf, n) == 0)
+                delivered += n;
+            else
+                to = -1;
         }
-        // Connect to the backend server to request the file.
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            send(client_sock, &err, sizeof(long), 0);
-            return;
+    }
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return delivered;
+}
+
+// relay_bounded: Relays len bytes of a backend's reply on from to the client on to, holding
+// at most RELAY_BUF of it in memory; see RELAY_BUF for the flow control. Both sockets are
+// used without blocking, so a slow client only slows this relay. If the client stalls or
+// fails, the rest of the reply is read and dropped. Returns the bytes delivered.
+long relay_bounded(int from, int to, long len) {
+    char *buf = pool_get(), chunk[16 * 1024], path[BUFSIZE];
+    // Of the moved bytes read from the backend, those not yet delivered are in buf (count
+    // of them, from head) and after those, in the spool file (spooled - unspooled).
+    long moved = 0, delivered = 0, head = 0, count = 0, spooled = 0, unspooled = 0;
+    // progress is when the client last took data, or when data last came to wait for it;
+    // stall time only runs while something is waiting. An empty buffer waits on the backend
+    // for as long as its receive timeout (none if unset), as a blocking recv() would.
+    long progress = now_ms(), first_pause = 0, backend_ms = -1;
+    int paused = 0, spool = -1, can_spool = relay_spool_ms >= 0;
+    struct timeval tv;
+    socklen_t tv_len = sizeof(tv);
+    if (!buf)
+        return relay_payload(from, to, len);
+    if (getsockopt(from, SOL_SOCKET, SO_RCVTIMEO, &tv, &tv_len) == 0 && (tv.tv_sec || tv.tv_usec))
+        backend_ms = tv.tv_sec * 1000L + tv.tv_usec / 1000;
+    qos_size(len);
+    while (delivered < len) {
+        int reading = moved < len && (spool >= 0 || !paused);
+        if (!reading && count == 0)
+            break;
+        struct pollfd pfd[2] = { { from, reading ? POLLIN : 0, 0 }, { to, count > 0 ? POLLOUT : 0, 0 } };
+        long now = now_ms(), wait = client_stall_ms - (now - progress), waiting = count;
+        if (paused && spool < 0 && can_spool && relay_spool_ms - (now - first_pause) < wait)
+            wait = relay_spool_ms - (now - first_pause);
+        int ready = poll(pfd, 2, count == 0 ? backend_ms : wait > 0 ? wait : 0);
+        if (ready < 0 && errno != EINTR)
+            break;
+        if (ready == 0 && count == 0) {
+            LOG(LL_WARN, "Backend sent nothing for %ld ms, ending the download\n", backend_ms);
+            break;
+        }
+        now = now_ms();
+        // A hangup is reported even when not asked for; only act on the awaited direction.
+        if (reading && pfd[0].revents) {
+            long tail = (head + count) % RELAY_BUF;
+            long want = spool >= 0 ? (long)sizeof(chunk) : RELAY_BUF - count < RELAY_BUF - tail ?
+                        RELAY_BUF - count : RELAY_BUF - tail;
+            if (want > len - moved)
+                want = len - moved;
+            ssize_t k = recv(from, spool >= 0 ? chunk : buf + tail, want, MSG_DONTWAIT);
+            if (k == 0 || (k < 0 && errno != EAGAIN && errno != EINTR))
+                break;
+            if (k > 0 && spool >= 0 && pwrite(spool, chunk, k, spooled) != k)
+                break;
+            if (k > 0) {
+                qos_charge(k);
+                moved += k;
+                if (spool >= 0)
+                    spooled += k;
+                else
+                    count += k;
+            }
+        }
+        if (count > 0 && pfd[1].revents) {
+            ssize_t k = send(to, buf + head, count < RELAY_BUF - head ? count : RELAY_BUF - head,
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (k < 0 && errno != EAGAIN && errno != EINTR) {
+                to = -1;
+                break;
+            }
+            if (k > 0) {
+                head = (head + k) % RELAY_BUF;
+                count -= k;
+                delivered += k;
+                progress = now;
+            }
+        }
+        // Bring spooled data back once the client has drained the buffer.
+        ssize_t k = 1;
+        if (spool >= 0 && count <= RELAY_LOW) {
+            while (count < RELAY_BUF && unspooled < spooled) {
+                long tail = (head + count) % RELAY_BUF;
+                long want = RELAY_BUF - count < RELAY_BUF - tail ? RELAY_BUF - count : RELAY_BUF - tail;
+                if (want > spooled - unspooled)
+                    want = spooled - unspooled;
+                if ((k = pread(spool, buf + tail, want, unspooled)) <= 0)
+                    break;
+                count += k;
+                unspooled += k;
+            }
+        }
+        if (k <= 0)
+            break;
+        if (waiting == 0 && count > 0)
+            progress = now;
+        if (!paused && spool < 0 && count >= RELAY_HIGH) {
+            paused = 1;
+            if (!first_pause)
+                first_pause = now;
+            __atomic_fetch_add(&metrics->relay_pauses, 1, __ATOMIC_RELAXED);
+        } else if (paused && count <= RELAY_LOW) {
+            paused = 0;
+        }
+        if (paused && spool < 0 && can_spool && now - first_pause >= relay_spool_ms) {
+            snprintf(path, sizeof(path), "%s/S1", get_home_dir());
+            mkdir(path, 0755);
+            spool = open(path, O_TMPFILE | O_RDWR, 0600);
+            can_spool = spool >= 0;
+            if (spool >= 0)
+                LOG_REQ("Client is slow: spooling the last %ld bytes of the reply\n", len - moved);
+            else
+                LOG(LL_WARN, "Cannot spool to %s: %s\n", path, strerror(errno));
+        }
+        if (count > 0 && now - progress >= client_stall_ms) {
+            LOG(LL_WARN, "Client took nothing for %ld ms, dropping its download\n", client_stall_ms);
+            __atomic_fetch_add(&metrics->relay_stalls, 1, __ATOMIC_RELAXED);
+            to = -1;
+            break;
+        }
+    }
+    if (spool >= 0)
+        close(spool);
+    if (spooled > 0)
+        __atomic_fetch_add(&metrics->relay_spooled, spooled, __ATOMIC_RELAXED);
+    pool_put(buf);
+    // Read the rest of the reply, if the client failed, so the backend can finish sending it.
+    if (to < 0 && moved < len)
+        relay_payload(from, -1, len - moved);
+    return delivered;
+}
+
+// arena_get: Returns an empty arena for a request, reusing a returned one if there is any,
+// or NULL if out of memory. A new one comes with its first block. Give it back with
+// arena_put().
+struct arena *arena_get(void) {
+    pthread_mutex_lock(&alloc_lock);
+    struct arena *a = arena_free;
+    if (a)
+        arena_free = a->next;
+    pthread_mutex_unlock(&alloc_lock);
+    if (a || !(a = calloc(1, sizeof(*a))))
+        return a;
+    if (metrics)
+        __atomic_fetch_add(&metrics->arena_mallocs, 1, __ATOMIC_RELAXED);
+    // An empty allocation makes the first block.
+    arena_alloc(a, 0);
+    return a;
+}
+
+// arena_alloc: Returns n bytes from arena a, aligned for any use, or NULL if out of memory
+// or a is NULL. They stay valid until a is given back.
+void *arena_alloc(struct arena *a, size_t n) {
+    if (!a)
+        return NULL;
+    n = (n + 15) & ~(size_t)15;
+    // The blocks after the current one are empty; the first that fits becomes current.
+    struct arena_block *b = a->cur;
+    while (b && b->size - b->used < n)
+        b = b->next;
+    if (!b) {
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        if (!(b = malloc(sizeof(*b) + size)))
+            return NULL;
+        b->size = size;
+        b->used = 0;
+        if (a->cur) {
+            b->next = a->cur->next;
+            a->cur->next = b;
+        } else {
+            b->next = a->first;
+            a->first = b;
+        }
+        if (metrics)
+            __atomic_fetch_add(&metrics->arena_mallocs, 1, __ATOMIC_RELAXED);
+    }
+    a->cur = b;
+    void *p = b->data + b->used;
+    b->used += n;
+    if (n && metrics)
+        __atomic_fetch_add(&metrics->arena_allocs, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+// arena_strdup: Copies string s into arena a. Returns NULL if out of memory.
+char *arena_strdup(struct arena *a, const char *s) {
+    size_t n = strlen(s) + 1;
+    char *p = arena_alloc(a, n);
+    if (p)
+        memcpy(p, s, n);
+    return p;
+}
+
+// arena_put: Empties arena a, freeing its blocks beyond the first ARENA_KEEP bytes, and puts
+// it on the free list. Everything allocated from it is gone. a may be NULL.
+void arena_put(struct arena *a) {
+    if (!a)
+        return;
+    size_t kept = 0;
+    struct arena_block **link = &a->first;
+    while (*link) {
+        struct arena_block *b = *link;
+        if (b != a->first && kept + b->size > ARENA_KEEP) {
+            *link = b->next;
+            free(b);
+            continue;
+        }
+        kept += b->size;
+        b->used = 0;
+        link = &b->next;
+    }
+    a->cur = a->first;
+    pthread_mutex_lock(&alloc_lock);
+    a->next = arena_free;
+    arena_free = a;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// pool_get: Returns a page-aligned relay buffer of POOL_BUF bytes, mapping a new slab of them
+// when none is free, or NULL if out of memory. Give it back with pool_put().
+void *pool_get(void) {
+    pthread_mutex_lock(&alloc_lock);
+    if (!pool_free) {
+        char *slab = mmap(NULL, (size_t)POOL_BUF * POOL_SLAB, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        for (int i = POOL_SLAB - 1; slab != MAP_FAILED && i >= 0; i--) {
+            *(void **)(slab + (size_t)i * POOL_BUF) = pool_free;
+            pool_free = slab + (size_t)i * POOL_BUF;
+        }
+        if (slab != MAP_FAILED && metrics)
+            __atomic_fetch_add(&metrics->pool_slabs, 1, __ATOMIC_RELAXED);
+    }
+    void *buf = pool_free;
+    if (buf)
+        pool_free = *(void **)buf;
+    pthread_mutex_unlock(&alloc_lock);
+    if (buf && metrics)
+        __atomic_fetch_add(&metrics->pool_gets, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+// pool_put: Gives relay buffer buf back for reuse. buf may be NULL.
+void pool_put(void *buf) {
+    if (!buf)
+        return;
+    pthread_mutex_lock(&alloc_lock);
+    *(void **)buf = pool_free;
+    pool_free = buf;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// forward_start: Streams an upload of fsize bytes from the client straight to backend b as
+// a framed uploadf request for dest_path. The frame header tells the backend where the path
+// ends and the data begins, so neither a pause nor a temporary copy is needed. Returns the
+// backend connection, whose status reply is still to be read, or -1 if the data could not be
+// delivered.
+int forward_start(int client_sock, const char *dest_path, const struct backend *b, long fsize) {
+    int sock = backend_open(b, OP_UPLOADF, 0, FIELD_PATH, dest_path, fsize, 0);
+    if (sock < 0) {
+        perror("Forward file connect failed");
+        relay_payload(client_sock, -1, fsize);
+        return -1;
+    }
+    long t0 = metrics_now();
+    long sent = relay_payload(client_sock, sock, fsize);
+    trace_span("transfer", t0, metrics_now());
+    if (sent != fsize) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// stripe_manifest: Builds the path of the manifest of the striped object at ~S1 path vpath.
+void stripe_manifest(const char *vpath, char *out, size_t outsz) {
+    snprintf(out, outsz, "%s/S1/.stripes%s", get_home_dir(), vpath + 3);
+}
+
+// stripe_load: Reads the manifest of the object at vpath, if it is striped. The manifest
+// holds "<size> <stripe size> <count>" and then the backend of each stripe, one per line.
+// Returns 0 and fills sp (whose where array the caller frees), or -1 if the object is not
+// striped or the manifest names a backend no longer in the route's pool.
+int stripe_load(const struct route *r, const char *vpath, struct stripes *sp) {
+    char manifest[BUFSIZE], name[64];
+    struct stat st;
+    stripe_manifest(vpath, manifest, sizeof(manifest));
+    FILE *fp = r ? fopen(manifest, "r") : NULL;
+    if (!fp)
+        return -1;
+    sp->where = NULL;
+    if (fstat(fileno(fp), &st) != 0 || fscanf(fp, "%ld %ld %d", &sp->size, &sp->stripe, &sp->count) != 3 ||
+        sp->count <= 0 || sp->stripe <= 0 || !(sp->where = calloc(sp->count, sizeof(*sp->where)))) {
+        fclose(fp);
+        free(sp->where);
+        return -1;
+    }
+    sp->mtime = st.st_mtime;
+    for (int i = 0; i < sp->count; i++) {
+        if (fscanf(fp, "%63s", name) != 1)
+            break;
+        for (int j = 0; j < r->npool && !sp->where[i]; j++)
+            if (strcmp(r->pool[j].name, name) == 0)
+                sp->where[i] = &r->pool[j];
+        if (!sp->where[i]) {
+            LOG(LL_ERROR, "Manifest %s names unknown backend %s\n", manifest, name);
+            break;
+        }
+    }
+    fclose(fp);
+    if (!sp->where[sp->count - 1]) {
+        free(sp->where);
+        return -1;
+    }
+    return 0;
+}
+
+// stripe_upload: Stores the size bytes following on the client socket as a striped object.
+// Stripe i goes to the backend after the object's owner by i places, so consecutive stripes
+// land on different backends and are written in parallel: S1 only waits for a backend's
+// acknowledgement before sending it its next stripe. The manifest is installed once every
+// stripe is stored, and replaces any previous version. Returns 0 on success.
+int stripe_upload(int client_sock, const struct route *r, const char *vpath, long size) {
+    int count = (size + stripe_size - 1) / stripe_size, first = route_backend(r, vpath) - r->pool;
+    int *socks = malloc(count * sizeof(int)), failed = !socks;
+    char bpath[BUFSIZE + 32], manifest[BUFSIZE], tmp[BUFSIZE + 16];
+    long off = 0;
+    // A stripe skipped after a failure has no connection to reap.
+    for (int i = 0; i < count && socks; i++)
+        socks[i] = -1;
+    for (int i = 0; i < count; i++) {
+        long len = size - off < stripe_size ? size - off : stripe_size;
+        const struct backend *b = &r->pool[(first + i) % r->npool];
+        off += len;
+        if (failed) {
+            relay_payload(client_sock, -1, len);
+            continue;
+        }
+        // The backend is single-threaded: collect its reply to the previous stripe first.
+        if (i >= r->npool && socks[i - r->npool] >= 0) {
+            failed |= backend_reply(socks[i - r->npool], NULL, 0) != 0;
+            close(socks[i - r->npool]);
+            socks[i - r->npool] = -1;
+        }
+        snprintf(bpath, sizeof(bpath), "%s%s.%d.stripe", r->root, vpath + 3, i);
+        socks[i] = backend_open(b, OP_UPLOADF, 0, FIELD_PATH, bpath, len, 0);
+        if (socks[i] < 0 || relay_payload(client_sock, socks[i], len) != len) {
+            if (socks[i] < 0)
+                relay_payload(client_sock, -1, len);
+            failed = 1;
+        }
+    }
+    for (int i = 0; i < count && socks; i++)
+        if (socks[i] >= 0) {
+            failed |= backend_reply(socks[i], NULL, 0) != 0;
+            close(socks[i]);
+        }
+    free(socks);
+
+    struct stripes old;
+    int had_old = stripe_load(r, vpath, &old) == 0;
+    FILE *fp = NULL;
+    stripe_manifest(vpath, manifest, sizeof(manifest));
+    snprintf(tmp, sizeof(tmp), "%s.%d", manifest, getpid());
+    if (!failed) {
+        create_directories(manifest);
+        fp = fopen(tmp, "w");
+    }
+    if (fp) {
+        fprintf(fp, "%ld %ld %d\n", size, stripe_size, count);
+        for (int i = 0; i < count; i++)
+            fprintf(fp, "%s\n", r->pool[(first + i) % r->npool].name);
+        failed |= fclose(fp) != 0 || rename(tmp, manifest) != 0;
+    } else {
+        failed = 1;
+    }
+    if (failed) {
+        // Nothing refers to the stripes that were written; drop them.
+        for (int i = 0; i < count; i++) {
+            snprintf(bpath, sizeof(bpath), "%s%s.%d.stripe", r->root, vpath + 3, i);
+            int sock = backend_open(&r->pool[(first + i) % r->npool], OP_REMOVEF, 0, FIELD_PATH, bpath, 0, 10);
+            if (sock >= 0) {
+                backend_reply(sock, NULL, 0);
+                close(sock);
+            }
         }
-        struct sockaddr_in servaddr;
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port = htons(port);
-        inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
-        if (connect(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-            send(client_sock, &err, sizeof(long), 0);
+        remove(tmp);
+        if (had_old)
+            free(old.where);
+        return -1;
+    }
+
+    // Drop what the new version does not overwrite: stripes of an older striped version
+    // and a copy stored whole on any shard.
+    char target[BUFSIZE];
+    snprintf(target, sizeof(target), "%s%s", r->root, vpath + 3);
+    for (int i = 0; i < (had_old ? old.count : 0); i++) {
+        if (i < count && old.where[i] == &r->pool[(first + i) % r->npool])
+            continue;
+        snprintf(bpath, sizeof(bpath), "%s.%d.stripe", target, i);
+        int sock = backend_open(old.where[i], OP_REMOVEF, 0, FIELD_PATH, bpath, 0, 10);
+        if (sock >= 0) {
+            backend_reply(sock, NULL, 0);
             close(sock);
-            return;
         }
-        // Send the download command to the backend.
-        char get_cmd[512];
-        snprintf(get_cmd, sizeof(get_cmd), "downlf %s", corrected_path);
-        send(sock, get_cmd, strlen(get_cmd), 0);
-        long fsize = 0;
-        if (recv(sock, &fsize, sizeof(long), 0) <= 0) {
-            send(client_sock, &err, sizeof(long), 0);
+    }
+    for (int j = 0; j < r->npool; j++) {
+        int sock = backend_open(&r->pool[j], OP_REMOVEF, 0, FIELD_PATH, target, 0, 10);
+        if (sock >= 0) {
+            backend_reply(sock, NULL, 0);
             close(sock);
-            return;
         }
-        // If the backend returns 0 or negative size, relay the error.
-        if (fsize <= 0) {
-            send(client_sock, &err, sizeof(long), 0);
+    }
+    if (had_old)
+        free(old.where);
+    return 0;
+}
+
+// stripe_fetch_run: Thread body fetching one stripe. A local backend hands over its file,
+// which is only read ahead here; otherwise the stripe is received into memory.
+void *stripe_fetch_run(void *arg) {
+    struct stripe_fetch *sf = arg;
+    int sock = backend_open(sf->b, OP_DOWNLF, FRAME_FD, FIELD_PATH, sf->path, 0, 30);
+    long size = sock < 0 ? -1 : backend_reply_fd(sock, &sf->fd, &sf->off);
+    if (size == sf->len && sf->fd >= 0) {
+        posix_fadvise(sf->fd, sf->off, sf->len, POSIX_FADV_WILLNEED);
+        sf->ok = 1;
+    } else if (size == sf->len && (sf->buf = malloc(sf->len)) != NULL) {
+        sf->ok = recv_all(sock, sf->buf, sf->len) == 0;
+    }
+    if (sock >= 0)
+        close(sock);
+    return NULL;
+}
+
+// stripe_fetch_start: Starts fetching stripe sf on a thread of its own, or fetches it here if
+// no thread can be created.
+void stripe_fetch_start(struct stripe_fetch *sf) {
+    sf->threaded = pthread_create(&sf->tid, NULL, stripe_fetch_run, sf) == 0;
+    if (!sf->threaded)
+        stripe_fetch_run(sf);
+}
+
+// stripe_download: Sends a striped object to the client. Up to STRIPE_WINDOW stripes are
+// fetched in parallel, each by its own thread, and written to the client in order.
+void stripe_download(int client_sock, const struct stripes *sp, const char *target) {
+    struct stripe_fetch *sf = calloc(sp->count, sizeof(struct stripe_fetch));
+    if (!sf) {
+        reply_size(client_sock, -1);
+        return;
+    }
+    for (int i = 0; i < sp->count; i++) {
+        sf[i].b = sp->where[i];
+        sf[i].fd = -1;
+        sf[i].len = i < sp->count - 1 ? sp->stripe : sp->size - (long)i * sp->stripe;
+        snprintf(sf[i].path, sizeof(sf[i].path), "%s.%d.stripe", target, i);
+    }
+    int started = 0, sent_size = 0;
+    for (; started < sp->count && started < STRIPE_WINDOW; started++)
+        stripe_fetch_start(&sf[started]);
+    for (int i = 0; i < sp->count; i++) {
+        if (sf[i].threaded)
+            pthread_join(sf[i].tid, NULL);
+        if (!sf[i].ok && !sent_size) {
+            // Nothing was promised yet, so the client can still be told.
+            reply_size(client_sock, -1);
+            sent_size = -1;
+        }
+        if (sf[i].ok && !sent_size) {
+            reply_size(client_sock, sp->size);
+            sent_size = 1;
+        }
+        if (sent_size > 0) {
+            long n = !sf[i].ok ? -1 : sf[i].fd >= 0 ? send_from_fd(client_sock, sf[i].fd, sf[i].off, sf[i].len)
+                                                     : (send_all(client_sock, sf[i].buf, sf[i].len) == 0 ? sf[i].len : -1);
+            if (n != sf[i].len) {
+                LOG(LL_ERROR, "Stripe %d of %s could not be sent\n", i, target);
+                shutdown(client_sock, SHUT_RDWR);
+                sent_size = -1;
+            }
+        }
+        if (sf[i].fd >= 0)
+            close(sf[i].fd);
+        free(sf[i].buf);
+        if (started < sp->count) {
+            stripe_fetch_start(&sf[started]);
+            started++;
+        }
+    }
+    free(sf);
+}
+
+// stripe_remove: Deletes every stripe of the object at vpath, then its manifest. Returns 0 if
+// all stripes were removed.
+int stripe_remove(const struct route *r, const char *vpath, const struct stripes *sp) {
+    char bpath[BUFSIZE + 32], manifest[BUFSIZE];
+    int failed = 0;
+    for (int i = 0; i < sp->count; i++) {
+        snprintf(bpath, sizeof(bpath), "%s%s.%d.stripe", r->root, vpath + 3, i);
+        int sock = backend_open(sp->where[i], OP_REMOVEF, 0, FIELD_PATH, bpath, 0, 10);
+        failed |= sock < 0 || backend_reply(sock, NULL, 0) < 0;
+        if (sock >= 0)
             close(sock);
+    }
+    stripe_manifest(vpath, manifest, sizeof(manifest));
+    remove(manifest);
+    free(sp->where);
+    return failed ? -1 : 0;
+}
+
+// stripe_list: Appends the names of the striped files of type ext in the ~S1 directory
+// dirpath to out, one per line, writing at most cap bytes. Returns the number of names.
+int stripe_list(const char *dirpath, const char *ext, char *out, long cap) {
+    char dir[BUFSIZE];
+    int count = 0;
+    long used = strlen(out);
+    stripe_manifest(dirpath, dir, sizeof(dir));
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        const char *e = strrchr(entry->d_name, '.');
+        if (entry->d_type != DT_REG || !e || strcmp(e, ext) != 0 || used + (long)strlen(entry->d_name) + 2 > cap)
+            continue;
+        used += sprintf(out + used, "%s\n", entry->d_name);
+        count++;
+    }
+    if (d)
+        closedir(d);
+    return count;
+}
+
+// handle_download: Processes a download request from the client.
+// For .c files stored in S1, the file is sent directly. For other file types,
+// the request is forwarded to the corresponding backend server.
+void handle_download(int client_sock, const char *filepath) {
+    const char *ext = strrchr(filepath, '.');
+
+    // If file extension is not provided, immediately send error indicator.
+    if (!ext) {
+        reply_size(client_sock, -1);
+        return;
+    }
+
+    char *home = get_home_dir();
+
+    if (strcmp(ext, ".c") == 0) {
+        // Build absolute path for .c files stored locally in S1.
+        char real_path[512];
+        snprintf(real_path, sizeof(real_path), "%s/%s", home, filepath + 1);
+        FILE *fp = fopen(real_path, "rb");
+        if (!fp) {
+            // File not found: send error indicator.
+            reply_size(client_sock, -1);
             return;
         }
-        // Send the file size to the client then stream the file data.
-        send(client_sock, &fsize, sizeof(long), 0);
+        // Determine the file size and send it.
+        fseek(fp, 0, SEEK_END);
+        long fsize = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        reply_size(client_sock, fsize);
         char buffer[BUFSIZE];
-        long received = 0;
         int n;
-        while (received < fsize) {
-            n = recv(sock, buffer, BUFSIZE, 0);
-            if (n <= 0) {
-                break;
+        // Stream the file data to the client.
+        while ((n = fread(buffer, 1, BUFSIZE, fp)) > 0) {
+            send_all(client_sock, buffer, n);
+        }
+        fclose(fp);
+    } else {
+        // For non-.c files, forward the request to the appropriate backend server.
+        const struct route *r = route_lookup(ext);
+        char corrected_path[512];
+        if (!r) {
+            // Unsupported file type.
+            reply_size(client_sock, -1);
+            return;
+        }
+        snprintf(corrected_path, sizeof(corrected_path), "%s%s", r->root, filepath + 3);
+        struct stripes sp;
+        if (stripe_load(r, filepath, &sp) == 0) {
+            stripe_download(client_sock, &sp, corrected_path);
+            free(sp.where);
+            return;
+        }
+        // Ask the shard that owns the file. Until a rebalance has moved it, the file may still
+        // be on another shard of the pool, so those are asked next.
+        const struct backend *order[ROUTE_POOL_MAX];
+        int nb = route_rank(r, filepath, order);
+        int sock = -1, fd = -1;
+        long off, fsize = -1;
+        for (int i = 0; i < nb && fsize < 0; i++) {
+            // A replica may not have caught up with a recent upload yet; then the primary is asked.
+            for (int p = 0; p < (order[i]->nep > 1 ? 2 : 1) && fsize < 0; p++) {
+                if (sock >= 0)
+                    close(sock);
+                read_primary = p;
+                // A backend reached over AF_UNIX may hand over the open file instead of its data.
+                sock = backend_open(order[i], OP_DOWNLF, FRAME_FD, FIELD_PATH, corrected_path, 0, 0);
+                fsize = sock < 0 ? -1 : backend_reply_fd(sock, &fd, &off);
             }
-            send(client_sock, buffer, n, 0);
-            received += n;
         }
+        read_primary = 0;
+        // Relay a backend error; text clients have always been told an empty file is missing.
+        if (fsize < 0 || (fsize == 0 && !framed)) {
+            reply_size(client_sock, -1);
+            if (fd >= 0)
+                close(fd);
+            if (sock >= 0)
+                close(sock);
+            return;
+        }
+        // Send the file size to the client then stream the file data.
+        long t0 = metrics_now();
+        reply_size(client_sock, fsize);
+        long sent = fd >= 0 ? send_from_fd(client_sock, fd, off, fsize) : relay_bounded(sock, client_sock, fsize);
+        trace_span("transfer", t0, metrics_now());
+        if (sent < fsize) {
+            // The client was promised fsize bytes, so its stream cannot be resynchronised.
+            LOG(LL_WARN, "Backend transfer ended early\n");
+            shutdown(client_sock, SHUT_RDWR);
+        }
+        if (fd >= 0)
+            close(fd);
         close(sock);
     }
 }
 
+// transport_bench: Fetches filepath from its backend iterations times over loopback TCP,
+// over AF_UNIX with the data relayed through the socket, and over AF_UNIX with the backend
+// passing its descriptor, and prints the mean latency and throughput of each. The data goes
+// to /dev/null, so only the S1-backend leg is measured.
+void transport_bench(const char *filepath, int iterations) {
+    static const char *modes[] = {"tcp", "unix", "unix+fd"};
+    const struct route *r = route_lookup(strrchr(filepath, '.'));
+    int sink = open("/dev/null", O_WRONLY);
+    if (!r || strlen(filepath) < 3 || sink < 0 || iterations <= 0) {
+        printf("Usage: S1 --transport-bench <~S1/path of a routed type> [iterations]\n");
+        return;
+    }
+    const struct backend *b = route_backend(r, filepath);
+    char path[512];
+    snprintf(path, sizeof(path), "%s%s", r->root, filepath + 3);
+
+    for (int mode = 0; mode < 3; mode++) {
+        struct timeval t0, t1;
+        long bytes = 0;
+        local_transport = mode > 0;
+        gettimeofday(&t0, NULL);
+        for (int i = 0; i < iterations; i++) {
+            int sock = backend_open(b, OP_DOWNLF, mode == 2 ? FRAME_FD : 0, FIELD_PATH, path, 0, 5);
+            int fd = -1;
+            long off, size = sock < 0 ? -1 : backend_reply_fd(sock, &fd, &off);
+            if (size < 0) {
+                printf("%s: fetch failed\n", modes[mode]);
+                if (sock >= 0)
+                    close(sock);
+                break;
+            }
+            bytes += fd >= 0 ? send_from_fd(sink, fd, off, size) : relay_payload(sock, sink, size);
+            if (fd >= 0)
+                close(fd);
+            close(sock);
+        }
+        gettimeofday(&t1, NULL);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        printf("%-8s %8.1f us/fetch %10.1f MB/s\n", modes[mode], secs * 1e6 / iterations,
+               bytes / (1024.0 * 1024.0) / secs);
+    }
+    close(sink);
+}
+
+// rebalance: Moves every object of the routed types, or of type only, to the shard that owns
+// it under the current routes. Each shard lists its objects; one that another shard now wins
+// is copied there and then removed from the old shard. Readers find it on one of the two at
+// any time, since S1 falls back to the other shards when the owner lacks a file. An object
+// the owner already holds was written since the pool changed, so the old copy is dropped.
+// Run it after adding a backend to a pool and reloading S1 with SIGHUP.
+void rebalance(const char *only) {
+    long moved = 0, dropped = 0, failed = 0;
+    // Replicas may lag behind; only the primaries are authoritative.
+    read_primary = 1;
+    for (int k = 0; k < nroutes; k++) {
+        const struct route *r = &routes[k];
+        if ((only && strcmp(only, r->ext) != 0) || r->npool < 2)
+            continue;
+        for (int j = 0; j < r->npool; j++) {
+            const struct backend *from = &r->pool[j];
+            int sock = backend_open(from, OP_LIST, 0, FIELD_TYPE, r->ext, 0, 30);
+            long n = sock < 0 ? -1 : backend_reply(sock, NULL, 0);
+            char *list = n >= 0 ? malloc(n + 1) : NULL;
+            if (!list || recv_all(sock, list, n) != 0) {
+                printf("%s: cannot list %s files\n", from->name, r->ext);
+                failed++;
+                free(list);
+                if (sock >= 0)
+                    close(sock);
+                continue;
+            }
+            close(sock);
+            list[n] = '\0';
+            char *save;
+            for (char *rel = strtok_r(list, "\n", &save); rel; rel = strtok_r(NULL, "\n", &save)) {
+                char vpath[BUFSIZE], bpath[BUFSIZE], msg[256];
+                snprintf(vpath, sizeof(vpath), "~S1%s", rel);
+                snprintf(bpath, sizeof(bpath), "%s%s", r->root, rel);
+                const struct backend *to = route_backend(r, vpath);
+                if (to == from)
+                    continue;
+                int ok = 0, dst = -1;
+                int src = backend_open(to, OP_STAT, 0, FIELD_PATH, bpath, 0, 10);
+                if (src >= 0 && backend_reply(src, NULL, 0) >= 0) {
+                    ok = 1;
+                    dropped++;
+                } else {
+                    if (src >= 0)
+                        close(src);
+                    // Copy the object to its owner.
+                    src = backend_open(from, OP_DOWNLF, 0, FIELD_PATH, bpath, 0, 10);
+                    long size = src < 0 ? -1 : backend_reply(src, NULL, 0);
+                    if (size >= 0)
+                        dst = backend_open(to, OP_UPLOADF, 0, FIELD_PATH, bpath, size, 10);
+                    if (dst >= 0 && relay_payload(src, dst, size) == size &&
+                        backend_reply(dst, msg, sizeof(msg)) >= 0) {
+                        ok = 1;
+                        moved++;
+                    }
+                }
+                if (src >= 0)
+                    close(src);
+                if (dst >= 0)
+                    close(dst);
+                if (ok) {
+                    // Only now is the old copy removed.
+                    int rm = backend_open(from, OP_REMOVEF, 0, FIELD_PATH, bpath, 0, 10);
+                    if (rm >= 0) {
+                        backend_reply(rm, NULL, 0);
+                        close(rm);
+                    }
+                    printf("%s: %s -> %s\n", vpath, from->name, to->name);
+                } else {
+                    printf("%s: could not move from %s to %s\n", vpath, from->name, to->name);
+                    failed++;
+                }
+            }
+            free(list);
+        }
+    }
+    printf("Rebalance done: %ld moved, %ld already in place, %ld failed\n", moved, dropped, failed);
+}
+
 // handle_remove: Processes a file removal request.
 // For .c files, the removal is handled locally; for other file types,
 // the request is forwarded to the appropriate backend server.
-void handle_remove(int client_sock, char *cmd) {
-    char filepath[512];
-    sscanf(cmd, "removef %s", filepath);
+void handle_remove(int client_sock, const char *filepath) {
     const char *ext = strrchr(filepath, '.');
     if (!ext) {
-        char *msg = "Invalid file extension.\n";
-        send(client_sock, msg, strlen(msg), 0);
+        reply_status(client_sock, 0, "Invalid file extension.\n");
         return;
     }
     char *home = get_home_dir();
@@ -422,80 +2848,275 @@ void handle_remove(int client_sock, char *cmd) {
         char local_path[512];
         snprintf(local_path, sizeof(local_path), "%s/%s", home, filepath + 1);
         if (remove(local_path) == 0) {
-            char *msg = "File deleted.\n";
-            send(client_sock, msg, strlen(msg), 0);
+            bump_generation();
+            reply_status(client_sock, 1, "File deleted.\n");
         } else {
-            char *msg = "File not found or cannot delete.\n";
-            send(client_sock, msg, strlen(msg), 0);
+            reply_status(client_sock, 0, "File not found or cannot delete.\n");
         }
     } else {
         // Forward removal requests for other file types to the correct backend.
-        int port = 0;
+        const struct route *r = route_lookup(ext);
         char corrected_path[512];
-        if (strcmp(ext, ".pdf") == 0) {
-            port = 7100;
-            snprintf(corrected_path, sizeof(corrected_path), "~S2%s", filepath + 3);
-        } else if (strcmp(ext, ".txt") == 0) {
-            port = 7200;
-            snprintf(corrected_path, sizeof(corrected_path), "~S3%s", filepath + 3);
-        } else if (strcmp(ext, ".zip") == 0) {
-            port = 7300;
-            snprintf(corrected_path, sizeof(corrected_path), "~S4%s", filepath + 3);
-        } else {
-            char *msg = "Unsupported file type.\n";
-            send(client_sock, msg, strlen(msg), 0);
+        if (!r) {
+            reply_status(client_sock, 0, "Unsupported file type.\n");
             return;
         }
-        // Connect to the backend server.
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        struct sockaddr_in servaddr;
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port = htons(port);
-        inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
-        if (connect(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-            char *msg = "Cannot connect.\n";
-            send(client_sock, msg, strlen(msg), 0);
+        snprintf(corrected_path, sizeof(corrected_path), "%s%s", r->root, filepath + 3);
+        struct stripes sp;
+        if (stripe_load(r, filepath, &sp) == 0) {
+            if (stripe_remove(r, filepath, &sp) == 0)
+                reply_status(client_sock, 1, "File removed.\n");
+            else
+                reply_status(client_sock, 0, "Some stripes could not be removed.\n");
             return;
         }
-        // Send the removal command to the backend.
-        char del_cmd[512];
-        snprintf(del_cmd, sizeof(del_cmd), "removef %s", corrected_path);
-        send(sock, del_cmd, strlen(del_cmd), 0);
-        char reply[256] = {0};
-        // Relay the reply from the backend to the client.
-        recv(sock, reply, sizeof(reply), 0);
-        send(client_sock, reply, strlen(reply), 0);
+        // Send the removal request to the owning shard, then to the others until one has the file.
+        const struct backend *order[ROUTE_POOL_MAX];
+        int nb = route_rank(r, filepath, order);
+        char reply[256] = "Cannot connect.\n";
+        long rc = -1;
+        for (int i = 0; i < nb && rc < 0; i++) {
+            int sock = backend_open(order[i], OP_REMOVEF, 0, FIELD_PATH, corrected_path, 0, 0);
+            if (sock < 0)
+                continue;
+            // Relay the reply from the backend to the client.
+            rc = backend_reply(sock, reply, sizeof(reply));
+            if (rc < 0 && !reply[0])
+                strcpy(reply, "No reply from backend.\n");
+            close(sock);
+        }
+        reply_status(client_sock, rc >= 0, reply);
+    }
+}
+
+// handle_batch: Serves a batched downlf, removef or stat. The list holds one ~S1 path per
+// line. Backend paths are grouped by the shard that owns them and sent to it as one batch,
+// all before any reply is read so that the backends work at the same time; .c paths are
+// served locally meanwhile. Every item is answered with its own reply carrying its path,
+// and a final reply closes the batch.
+void handle_batch(int client_sock, int opcode, char *list) {
+    // Group k * ROUTE_POOL_MAX + j collects the items of route k owned by its backend j.
+    enum { NGROUPS = ROUTE_MAX * ROUTE_POOL_MAX };
+    long len = strlen(list);
+    char *group[NGROUPS], **local = arena_alloc(arena, (len / 2 + 1) * sizeof(char *));
+    long glen[NGROUPS];
+    int gcount[NGROUPS], socks[NGROUPS], nlocal = 0, n = 0;
+    // Items from several sources go out back to back, so hold the client socket throughout.
+    reply_begin();
+    for (int g = 0; g < NGROUPS; g++) {
+        group[g] = NULL;
+        glen[g] = gcount[g] = 0;
+        socks[g] = -1;
+    }
+    if (!local) {
+        reply_status(client_sock, 0, "Out of memory.\n");
+        goto out;
+    }
+
+    // Sort the items by destination; a bad path is answered straight away.
+    char *save;
+    for (char *tok = strtok_r(list, "\n", &save); tok; tok = strtok_r(NULL, "\n", &save)) {
+        const char *ext = strrchr(tok, '.');
+        int k;
+        n++;
+        batch_path = tok;
+        if (strncmp(tok, "~S1/", 4) != 0 || !ext) {
+            reply_status(client_sock, 0, "Invalid path.\n");
+            continue;
+        }
+        if (strcmp(ext, ".c") == 0) {
+            local[nlocal++] = tok;
+            continue;
+        }
+        const struct route *r = route_lookup(ext);
+        if (!r) {
+            reply_status(client_sock, 0, "Unsupported file type.\n");
+            continue;
+        }
+        // Striped files are served by S1 itself, from their manifest.
+        char manifest[BUFSIZE];
+        stripe_manifest(tok, manifest, sizeof(manifest));
+        if (access(manifest, F_OK) == 0) {
+            local[nlocal++] = tok;
+            continue;
+        }
+        k = (r - routes) * ROUTE_POOL_MAX + (route_backend(r, tok) - r->pool);
+        // A group gains at most the difference in root length per item over the ~S1 path.
+        if (!group[k] && !(group[k] = arena_alloc(arena, len + 1 + (len / 4 + 1) * strlen(r->root)))) {
+            reply_status(client_sock, 0, "Out of memory.\n");
+            continue;
+        }
+        glen[k] += sprintf(group[k] + glen[k], "%s%s\n", r->root, tok + 3);
+        gcount[k]++;
+    }
+
+    for (int g = 0; g < NGROUPS; g++) {
+        if (gcount[g] == 0)
+            continue;
+        socks[g] = backend_open(&routes[g / ROUTE_POOL_MAX].pool[g % ROUTE_POOL_MAX], opcode,
+                                FRAME_BATCH, 0, NULL, glen[g], 10);
+        if (socks[g] >= 0 && send_all(socks[g], group[g], glen[g]) != 0) {
+            close(socks[g]);
+            socks[g] = -1;
+        }
+    }
+
+    // Local .c and striped files go through the single-file handlers while the backends work.
+    for (int i = 0; i < nlocal; i++) {
+        char real_path[512];
+        struct stat st;
+        struct stripes sp;
+        batch_path = local[i];
+        if (opcode == OP_DOWNLF)
+            handle_download(client_sock, local[i]);
+        else if (opcode == OP_REMOVEF)
+            handle_remove(client_sock, local[i]);
+        else if (opcode == OP_STAT && stripe_load(route_lookup(strrchr(local[i], '.')), local[i], &sp) == 0) {
+            reply_stat(client_sock, sp.size, sp.mtime);
+            free(sp.where);
+        }
+        else if (opcode == OP_STAT) {
+            snprintf(real_path, sizeof(real_path), "%s/%s", get_home_dir(), local[i] + 1);
+            if (stat(real_path, &st) == 0 && S_ISREG(st.st_mode))
+                reply_stat(client_sock, st.st_size, st.st_mtime);
+            else
+                reply_status(client_sock, 0, "File not found.\n");
+        }
+        else
+            reply_status(client_sock, 0, "Invalid command.\n");
+    }
+
+    for (int g = 0; g < NGROUPS; g++) {
+        const struct route *r = &routes[g / ROUTE_POOL_MAX];
+        if (gcount[g] == 0)
+            continue;
+        long relayed = socks[g] >= 0 ? relay_batch(client_sock, socks[g], r->root) : -1;
+        if (socks[g] >= 0)
+            close(socks[g]);
+        if (relayed < 0) {
+            // The backend failed part-way; which items it answered is already on the wire.
+            char msg[160];
+            snprintf(msg, sizeof(msg), "Backend %.63s for %.15s files failed; results may be missing.\n",
+                     r->pool[g % ROUTE_POOL_MAX].name, r->ext);
+            batch_path = r->ext;
+            reply_status(client_sock, 0, msg);
+        }
+    }
+
+    char msg[64];
+    batch_path = NULL;
+    snprintf(msg, sizeof(msg), "Batch of %d done.\n", n);
+    reply_status(client_sock, 1, msg);
+out:
+    batch_path = NULL;
+}
+
+// relay_batch: Forwards a backend's item replies and their payloads to the client, mapping
+// each item's path from the backend's root back under ~S1. Returns the number of items
+// relayed, or -1 if the backend went away before its final reply.
+long relay_batch(int client_sock, int sock, const char *root) {
+    struct frame f;
+    char fields[FRAME_FIELDS_MAX], value[FRAME_FIELDS_MAX];
+    int rlen = strlen(root);
+    long items = 0;
+    while (frame_recv(sock, &f) == 0 && f.opcode == OP_REPLY) {
+        if (!(f.flags & FRAME_MORE))
+            return items;
+        // FIELD_PATH starts with the route's root; the client asked for ~S1.
+        int flen = 0;
+        for (int off = 0; off + 3 <= f.fields_len && flen >= 0; ) {
+            int vlen = ((unsigned char)f.fields[off + 1] << 8) | (unsigned char)f.fields[off + 2];
+            if (off + 3 + vlen > f.fields_len)
+                break;
+            int skip = f.fields[off] == FIELD_PATH && vlen >= rlen &&
+                       memcmp(f.fields + off + 3, root, rlen) == 0 ? rlen : 0;
+            snprintf(value, sizeof(value), "%s%.*s", skip ? "~S1" : "", vlen - skip, f.fields + off + 3 + skip);
+            flen = frame_add(fields, flen, f.fields[off], value);
+            off += 3 + vlen;
+        }
+        if (flen < 0)
+            return -1;
+        frame_send(client_sock, OP_REPLY, f.flags, frame_req_id, fields, flen, f.payload_len);
+        if (relay_bounded(sock, client_sock, f.payload_len) < f.payload_len) {
+            LOG(LL_WARN, "Backend transfer ended early\n");
+            shutdown(client_sock, SHUT_RDWR);
+            return -1;
+        }
+        items++;
+    }
+    return -1;
+}
+
+// open_c_tar: Returns the cached tar archive of S1's .c files, opened for reading.
+// The archive is rebuilt only if a .c file changed since it was last generated;
+// the lock keeps concurrent handlers from racing on the rename and generation.
+FILE *open_c_tar(const char *home) {
+    char tar_cmd[BUFSIZE * 4 + 64];   // home, the list file twice and the build archive.
+    char tmpTar[BUFSIZE];
+    char tmpList[BUFSIZE];
+    char tmpLock[BUFSIZE];
+    char buildTar[BUFSIZE];
+    // Build paths for the cached tar archive, its lock and the temporary list file.
+    snprintf(tmpTar, sizeof(tmpTar), "%s/cfiles.tar", home);
+    snprintf(tmpLock, sizeof(tmpLock), "%s/cfiles.lock", home);
+    snprintf(tmpList, sizeof(tmpList), "%s/cfiles.%d.list", home, getpid());
+    snprintf(buildTar, sizeof(buildTar), "%s/cfiles.%d.tar", home, getpid());
+
+    int lock_fd = open(tmpLock, O_CREAT | O_RDWR, 0644);
+    if (lock_fd >= 0)
+        flock(lock_fd, LOCK_EX);
+    unsigned long gen = __atomic_load_n(&tar_cache->ns_generation, __ATOMIC_ACQUIRE);
+    if (tar_cache->tar_generation != gen || access(tmpTar, R_OK) != 0) {
+        // Create a fresh tar archive of .c files in S1, then swap it in atomically.
+        int n = snprintf(tar_cmd, sizeof(tar_cmd),
+                         "cd %s/S1 && find . -type f -name \"*.c\" > %s && tar -cf %s -T %s",
+                         home, tmpList, buildTar, tmpList);
+        if (n < 0 || n >= (int)sizeof(tar_cmd)) {
+            // A cut-off path would run the command on the wrong files.
+            LOG(LL_ERROR, "Home directory path too long to build cfiles.tar: %s\n", home);
+            if (lock_fd >= 0)
+                close(lock_fd);
+            return NULL;
+        }
+        system(tar_cmd);
+        remove(tmpList);
+        if (rename(buildTar, tmpTar) == 0)
+            tar_cache->tar_generation = gen;
+        LOG(LL_INFO, "Rebuilt cfiles.tar at generation %lu\n", gen);
+    }
+    FILE *fp = fopen(tmpTar, "rb");
+    if (lock_fd >= 0)
+        close(lock_fd);
+    return fp;
+}
+
+// open_backend_tar: Connects to a backend server and requests its tar archive for filetype.
+// If fsize is given, the reply is read and the archive size stored in *fsize; the archive
+// data follows on the returned socket. Returns -1 if the backend cannot be reached.
+int open_backend_tar(const struct backend *b, const char *filetype, long *fsize) {
+    // Receives from the backend time out after 10 seconds.
+    int sock = backend_open(b, OP_DOWNLTAR, 0, FIELD_TYPE, filetype, 0, 10);
+    if (sock < 0)
+        return -1;
+    LOG_REQ("Sent request to backend server: downltar %s\n", filetype);
+    if (fsize && (*fsize = backend_reply(sock, NULL, 0)) < 0) {
         close(sock);
+        return -1;
     }
+    return sock;
 }
 
 // handle_downltar: Processes a command to create and download a tar archive.
-// For .c files, the archive is generated locally; for .pdf and .txt files, the request is forwarded.
-// Only .c, .pdf, and .txt file types are supported for tar archiving.
-void handle_downltar(int client_sock, char *cmd) {
-    char filetype[10];
-    sscanf(cmd, "downltar %s", filetype);
+// For .c files, the archive is generated locally; for routed types such as .pdf, the request
+// is forwarded to the route's backend. "downltar all" merges every server's archive into one.
+void handle_downltar(int client_sock, const char *filetype) {
     char *home = get_home_dir();
-
-    if (strcmp(filetype, ".c") == 0) {
-        char tar_cmd[BUFSIZE];
-        char tmpTar[BUFSIZE];
-        char tmpList[BUFSIZE];
-        // Build paths for temporary tar and list files in the home directory.
-        snprintf(tmpTar, sizeof(tmpTar), "%s/cfiles.tar", home);
-        snprintf(tmpList, sizeof(tmpList), "%s/cfiles.list", home);
-        
-        
-        // Remove any existing temporary files and create a new tar archive of .c files in S1.
-        snprintf(tar_cmd, sizeof(tar_cmd),
-                 "rm -f %s; rm -f %s; cd %s/S1 && find . -type f -name \"*.c\" > %s && tar -cf %s -T %s",
-                 tmpTar, tmpList, home, tmpList, tmpTar, tmpList);
-        system(tar_cmd);
-        
-        FILE *fp = fopen(tmpTar, "rb");
+
+    if (strcmp(filetype, ".c") == 0) {
+        FILE *fp = open_c_tar(home);
         if (!fp) {
             char *msg = "Could not create cfiles.tar.\n";
-            send(client_sock, msg, strlen(msg), 0);
+            reply_status(client_sock, 0, msg);
             return;
         }
         // Determine tar archive size and check for empty archive.
@@ -504,119 +3125,293 @@ void handle_downltar(int client_sock, char *cmd) {
         fseek(fp, 0, SEEK_SET);
         if (fsize == 0) {
             char *msg = "No .c files found to create tar archive.\n";
-            send(client_sock, msg, strlen(msg), 0);
+            reply_status(client_sock, 0, msg);
             fclose(fp);
-            remove(tmpTar);
-            remove(tmpList);
             return;
         }
         // Send the tar archive size followed by the archive data.
-        send(client_sock, &fsize, sizeof(long), 0);
+        reply_size(client_sock, fsize);
         char buf[BUFSIZE];
         int n;
         while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
-            send(client_sock, buf, n, 0);
+            send_all(client_sock, buf, n);
         fclose(fp);
-        remove(tmpTar);
-        remove(tmpList);
-        printf("Sent cfiles.tar to client (%ld bytes)\n", fsize);
+        LOG_REQ("Sent cfiles.tar to client (%ld bytes)\n", fsize);
     }
     
 
 
-    else if (strcmp(filetype, ".pdf") == 0 || strcmp(filetype, ".txt") == 0) {
-        // Forward tar requests for .pdf or .txt files to their corresponding backend server.
-        int port = (strcmp(filetype, ".pdf") == 0) ? 7100 : 7200;
-        const char *tar_name = (strcmp(filetype, ".pdf") == 0) ? "pdf.tar" : "text.tar";
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
+    else if (route_lookup(filetype) && route_lookup(filetype)->npool > 1) {
+        // A sharded type has one archive per shard; they are merged like "downltar all".
+        handle_downltar_all(client_sock, NULL, route_lookup(filetype));
+    }
+    else if (route_lookup(filetype)) {
+        // Forward tar requests for routed file types to their backend server.
+        const struct route *r = route_lookup(filetype);
+        const char *tar_name = r->tar_name;
+        long fsize;
+        int sock = open_backend_tar(&r->pool[0], filetype, &fsize);
         if (sock < 0) {
-            char *msg = "Failed to create socket for backend connection.\n";
-            send(client_sock, msg, strlen(msg), 0);
-            return;
-        }
-        // Set a receive timeout on the backend connection.
-        struct timeval tv;
-        tv.tv_sec = 10;
-        tv.tv_usec = 0;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-        struct sockaddr_in servaddr;
-        servaddr.sin_family = AF_INET;
-        servaddr.sin_port = htons(port);
-        inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
-        if (connect(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
             char *msg = "Cannot connect to backend server.\n";
-            send(client_sock, msg, strlen(msg), 0);
-            close(sock);
-            return;
-        }
-        // Build and send the backend command.
-        char cmd2[32];
-        snprintf(cmd2, sizeof(cmd2), "downltar %s", filetype);
-        send(sock, cmd2, strlen(cmd2), 0);
-        printf("Sent request to backend server: %s\n", cmd2);
-        long fsize;
-        // Receive the tar file size from the backend.
-        if (recv(sock, &fsize, sizeof(long), 0) <= 0) {
-            char *msg = "Failed to receive file size from backend server.\n";
-            send(client_sock, msg, strlen(msg), 0);
-            close(sock);
+            reply_status(client_sock, 0, msg);
             return;
         }
         if (fsize == 0) {
             char *msg = "No files found to create tar archive.\n";
-            send(client_sock, msg, strlen(msg), 0);
+            reply_status(client_sock, 0, msg);
             close(sock);
             return;
         }
         // Relay the tar file size to the client, then forward the tar data.
-        send(client_sock, &fsize, sizeof(long), 0);
-        char buf[BUFSIZE];
-        long recvd = 0;
-        int n;
-        while (recvd < fsize) {
-            n = recv(sock, buf, BUFSIZE, 0);
-            if (n <= 0) {
-                printf("Error receiving data from backend server\n");
-                break;
-            }
-            send(client_sock, buf, n, 0);
-            recvd += n;
+        reply_size(client_sock, fsize);
+        long recvd = relay_bounded(sock, client_sock, fsize);
+        if (recvd < fsize) {
+            LOG(LL_ERROR, "Error receiving data from backend server\n");
+            shutdown(client_sock, SHUT_RDWR);
         }
         close(sock);
-        printf("Forwarded %s to client (%ld/%ld bytes)\n", tar_name, recvd, fsize);
+        LOG_REQ("Forwarded %s to client (%ld/%ld bytes)\n", tar_name, recvd, fsize);
+    }
+    else if (strcmp(filetype, "all") == 0) {
+        handle_downltar_all(client_sock, home, NULL);
     }
     else {
-        // Unsupported file type for tar archive.
-        char *msg = "Only .c, .pdf, and .txt file types are supported for tar.\n";
-        send(client_sock, msg, strlen(msg), 0);
+        // Unsupported file type for tar archive; list the ones that are.
+        char msg[ROUTE_MAX * 20 + 64] = "Only .c";
+        for (int i = 0; i < nroutes; i++)
+            sprintf(msg + strlen(msg), ", %.15s", routes[i].ext);
+        strcat(msg, " and all are supported for tar.\n");
+        reply_status(client_sock, 0, msg);
     }
 }
 
+// tar_member_size: Decodes the size field of a tar header block (octal or GNU base-256).
+long tar_member_size(const char *h) {
+    long size = 0;
+    if ((unsigned char)h[124] & 0x80) {
+        for (int i = 1; i < 12; i++)
+            size = (size << 8) | (unsigned char)h[124 + i];
+        return size;
+    }
+    for (int i = 0; i < 12 && h[124 + i]; i++) {
+        if (h[124 + i] >= '0' && h[124 + i] <= '7')
+            size = size * 8 + (h[124 + i] - '0');
+    }
+    return size;
+}
 
-// collect_files_from_server: Contacts a backend server and issues a command to list file names.
-// The backend's file list is received into the provided buffer.
-// Returns 1 on success, or 0 if the connection fails.
-int collect_files_from_server(const char *path, int port, char *buffer) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-    struct sockaddr_in servaddr;
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-    inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
-    if (connect(sock, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-        close(sock);
+// One input archive merged by handle_downltar_all(): S1's cached .c archive or a
+// backend's tar stream. Members are relayed whole, so the merged archive stays valid.
+struct tar_source {
+    int fd;
+    long size;          // Archive size announced by the source.
+    long consumed;      // Bytes read from the source so far.
+    char hdr[TAR_BLOCK];
+    int hdr_len;        // Bytes of the current header block received.
+    long entry_left;    // Data bytes (with padding) of the current member still to relay.
+    int hold;           // Current member is a GNU/pax prefix header; keep the next member with it.
+    int done;
+};
+
+// read_tar_source: Reads up to len bytes from a merge source, tracking how much was consumed.
+int read_tar_source(struct tar_source *src, char *buf, long len) {
+    if (len > src->size - src->consumed)
+        len = src->size - src->consumed;
+    if (len <= 0)
         return 0;
+    int n = read(src->fd, buf, len);
+    if (n > 0)
+        src->consumed += n;
+    return n;
+}
+
+// handle_downltar_all: Streams one tar archive merging the .c archive (if home is given) with
+// the archives of every shard of route only, or of every route if only is NULL.
+// All backends are asked for their archive up front so they build concurrently, then members
+// are relayed to the client as each source produces them. A source owns the client stream
+// only while one of its members is in flight, so entries interleave without being split.
+void handle_downltar_all(int client_sock, const char *home, const struct route *only) {
+    static const char zero_block[TAR_BLOCK];
+    int maxsrc = 1 + nroutes * ROUTE_POOL_MAX, nsrc = 0, nsock = 0;
+    struct tar_source *src = arena_alloc(arena, maxsrc * sizeof(struct tar_source));
+    struct pollfd *pfds = arena_alloc(arena, maxsrc * sizeof(struct pollfd));
+    int *socks = arena_alloc(arena, maxsrc * sizeof(int)), *idx = arena_alloc(arena, maxsrc * sizeof(int));
+    if (!src || !pfds || !socks || !idx) {
+        reply_status(client_sock, 0, "Out of memory.\n");
+        goto out;
+    }
+
+    // Send every backend request before reading anything back.
+    for (int i = 0; i < nroutes; i++)
+        for (int j = 0; j < routes[i].npool; j++)
+            if (!only || only == &routes[i])
+                socks[nsock++] = open_backend_tar(&routes[i].pool[j], routes[i].ext, NULL);
+
+    FILE *cfp = home ? open_c_tar(home) : NULL;
+    if (cfp) {
+        memset(&src[nsrc], 0, sizeof(struct tar_source));
+        src[nsrc].fd = fileno(cfp);
+        fseek(cfp, 0, SEEK_END);
+        src[nsrc].size = ftell(cfp);
+        fseek(cfp, 0, SEEK_SET);
+        nsrc++;
+    }
+    for (int i = 0; i < nsock; i++) {
+        long fsize;
+        if (socks[i] < 0)
+            continue;
+        if ((fsize = backend_reply(socks[i], NULL, 0)) <= 0) {
+            close(socks[i]);
+            continue;
+        }
+        memset(&src[nsrc], 0, sizeof(struct tar_source));
+        src[nsrc].fd = socks[i];
+        src[nsrc].size = fsize;
+        nsrc++;
+    }
+
+    // Each archive contributes everything but its two end-of-archive blocks; GNU tar may
+    // pad further, in which case the merged archive is padded out with zeros at the end.
+    long total = 2 * TAR_BLOCK;
+    for (int i = 0; i < nsrc; i++) {
+        if (src[i].size > 2 * TAR_BLOCK)
+            total += src[i].size - 2 * TAR_BLOCK;
+        else
+            src[i].done = 1;
+    }
+    if (total == 2 * TAR_BLOCK) {
+        char *msg = "No files found to create tar archive.\n";
+        reply_status(client_sock, 0, msg);
+        for (int i = 0; i < nsrc; i++)
+            if (!cfp || src[i].fd != fileno(cfp))
+                close(src[i].fd);
+        if (cfp)
+            fclose(cfp);
+        goto out;
+    }
+    reply_size(client_sock, total);
+
+    char buf[BUFSIZE];
+    long sent = 0;
+    int owner = -1;
+    int active = 0, clean = 1;
+    for (int i = 0; i < nsrc; i++)
+        if (!src[i].done)
+            active++;
+    while (active > 0) {
+        int npfd = 0;
+        for (int i = 0; i < nsrc; i++) {
+            if (src[i].done || (owner >= 0 && owner != i))
+                continue;
+            pfds[npfd].fd = src[i].fd;
+            pfds[npfd].events = POLLIN;
+            idx[npfd++] = i;
+        }
+        if (poll(pfds, npfd, 10000) <= 0) {
+            LOG(LL_WARN, "Timed out waiting for backend tar data\n");
+            clean = 0;
+            break;
+        }
+        for (int p = 0; p < npfd; p++) {
+            if (!(pfds[p].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            struct tar_source *s = &src[idx[p]];
+            int n;
+            if (s->entry_left > 0) {
+                // Relay the next chunk of the member currently in flight.
+                n = read_tar_source(s, buf, s->entry_left < BUFSIZE ? s->entry_left : BUFSIZE);
+                if (n > 0) {
+                    send_all(client_sock, buf, n);
+                    sent += n;
+                    s->entry_left -= n;
+                    if (s->entry_left == 0 && !s->hold)
+                        owner = -1;
+                }
+            } else {
+                // Accumulate the next header block; an all-zero block ends this source.
+                n = read_tar_source(s, s->hdr + s->hdr_len, TAR_BLOCK - s->hdr_len);
+                if (n > 0) {
+                    s->hdr_len += n;
+                    owner = idx[p];
+                }
+                if (s->hdr_len == TAR_BLOCK) {
+                    s->hdr_len = 0;
+                    if (memcmp(s->hdr, zero_block, TAR_BLOCK) == 0) {
+                        // Drain the rest of the trailer so the backend never writes into a closed socket.
+                        while (read_tar_source(s, buf, BUFSIZE) > 0)
+                            ;
+                        s->done = 1;
+                        active--;
+                        owner = -1;
+                        continue;
+                    }
+                    long size = tar_member_size(s->hdr);
+                    char type = s->hdr[156];
+                    s->entry_left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+                    s->hold = (type == 'L' || type == 'K' || type == 'x' || type == 'g');
+                    send_all(client_sock, s->hdr, TAR_BLOCK);
+                    sent += TAR_BLOCK;
+                    if (s->entry_left == 0 && !s->hold)
+                        owner = -1;
+                }
+            }
+            if (n <= 0) {
+                // The source ended early, without its members after this point; if it was
+                // mid-member the merged stream is unusable.
+                s->done = 1;
+                active--;
+                clean = 0;
+                if (owner == idx[p]) {
+                    LOG(LL_WARN, "Backend tar stream ended inside a member\n");
+                    active = 0;
+                }
+            }
+            if (owner >= 0)
+                break;
+        }
     }
 
-    // Build the command to list filenames.
-    char cmd[BUFSIZE];
-    snprintf(cmd, sizeof(cmd), "dispfnames %s", path);
-    send(sock, cmd, strlen(cmd), 0);
-    int n = recv(sock, buffer, BUFSIZE, 0);
-    if(n < 0)
+    // Terminate the archive and pad it to the size announced to the client. If a source failed,
+    // a padded archive would look complete, so the client is cut off instead.
+    if (!clean) {
+        LOG(LL_ERROR, "Merged tar archive is incomplete (%ld/%ld bytes)\n", sent, total);
+        shutdown(client_sock, SHUT_RDWR);
+    }
+    while (clean && sent < total) {
+        long chunk = total - sent < TAR_BLOCK ? total - sent : TAR_BLOCK;
+        send_all(client_sock, zero_block, chunk);
+        sent += chunk;
+    }
+    for (int i = 0; i < nsrc; i++)
+        if (!cfp || src[i].fd != fileno(cfp))
+            close(src[i].fd);
+    if (cfp)
+        fclose(cfp);
+    LOG_REQ("Sent merged %s to client (%ld bytes from %d sources)\n", only ? only->tar_name : "allfiles.tar",
+           sent, nsrc);
+out:
+    return;
+}
+
+
+// collect_files_from_server: Contacts backend b of route r and issues a command to list the
+// names of files of the route's type. The backend's file list is received into the provided buffer,
+// of cap bytes including the terminator. Returns 1 on success, or 0 if the connection fails.
+int collect_files_from_server(const char *path, const struct route *r, const struct backend *b, char *buffer,
+                              long cap) {
+    char fields[FRAME_FIELDS_MAX];
+    int len = frame_add(fields, frame_add(fields, 0, FIELD_PATH, path), FIELD_TYPE, r->ext);
+    // Request the list of filenames, waiting at most 2 seconds for each receive.
+    int sock = len < 0 ? -1 : backend_open_fields(b, OP_DISPFNAMES, 0, fields, len, 0, 2);
+    if (sock < 0)
+        return 0;
+    long n = backend_reply(sock, NULL, 0);
+    // Keep as much of the list as fits in the buffer.
+    if (n < 0)
+        n = 0;
+    if (n > cap - 1)
+        n = cap - 1;
+    if (recv_all(sock, buffer, n) != 0)
         n = 0;
     buffer[n] = '\0';
     close(sock);
@@ -630,121 +3425,980 @@ int cmp_str(const void *a, const void *b) {
     return strcmp(s1, s2);
 }
 
-// handle_dispfnames: Aggregates file names from local storage (for .c files) and from backends (for .pdf, .txt, and .zip files).
+// append_sorted: Sorts the newline-separated names in list and appends them, one per line, to
+// out, writing at most cap bytes including the terminator. A name listed twice, as by two
+// shards while a rebalance is moving it, is appended once. Returns the number of names.
+int append_sorted(char *out, long cap, char *list) {
+    char *arr[4096], *save;
+    int count = 0;
+    for (char *token = strtok_r(list, "\n", &save); token && count < 4096; token = strtok_r(NULL, "\n", &save))
+        arr[count++] = token;
+    if (count > 0)
+        qsort(arr, count, sizeof(char*), cmp_str);
+    out[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && strcmp(arr[i], arr[i - 1]) == 0)
+            continue;
+        strncat(out, arr[i], cap - strlen(out) - 1);
+        strncat(out, "\n", cap - strlen(out) - 1);
+    }
+    return count;
+}
+
+// handle_dispfnames: Aggregates file names from local storage (for .c files) and from the backends of every route.
 // The resulting sorted list is sent to the client.
-void handle_dispfnames(int client_sock, char *cmd) {
-    char dirpath[512];
-    sscanf(cmd, "dispfnames %s", dirpath);
+void handle_dispfnames(int client_sock, const char *dirpath) {
 
     char *home = get_home_dir();
     char local_dir[512];
     // Convert the virtual path "~S1/folder" to a local path "$HOME/S1/folder".
     snprintf(local_dir, sizeof(local_dir), "%s/%s", home, dirpath + 1);
 
+    // The lists and the names in them last only as long as the request, in its arena.
+    long tmp_cap = ROUTE_POOL_MAX * BUFSIZE;
+    char **c_names = arena_alloc(arena, 1024 * sizeof(char*));
+    char *final = arena_alloc(arena, (1 + nroutes) * BUFSIZE);
+    char *tmp = arena_alloc(arena, tmp_cap);
+    if (!c_names || !final || !tmp) {
+        reply_text(client_sock, "Out of memory.\n");
+        return;
+    }
+
     // Process local .c files.
-    char *c_names[1024];
     int c_count = 0;
     DIR *dir = opendir(local_dir);
     if (dir) {
         struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL) {
+        while (c_count < 1024 && (entry = readdir(dir)) != NULL) {
             if (entry->d_type == DT_REG) {
                 const char *ext = strrchr(entry->d_name, '.');
-                if (ext && strcmp(ext, ".c") == 0) {
-                    c_names[c_count] = strdup(entry->d_name);
+                if (ext && strcmp(ext, ".c") == 0 &&
+                    (c_names[c_count] = arena_strdup(arena, entry->d_name)) != NULL)
                     c_count++;
-                }
             }
         }
         closedir(dir);
     }
     if (c_count > 0)
         qsort(c_names, c_count, sizeof(char*), cmp_str);
-    char c_files[BUFSIZE] = "";
+    final[0] = '\0';
     for (int i = 0; i < c_count; i++) {
-        strncat(c_files, c_names[i], BUFSIZE - strlen(c_files) - 1);
-        strncat(c_files, "\n", BUFSIZE - strlen(c_files) - 1);
-        free(c_names[i]);
-    }
-
-    // Prepare virtual backend paths for .pdf, .txt, and .zip files.
-    char pdf_path[512], txt_path[512], zip_path[512];
-    snprintf(pdf_path, sizeof(pdf_path), "~S2%s", dirpath + 3);
-    snprintf(txt_path, sizeof(txt_path), "~S3%s", dirpath + 3);
-    snprintf(zip_path, sizeof(zip_path), "~S4%s", dirpath + 3);
-
-    char pdf_files[BUFSIZE] = "", txt_files[BUFSIZE] = "", zip_files[BUFSIZE] = "";
-    char tmp[BUFSIZE] = "";
-
-    // Retrieve lists of files from corresponding backend servers.
-    if (collect_files_from_server(pdf_path, 7100, tmp)) {
-        strncpy(pdf_files, tmp, BUFSIZE);
-    }
-    if (collect_files_from_server(txt_path, 7200, tmp)) {
-        strncpy(txt_files, tmp, BUFSIZE);
-    }
-    if (collect_files_from_server(zip_path, 7300, tmp)) {
-        strncpy(zip_files, tmp, BUFSIZE);
-    }
-
-    // Sort backend lists alphabetically. For simplicity, we tokenize by newline.
-    char *pdf_arr[1024];
-    int pdf_count = 0;
-    char *token = strtok(pdf_files, "\n");
-    while (token != NULL && pdf_count < 1024) {
-        pdf_arr[pdf_count++] = token;
-        token = strtok(NULL, "\n");
-    }
-    if (pdf_count > 0)
-        qsort(pdf_arr, pdf_count, sizeof(char*), cmp_str);
-    char sorted_pdf[BUFSIZE] = "";
-    for (int i = 0; i < pdf_count; i++) {
-        strncat(sorted_pdf, pdf_arr[i], BUFSIZE - strlen(sorted_pdf) - 1);
-        strncat(sorted_pdf, "\n", BUFSIZE - strlen(sorted_pdf) - 1);
-    }
-
-    char *txt_arr[1024];
-    int txt_count = 0;
-    token = strtok(txt_files, "\n");
-    while (token != NULL && txt_count < 1024) {
-        txt_arr[txt_count++] = token;
-        token = strtok(NULL, "\n");
-    }
-    if (txt_count > 0)
-        qsort(txt_arr, txt_count, sizeof(char*), cmp_str);
-    char sorted_txt[BUFSIZE] = "";
-    for (int i = 0; i < txt_count; i++) {
-        strncat(sorted_txt, txt_arr[i], BUFSIZE - strlen(sorted_txt) - 1);
-        strncat(sorted_txt, "\n", BUFSIZE - strlen(sorted_txt) - 1);
-    }
-
-    char *zip_arr[1024];
-    int zip_count = 0;
-    token = strtok(zip_files, "\n");
-    while (token != NULL && zip_count < 1024) {
-        zip_arr[zip_count++] = token;
-        token = strtok(NULL, "\n");
-    }
-    if (zip_count > 0)
-        qsort(zip_arr, zip_count, sizeof(char*), cmp_str);
-    char sorted_zip[BUFSIZE] = "";
-    for (int i = 0; i < zip_count; i++) {
-        strncat(sorted_zip, zip_arr[i], BUFSIZE - strlen(sorted_zip) - 1);
-        strncat(sorted_zip, "\n", BUFSIZE - strlen(sorted_zip) - 1);
-    }
-
-    // Combine all file lists into one final result string.
-    char final[4 * BUFSIZE] = "";
-    strcat(final, c_files);
-    strcat(final, sorted_pdf);
-    strcat(final, sorted_txt);
-    strcat(final, sorted_zip);
+        strncat(final, c_names[i], BUFSIZE - strlen(final) - 1);
+        strncat(final, "\n", BUFSIZE - strlen(final) - 1);
+    }
+
+    // Append each route's list, sorted, in the order the routes are configured.
+    for (int k = 0; k < nroutes; k++) {
+        // A sharded type is listed by every shard; the lists are merged.
+        char backend_path[512];
+        long used = 0;
+        snprintf(backend_path, sizeof(backend_path), "%s%s", routes[k].root, dirpath + 3);
+        for (int j = 0; j < routes[k].npool; j++) {
+            // Each shard gets what is left, less a byte for the newline ending its list.
+            if (tmp_cap - used - 1 > 1 &&
+                collect_files_from_server(backend_path, &routes[k], &routes[k].pool[j], tmp + used,
+                                          tmp_cap - used - 1))
+                used += strlen(tmp + used);
+            if (used > 0 && tmp[used - 1] != '\n')
+                tmp[used++] = '\n';
+            tmp[used] = '\0';
+        }
+        if (routes[k].npool > 1)
+            stripe_list(dirpath, routes[k].ext, tmp + used, tmp_cap - used);
+        append_sorted(final + strlen(final), BUFSIZE, tmp);
+    }
 
     // Send the final list to the client, or an error message if no files were found.
     if (strlen(final) == 0) {
-        char *msg = "No files found in the specified path.\n";
-        send(client_sock, msg, strlen(msg), 0);
+        reply_text(client_sock, "No files found in the specified path.\n");
+    } else {
+        reply_text(client_sock, final);
+    }
+}
+
+// handle_listtree: Answers dispfnames with FRAME_TREE: every file below dirpath at any depth,
+// as a path relative to it, one per line and sorted. Unlike dispfnames, the list is not
+// limited in size. S1's .c files and striped objects are found by walking its directories;
+// every backend of a route lists its files of the route's type, and those below dirpath are
+// kept.
+void handle_listtree(int client_sock, const char *dirpath) {
+    struct tree_list t = { NULL, 0, 0 };
+    char dir[BUFSIZE], prefix[BUFSIZE];
+    int failed = 0;
+    // "~S1/a/b/" is "/a/b" below each server's root.
+    snprintf(prefix, sizeof(prefix), "%s", dirpath + 3);
+    size_t plen = strlen(prefix);
+    while (plen > 0 && prefix[plen - 1] == '/')
+        prefix[--plen] = '\0';
+    snprintf(dir, sizeof(dir), "%s/S1%s", get_home_dir(), prefix);
+    tree_walk(&t, dir, "", 0);
+    stripe_manifest(dirpath, dir, sizeof(dir));
+    tree_walk(&t, dir, "", 1);
+
+    for (int k = 0; k < nroutes; k++) {
+        for (int j = 0; j < routes[k].npool; j++) {
+            int sock = backend_open(&routes[k].pool[j], OP_LIST, 0, FIELD_TYPE, routes[k].ext, 0, 10);
+            long n = sock < 0 ? -1 : backend_reply(sock, NULL, 0);
+            char *list = n >= 0 ? arena_alloc(arena, n + 1) : NULL, *save;
+            if (list && recv_all(sock, list, n) == 0) {
+                list[n] = '\0';
+                for (char *rel = strtok_r(list, "\n", &save); rel; rel = strtok_r(NULL, "\n", &save))
+                    if (strncmp(rel, prefix, plen) == 0 && rel[plen] == '/')
+                        failed |= tree_add(&t, rel + plen + 1);
+            }
+            if (sock >= 0)
+                close(sock);
+        }
+    }
+
+    // Sort, dropping names listed twice, as by two shards while a rebalance is moving them.
+    long len = 0;
+    for (int i = 0; i < t.count; i++)
+        len += strlen(t.names[i]) + 1;
+    char *final = failed ? NULL : arena_alloc(arena, len + 1);
+    if (final) {
+        qsort(t.names, t.count, sizeof(char*), cmp_str);
+        len = 0;
+        for (int i = 0; i < t.count; i++)
+            if (i == 0 || strcmp(t.names[i], t.names[i - 1]) != 0)
+                len += sprintf(final + len, "%s\n", t.names[i]);
+        final[len] = '\0';
+    }
+    if (!final)
+        reply_status(client_sock, 0, "Out of memory.\n");
+    else if (len == 0)
+        reply_status(client_sock, 0, "No files found in the specified path.\n");
+    else
+        reply_text(client_sock, final);
+}
+
+// tree_add: Appends a copy of name to list t, both in the request's arena. Returns -1 if out
+// of memory.
+int tree_add(struct tree_list *t, const char *name) {
+    if (t->count == t->cap) {
+        int cap = t->cap ? t->cap * 2 : 256;
+        char **names = arena_alloc(arena, cap * sizeof(char*));
+        if (!names)
+            return -1;
+        if (t->count > 0)
+            memcpy(names, t->names, t->count * sizeof(char*));
+        t->names = names;
+        t->cap = cap;
+    }
+    if (!(t->names[t->count] = arena_strdup(arena, name)))
+        return -1;
+    t->count++;
+    return 0;
+}
+
+// tree_walk: Adds the files below directory dir to list t, named by their path relative to
+// the top of the walk; rel is dir's own, "" at the top. These are the .c files, or with
+// manifests set, the striped objects whose manifests are kept there. Hidden entries, such
+// as S1's .stripes directory, are skipped.
+void tree_walk(struct tree_list *t, const char *dir, const char *rel, int manifests) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[BUFSIZE], name[BUFSIZE];
+    struct stat st;
+    while (d && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name);
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        const char *ext = strrchr(entry->d_name, '.');
+        if (type == DT_DIR)
+            tree_walk(t, path, name, manifests);
+        else if (type == DT_REG && ext && (manifests ? route_lookup(ext) != NULL : strcmp(ext, ".c") == 0))
+            tree_add(t, name);
+    }
+    if (d)
+        closedir(d);
+}
+
+// metrics_now: Microseconds on the monotonic clock.
+long metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// hist_record: Adds a value of us microseconds to histogram h. Values below HIST_SUB get a
+// bucket each; above that, each power of two is split into HIST_SUB equal buckets.
+void hist_record(struct hist *h, long us) {
+    unsigned long v = us < 0 ? 0 : us;
+    int i = v;
+    if (v >= HIST_SUB) {
+        int e = 63 - __builtin_clzl(v);
+        i = (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+    }
+    if (i >= HIST_BUCKETS)
+        i = HIST_BUCKETS - 1;
+    __atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+// hist_quantile: The value, in microseconds, below which a fraction q of the values recorded
+// in h fall. It is reported as the middle of the bucket it lies in.
+double hist_quantile(const struct hist *h, double q) {
+    unsigned long n = h->count, seen = 0, rank = q * n + 0.5;
+    if (n == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen < rank)
+            continue;
+        if (i < HIST_SUB)
+            return i;
+        int shift = i / HIST_SUB - 1;
+        return ((double)(HIST_SUB + i % HIST_SUB) + 0.5) * (1L << shift);
+    }
+    return 0;
+}
+
+// metrics_begin: Starts measuring a request with the given opcode on this thread.
+void metrics_begin(int op) {
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.start = metrics_now();
+}
+
+// metrics_wait: Accounts the time since start, a metrics_now() reading, as a wait on
+// backends by the current request, and traces it as a span named span.
+void metrics_wait(const char *span, long start) {
+    long now = metrics_now(), us = now - start;
+    if (metrics)
+        hist_record(&metrics->wait, us);
+    req.wait_us += us;
+    trace_span(span, start, now);
+}
+
+// metrics_end: Records the request started by metrics_begin(), if any, and writes out its
+// trace.
+void metrics_end(void) {
+    trace_end();
+    if (!metrics || req.op <= 0 || req.op > OP_STATS)
+        return;
+    long us = metrics_now() - req.start;
+    struct op_metrics *m = &metrics->op[req.op];
+    __atomic_fetch_add(&m->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->errors, req.error, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->bytes_in, req.bytes_in, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->bytes_out, req.bytes_out, __ATOMIC_RELAXED);
+    hist_record(&m->latency, us);
+    hist_record(&metrics->rest, us > req.wait_us ? us - req.wait_us : 0);
+    req.op = 0;
+}
+
+// metrics_summary: Appends histogram h to out as a Prometheus summary with the p50, p99 and
+// p999 latencies in seconds. labels are the series' labels, without braces.
+int metrics_summary(char *out, int cap, int len, const char *name, const char *labels,
+                    const struct hist *h) {
+    static const double q[] = { 0.5, 0.99, 0.999 };
+    for (int i = 0; i < 3 && len < cap; i++)
+        len += snprintf(out + len, cap - len, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels, q[i],
+                        hist_quantile(h, q[i]) / 1e6);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "%s_sum{%s} %.6f\n%s_count{%s} %lu\n", name, labels,
+                        h->sum_us / 1e6, name, labels, h->count);
+    return len;
+}
+
+// metrics_format: Writes all metrics to out in the Prometheus text format, summing the shards
+// in the request's arena. Returns the length.
+int metrics_format(char *out, int cap) {
+    static const char *counters[] = { "requests", "errors", "bytes_in", "bytes_out" };
+    char labels[64];
+    int len = 0;
+    out[0] = '\0';
+    if (!metrics)
+        return 0;
+    struct metrics *all = arena_alloc(arena, sizeof(struct metrics));
+    if (!all)
+        return 0;
+    metrics_total(all);
+    for (int c = 0; c < 4 && len < cap; c++) {
+        len += snprintf(out + len, cap - len, "# TYPE dfs_%s_total counter\n", counters[c]);
+        for (int op = 1; op <= OP_STATS && len < cap; op++) {
+            const struct op_metrics *m = &all->op[op];
+            unsigned long v[] = { m->requests, m->errors, m->bytes_in, m->bytes_out };
+            if (op != OP_REPLY)
+                len += snprintf(out + len, cap - len, "dfs_%s_total{server=\"S1\",op=\"%s\"} %lu\n",
+                                counters[c], op_names[op], v[c]);
+        }
+    }
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_request_seconds summary\n");
+    for (int op = 1; op <= OP_STATS && len < cap; op++) {
+        if (op == OP_REPLY || all->op[op].latency.count == 0)
+            continue;
+        snprintf(labels, sizeof(labels), "server=\"S1\",op=\"%s\"", op_names[op]);
+        len = metrics_summary(out, cap, len, "dfs_request_seconds", labels, &all->op[op].latency);
+    }
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_relay_pauses_total counter\n"
+                        "dfs_relay_pauses_total{server=\"S1\"} %lu\n"
+                        "# TYPE dfs_relay_spooled_bytes_total counter\n"
+                        "dfs_relay_spooled_bytes_total{server=\"S1\"} %lu\n"
+                        "# TYPE dfs_relay_stalls_total counter\n"
+                        "dfs_relay_stalls_total{server=\"S1\"} %lu\n",
+                        all->relay_pauses, all->relay_spooled, all->relay_stalls);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_qos_waits_total counter\n"
+                        "dfs_qos_waits_total{server=\"S1\",class=\"interactive\"} %lu\n"
+                        "dfs_qos_waits_total{server=\"S1\",class=\"bulk\"} %lu\n"
+                        "# TYPE dfs_qos_queued_total counter\n"
+                        "dfs_qos_queued_total{server=\"S1\",class=\"interactive\"} %lu\n"
+                        "dfs_qos_queued_total{server=\"S1\",class=\"bulk\"} %lu\n",
+                        qos->waits[QOS_INTERACTIVE], qos->waits[QOS_BULK],
+                        qos->queued[QOS_INTERACTIVE], qos->queued[QOS_BULK]);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_backend_seconds summary\n");
+    len = metrics_summary(out, cap, len, "dfs_backend_seconds", "server=\"S1\"", &all->wait);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_network_seconds summary\n");
+    len = metrics_summary(out, cap, len, "dfs_network_seconds", "server=\"S1\"", &all->rest);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_connections_total counter\n");
+    for (int w = 0; w < nworkers && len < cap; w++)
+        len += snprintf(out + len, cap - len, "dfs_connections_total{server=\"S1\",worker=\"%d\"} %lu\n",
+                        w, metrics_shards[w].connections);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_arena_allocs_total counter\n"
+                        "dfs_arena_allocs_total{server=\"S1\"} %lu\n"
+                        "# TYPE dfs_arena_mallocs_total counter\n"
+                        "dfs_arena_mallocs_total{server=\"S1\"} %lu\n"
+                        "# TYPE dfs_pool_gets_total counter\n"
+                        "dfs_pool_gets_total{server=\"S1\"} %lu\n"
+                        "# TYPE dfs_pool_slabs_total counter\n"
+                        "dfs_pool_slabs_total{server=\"S1\"} %lu\n",
+                        all->arena_allocs, all->arena_mallocs, all->pool_gets, all->pool_slabs);
+    return len < cap ? len : cap - 1;
+}
+
+// metrics_total: Sets all to the sum of the workers' metrics shards.
+void metrics_total(struct metrics *all) {
+    memset(all, 0, sizeof(*all));
+    // A shard is nothing but unsigned long counters, so they add up word by word.
+    _Static_assert(sizeof(struct metrics) % sizeof(unsigned long) == 0, "metrics are counters");
+    unsigned long *sum = (unsigned long *)all;
+    for (int w = 0; w < nworkers; w++) {
+        const unsigned long *shard = (const unsigned long *)&metrics_shards[w];
+        for (size_t k = 0; k < sizeof(struct metrics) / sizeof(unsigned long); k++)
+            sum[k] += __atomic_load_n(&shard[k], __ATOMIC_RELAXED);
+    }
+}
+
+// metrics_dump: Writes the metrics to path, replacing it atomically. Each dump is a request
+// of its own as far as memory goes.
+void metrics_dump(const char *path) {
+    char *text = arena_alloc(arena = arena_get(), STATS_MAX), tmp[BUFSIZE + 8];
+    if (!text) {
+        arena_put(arena);
+        arena = NULL;
+        return;
+    }
+    int len = metrics_format(text, STATS_MAX);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp && fwrite(text, 1, len, fp) == (size_t)len && fclose(fp) == 0)
+        rename(tmp, path);
+    else if (fp)
+        fclose(fp);
+    arena_put(arena);
+    arena = NULL;
+}
+
+// handle_stats: Answers a stats request with the current metrics.
+void handle_stats(int sock) {
+    char *text = arena_alloc(arena, STATS_MAX);
+    if (!text) {
+        reply_status(sock, 0, "Out of memory.\n");
+        return;
+    }
+    metrics_format(text, STATS_MAX);
+    reply_text(sock, text);
+}
+
+// log_init: Reads DFS_LOG_LEVEL and DFS_LOG_SAMPLE and arranges for lines still in the rings
+// to be written at exit and after fork().
+void log_init(void) {
+    static const char *names[] = { "error", "warn", "info", "debug" };
+    const char *level = getenv("DFS_LOG_LEVEL");
+    if (level) {
+        log_level = -1;   // "off", or anything unknown.
+        for (int i = 0; i < 4; i++)
+            if (strcmp(level, names[i]) == 0)
+                log_level = i;
+    }
+    if (getenv("DFS_LOG_SAMPLE") && atoi(getenv("DFS_LOG_SAMPLE")) > 0)
+        log_sample = atoi(getenv("DFS_LOG_SAMPLE"));
+    pthread_key_create(&log_key, log_release);
+    // What is still printed directly (startup, tools) keeps its place among the log lines.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    pthread_atfork(NULL, NULL, log_forked);
+    atexit(log_exit);
+}
+
+// log_forked: Runs in a new child process. The rings are the parent's to write out, and the
+// flusher thread did not survive the fork, so the child starts over with rings of its own.
+void log_forked(void) {
+    pthread_mutex_init(&log_lock, NULL);
+    pthread_mutex_init(&log_flush_lock, NULL);
+    log_rings = NULL;
+    log_mine = NULL;
+    log_flusher = 0;
+}
+
+// log_release: Thread exit hook that hands the thread's ring to the next thread needing one.
+void log_release(void *ring) {
+    __atomic_store_n(&((struct log_ring *)ring)->free, 1, __ATOMIC_RELEASE);
+}
+
+// log_attach: Gives the calling thread a ring, reusing one left by an exited thread, and
+// starts this process's flusher with the first ring. Returns NULL if out of memory.
+struct log_ring *log_attach(void) {
+    struct log_ring *r;
+    pthread_mutex_lock(&log_lock);
+    for (r = log_rings; r; r = r->next)
+        if (__atomic_load_n(&r->free, __ATOMIC_ACQUIRE)) {
+            r->free = 0;
+            break;
+        }
+    if (!r && (r = calloc(1, sizeof(*r)))) {
+        r->next = log_rings;
+        __atomic_store_n(&log_rings, r, __ATOMIC_RELEASE);
+    }
+    if (r && !log_flusher) {
+        pthread_t tid;
+        log_flusher = pthread_create(&tid, NULL, log_flush_run, NULL) == 0;
+        if (log_flusher)
+            pthread_detach(tid);
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (r)
+        pthread_setspecific(log_key, r);
+    return log_mine = r;
+}
+
+// log_write: Formats a line, prefixed with the time, level and process, into the calling
+// thread's ring. Use LOG() or LOG_REQ(), which skip the call for filtered lines.
+void log_write(int level, const char *fmt, ...) {
+    static const char *names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+    struct log_ring *r = log_mine ? log_mine : log_attach();
+    if (!r)
+        return;
+    unsigned long h = r->head;
+    if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    char *line = r->line[h % LOG_RING];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int n = snprintf(line, LOG_LINE, "%ld.%06ld %-5s S1[%d] ", (long)ts.tv_sec, ts.tv_nsec / 1000,
+                     names[level], (int)getpid());
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line + n, LOG_LINE - n, fmt, ap);
+    va_end(ap);
+    // Every line ends in exactly one newline, even when it was cut.
+    n = strlen(line);
+    if (n == LOG_LINE - 1)
+        n--;
+    while (n > 0 && line[n - 1] == '\n')
+        n--;
+    strcpy(line + n, "\n");
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+// log_request: Starts a new request, deciding whether its LOG_REQ() lines are kept.
+void log_request(void) {
+    log_this = log_sample == 1 || __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED) % log_sample == 0;
+}
+
+// log_flush: Writes out every line waiting in the rings, a batch at a time. Threads taking
+// a ring are never held up by it, even when stdout blocks. Unless wait is set, it gives up
+// at once if the flusher is busy writing.
+void log_flush(int wait) {
+    struct iovec iov[64];
+    char note[64];
+    if (wait)
+        pthread_mutex_lock(&log_flush_lock);
+    else if (pthread_mutex_trylock(&log_flush_lock) != 0)
+        return;
+    for (struct log_ring *r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long t = r->tail, h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (t < h) {
+            int n = 0;
+            for (; t < h && n < 64; n++, t++) {
+                iov[n].iov_base = r->line[t % LOG_RING];
+                iov[n].iov_len = strlen(r->line[t % LOG_RING]);
+            }
+            if (writev(STDOUT_FILENO, iov, n) < 0 && errno != EINTR)
+                t = h;   // stdout is gone; drop the lines rather than spin.
+            __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+        }
+        unsigned long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            int n = snprintf(note, sizeof(note), "(%lu log lines dropped)\n", dropped);
+            if (write(STDOUT_FILENO, note, n) < 0)
+                break;
+        }
+    }
+    pthread_mutex_unlock(&log_flush_lock);
+}
+
+// log_exit: Writes out what is left at exit, unless stdout is blocked.
+void log_exit(void) {
+    log_flush(0);
+}
+
+// log_flush_run: Body of the flusher thread.
+void *log_flush_run(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(LOG_FLUSH_US);
+        log_flush(1);
+    }
+    return NULL;
+}
+
+// trace_init: Opens DFS_TRACE_FILE, if it is set, to append trace events to.
+void trace_init(void) {
+    const char *path = getenv("DFS_TRACE_FILE");
+    if (!path)
+        return;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("S1: DFS_TRACE_FILE");
+        return;
+    }
+    // The array is left open: trace viewers accept a file without the closing bracket.
+    struct stat st;
+    if (fstat(trace_fd, &st) == 0 && st.st_size == 0 && write(trace_fd, "[\n", 2) != 2)
+        perror("S1: DFS_TRACE_FILE");
+    if (getenv("DFS_TRACE_SAMPLE") && atoi(getenv("DFS_TRACE_SAMPLE")) > 0)
+        trace_sample = atoi(getenv("DFS_TRACE_SAMPLE"));
+}
+
+// trace_begin: Starts tracing the current request if it is sampled, with the stages before
+// its handler: the wait to be accepted and served, on a connection's first request, and
+// the time from the request's first byte until now.
+void trace_begin(void) {
+    trace.id = 0;
+    trace.nspans = 0;
+    if (trace_fd < 0)
+        return;
+    unsigned long seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+    if (seq % trace_sample != 0)
+        return;
+    // The id only has to be unique among the traces in one file.
+    unsigned long x = ((unsigned long)getpid() << 40) ^ (seq << 20) ^ metrics_now();
+    x = (x ^ (x >> 31)) * 0x9e3779b97f4a7c15UL;
+    trace.id = (x ^ (x >> 29)) | 1;
+    long accepted = __atomic_exchange_n(&accepted_at, 0, __ATOMIC_RELAXED);
+    if (accepted)
+        trace_span("accept", accepted, trace_arrived);
+    trace_span("parse", trace_arrived, metrics_now());
+}
+
+// trace_pass: Adds the current trace to the field area of a request about to be sent to a
+// backend, with a new flow id that links the backend's spans to this point. Returns the new
+// length of the fields, or len unchanged if the request is not traced.
+int trace_pass(char *fields, int len) {
+    char ctx[48];
+    if (!trace.id || trace.nspans == TRACE_SPANS)
+        return len;
+    unsigned long flow = trace.id + trace.nspans;
+    snprintf(ctx, sizeof(ctx), "%lx:%lx", trace.id, flow);
+    int n = frame_add(fields, len, FIELD_TRACE, ctx);
+    if (n < 0)
+        return len;
+    trace.span[trace.nspans++] = (struct span){ "backend", 's', metrics_now(), 0, 0, 1, flow };
+    return n;
+}
+
+// trace_span: Records that stage name of the traced request, if any, ran from start to end,
+// both metrics_now() readings.
+void trace_span(const char *name, long start, long end) {
+    if (!trace.id)
+        return;
+    for (int i = trace.nspans - 1; i >= 0; i--) {
+        struct span *s = &trace.span[i];
+        if (s->name == name && s->ph == 'X') {
+            s->end = end;
+            s->busy_us += end - start;
+            s->calls++;
+            return;
+        }
+    }
+    if (trace.nspans < TRACE_SPANS)
+        trace.span[trace.nspans++] = (struct span){ name, 'X', start, end, end - start, 1, 0 };
+}
+
+// trace_end: Appends the traced request, if any, and its spans to the trace file.
+void trace_end(void) {
+    char buf[(TRACE_SPANS + 2) * TRACE_EVENT];
+    int len = 0, pid = getpid(), tid = gettid();
+    if (!trace.id)
+        return;
+    if (trace_pid != pid) {
+        // Each process names itself once, so the viewer labels its rows.
+        trace_pid = pid;
+        len += snprintf(buf, TRACE_EVENT, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                        "\"tid\":%d,\"args\":{\"name\":\"S1\"}},\n", pid, tid);
+    }
+    long now = metrics_now();
+    len += snprintf(buf + len, TRACE_EVENT, "{\"name\":\"%s\",\"cat\":\"dfs\",\"ph\":\"X\",\"ts\":%ld,"
+                    "\"dur\":%ld,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%016lx\",\"req\":%u,"
+                    "\"error\":%d}},\n", req.op > 0 && req.op <= OP_STATS ? op_names[req.op] : "request",
+                    trace_arrived, now - trace_arrived, pid, tid, trace.id, frame_req_id, req.error);
+    for (int i = 0; i < trace.nspans; i++) {
+        const struct span *s = &trace.span[i];
+        if (s->ph == 'X')
+            len += snprintf(buf + len, TRACE_EVENT, "{\"name\":\"%s\",\"cat\":\"dfs\",\"ph\":\"X\","
+                            "\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":"
+                            "\"%016lx\",\"calls\":%d,\"busy_us\":%ld}},\n", s->name, s->start,
+                            s->end - s->start, pid, tid, trace.id, s->calls, s->busy_us);
+        else
+            len += snprintf(buf + len, TRACE_EVENT, "{\"name\":\"%s\",\"cat\":\"dfs\",\"ph\":\"%c\","
+                            "\"id\":\"%lx\",\"ts\":%ld,\"pid\":%d,\"tid\":%d%s},\n", s->name, s->ph,
+                            s->flow, s->start, pid, tid, s->ph == 'f' ? ",\"bp\":\"e\"" : "");
+    }
+    trace.id = 0;
+    if (write(trace_fd, buf, len) < 0)
+        LOG(LL_WARN, "Trace write failed: %s\n", strerror(errno));
+}
+
+// qos_init: Maps the scheduler state shared with the handlers and reads its settings.
+void qos_init(void) {
+    pthread_mutexattr_t ma;
+    pthread_condattr_t ca;
+    // The predecessor's scheduler is taken over as it is, lock and all.
+    if (!shared_inherited) {
+        pthread_mutexattr_init(&ma);
+        pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&qos->lock, &ma);
+        pthread_condattr_init(&ca);
+        pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&qos->cond, &ca);
+    }
+    if (getenv("DFS_QOS_BULK_MIN") && atol(getenv("DFS_QOS_BULK_MIN")) > 0)
+        qos_bulk_min = atol(getenv("DFS_QOS_BULK_MIN"));
+    if (getenv("DFS_QOS_WEIGHT") && atoi(getenv("DFS_QOS_WEIGHT")) > 0)
+        qos_weight = atoi(getenv("DFS_QOS_WEIGHT"));
+    if (getenv("DFS_CLIENT_INTERACTIVE") && atoi(getenv("DFS_CLIENT_INTERACTIVE")) > 0)
+        qos_limit[QOS_INTERACTIVE] = atoi(getenv("DFS_CLIENT_INTERACTIVE"));
+    if (getenv("DFS_CLIENT_BULK") && atoi(getenv("DFS_CLIENT_BULK")) > 0)
+        qos_limit[QOS_BULK] = atoi(getenv("DFS_CLIENT_BULK"));
+}
+
+// qos_lock: Takes the scheduler lock. If its holder died, what it was changing is at worst
+// off by one request, so the state is simply marked consistent again.
+void qos_lock(void) {
+    if (pthread_mutex_lock(&qos->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&qos->lock);
+}
+
+// qos_wait: Waits on the scheduler condition, with the lock held, until woken or until the
+// time in until if it is not NULL. Returns 1 once that time has passed.
+int qos_wait(const struct timespec *until) {
+    int rc = until ? pthread_cond_timedwait(&qos->cond, &qos->lock, until)
+                   : pthread_cond_wait(&qos->cond, &qos->lock);
+    if (rc == EOWNERDEAD)
+        pthread_mutex_consistent(&qos->lock);
+    return rc == ETIMEDOUT;
+}
+
+// qos_share: The weight of class cls.
+double qos_share(int cls) {
+    return cls == QOS_INTERACTIVE ? qos_weight : 1;
+}
+
+// qos_ahead: Whether class cls is more than a quantum of another busy class's share ahead of
+// it. Called with the lock held.
+int qos_ahead(int cls) {
+    for (int c = 0; c < QOS_CLASSES; c++)
+        if (c != cls && qos->active[c] > 0 && qos->vtime[cls] - qos->vtime[c] > QOS_QUANTUM / qos_share(c))
+            return 1;
+    return 0;
+}
+
+// qos_class_of: The class of a request with the given opcode and upload size. A download's
+// size is only known once its backend answers; see qos_size().
+int qos_class_of(int opcode, long payload_len) {
+    if (opcode == OP_DOWNLTAR || (opcode == OP_UPLOADF && payload_len >= qos_bulk_min))
+        return QOS_BULK;
+    return QOS_INTERACTIVE;
+}
+
+// qos_attach: Records the connection this handler serves, from the client at addr.
+void qos_attach(uint32_t addr) {
+    qos_lock();
+    for (int i = 0; i < QOS_CONNS && qos_slot < 0; i++)
+        if (qos->conn[i].pid == 0) {
+            memset(&qos->conn[i], 0, sizeof(qos->conn[i]));
+            qos->conn[i].pid = getpid();
+            qos->conn[i].addr = addr;
+            qos_slot = i;
+        }
+    pthread_mutex_unlock(&qos->lock);
+}
+
+// qos_detach: Takes back whatever the exited handler pid still held, so neither its client's
+// limits nor the scheduler wait for requests that will never end.
+void qos_detach(pid_t pid) {
+    qos_lock();
+    for (int i = 0; i < QOS_CONNS; i++) {
+        struct qos_conn *c = &qos->conn[i];
+        if (c->pid != pid)
+            continue;
+        for (int k = 0; k < QOS_CLASSES; k++)
+            qos->active[k] -= c->active[k];
+        memset(c, 0, sizeof(*c));
+    }
+    pthread_cond_broadcast(&qos->cond);
+    pthread_mutex_unlock(&qos->lock);
+}
+
+// qos_admit: Admits a request of class cls, waiting while its client already has its limit
+// of that class running, and starts it for the scheduler.
+void qos_admit(int cls) {
+    qos_lock();
+    if (qos_slot >= 0) {
+        uint32_t addr = qos->conn[qos_slot].addr;
+        for (int waited = 0; ; waited = 1) {
+            int running = 0;
+            for (int i = 0; i < QOS_CONNS; i++)
+                if (qos->conn[i].pid && qos->conn[i].addr == addr)
+                    running += qos->conn[i].running[cls];
+            if (running < qos_limit[cls])
+                break;
+            if (!waited)
+                qos->queued[cls]++;
+            qos_wait(NULL);
+        }
+        qos->conn[qos_slot].running[cls]++;
+    }
+    pthread_mutex_unlock(&qos->lock);
+    qos_admitted = cls;
+    qos_begin(cls);
+}
+
+// qos_begin: Marks this thread's request as in progress in class cls. A class that was idle
+// rejoins at the virtual time of a busy one, so it cannot bank the time it was idle.
+void qos_begin(int cls) {
+    qos_lock();
+    if (qos->active[cls]++ == 0)
+        for (int c = 0; c < QOS_CLASSES; c++)
+            if (qos->active[c] > 0 && qos->vtime[c] > qos->vtime[cls])
+                qos->vtime[cls] = qos->vtime[c];
+    if (qos_slot >= 0)
+        qos->conn[qos_slot].active[cls]++;
+    pthread_mutex_unlock(&qos->lock);
+    qos_class = cls;
+}
+
+// qos_size: Moves this thread's request to the bulk class for the scheduler when it turns out
+// to move len bytes, at least qos_bulk_min, as the download of a large file does. It stays
+// admitted as what it was.
+void qos_size(long len) {
+    if (qos_class != QOS_INTERACTIVE || len < qos_bulk_min)
+        return;
+    qos_lock();
+    qos->active[QOS_INTERACTIVE]--;
+    if (qos_slot >= 0)
+        qos->conn[qos_slot].active[QOS_INTERACTIVE]--;
+    pthread_cond_broadcast(&qos->cond);
+    pthread_mutex_unlock(&qos->lock);
+    qos_begin(QOS_BULK);
+}
+
+// qos_charge: Accounts bytes that this thread's request is about to move. While its class is
+// ahead of another busy class it waits for that one to catch up or go idle, but for no more
+// than QOS_WAIT_MAX_MS, so neither class is ever starved.
+void qos_charge(long bytes) {
+    int cls = qos_class;
+    if (cls < 0)
+        return;
+    qos_lock();
+    if (qos_ahead(cls)) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += QOS_WAIT_MAX_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        qos->waits[cls]++;
+        while (qos_ahead(cls) && !qos_wait(&until))
+            ;
+    }
+    qos->vtime[cls] += bytes / qos_share(cls);
+    pthread_mutex_unlock(&qos->lock);
+}
+
+// qos_leave: Ends this thread's request, if it was admitted: charges it its quantum, gives its
+// client's slot back and wakes whoever waits on either.
+void qos_leave(void) {
+    if (qos_admitted < 0)
+        return;
+    qos_lock();
+    if (qos_class >= 0) {
+        qos->active[qos_class]--;
+        qos->vtime[qos_class] += QOS_QUANTUM / qos_share(qos_class);
+    }
+    if (qos_slot >= 0) {
+        if (qos_class >= 0)
+            qos->conn[qos_slot].active[qos_class]--;
+        qos->conn[qos_slot].running[qos_admitted]--;
+    }
+    pthread_cond_broadcast(&qos->cond);
+    pthread_mutex_unlock(&qos->lock);
+    qos_class = qos_admitted = -1;
+}
+
+// on_sigchld: Only interrupts accept(), so that exited handlers are reaped at once.
+void on_sigchld(int sig) {
+    (void)sig;
+}
+
+// shared_init: Maps the state shared by S1's processes: the predecessor's, handed down as
+// the memfd state_fd, if this S1 was started by an upgrade and its layout is the same, or
+// else new state.
+void shared_init(int state_fd) {
+    size_t part[SHARED_PARTS] = { sizeof(struct health_table), WORKERS_MAX * sizeof(struct metrics),
+                                  sizeof(struct qos), sizeof(struct tar_cache) };
+    size_t off[SHARED_PARTS], page = sysconf(_SC_PAGESIZE), size = page;
+    for (int i = 0; i < SHARED_PARTS; i++) {
+        off[i] = size;
+        size += (part[i] + page - 1) / page * page;
+    }
+    struct stat st;
+    char *base = MAP_FAILED;
+    if (state_fd >= 0 && fstat(state_fd, &st) == 0 && st.st_size == (off_t)size)
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+    struct shared_hdr *hdr = (struct shared_hdr *)base;
+    if (base != MAP_FAILED && hdr->magic == SHARED_MAGIC && memcmp(hdr->part, part, sizeof(part)) == 0) {
+        shared_fd = state_fd;
+        shared_inherited = 1;
     } else {
-        send(client_sock, final, strlen(final), 0);
+        if (state_fd >= 0)
+            LOG(LL_WARN, "The shared state handed over does not match, starting afresh\n");
+        if (base != MAP_FAILED)
+            munmap(base, size);
+        if (state_fd >= 0)
+            close(state_fd);
+        shared_fd = memfd_create("dfs-s1", MFD_CLOEXEC);
+        if (shared_fd < 0 || ftruncate(shared_fd, size) != 0 ||
+            (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0)) == MAP_FAILED) {
+            perror("S1: shared state");
+            exit(1);
+        }
+        hdr = (struct shared_hdr *)base;
+        hdr->magic = SHARED_MAGIC;
+        memcpy(hdr->part, part, sizeof(part));
     }
+    health = (struct health_table *)(base + off[0]);
+    metrics_shards = (struct metrics *)(base + off[1]);
+    qos = (struct qos *)(base + off[2]);
+    tar_cache = (struct tar_cache *)(base + off[3]);
+    if (!shared_inherited)
+        tar_cache->ns_generation = 1;
+}
+
+// on_sigusr2: Asks the accept loop to hand S1 over to a new instance.
+void on_sigusr2(int sig) {
+    (void)sig;
+    upgrade_requested = 1;
+}
+
+// upgrade_inherit: Takes over what the S1 this one was started to replace handed down, if
+// any: DFS_UPGRADE then holds "<state>,<peer>,<listener>...". Returns the shared state's
+// memfd, or -1.
+int upgrade_inherit(void) {
+    const char *env = getenv("DFS_UPGRADE");
+    int state, peer, n, fd;
+    if (!env || sscanf(env, "%d,%d%n", &state, &peer, &n) != 2)
+        return -1;
+    for (env += n; nlisteners < WORKERS_MAX && sscanf(env, ",%d%n", &fd, &n) == 1; env += n)
+        listeners[nlisteners++] = fd;
+    unsetenv("DFS_UPGRADE");
+    fcntl(state, F_SETFD, FD_CLOEXEC);
+    fcntl(peer, F_SETFD, FD_CLOEXEC);
+    upgrade_peer = peer;
+    LOG(LL_INFO, "Taking over %d listeners from the old S1\n", nlisteners);
+    return state;
+}
+
+// upgrade_start: Starts the successor with the listeners and the shared state. Returns 0
+// once it is ready to accept, or -1 if it could not be started, in which case this S1
+// carries on as before.
+int upgrade_start(void) {
+    int sv[2];
+    char env[64 + WORKERS_MAX * 12], ok;
+    pid_t mid, pid = -1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        LOG(LL_ERROR, "Upgrade failed, carrying on: %s\n", strerror(errno));
+        return -1;
+    }
+    int len = snprintf(env, sizeof(env), "%d,%d", shared_fd, sv[1]);
+    for (int i = 0; i < nlisteners; i++)
+        len += snprintf(env + len, sizeof(env) - len, ",%d", listeners[i]);
+    log_flush(1);
+    // The successor is forked twice, so that it is no child of this S1's, which waits for
+    // all of its children before it exits.
+    if ((mid = fork()) == 0) {
+        if ((pid = fork()) == 0) {
+            // Only the shared state, the peer socket and the listeners are kept across the exec.
+            fcntl(shared_fd, F_SETFD, 0);
+            fcntl(sv[1], F_SETFD, 0);
+            setenv("DFS_UPGRADE", env, 1);
+            execvp(upgrade_argv[0], upgrade_argv);
+            _exit(127);
+        }
+        send(sv[1], &pid, sizeof(pid), 0);
+        _exit(0);
+    }
+    close(sv[1]);
+    while (mid > 0 && waitpid(mid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    if (mid > 0 && recv(sv[0], &pid, sizeof(pid), 0) == sizeof(pid) && pid > 0) {
+        struct pollfd pfd = { sv[0], POLLIN, 0 };
+        int n;
+        while ((n = poll(&pfd, 1, UPGRADE_WAIT_MS)) < 0 && errno == EINTR)
+            ;
+        if (n == 1 && recv(sv[0], &ok, 1, 0) == 1) {
+            close(sv[0]);
+            LOG(LL_INFO, "Handed over to pid %d, draining\n", pid);
+            return 0;
+        }
+        kill(pid, SIGKILL);
+    }
+    close(sv[0]);
+    LOG(LL_ERROR, "Upgrade failed, carrying on: the new S1 did not start\n");
+    return -1;
+}
+
+// upgrade_drain: Stops accepting, stops the helper processes and exits once every child has.
+// The handlers of a draining S1 finish their connections as usual.
+void upgrade_drain(void) {
+    pid_t pid;
+    for (int i = 0; i < nlisteners; i++)
+        close(listeners[i]);
+    for (int i = 0; i < 2; i++)
+        if (helper_pids[i] > 0)
+            kill(helper_pids[i], SIGTERM);
+    while ((pid = wait(NULL)) > 0 || errno == EINTR)
+        if (pid > 0)
+            qos_detach(pid);
+    LOG(LL_INFO, "Drained, exiting\n");
+    exit(0);
 }
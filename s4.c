@@ -1,4 +1,5 @@
 // S4.c - ZIP Backend Server
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,10 +12,372 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pwd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <poll.h>
+#include <endian.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/sendfile.h>
 
 #define PORT 7300
+#define FILE_TYPE ".zip"          // Type listed and archived when a request names none.
 #define BUFSIZE 1024
 
+#define TAR_BLOCK 512
+#define TAR_DIRTY_MAX 64
+
+// Tar segment index used by send_tar(). Each entry is one member of the archive
+// with its ustar header block already built, so an unchanged namespace is streamed
+// straight from the index instead of re-running find/tar for every request.
+struct tar_entry {
+    char *path;               // Absolute path of the file under $HOME/S4.
+    long size;                // Size recorded in the header.
+    char header[TAR_BLOCK];   // Cached ustar header for this member.
+};
+
+static struct tar_entry *tar_index = NULL;
+static int tar_count = 0, tar_cap = 0;
+
+// Namespace generation counter. save_file() and delete_file() bump it; the index
+// is only revalidated when it no longer matches the generation it was built at.
+static unsigned long ns_generation = 1;
+static unsigned long tar_generation = 0;
+
+// Files touched since the last revalidation. Only these segments are regenerated,
+// unless more than TAR_DIRTY_MAX changed, in which case the tree is rescanned.
+static char tar_dirty[TAR_DIRTY_MAX][BUFSIZE];
+static int tar_dirty_count = 0;
+static int tar_dirty_overflow = 0;
+
+#define URING_DEPTH 8                // Reads/writes kept in flight per transfer.
+#define URING_BUFSIZE (128 * 1024)   // Size of each registered I/O buffer.
+
+// io_uring storage engine state. The ring is driven through the raw system calls,
+// so no liburing is needed to build the server; if the kernel refuses io_uring
+// (or DFS_IO=stdio is set) the original stdio path is used instead.
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    char *bufs;          // URING_DEPTH page-aligned buffers, registered with the kernel if allowed.
+    int fixed;           // 1 if bufs are registered and READ_FIXED/WRITE_FIXED can be used.
+    unsigned pending;    // SQEs queued but not yet submitted.
+};
+static struct uring ring;
+static int uring_ok = 0;
+static long direct_min = 0;   // Objects at least this large use O_DIRECT (DFS_DIRECT_MIN, 0 = never).
+
+#define PACK_MAGIC 0x4b435044u            // "DPCK", marks the start of every pack record.
+#define PACK_LIVE 1
+#define PACK_TOMBSTONE 2
+#define PACK_SEG_MAX (64L * 1024 * 1024)  // A segment is sealed once it grows past this size.
+#define HOT_SLOTS 64                      // Objects that can be mapped at once.
+#define HOT_RECENT 32                     // Recently served paths, to spot repeat reads.
+#define HOT_MAX (256L * 1024 * 1024)      // Default cap on mapped bytes (DFS_MMAP_MAX).
+#define HOT_CHUNK (1024 * 1024)           // Bytes handed to vmsplice() at a time.
+
+// Small-file packing store. Objects up to pack_max bytes (DFS_PACK_MAX, 0 = disabled)
+// are appended to segment files under $HOME/S4/.pack instead of getting a file of
+// their own. Each record is a pack_record header, the object path and the object data.
+struct pack_record {
+    uint32_t magic;
+    uint32_t flags;       // PACK_LIVE or PACK_TOMBSTONE.
+    uint32_t path_len;
+    uint32_t data_len;
+    int64_t mtime;
+};
+
+// In-memory offset index: open-addressing hash table keyed by the absolute path.
+struct pack_entry {
+    char *path;           // NULL for an empty slot.
+    int seg;              // Segment id holding the record.
+    long off;             // Offset of the object data within the segment.
+    long len;             // Object size.
+    long rec_len;         // Size of the whole record, for garbage accounting.
+    time_t mtime;
+};
+
+struct pack_seg {
+    int id;
+    int fd;
+    long size;            // Bytes appended so far.
+    long dead;            // Bytes belonging to replaced, deleted or tombstone records.
+    int stuck;            // Compaction could not finish; it is not tried again until a restart.
+};
+
+static long pack_max = 0;
+static long pack_seg_max = PACK_SEG_MAX;   // DFS_PACK_SEG overrides the segment size.
+static struct pack_entry *pack_tab = NULL;
+static int pack_cap = 0, pack_used = 0;
+static struct pack_seg *pack_segs = NULL;   // Sorted by id; the last one is appended to.
+static int pack_nsegs = 0;
+
+// Hot-file cache. A file served a second time while it is still in the recent list is
+// mmap()ed, and later downloads are spliced from the mapping to the socket instead of
+// being read again. Mappings are dropped LRU-first once hot_bytes would exceed hot_max.
+struct hot_map {
+    char *path;           // NULL for a free slot.
+    char *addr;
+    long len;
+    dev_t dev;            // Identity of the mapped file, to notice outside changes.
+    ino_t ino;
+    time_t mtime;
+    unsigned long last_use;
+};
+
+static struct hot_map hot[HOT_SLOTS];
+static char *hot_recent[HOT_RECENT];
+static int hot_recent_pos = 0;
+static long hot_max = HOT_MAX, hot_bytes = 0;
+static unsigned long hot_clock = 0, hot_lookups = 0, hot_hits = 0;
+static int hot_pipe[2] = { -1, -1 };   // Carries pages from vmsplice() to splice().
+
+// Binary framing. A framed message is a frame_hdr in network byte order, fields_len bytes
+// of typed fields (type byte, 16-bit length, value), then payload_len bytes of raw data
+// such as file contents. Connections that do not start with FRAME_MAGIC are served with
+// the old text commands.
+#define FRAME_MAGIC 0x44465331u     // "DFS1"
+#define FRAME_VERSION 1
+#define FRAME_FIELDS_MAX 2048       // Largest field area accepted in one message.
+#define FRAME_ERROR 0x01            // Reply flag: the request failed, FIELD_TEXT says why.
+#define FRAME_BATCH 0x02            // Request flag: the payload lists one path per line.
+#define FRAME_MORE 0x04             // Reply flag: one item of a batch, more replies follow.
+#define FRAME_FD 0x08               // Request: a local peer may answer with a descriptor. Reply: the
+                                    // payload is not inline but in the attached descriptor.
+#define FRAME_TREE 0x10             // Request flag on dispfnames: list every file below the path,
+                                    // relative to it, however deep and however many.
+#define BATCH_MAX_BYTES (1024 * 1024)   // Largest path list accepted in one batch.
+#define LOCAL_SOCK_NAME "dfs-%d"    // Abstract AF_UNIX name of the server on a TCP port.
+#define REPLICA_MAX 4               // Servers one instance copies its changes to.
+
+enum { OP_UPLOADF = 1, OP_DOWNLF, OP_REMOVEF, OP_DOWNLTAR, OP_DISPFNAMES, OP_REPLY, OP_STAT, OP_LIST, OP_STATS };
+enum { FIELD_PATH = 1, FIELD_NAME, FIELD_TYPE, FIELD_TEXT, FIELD_SIZE, FIELD_MTIME, FIELD_OFFSET, FIELD_TRACE };
+
+struct frame_hdr {
+    uint32_t magic;
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t version;
+    uint32_t req_id;          // Chosen by the requester and echoed in the reply.
+    uint32_t fields_len;
+    uint64_t payload_len;
+};
+
+// A received message: the decoded header and its field area.
+struct frame {
+    int opcode;
+    int flags;
+    uint32_t req_id;
+    long payload_len;
+    int fields_len;
+    char fields[FRAME_FIELDS_MAX];
+};
+
+// Per thread, as the bulk workers answer requests too.
+static __thread int framed = 0;              // The current client sent a framed request.
+static __thread uint32_t frame_req_id = 0;   // Request id echoed in replies to it.
+static __thread const char *batch_path = NULL;   // Item of a batch being answered, if any.
+static int peer_local = 0;   // The current connection came in over the AF_UNIX socket.
+static int fd_reply = 0;     // Answer a downlf with a descriptor instead of the data.
+static int listen_port;      // TCP port of this instance.
+
+// A replica this server copies its changes to, and how far into the replication log it got.
+struct replica {
+    char name[64];           // "host:port" as given on the command line.
+    struct sockaddr_in addr;
+    long pos;                // Offset of the next record to apply.
+    int pos_fd;              // $HOME/S4/.replog.<name>, where pos survives a restart.
+    pthread_t tid;
+};
+static struct replica replicas[REPLICA_MAX];
+static int nreplicas = 0;
+static int replog_fd = -1;   // $HOME/S4/.replog: one "~S4/<path>" line per stored or removed object.
+static long replog_size = 0;
+static pthread_mutex_t replog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replog_cond = PTHREAD_COND_INITIALIZER;
+static int replog_frozen = 0;   // Replication is paused for a successor to take it over.
+
+// Logging. A log line is formatted by the calling thread into a ring of its own and written
+// to stdout by a flusher thread, so a request never waits on stdout or the stdio lock. When
+// a ring is full the line is dropped and counted instead of blocking. DFS_LOG_LEVEL (error,
+// warn, info, debug or off) filters lines before any formatting, which leaves a disabled
+// LOG() costing one compare. DFS_LOG_SAMPLE=N keeps the per-request lines (LOG_REQ) of only
+// one request in N.
+#define LOG_RING 128              // Lines a thread can have waiting to be written.
+#define LOG_LINE 256              // Longest line; longer ones are cut.
+#define LOG_FLUSH_US 5000         // How often the flusher looks for new lines.
+enum { LL_ERROR, LL_WARN, LL_INFO, LL_DEBUG };
+#define LOG(level, ...) do { if ((level) <= log_level) log_write(level, __VA_ARGS__); } while (0)
+#define LOG_REQ(...) do { if (LL_INFO <= log_level && log_this) log_write(LL_INFO, __VA_ARGS__); } while (0)
+
+struct log_ring {
+    unsigned long head;       // Next slot the owning thread fills.
+    unsigned long tail;       // Next slot the flusher writes out.
+    unsigned long dropped;    // Lines lost to a full ring since the last flush.
+    int free;                 // The owning thread exited; another may take the ring over.
+    struct log_ring *next;
+    char line[LOG_RING][LOG_LINE];
+};
+static int log_level = LL_INFO;
+static int log_sample = 1;
+static unsigned long log_seq;
+static __thread int log_this = 1;          // The current request's lines are kept.
+static __thread struct log_ring *log_mine;
+static struct log_ring *log_rings;         // Every ring of this process; rings are never freed.
+static int log_flusher = 0;                // This process has started its flusher.
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;         // Taking and adding rings.
+static pthread_mutex_t log_flush_lock = PTHREAD_MUTEX_INITIALIZER;   // Writing them out.
+static pthread_key_t log_key;
+
+// Metrics. Each request is counted per opcode with its bytes in and out and whether it
+// failed, and its latency goes into a log-linear histogram: HIST_SUB buckets per power of
+// two microseconds, so a quantile read from it is within about 3% of the true value. The
+// part of a request spent waiting on the disk is recorded apart from the rest, which is
+// network transfer and processing. "stats" returns all of it in the Prometheus text format,
+// and DFS_STATS_FILE names a file it is also written to every DFS_STATS_INTERVAL seconds.
+#define HIST_SUB 16
+#define HIST_BUCKETS (40 * HIST_SUB)       // Up to 2^43 us.
+#define STATS_INTERVAL 10
+#define STATS_MAX (32 * 1024)              // Room for the formatted metrics.
+
+struct hist {
+    unsigned long count;
+    unsigned long sum_us;
+    unsigned long bucket[HIST_BUCKETS];
+};
+struct op_metrics {
+    unsigned long requests, errors, bytes_in, bytes_out;
+    struct hist latency;
+};
+struct metrics {
+    struct op_metrics op[OP_STATS + 1];
+    struct hist wait;         // Waits on the disk.
+    struct hist rest;         // Latency minus waits.
+};
+static struct metrics *metrics;
+// The request being measured on this thread.
+static __thread struct { int op, error; long start, wait_us, bytes_in, bytes_out; } req;
+static const char *op_names[] = { "", "uploadf", "downlf", "removef", "downltar", "dispfnames",
+                                   "reply", "stat", "list", "stats" };
+
+// Tracing. S1 sends a trace id and a flow id in FIELD_TRACE with the requests it traces. With
+// DFS_TRACE_FILE set, the stages of such a request are recorded as spans: parse (from the
+// connection to the decoded request), disk open, disk read and disk write. When the request
+// ends they are appended to the file, in one write(), as Chrome trace events in the JSON
+// array format, linked by the flow id to the S1 span that made the call. A stage repeated
+// within a request, such as a read per chunk, is kept as one span from its first start to
+// its last end, with the number of calls and the time spent in them.
+#define TRACE_SPANS 32            // Spans kept per request.
+#define TRACE_EVENT 256           // Room for one formatted event.
+
+struct span {
+    const char *name;         // A string constant; repeats are found by address.
+    char ph;                  // 'X' for a span, 'f' for the end of a flow from S1.
+    long start, end, busy_us;
+    int calls;
+    unsigned long flow;
+};
+static int trace_fd = -1;
+static int trace_pid;                      // Process that has named itself in the file.
+static __thread long trace_arrived;        // When the current request's connection was taken.
+// The request being traced on this thread; id is 0 if it is not traced.
+static __thread struct { unsigned long id; int nspans; struct span span[TRACE_SPANS]; } trace;
+
+// Quality of service. A request that moves at least qos_bulk_min bytes (DFS_QOS_BULK_MIN,
+// 1 MB by default), such as a large upload, download or tar archive, is bulk. Once the main
+// thread has looked it up, it is handed with its connection to one of the bulk workers
+// (DFS_BULK_WORKERS, 2 by default), so listings and small transfers never queue behind it.
+// Workers move data a QOS_QUANTUM at a time. The classes share the I/O by weighted fair
+// queuing: each has a virtual time, advanced by the bytes it moves over its weight
+// (DFS_QOS_WEIGHT for interactive requests, 16 by default, and 1 for bulk). A class that is
+// more than a quantum ahead of another busy class waits for it (see qos_charge), and every
+// request costs at least a quantum. Changes to the namespace, such as putting a finished
+// upload in place, stay with the main thread.
+#define QOS_QUANTUM (64 * 1024)       // Bytes a bulk transfer moves between scheduling checks.
+#define QOS_WAIT_MAX_MS 20            // Longest a class is held back per quantum.
+#define QOS_BULK_MIN (1024 * 1024)
+#define QOS_BULK_WORKERS 2
+
+enum { QOS_INTERACTIVE, QOS_BULK, QOS_CLASSES };
+struct qos {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int active[QOS_CLASSES];             // Requests of each class in progress.
+    double vtime[QOS_CLASSES];           // Bytes moved over the class's weight.
+    unsigned long waits[QOS_CLASSES];    // Quanta held back for the other class.
+};
+static struct qos qos_state = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static struct qos *qos = &qos_state;
+static long qos_bulk_min = QOS_BULK_MIN;
+static int qos_weight = 16;
+static __thread int qos_class = -1;      // Class of the request on this thread, -1 if none.
+
+// A bulk request handed to the workers. The request's per-thread state goes with it and
+// comes back to the main thread, which records the request and closes the connection.
+enum { BULK_UPLOAD, BULK_DOWNLOAD, BULK_TAR };
+struct tar_item {
+    struct tar_entry e;
+    int pack_fd;          // Segment holding a packed member's data, -1 for a file of its own.
+    long pack_off;
+};
+struct bulk_job {
+    int kind, sock, rc;
+    int fd;                          // BULK_DOWNLOAD: the open object.
+    long size;                       // Bytes to move: the object, or the whole archive.
+    char path[BUFSIZE];              // Absolute object path.
+    char tmp[BUFSIZE + 32];          // BULK_UPLOAD: where the data goes until it is complete.
+    struct tar_item *items;          // BULK_TAR: the archive members as of the request.
+    int nitems;
+    char type[16];
+    unsigned long generation;
+    int framed, log_this;
+    uint32_t req_id;
+    long arrived;
+    __typeof__(req) req;
+    __typeof__(trace) trace;
+    struct bulk_job *next;
+};
+static pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bulk_cond = PTHREAD_COND_INITIALIZER;
+static struct bulk_job *bulk_queue, **bulk_tail = &bulk_queue;   // Waiting for a worker.
+static struct bulk_job *bulk_done;          // Finished, for the main thread.
+static int bulk_pipe[2] = { -1, -1 };       // Wakes the main loop when a job is done.
+static int bulk_active = 0;                 // Jobs handed off and not yet finished.
+
+// Hot upgrade. SIGUSR2 starts a successor from the binary at argv[0], which inherits the
+// listening sockets, so no connection is refused while the two change over. The indexes go
+// along in $HOME/S4/.snapshot, which the successor loads instead of replaying the pack
+// segments and scanning the tree. Once it is ready the old server stops accepting and
+// drains: its bulk jobs run to the end, and each finished upload is passed over with its
+// connection, so only the successor touches the store from then on.
+#define SNAPSHOT_MAGIC 0x504e5344u   // "DSNP"
+#define SNAPSHOT_VERSION 1
+#define UPGRADE_WAIT_MS 10000        // How long a successor may take to get ready.
+
+// A finished upload passed to the successor, with the client's connection attached.
+struct handover {
+    int framed, log_this;
+    uint32_t req_id;
+    char tmp[BUFSIZE + 32];
+    char path[BUFSIZE];
+};
+static volatile sig_atomic_t upgrade_requested = 0;
+static char **upgrade_argv;
+static int upgrade_peer = -1;   // Socket to the predecessor, or to the successor while draining.
+static int draining = 0;        // The successor accepts; this server only finishes its jobs.
+
 // Helper function to reliably retrieve the HOME directory.
 // It first attempts to retrieve the HOME environment variable.
 // If that's not available, it uses the passwd structure.
@@ -30,38 +393,229 @@ char* get_home_dir() {
 
 // Function prototypes for client handling and file-related operations.
 
-void handle_client(int);
-void save_file(int, const char*);
-void send_file(int, const char*);
+int handle_client(int);
+int handle_frame(int);
+int save_file(int, const char*, long);
+int send_file(int, const char*);
 void delete_file(int, const char*);
-void send_tar(int);
-void list_files(int, const char*);
+int send_tar(int, const char*);
+void list_files(int, const char*, const char*);
+void list_all(int, const char*);
+void stat_file(int, const char*);
+int has_type(const char*, const char*);
+void mark_dirty(const char*);
+void tar_refresh(void);
+int uring_init(void);
+int uring_send_file(int, const char*);
+int uring_save_file(int, const char*, long);
+void io_bench(const char*, long, int);
+void pack_init(void);
+void pack_compact_step(void);
+struct pack_entry *pack_lookup(const char*);
+int pack_put(const char*, const char*, long);
+int pack_remove(const char*);
+long pack_read(const struct pack_entry*, char*, long, long);
+void pack_send(int, const struct pack_entry*);
+void hot_init(void);
+void hot_drop(const char*);
+struct hot_map *hot_get(const char*);
+int hot_send(int, const struct hot_map*);
+int send_all(int, const char*, long);
+int recv_all(int, void*, long);
+int frame_add(char*, int, int, const char*);
+int frame_get(const struct frame*, int, char*, int);
+int frame_pack(char*, int, int, uint32_t, const char*, int, long);
+int frame_send(int, int, int, uint32_t, const char*, int, long);
+int frame_recv(int, struct frame*);
+int is_framed(int);
+socklen_t local_addr(struct sockaddr_un*, int);
+int local_listen(int);
+int frame_send_fd(int, int, int, uint32_t, const char*, int, long, int);
+int send_fd_reply(int, const char*);
+void reply_status(int, int, const char*);
+int reply_size(int, long);
+void reply_text(int, const char*);
+int reply_frame(int, int, const char*, int, long);
+void reply_stat(int, long, long);
+void handle_batch(int, int, char*);
+int replica_add(const char*);
+void replog_init(void);
+void replog_append(const char*);
+void *replica_run(void*);
+void log_init(void);
+void log_write(int, const char*, ...) __attribute__((format(printf, 2, 3)));
+void log_request(void);
+void log_flush(int);
+void log_exit(void);
+void log_forked(void);
+void log_release(void*);
+struct log_ring *log_attach(void);
+void *log_flush_run(void*);
+long metrics_now(void);
+void hist_record(struct hist*, long);
+double hist_quantile(const struct hist*, double);
+void metrics_begin(int);
+void metrics_wait(const char*, long);
+void metrics_end(void);
+void trace_init(void);
+void trace_begin(const struct frame*);
+void trace_span(const char*, long, long);
+void trace_end(void);
+int metrics_format(char*, int);
+void metrics_dump(const char*);
+void handle_stats(int);
+void *metrics_dump_run(void*);
+void qos_init(void);
+double qos_share(int);
+int qos_ahead(int);
+void qos_begin(int);
+void qos_charge(long);
+void qos_end(void);
+int bulk_ok(long);
+int bulk_upload(int, const char*, long);
+int bulk_download(int, const char*);
+void bulk_submit(struct bulk_job*);
+void *bulk_run(void*);
+int bulk_save(struct bulk_job*);
+void bulk_send(struct bulk_job*);
+void bulk_finish(void);
+void bulk_free(struct bulk_job*);
+void serve_client(int);
+void bulk_store(int, int, const char*, const char*);
+void pack_load(void);
+void on_sigusr2(int);
+int upgrade_inherit(int*);
+int upgrade_start(int, int);
+void upgrade_drain(int, int);
+int upgrade_pass(const struct bulk_job*);
+void upgrade_receive(void);
+int snapshot_write(void);
+int snapshot_load(void);
+void snapshot_reset(void);
+int tar_snapshot(struct bulk_job*, const char*);
+void tar_stream(struct bulk_job*);
 
-int main() {
+int main(int argc, char *argv[]) {
     int server_sock, client_sock;
     struct sockaddr_in server_addr, client_addr;
     socklen_t sin_size = sizeof(struct sockaddr_in);
-    // Create a socket using IPv4 and TCP.
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    // Set up the server address structure.
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    memset(&(server_addr.sin_zero), 0, 8);
+    // A client that goes away mid-transfer must not take the server down with it.
+    signal(SIGPIPE, SIG_IGN);
+    // SIGUSR2 hands the server over to a new instance of its binary.
+    upgrade_argv = argv;
+    signal(SIGUSR2, on_sigusr2);
+    log_init();
+    trace_init();
+
+    // Storage engine: io_uring when the kernel allows it, stdio otherwise.
+    uring_init();
+    // Optional small-file packing store (DFS_PACK_MAX).
+    pack_init();
+    // Hot-file mmap cache (DFS_MMAP_MAX, 0 disables it).
+    hot_init();
+    // A server started by an upgrade takes its predecessor's indexes over from the snapshot;
+    // otherwise the pack index is rebuilt from the segments.
+    if (snapshot_load() != 0)
+        pack_load();
 
-    // Bind the socket to the specified port and address.
-    bind(server_sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr));
+    // "--io-bench <path> [MB] [iterations]" compares the stdio and io_uring paths and exits.
+    // "--port <n>" runs another instance, e.g. one more shard of this file type. Each
+    // instance needs its own storage, so shards on one host are started with different HOMEs.
+    // "--replica <host:port>", up to REPLICA_MAX times, copies every change to that server.
+    int port = PORT;
+    while (argc >= 3 && (strcmp(argv[1], "--port") == 0 || strcmp(argv[1], "--replica") == 0)) {
+        if (strcmp(argv[1], "--port") == 0)
+            port = atoi(argv[2]);
+        else if (replica_add(argv[2]) != 0)
+            return 1;
+        argc -= 2;
+        argv += 2;
+    }
+    listen_port = port;
+
+    if (argc >= 3 && strcmp(argv[1], "--io-bench") == 0) {
+        io_bench(argv[2], argc > 3 ? atol(argv[3]) : 256, argc > 4 ? atoi(argv[4]) : 3);
+        return 0;
+    }
+
+    // Metrics, written to DFS_STATS_FILE every DFS_STATS_INTERVAL seconds if it is set.
+    metrics = calloc(1, sizeof(struct metrics));
+    static int stats_interval = STATS_INTERVAL;
+    if (getenv("DFS_STATS_INTERVAL") && atoi(getenv("DFS_STATS_INTERVAL")) > 0)
+        stats_interval = atoi(getenv("DFS_STATS_INTERVAL"));
+    if (getenv("DFS_STATS_FILE")) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, metrics_dump_run, &stats_interval);
+    }
+    // Bulk workers and the settings of the scheduler (DFS_QOS_*, DFS_BULK_WORKERS).
+    qos_init();
+
+    // A successor started by an upgrade is handed its predecessor's listeners instead.
+    int local_sock = -1;
+    server_sock = upgrade_inherit(&local_sock);
+    if (server_sock < 0) {
+        // Create a socket using IPv4 and TCP.
+        server_sock = socket(AF_INET, SOCK_STREAM, 0);
+        // Set up the server address structure.
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        memset(&(server_addr.sin_zero), 0, 8);
+
+        // A restarted server must be able to take its port back while old connections linger.
+        int one = 1;
+        setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        // Bind the socket to the specified port and address.
+        bind(server_sock, (struct sockaddr *)&server_addr, sizeof(struct sockaddr));
 
-    // Listen for incoming connections; allow up to 10 pending connections.
-    listen(server_sock, 10);
-    printf("S4 Server (ZIP) listening on port %d...\n", PORT);
+        // Listen for incoming connections; allow up to 64 pending connections.
+        listen(server_sock, 64);
+        // Co-located servers such as S1 can also connect over an AF_UNIX socket.
+        local_sock = local_listen(port);
+    }
+    printf("S4 Server (ZIP) listening on port %d (%s I/O)...\n", port, uring_ok ? "io_uring" : "stdio");
+    // Replication threads fetch changed objects through the listeners above.
+    if (nreplicas > 0)
+        replog_init();
+    // The predecessor, if any, stops accepting once this is sent.
+    if (upgrade_peer >= 0 && send(upgrade_peer, "R", 1, 0) != 1)
+        LOG(LL_WARN, "Could not tell the old server to hand over: %s\n", strerror(errno));
 
     // Main loop: accept and handle incoming client connections.
     while (1) {
-        client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &sin_size);
-        if (client_sock > 0) {
-            handle_client(client_sock);
-            close(client_sock);
+        if (upgrade_requested) {
+            upgrade_requested = 0;
+            if (upgrade_start(server_sock, local_sock) == 0)
+                upgrade_drain(server_sock, local_sock);
+        }
+        // Wait on both listeners and on bulk jobs coming back. With packing enabled, idle
+        // periods are used to compact segments full of garbage.
+        struct pollfd pfd[4] = { { server_sock, POLLIN, 0 }, { local_sock, POLLIN, 0 },
+                                 { bulk_pipe[0], POLLIN, 0 }, { upgrade_peer, POLLIN, 0 } };
+        int ready = poll(pfd, 4, pack_max > 0 ? 1000 : -1);
+        if (ready == 0)
+            pack_compact_step();
+        if (ready <= 0)
+            continue;
+        if (pfd[2].revents & POLLIN)
+            bulk_finish();
+        // Uploads the predecessor finished while it drained.
+        if (pfd[3].revents & (POLLIN | POLLHUP))
+            upgrade_receive();
+        if (pfd[0].revents & POLLIN) {
+            client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &sin_size);
+            if (client_sock > 0) {
+                peer_local = 0;
+                serve_client(client_sock);
+            }
+        }
+        if (local_sock >= 0 && (pfd[1].revents & POLLIN)) {
+            client_sock = accept(local_sock, NULL, NULL);
+            if (client_sock > 0) {
+                peer_local = 1;
+                serve_client(client_sock);
+            }
         }
     }
 
@@ -69,74 +623,1291 @@ int main() {
 }
 
 // Handles the communication with a connected client.
-void handle_client(int sock) {
+// Returns 1 if the request went to a bulk worker, which then owns the connection.
+int handle_client(int sock) {
     char buffer[BUFSIZE] = {0};
+    log_request();
+    trace_arrived = metrics_now();
+
+    // Framed requests carry their arguments in typed fields; anything else is a text command.
+    framed = is_framed(sock);
+    if (framed < 0)
+        return 0;
+    if (framed)
+        return handle_frame(sock);
 
     // Receive the command from the client.
     recv(sock, buffer, sizeof(buffer), 0);
 
     // Determine the command sent by the client by checking the prefix of the message.
     if (strncmp(buffer, "uploadf ", 8) == 0) {
+        metrics_begin(OP_UPLOADF);
         char filepath[512];
 
         // Extract the file path from the command.
-        sscanf(buffer, "uploadf %s", filepath);
+        sscanf(buffer, "uploadf %511s", filepath);
+        // The size of the upload follows the command as a raw long.
+        long fsize;
+        if (recv(sock, &fsize, sizeof(long), 0) <= 0) {
+            perror("Failed to receive file size");
+            return 0;
+        }
         // Call save_file() with the path starting after the '~' character.
-        save_file(sock, filepath + 1);
+        req.bytes_in = fsize;
+        return save_file(sock, filepath + 1, fsize) == 1;
     }
     else if (strncmp(buffer, "downlf ", 7) == 0) {
+        metrics_begin(OP_DOWNLF);
         char filepath[512];
-        sscanf(buffer, "downlf %s", filepath);
+        sscanf(buffer, "downlf %511s", filepath);
         // Call send_file() with the path starting after the '~' character.
-        send_file(sock, filepath + 1);
+        return send_file(sock, filepath + 1);
     }
     else if (strncmp(buffer, "removef ", 8) == 0) {
+        metrics_begin(OP_REMOVEF);
         char filepath[512];
-        sscanf(buffer, "removef %s", filepath);
+        sscanf(buffer, "removef %511s", filepath);
         // Call delete_file() with the path starting after the '~' character.
         delete_file(sock, filepath + 1);
     }
     else if (strncmp(buffer, "downltar ", 9) == 0) {
+        metrics_begin(OP_DOWNLTAR);
         // Client requests a tar archive of all .zip files.
-        send_tar(sock);
+        char type[16] = FILE_TYPE;
+        sscanf(buffer, "downltar %15s", type);
+        return send_tar(sock, type);
     }
     else if (strncmp(buffer, "dispfnames ", 11) == 0) {
+        metrics_begin(OP_DISPFNAMES);
         char path[512];
-        sscanf(buffer, "dispfnames %s", path);
+        sscanf(buffer, "dispfnames %511s", path);
         // List all .zip files in the given directory (after the '~' character).
-        list_files(sock, path + 1);
+        list_files(sock, path + 1, FILE_TYPE);
+    }
+    else if (strncmp(buffer, "stats", 5) == 0) {
+        metrics_begin(OP_STATS);
+        handle_stats(sock);
+    }
+    return 0;
+}
+
+// handle_frame: Serves one framed request. The object path (or archive type) comes from a
+// typed field and an upload's size from the header; every request gets a reply frame.
+// Returns 1 if the request went to a bulk worker.
+int handle_frame(int sock) {
+    struct frame f;
+    char arg[BUFSIZE];
+    if (frame_recv(sock, &f) != 0) {
+        LOG(LL_WARN, "Malformed frame, closing connection\n");
+        return 0;
+    }
+    frame_req_id = f.req_id;
+    fd_reply = peer_local && (f.flags & FRAME_FD);
+    trace_begin(&f);
+    metrics_begin(f.opcode);
+    req.bytes_in = f.payload_len;
+    if (f.flags & FRAME_BATCH) {
+        if (f.payload_len > BATCH_MAX_BYTES) {
+            // Read the list off the socket so the reply is not lost to a reset.
+            char buf[BUFSIZE];
+            long left = f.payload_len;
+            int n = 1;
+            while (left > 0 && (n = recv(sock, buf, left < BUFSIZE ? left : BUFSIZE, 0)) > 0)
+                left -= n;
+            reply_status(sock, 0, "Batch too large.\n");
+            return 0;
+        }
+        char *list = malloc(f.payload_len + 1);
+        if (!list || recv_all(sock, list, f.payload_len) != 0) {
+            free(list);
+            return 0;
+        }
+        list[f.payload_len] = '\0';
+        handle_batch(sock, f.opcode, list);
+        free(list);
+        return 0;
+    }
+    if (f.opcode == OP_STATS) {
+        handle_stats(sock);
+        return 0;
+    }
+    // S1 names the type it routes here; a backend may serve several.
+    char type[16];
+    if (frame_get(&f, FIELD_TYPE, type, sizeof(type)) != 0 || type[0] != '.')
+        strcpy(type, FILE_TYPE);
+    if (f.opcode == OP_DOWNLTAR)
+        return send_tar(sock, type);
+    if (f.opcode == OP_LIST) {
+        list_all(sock, type);
+        return 0;
+    }
+    if (frame_get(&f, FIELD_PATH, arg, sizeof(arg)) != 0 || arg[0] != '~') {
+        reply_status(sock, 0, "Missing or invalid path.\n");
+        return 0;
+    }
+    // Paths keep the client's '~' prefix, which is dropped as for text commands.
+    if (f.opcode == OP_UPLOADF) {
+        int rc = save_file(sock, arg + 1, f.payload_len);
+        if (rc == 1)
+            return 1;
+        if (rc == 0)
+            reply_status(sock, 1, "File stored.\n");
+        else
+            reply_status(sock, 0, "Failed to store file.\n");
+    }
+    else if (f.opcode == OP_DOWNLF)
+        return send_file(sock, arg + 1);
+    else if (f.opcode == OP_REMOVEF)
+        delete_file(sock, arg + 1);
+    else if (f.opcode == OP_DISPFNAMES)
+        list_files(sock, arg + 1, type);
+    else if (f.opcode == OP_STAT)
+        stat_file(sock, arg + 1);
+    else
+        reply_status(sock, 0, "Unknown request.\n");
+    return 0;
+}
+
+// batch_cmp: Orders paths by directory and then by name, so each directory's entries are
+// adjacent in a sorted batch.
+int batch_cmp(const void *a, const void *b) {
+    const char *p = *(const char **)a, *q = *(const char **)b;
+    const char *ps = strrchr(p, '/'), *qs = strrchr(q, '/');
+    long dp = ps ? ps - p : 0, dq = qs ? qs - q : 0;
+    int c = strncmp(p, q, dp < dq ? dp : dq);
+    if (c != 0)
+        return c;
+    if (dp != dq)
+        return dp < dq ? -1 : 1;
+    return strcmp(p + dp, q + dq);
+}
+
+// handle_batch: Runs a batched downlf, removef or stat over a list of '~' paths, one per
+// line. Each item gets its own reply, and a final reply closes the batch. The list is sorted
+// so that every directory is opened once; its entries are then removed or looked up with
+// unlinkat() and fstatat() relative to it instead of resolving each full path again.
+void handle_batch(int sock, int opcode, char *list) {
+    char *home = get_home_dir();
+    int n = 0, max = 1;
+    for (char *c = list; *c; c++)
+        if (*c == '\n')
+            max++;
+    char **paths = malloc(max * sizeof(char *));
+    if (!paths) {
+        reply_status(sock, 0, "Out of memory.\n");
+        return;
+    }
+    char *save;
+    for (char *tok = strtok_r(list, "\n", &save); tok; tok = strtok_r(NULL, "\n", &save))
+        paths[n++] = tok;
+    qsort(paths, n, sizeof(char *), batch_cmp);
+
+    char dir[BUFSIZE] = "";
+    int dfd = -1;
+    for (int i = 0; i < n; i++) {
+        char full_path[BUFSIZE];
+        batch_path = paths[i];
+        if (paths[i][0] != '~' || strchr(paths[i], '/') == NULL) {
+            reply_status(sock, 0, "Invalid path.\n");
+            continue;
+        }
+        if (opcode == OP_DOWNLF) {
+            send_file(sock, paths[i] + 1);
+            continue;
+        }
+        snprintf(full_path, sizeof(full_path), "%s/%s", home, paths[i] + 1);
+        // Move to the item's directory when it differs from the previous one.
+        char *slash = strrchr(full_path, '/');
+        *slash = '\0';
+        if (strcmp(dir, full_path) != 0) {
+            if (dfd >= 0)
+                close(dfd);
+            strcpy(dir, full_path);
+            dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        *slash = '/';
+        struct stat st;
+        struct pack_entry *pe;
+        if (opcode == OP_REMOVEF) {
+            hot_drop(full_path);
+            if (pack_remove(full_path) == 0 || (dfd >= 0 && unlinkat(dfd, slash + 1, 0) == 0)) {
+                mark_dirty(full_path);
+                reply_status(sock, 1, "File removed.\n");
+            } else {
+                reply_status(sock, 0, "File not found.\n");
+            }
+        } else if (opcode == OP_STAT && (pe = pack_lookup(full_path)) != NULL) {
+            reply_stat(sock, pe->len, pe->mtime);
+        } else if (opcode == OP_STAT) {
+            if (dfd >= 0 && fstatat(dfd, slash + 1, &st, 0) == 0 && S_ISREG(st.st_mode))
+                reply_stat(sock, st.st_size, st.st_mtime);
+            else
+                reply_status(sock, 0, "File not found.\n");
+        } else {
+            reply_status(sock, 0, "Unknown request.\n");
+        }
+    }
+    if (dfd >= 0)
+        close(dfd);
+    free(paths);
+    batch_path = NULL;
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Batch of %d done.\n", n);
+    reply_status(sock, 1, msg);
+    LOG_REQ("Batch of %d requests (op %d) done\n", n, opcode);
+}
+
+// recv_all: Receives exactly len bytes. Returns 0 on success, -1 if the peer went away.
+int recv_all(int sock, void *buf, long len) {
+    long got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// frame_add: Appends a typed field to a field area of len bytes and returns the new length,
+// or -1 if it does not fit.
+int frame_add(char *fields, int len, int type, const char *value) {
+    int vlen = strlen(value);
+    if (len < 0 || vlen > 0xffff || len + 3 + vlen > FRAME_FIELDS_MAX)
+        return -1;
+    fields[len] = type;
+    fields[len + 1] = vlen >> 8;
+    fields[len + 2] = vlen & 0xff;
+    memcpy(fields + len + 3, value, vlen);
+    return len + 3 + vlen;
+}
+
+// frame_get: Copies the value of a field into out as a string. Returns -1 if the field is
+// missing, malformed or longer than outsz - 1.
+int frame_get(const struct frame *f, int type, char *out, int outsz) {
+    int off = 0;
+    while (off + 3 <= f->fields_len) {
+        int vlen = ((unsigned char)f->fields[off + 1] << 8) | (unsigned char)f->fields[off + 2];
+        if (off + 3 + vlen > f->fields_len)
+            return -1;
+        if (f->fields[off] == type) {
+            if (vlen >= outsz || memchr(f->fields + off + 3, '\0', vlen))
+                return -1;
+            memcpy(out, f->fields + off + 3, vlen);
+            out[vlen] = '\0';
+            return 0;
+        }
+        off += 3 + vlen;
+    }
+    return -1;
+}
+
+// frame_pack: Encodes a message header and its field area into out, which must have room for
+// a header and FRAME_FIELDS_MAX bytes. Returns the encoded length, or -1 if the fields are
+// too long.
+int frame_pack(char *out, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    struct frame_hdr h;
+    if (fields_len < 0 || fields_len > FRAME_FIELDS_MAX)
+        return -1;
+    h.magic = htonl(FRAME_MAGIC);
+    h.opcode = opcode;
+    h.flags = flags;
+    h.version = htons(FRAME_VERSION);
+    h.req_id = htonl(req_id);
+    h.fields_len = htonl(fields_len);
+    h.payload_len = htobe64(payload_len);
+    memcpy(out, &h, sizeof(h));
+    if (fields_len > 0)
+        memcpy(out + sizeof(h), fields, fields_len);
+    return sizeof(h) + fields_len;
+}
+
+// frame_send: Sends a message header and its field area in one write; the caller sends
+// the payload_len bytes of payload after it.
+int frame_send(int sock, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    char out[sizeof(struct frame_hdr) + FRAME_FIELDS_MAX];
+    long len = frame_pack(out, opcode, flags, req_id, fields, fields_len, payload_len), sent = 0;
+    if (len < 0)
+        return -1;
+    // With a payload to follow, MSG_MORE holds the header back so the two share a segment
+    // instead of the payload waiting on Nagle for the header's delayed ACK.
+    while (sent < len) {
+        ssize_t n = send(sock, out + sent, len - sent, payload_len > 0 ? MSG_MORE : 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// frame_send_fd: Sends a message header and its field area like frame_send(), with fd
+// attached as SCM_RIGHTS ancillary data. Only works on an AF_UNIX socket.
+int frame_send_fd(int sock, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+                  long payload_len, int fd) {
+    char out[sizeof(struct frame_hdr) + FRAME_FIELDS_MAX];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    int len = frame_pack(out, opcode, flags, req_id, fields, fields_len, payload_len);
+    if (len < 0)
+        return -1;
+    struct iovec iov = { out, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    ssize_t n;
+    do
+        n = sendmsg(sock, &msg, 0);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+    // The descriptor went with the first byte; the rest of the header is plain data.
+    return send_all(sock, out + n, len - n);
+}
+
+// frame_recv: Receives a message header and its field area, leaving the payload on the
+// socket. Returns -1 at end of stream or if the header is not a valid frame.
+int frame_recv(int sock, struct frame *f) {
+    struct frame_hdr h;
+    if (recv_all(sock, &h, sizeof(h)) != 0)
+        return -1;
+    if (ntohl(h.magic) != FRAME_MAGIC || ntohs(h.version) != FRAME_VERSION ||
+        ntohl(h.fields_len) > FRAME_FIELDS_MAX || (int64_t)be64toh(h.payload_len) < 0)
+        return -1;
+    f->opcode = h.opcode;
+    f->flags = h.flags;
+    f->req_id = ntohl(h.req_id);
+    f->fields_len = ntohl(h.fields_len);
+    f->payload_len = be64toh(h.payload_len);
+    return recv_all(sock, f->fields, f->fields_len);
+}
+
+// local_addr: Fills in the AF_UNIX address of the server listening on TCP port, in the
+// abstract namespace so that no socket file is left behind. Returns the address length.
+socklen_t local_addr(struct sockaddr_un *addr, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, LOCAL_SOCK_NAME, port);
+    return sizeof(sa_family_t) + 1 + n;
+}
+
+// local_listen: Opens the AF_UNIX listener that co-located servers use instead of loopback
+// TCP. Returns -1 if it cannot be set up, in which case only the TCP port is served.
+int local_listen(int port) {
+    struct sockaddr_un addr;
+    socklen_t len = local_addr(&addr, port);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, len) != 0 || listen(sock, 64) != 0) {
+        perror("AF_UNIX listener");
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// is_framed: Peeks at the start of the next message to tell a framed request from a text
+// command. Returns 1 for a frame, 0 for text and -1 if the peer closed the connection.
+int is_framed(int sock) {
+    uint32_t magic;
+    ssize_t n = recv(sock, &magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+    if (n <= 0)
+        return -1;
+    return n == sizeof(magic) && ntohl(magic) == FRAME_MAGIC;
+}
+
+// reply_frame: Sends the reply header for the current request. Inside a batch it also names
+// the item in FIELD_PATH and sets FRAME_MORE, since the final reply of the batch follows.
+int reply_frame(int sock, int flags, const char *fields, int len, long payload_len) {
+    char all[FRAME_FIELDS_MAX];
+    req.bytes_out += payload_len;
+    if (!batch_path)
+        return frame_send(sock, OP_REPLY, flags, frame_req_id, fields, len, payload_len);
+    int n = frame_add(all, 0, FIELD_PATH, batch_path);
+    if (n < 0 || n + len > FRAME_FIELDS_MAX)
+        return -1;
+    if (len > 0)
+        memcpy(all + n, fields, len);
+    return frame_send(sock, OP_REPLY, flags | FRAME_MORE, frame_req_id, all, n + len, payload_len);
+}
+
+// reply_status: Answers a request with a status message: the bare text for text clients,
+// or a reply frame carrying it in FIELD_TEXT (flagged FRAME_ERROR unless ok).
+void reply_status(int sock, int ok, const char *msg) {
+    if (!ok)
+        req.error = 1;
+    if (!framed) {
+        send(sock, msg, strlen(msg), 0);
+        return;
+    }
+    char fields[FRAME_FIELDS_MAX];
+    int len = frame_add(fields, 0, FIELD_TEXT, msg);
+    reply_frame(sock, ok ? 0 : FRAME_ERROR, fields, len < 0 ? 0 : len, 0);
+}
+
+// reply_size: Announces a payload of size bytes, which the caller sends next: a raw long for
+// text clients, a reply frame otherwise. A negative size reports the object as missing.
+int reply_size(int sock, long size) {
+    if (size < 0)
+        req.error = 1;
+    else if (!framed)
+        req.bytes_out += size;
+    if (!framed) {
+        if (size < 0)
+            size = 0;   // Text clients have always been told "not found" with a zero size.
+        return send_all(sock, (const char *)&size, sizeof(long));
+    }
+    if (size < 0) {
+        reply_status(sock, 0, "File not found.\n");
+        return 0;
+    }
+    return reply_frame(sock, 0, NULL, 0, size);
+}
+
+// reply_stat: Answers a stat request with the object's size and modification time.
+void reply_stat(int sock, long size, long mtime) {
+    char fields[64], num[24];
+    snprintf(num, sizeof(num), "%ld", size);
+    int len = frame_add(fields, 0, FIELD_SIZE, num);
+    snprintf(num, sizeof(num), "%ld", mtime);
+    len = frame_add(fields, len, FIELD_MTIME, num);
+    reply_frame(sock, 0, fields, len, 0);
+}
+
+// reply_text: Sends a text result such as a file list. Framed clients get its length first.
+void reply_text(int sock, const char *text) {
+    if (!framed)
+        req.bytes_out += strlen(text);
+    if (framed)
+        reply_frame(sock, 0, NULL, 0, strlen(text));
+    send_all(sock, text, strlen(text));
+}
+
+// pack_hash: FNV-1a hash of a path, used to place entries in the pack index.
+unsigned long pack_hash(const char *s) {
+    unsigned long h = 1469598103934665603UL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// pack_lookup: Returns the index entry for full_path, or NULL if it is not packed.
+struct pack_entry *pack_lookup(const char *full_path) {
+    if (pack_used == 0)
+        return NULL;
+    unsigned long i = pack_hash(full_path) & (pack_cap - 1);
+    while (pack_tab[i].path) {
+        if (strcmp(pack_tab[i].path, full_path) == 0)
+            return &pack_tab[i];
+        i = (i + 1) & (pack_cap - 1);
+    }
+    return NULL;
+}
+
+struct pack_seg *pack_seg_by_id(int id) {
+    for (int i = 0; i < pack_nsegs; i++)
+        if (pack_segs[i].id == id)
+            return &pack_segs[i];
+    return NULL;
+}
+
+// pack_insert: Adds or replaces the index entry for e->path (the path string is copied).
+// The record it replaces, if any, is counted as garbage in its segment.
+void pack_insert(const struct pack_entry *e) {
+    if ((pack_used + 1) * 10 >= pack_cap * 7) {
+        // Grow to keep the load factor under 70%.
+        struct pack_entry *old = pack_tab;
+        int old_cap = pack_cap;
+        pack_cap = pack_cap ? pack_cap * 2 : 1024;
+        pack_tab = calloc(pack_cap, sizeof(struct pack_entry));
+        pack_used = 0;
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i].path)
+                continue;
+            unsigned long j = pack_hash(old[i].path) & (pack_cap - 1);
+            while (pack_tab[j].path)
+                j = (j + 1) & (pack_cap - 1);
+            pack_tab[j] = old[i];
+            pack_used++;
+        }
+        free(old);
+    }
+    unsigned long i = pack_hash(e->path) & (pack_cap - 1);
+    while (pack_tab[i].path && strcmp(pack_tab[i].path, e->path) != 0)
+        i = (i + 1) & (pack_cap - 1);
+    if (pack_tab[i].path) {
+        struct pack_seg *s = pack_seg_by_id(pack_tab[i].seg);
+        if (s)
+            s->dead += pack_tab[i].rec_len;
+        char *path = pack_tab[i].path;
+        pack_tab[i] = *e;
+        pack_tab[i].path = path;
+    } else {
+        pack_tab[i] = *e;
+        pack_tab[i].path = strdup(e->path);
+        pack_used++;
+    }
+}
+
+// pack_erase: Drops an index entry, counting its record as garbage. Uses backward-shift
+// deletion so lookups never need tombstone slots.
+void pack_erase(struct pack_entry *e) {
+    struct pack_seg *s = pack_seg_by_id(e->seg);
+    if (s)
+        s->dead += e->rec_len;
+    free(e->path);
+    unsigned long i = e - pack_tab;
+    unsigned long j = i;
+    pack_tab[i].path = NULL;
+    while (1) {
+        j = (j + 1) & (pack_cap - 1);
+        if (!pack_tab[j].path)
+            break;
+        unsigned long home = pack_hash(pack_tab[j].path) & (pack_cap - 1);
+        // Move the entry back if its home slot is not between the hole and its position.
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            pack_tab[i] = pack_tab[j];
+            pack_tab[j].path = NULL;
+            i = j;
+        }
+    }
+    pack_used--;
+}
+
+// pack_open_seg: Opens (creating if needed) segment id and appends it to the segment list.
+struct pack_seg *pack_open_seg(int id) {
+    char seg_path[BUFSIZE];
+    snprintf(seg_path, sizeof(seg_path), "%s/S4/.pack/seg-%06d.dat", get_home_dir(), id);
+    int fd = open(seg_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+    pack_segs = realloc(pack_segs, (pack_nsegs + 1) * sizeof(struct pack_seg));
+    struct pack_seg *s = &pack_segs[pack_nsegs++];
+    s->id = id;
+    s->fd = fd;
+    s->size = lseek(fd, 0, SEEK_END);
+    s->dead = 0;
+    s->stuck = 0;
+    return s;
+}
+
+// pack_append: Appends one record to the active segment, rolling over to a new segment
+// when it is full. Returns the segment used and stores the record offset in *rec_off.
+struct pack_seg *pack_append(uint32_t flags, const char *full_path, const char *data, long len,
+                             time_t mtime, long *rec_off) {
+    struct pack_seg *s = pack_nsegs ? &pack_segs[pack_nsegs - 1] : NULL;
+    if (!s || s->size >= pack_seg_max)
+        s = pack_open_seg(s ? s->id + 1 : 1);
+    if (!s)
+        return NULL;
+    struct pack_record rec;
+    rec.magic = PACK_MAGIC;
+    rec.flags = flags;
+    rec.path_len = strlen(full_path);
+    rec.data_len = len;
+    rec.mtime = mtime;
+    struct iovec iov[3] = {
+        { &rec, sizeof(rec) },
+        { (void *)full_path, rec.path_len },
+        { (void *)data, len },
+    };
+    long rec_len = sizeof(rec) + rec.path_len + len;
+    if (pwritev(s->fd, iov, 3, s->size) != rec_len)
+        return NULL;
+    *rec_off = s->size;
+    s->size += rec_len;
+    return s;
+}
+
+// pack_put: Stores a small object in the pack and points the index at it.
+int pack_put(const char *full_path, const char *data, long len) {
+    long rec_off;
+    time_t now = time(NULL);
+    long t0 = metrics_now();
+    struct pack_seg *s = pack_append(PACK_LIVE, full_path, data, len, now, &rec_off);
+    metrics_wait("disk write", t0);
+    if (!s)
+        return -1;
+    struct pack_entry e;
+    e.path = (char *)full_path;
+    e.seg = s->id;
+    e.rec_len = sizeof(struct pack_record) + strlen(full_path) + len;
+    e.off = rec_off + e.rec_len - len;
+    e.len = len;
+    e.mtime = now;
+    pack_insert(&e);
+    return 0;
+}
+
+// pack_remove: Deletes a packed object by appending a tombstone. Returns -1 if not packed.
+int pack_remove(const char *full_path) {
+    struct pack_entry *e = pack_lookup(full_path);
+    if (!e)
+        return -1;
+    long rec_off;
+    struct pack_seg *s = pack_append(PACK_TOMBSTONE, full_path, NULL, 0, time(NULL), &rec_off);
+    if (!s)
+        return -1;
+    s->dead += sizeof(struct pack_record) + strlen(full_path);
+    pack_erase(e);
+    return 0;
+}
+
+// pack_read: Reads len bytes of a packed object starting at pos with a single pread().
+long pack_read(const struct pack_entry *e, char *buf, long pos, long len) {
+    struct pack_seg *s = pack_seg_by_id(e->seg);
+    if (!s)
+        return -1;
+    long t0 = metrics_now();
+    long n = pread(s->fd, buf, len, e->off + pos);
+    metrics_wait("disk read", t0);
+    return n;
+}
+
+// pack_replay: Rebuilds the index from one segment at startup. A torn record at the
+// end (crash during append) is cut off so later appends start on a clean boundary.
+void pack_replay(struct pack_seg *s) {
+    long off = 0;
+    struct pack_record rec;
+    char path[BUFSIZE];
+    while (pread(s->fd, &rec, sizeof(rec), off) == sizeof(rec)) {
+        long rec_len = sizeof(rec) + rec.path_len + rec.data_len;
+        if (rec.magic != PACK_MAGIC || rec.path_len >= BUFSIZE || off + rec_len > s->size)
+            break;
+        if (pread(s->fd, path, rec.path_len, off + sizeof(rec)) != rec.path_len)
+            break;
+        path[rec.path_len] = '\0';
+        if (rec.flags == PACK_LIVE) {
+            struct pack_entry e;
+            e.path = path;
+            e.seg = s->id;
+            e.off = off + sizeof(rec) + rec.path_len;
+            e.len = rec.data_len;
+            e.rec_len = rec_len;
+            e.mtime = rec.mtime;
+            pack_insert(&e);
+        } else {
+            struct pack_entry *e = pack_lookup(path);
+            if (e)
+                pack_erase(e);
+            s->dead += rec_len;
+        }
+        off += rec_len;
+    }
+    if (off < s->size) {
+        LOG(LL_WARN, "Truncating torn pack segment %d at %ld\n", s->id, off);
+        ftruncate(s->fd, off);
+        s->size = off;
+    }
+}
+
+int pack_seg_cmp(const void *a, const void *b) {
+    return ((const struct pack_seg *)a)->id - ((const struct pack_seg *)b)->id;
+}
+
+// pack_init: Enables the packing store if DFS_PACK_MAX is set and opens existing segments.
+void pack_init(void) {
+    const char *max = getenv("DFS_PACK_MAX");
+    if (!max || atol(max) <= 0)
+        return;
+    pack_max = atol(max);
+    if (getenv("DFS_PACK_SEG") && atol(getenv("DFS_PACK_SEG")) > 0)
+        pack_seg_max = atol(getenv("DFS_PACK_SEG"));
+    char dir[BUFSIZE];
+    snprintf(dir, sizeof(dir), "%s/S4", get_home_dir());
+    mkdir(dir, 0755);
+    snprintf(dir, sizeof(dir), "%s/S4/.pack", get_home_dir());
+    mkdir(dir, 0755);
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        int id;
+        if (sscanf(entry->d_name, "seg-%d.dat", &id) == 1)
+            pack_open_seg(id);
+    }
+    closedir(d);
+    qsort(pack_segs, pack_nsegs, sizeof(struct pack_seg), pack_seg_cmp);
+}
+
+// pack_load: Builds the pack index by replaying the segments opened by pack_init().
+void pack_load(void) {
+    if (pack_max <= 0)
+        return;
+    for (int i = 0; i < pack_nsegs; i++)
+        pack_replay(&pack_segs[i]);
+    LOG(LL_INFO, "Packing objects up to %ld bytes: %d segments, %d objects\n", pack_max, pack_nsegs, pack_used);
+}
+
+// pack_compact_step: Rewrites the sealed segment with the most garbage once at least half of
+// it is dead: live records are copied to the active segment and the old file is removed.
+// If a record cannot be read or copied, the segment is kept, since the index still points
+// into it, and left alone from then on. Called from the accept loop while no client is
+// waiting, so it needs no locking.
+void pack_compact_step(void) {
+    int victim = -1, older = 0, ok = 1;
+    // Bulk archives in progress read packed members straight from their segments.
+    if (bulk_active > 0)
+        return;
+    for (int i = 0; i < pack_nsegs - 1; i++) {
+        if (pack_segs[i].size > 0 && pack_segs[i].dead * 2 >= pack_segs[i].size && !pack_segs[i].stuck &&
+            (victim < 0 || pack_segs[i].dead > pack_segs[victim].dead))
+            victim = i;
+    }
+    if (victim < 0)
+        return;
+    int id = pack_segs[victim].id;
+    int fd = pack_segs[victim].fd;
+    long size = pack_segs[victim].size;
+    long off = 0, moved = 0, moved_bytes = 0;
+    struct pack_record rec;
+    char path[BUFSIZE];
+    char *data = NULL;
+    long data_cap = 0;
+    for (int i = 0; i < pack_nsegs; i++)
+        if (pack_segs[i].id < id)
+            older = 1;
+    while (off < size) {
+        if (pread(fd, &rec, sizeof(rec), off) != sizeof(rec) || rec.magic != PACK_MAGIC ||
+            rec.path_len >= BUFSIZE || pread(fd, path, rec.path_len, off + sizeof(rec)) != (ssize_t)rec.path_len) {
+            ok = 0;
+            break;
+        }
+        long rec_len = sizeof(rec) + rec.path_len + rec.data_len;
+        path[rec.path_len] = '\0';
+        struct pack_entry *e = pack_lookup(path);
+        long data_off = off + sizeof(rec) + rec.path_len;
+        if (rec.flags == PACK_LIVE && e && e->seg == id && e->off == data_off) {
+            // Still the current version: move it to the active segment.
+            long new_off;
+            if (e->len > data_cap) {
+                char *grown = realloc(data, e->len);
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                data = grown;
+                data_cap = e->len;
+            }
+            struct pack_seg *s = pread(fd, data, e->len, data_off) == e->len ?
+                pack_append(PACK_LIVE, path, data, e->len, e->mtime, &new_off) : NULL;
+            if (!s) {
+                ok = 0;
+                break;
+            }
+            e->seg = s->id;
+            e->off = new_off + rec_len - e->len;
+            moved++;
+            moved_bytes += rec_len;
+        } else if (rec.flags == PACK_TOMBSTONE && older && !e) {
+            // Older segments may still hold the record this tombstone cancels.
+            long new_off;
+            struct pack_seg *s = pack_append(PACK_TOMBSTONE, path, NULL, 0, rec.mtime, &new_off);
+            if (!s) {
+                ok = 0;
+                break;
+            }
+            s->dead += rec_len;
+        }
+        off += rec_len;
+    }
+    free(data);
+    if (!ok) {
+        // What was moved is now garbage here; the rest is still only here.
+        struct pack_seg *s = pack_seg_by_id(id);
+        s->dead += moved_bytes;
+        s->stuck = 1;
+        LOG(LL_ERROR, "Cannot compact pack segment %d at offset %ld; keeping it\n", id, off);
+        return;
+    }
+
+    // pack_append() may have grown the segment array, so look the victim up again by id.
+    char seg_path[BUFSIZE];
+    snprintf(seg_path, sizeof(seg_path), "%s/S4/.pack/seg-%06d.dat", get_home_dir(), id);
+    struct pack_seg *s = pack_seg_by_id(id);
+    close(s->fd);
+    unlink(seg_path);
+    memmove(s, s + 1, (&pack_segs[pack_nsegs] - (s + 1)) * sizeof(struct pack_seg));
+    pack_nsegs--;
+    LOG(LL_INFO, "Compacted pack segment %d (%ld bytes, %ld live objects moved)\n", id, size, moved);
+}
+
+// send_fd_reply: Answers a downlf from a co-located S1 with an open descriptor instead of the
+// data. The reply gives the object's size and its offset within the descriptor (a packed
+// object lives inside a segment file), and S1 then sendfile()s from it to its own client.
+// Returns -1, having sent nothing, if the object cannot be opened.
+int send_fd_reply(int sock, const char *full_path) {
+    struct pack_entry *pe = pack_lookup(full_path);
+    struct pack_seg *seg = pe ? pack_seg_by_id(pe->seg) : NULL;
+    struct stat st;
+    long off = 0, size;
+    int fd;
+    if (pe) {
+        if (!seg)
+            return -1;
+        fd = seg->fd;
+        off = pe->off;
+        size = pe->len;
+    } else {
+        long t0 = metrics_now();
+        fd = open(full_path, O_RDONLY | O_CLOEXEC);
+        metrics_wait("disk open", t0);
+        if (fd < 0)
+            return -1;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(fd);
+            return -1;
+        }
+        size = st.st_size;
+    }
+    char fields[64], num[24];
+    snprintf(num, sizeof(num), "%ld", off);
+    int len = frame_add(fields, 0, FIELD_OFFSET, num);
+    frame_send_fd(sock, OP_REPLY, FRAME_FD, frame_req_id, fields, len, size, fd);
+    if (!pe)
+        close(fd);
+    return 0;
+}
+
+// pack_send: Serves a packed object: the size, then the data read with one pread().
+void pack_send(int sock, const struct pack_entry *e) {
+    char buf[BUFSIZE];
+    char *data = e->len <= BUFSIZE ? buf : malloc(e->len);
+    long fsize = e->len;
+    long n = pack_read(e, data, 0, e->len);
+    if (n != e->len) {
+        // The segment could not be read; report the object as missing.
+        fsize = -1;
+    }
+    reply_size(sock, fsize);
+    if (fsize > 0)
+        send_all(sock, data, fsize);
+    if (data != buf)
+        free(data);
+}
+
+// uring_init: Sets up the io_uring instance and its registered buffers.
+// Returns 0 on success or -1 if the stdio path should be used.
+int uring_init(void) {
+    const char *mode = getenv("DFS_IO");
+    const char *dmin = getenv("DFS_DIRECT_MIN");
+    if (dmin)
+        direct_min = atol(dmin);
+    if (mode && strcmp(mode, "stdio") == 0)
+        return -1;
+
+    // Cooperative task running keeps completions from interrupting blocking socket calls
+    // (kernels before 5.19 reject the flag, so retry without it).
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (ring.fd < 0) {
+        memset(&p, 0, sizeof(p));
+        ring.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    }
+    if (ring.fd < 0)
+        return -1;
+
+    // Map the submission and completion rings (a single mapping on newer kernels) and the SQE array.
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_sz > sq_sz)
+            sq_sz = cq_sz;
+        cq_sz = sq_sz;
+    }
+    char *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(ring.fd);
+            return -1;
+        }
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Page-aligned buffers work for O_DIRECT; registering them saves the per-I/O page pinning.
+    if (posix_memalign((void **)&ring.bufs, 4096, URING_DEPTH * URING_BUFSIZE) != 0) {
+        close(ring.fd);
+        return -1;
+    }
+    struct iovec iov[URING_DEPTH];
+    for (int i = 0; i < URING_DEPTH; i++) {
+        iov[i].iov_base = ring.bufs + i * URING_BUFSIZE;
+        iov[i].iov_len = URING_BUFSIZE;
+    }
+    ring.fixed = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) == 0;
+    uring_ok = 1;
+    return 0;
+}
+
+// uring_queue: Queues a read (is_read) or write of len bytes at file offset off using buffer slot.
+// Nothing reaches the kernel until uring_submit() or uring_wait(), so queued requests are batched.
+void uring_queue(int is_read, int fd, int slot, unsigned len, long off) {
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    if (ring.fixed)
+        sqe->opcode = is_read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+    else
+        sqe->opcode = is_read ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)(ring.bufs + slot * URING_BUFSIZE);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = slot;
+    sqe->user_data = slot;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+}
+
+// uring_submit: Hands every queued request to the kernel in a single io_uring_enter() call.
+void uring_submit(void) {
+    while (ring.pending > 0) {
+        int r = syscall(__NR_io_uring_enter, ring.fd, ring.pending, 0, 0, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        ring.pending -= r;
+    }
+}
+
+// uring_wait: Submits anything still queued and waits for one completion.
+// Stores the buffer slot of the completed request in *slot and returns its result. The wait
+// is traced as a span named span.
+int uring_wait(int *slot, const char *span) {
+    long t0 = metrics_now();
+    unsigned head = __atomic_load_n(ring.cq_head, __ATOMIC_ACQUIRE);
+    while (ring.pending > 0 || head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        unsigned want = head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) ? 1 : 0;
+        int r = syscall(__NR_io_uring_enter, ring.fd, ring.pending, want, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            *slot = -1;
+            metrics_wait(span, t0);
+            return -errno;
+        }
+        ring.pending -= r;
+    }
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    *slot = (int)cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    metrics_wait(span, t0);
+    return res;
+}
+
+// send_all: Sends len bytes, retrying after short writes. A blocking send() can return early
+// while io_uring completions are being delivered to the task, so the engine never relies on one call.
+int send_all(int sock, const char *buf, long len) {
+    long sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, buf + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// uring_send_file: Sends the file size and then the file data, keeping up to URING_DEPTH
+// reads in flight so the disk keeps working while earlier chunks go out on the socket.
+// Returns -1 (before anything was sent) if the file cannot be opened, 1 if the transfer was
+// cut short after the size went out (the request is then marked as failed), and 0 once sent.
+int uring_send_file(int sock, const char *full_path) {
+    struct stat st;
+    long t0 = metrics_now();
+    if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    int direct = direct_min > 0 && st.st_size >= direct_min;
+    int fd = open(full_path, O_RDONLY | (direct ? O_DIRECT : 0));
+    if (fd < 0 && direct) {
+        // Some filesystems (tmpfs for one) refuse O_DIRECT; fall back to buffered reads.
+        fd = open(full_path, O_RDONLY);
+    }
+    metrics_wait("disk open", t0);
+    if (fd < 0)
+        return -1;
+
+    long fsize = st.st_size;
+    if (reply_size(sock, fsize) != 0) {
+        close(fd);
+        req.error = 1;
+        return 1;
+    }
+
+    // Buffer slot i always holds the chunk at offset (k * URING_DEPTH + i) * URING_BUFSIZE,
+    // so chunks are sent in order even though reads may complete out of order.
+    int done[URING_DEPTH] = {0};
+    int result[URING_DEPTH] = {0};
+    long next_issue = 0, next_send = 0;
+    int inflight = 0, failed = 0;
+    for (int i = 0; i < URING_DEPTH && next_issue < fsize; i++) {
+        uring_queue(1, fd, i, URING_BUFSIZE, next_issue);
+        next_issue += URING_BUFSIZE;
+        inflight++;
     }
+    while (next_send < fsize) {
+        int cur = (int)((next_send / URING_BUFSIZE) % URING_DEPTH);
+        while (!done[cur]) {
+            int slot;
+            int res = uring_wait(&slot, "disk read");
+            if (slot < 0 || slot >= URING_DEPTH)
+                break;
+            result[slot] = res;
+            done[slot] = 1;
+            inflight--;
+        }
+        // The ring itself failed: this slot's read may still be running, so its buffer can be
+        // neither sent nor reused.
+        if (!done[cur]) {
+            LOG(LL_ERROR, "io_uring wait failed while sending %s; aborting the transfer\n", full_path);
+            failed = 1;
+            break;
+        }
+        char *buf = ring.bufs + cur * URING_BUFSIZE;
+        long want = fsize - next_send < URING_BUFSIZE ? fsize - next_send : URING_BUFSIZE;
+        long got = result[cur] > 0 ? result[cur] : 0;
+        if (got < want) {
+            // Short or failed read: finish the chunk synchronously, zero-filling if the file shrank.
+            int bfd = open(full_path, O_RDONLY);
+            while (bfd >= 0 && got < want) {
+                ssize_t n = pread(bfd, buf + got, want - got, next_send + got);
+                if (n <= 0)
+                    break;
+                got += n;
+            }
+            if (bfd >= 0)
+                close(bfd);
+            if (got < want)
+                memset(buf + got, 0, want - got);
+        }
+        if (send_all(sock, buf, want) != 0) {
+            failed = 1;
+            break;
+        }
+        next_send += want;
+        done[cur] = 0;
+        if (next_issue < fsize) {
+            uring_queue(1, fd, cur, URING_BUFSIZE, next_issue);
+            next_issue += URING_BUFSIZE;
+            inflight++;
+        }
+    }
+    // If the client went away, reap the reads still in flight so the next request starts clean.
+    while (inflight > 0) {
+        int slot;
+        uring_wait(&slot, "disk read");
+        if (slot < 0)
+            break;
+        inflight--;
+    }
+    close(fd);
+    if (failed)
+        req.error = 1;
+    return failed;
 }
 
-// Saves an uploaded file from the client to the server's file system.
-void save_file(int sock, const char *path) {
-    long fsize;
-    // Receive the file size from the client.
-    recv(sock, &fsize, sizeof(long), 0);
+// uring_save_file: Receives fsize bytes from sock into the registered buffers and writes them
+// at their file offsets, keeping up to URING_DEPTH writes in flight while the next chunk arrives.
+// With O_DIRECT the unaligned tail is written through the page cache. Returns 0 on success.
+int uring_save_file(int sock, const char *full_path, long fsize) {
+    int direct = direct_min > 0 && fsize >= direct_min;
+    long t0 = metrics_now();
+    int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && direct) {
+        direct = 0;
+        fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    metrics_wait("disk open", t0);
+    if (fd < 0)
+        return -1;
+
+    int busy[URING_DEPTH] = {0};
+    long slot_len[URING_DEPTH], slot_off[URING_DEPTH];
+    int inflight = 0, slot = 0, err = 0;
+    long received = 0;
+    while (received < fsize) {
+        // Wait for the next buffer in rotation to be written out before reusing it.
+        while (busy[slot]) {
+            int s;
+            int res = uring_wait(&s, "disk write");
+            if (s < 0 || s >= URING_DEPTH) {
+                err = 1;
+                break;
+            }
+            if (res < slot_len[s]) {
+                // Short or failed write: finish it synchronously.
+                long off = res > 0 ? res : 0;
+                if (pwrite(fd, ring.bufs + s * URING_BUFSIZE + off, slot_len[s] - off, slot_off[s] + off)
+                        != slot_len[s] - off)
+                    err = 1;
+            }
+            busy[s] = 0;
+            inflight--;
+        }
+        if (err)
+            break;
+        char *buf = ring.bufs + slot * URING_BUFSIZE;
+        long want = fsize - received < URING_BUFSIZE ? fsize - received : URING_BUFSIZE;
+        long got = 0;
+        while (got < want) {
+            int n = recv(sock, buf + got, want - got, 0);
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        if (got == 0)
+            break;
+        if (direct && got % 4096 != 0) {
+            int bfd = open(full_path, O_WRONLY);
+            if (bfd < 0 || pwrite(bfd, buf, got, received) != got)
+                err = 1;
+            if (bfd >= 0)
+                close(bfd);
+        } else {
+            slot_len[slot] = got;
+            slot_off[slot] = received;
+            uring_queue(0, fd, slot, got, received);
+            uring_submit();
+            busy[slot] = 1;
+            inflight++;
+        }
+        received += got;
+        slot = (slot + 1) % URING_DEPTH;
+        if (got < want)
+            break;
+    }
+    // Drain the writes still in flight.
+    while (inflight > 0) {
+        int s;
+        int res = uring_wait(&s, "disk write");
+        if (s < 0 || s >= URING_DEPTH)
+            break;
+        if (res != slot_len[s])
+            err = 1;
+        inflight--;
+    }
+    close(fd);
+    return (err || received < fsize) ? -1 : 0;
+}
 
+// Saves an uploaded file of fsize bytes from the client to the server's file system.
+// Returns 0 once the whole file is stored, -1 otherwise.
+// A large upload is handed to a bulk worker instead, and 1 returned.
+int save_file(int sock, const char *path, long fsize) {
     char *home = get_home_dir();
     // Construct the absolute file path under $HOME/S4 directory.
     char full_path[BUFSIZE];
     snprintf(full_path, sizeof(full_path), "%s/%s", home, path);
+    hot_drop(full_path);
 
-    // Create necessary parent directories if they do not exist.
+    // Small objects go into the packing store: no directory, inode or file of their own.
+    if (pack_max > 0 && fsize <= pack_max) {
+        char *data = malloc(fsize > 0 ? fsize : 1);
+        long received = 0;
+        while (received < fsize) {
+            int n = recv(sock, data + received, fsize - received, 0);
+            if (n <= 0)
+                break;
+            received += n;
+        }
+        int rc = -1;
+        if (received == fsize && pack_put(full_path, data, fsize) == 0) {
+            remove(full_path);   // Drop a loose copy left by an earlier, larger version.
+            mark_dirty(full_path);
+            LOG_REQ("Stored ZIP (packed): %s\n", full_path);
+            rc = 0;
+        } else {
+            perror("pack_put");
+        }
+        free(data);
+        return rc;
+    }
+    // Create necessary parent directories if they do not exist, as mkdir -p would.
     char dir[BUFSIZE];
-    strncpy(dir, full_path, BUFSIZE);
-    dir[BUFSIZE - 1] = '\0';
-    char *slash = strrchr(dir, '/');
-    if (slash) {
-        *slash = '\0';
-        char cmd[BUFSIZE];
-        // Command to create directories recursively.
-        snprintf(cmd, sizeof(cmd), "mkdir -p %s", dir);
-        system(cmd);
+    snprintf(dir, sizeof(dir), "%s", full_path);
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+
+    // Large uploads are received by a bulk worker and put in place once complete.
+    if (bulk_upload(sock, full_path, fsize) == 0)
+        return 1;
+    // Larger objects are stored as regular files; forget any packed earlier version.
+    pack_remove(full_path);
+
+
+    // Write the upload through the io_uring engine when it is available.
+    if (uring_ok) {
+        if (uring_save_file(sock, full_path, fsize) != 0) {
+            perror("io_uring write in S4");
+            return -1;
+        }
+        mark_dirty(full_path);
+        LOG_REQ("Stored ZIP (io_uring): %s\n", full_path);
+        return 0;
     }
 
     // Open the file in binary write mode.
+    long t0 = metrics_now();
     FILE *fp = fopen(full_path, "wb");
+    metrics_wait("disk open", t0);
     if (!fp) {
         perror("fopen in S4");
-        return;
+        // Still consume the upload so the client's stream stays in step.
+        char buf[BUFSIZE];
+        for (long left = fsize; left > 0; ) {
+            int n = recv(sock, buf, left < BUFSIZE ? left : BUFSIZE, 0);
+            if (n <= 0)
+                break;
+            left -= n;
+        }
+        return -1;
     }
     char buf[BUFSIZE];
     long received = 0;
@@ -144,28 +1915,87 @@ void save_file(int sock, const char *path) {
 
     // Receive file data in chunks until the entire file is received.
     while (received < fsize) {
-        n = recv(sock, buf, BUFSIZE, 0);
+        n = recv(sock, buf, fsize - received < BUFSIZE ? fsize - received : BUFSIZE, 0);
+        if (n <= 0)
+            break;
+        long t0 = metrics_now();
         fwrite(buf, 1, n, fp);
+        metrics_wait("disk write", t0);
         received += n;
     }
     fclose(fp);
-    printf("Stored ZIP: %s\n", full_path);
+    if (received < fsize)
+        return -1;
+    mark_dirty(full_path);
+    LOG_REQ("Stored ZIP: %s\n", full_path);
+    return 0;
 }
 
 
 // Sends the requested file to the client.
-void send_file(int sock, const char *path) {
+// Returns 1 if the file was handed to a bulk worker.
+int send_file(int sock, const char *path) {
     char *home = get_home_dir();
     // Construct the absolute file path under $HOME.
     char full_path[BUFSIZE];
     snprintf(full_path, sizeof(full_path), "%s/%s", home, path);
 
+    // A co-located S1 is handed an open descriptor and sends the data itself.
+    if (fd_reply && send_fd_reply(sock, full_path) == 0) {
+        LOG_REQ("Sent file (descriptor): %s\n", full_path);
+        return 0;
+    }
+
+    // Packed small objects are served with a single pread() from their segment.
+    struct pack_entry *pe = pack_lookup(full_path);
+    if (pe) {
+        pack_send(sock, pe);
+        LOG_REQ("Sent file (packed): %s\n", full_path);
+        return 0;
+    }
+
+    // Files read repeatedly are served from a cached mapping, large ones too: they are sent
+    // here, but scheduled as bulk.
+    struct hot_map *hm = hot_get(full_path);
+    if (hm && !batch_path && hm->len >= qos_bulk_min && qos_class == QOS_INTERACTIVE) {
+        qos_end();
+        qos_begin(QOS_BULK);
+    }
+    // Once the size has gone out the reply is committed: a failed send ends it here rather
+    // than starting another one on the same connection.
+    if (hm) {
+        if (hot_send(sock, hm) == 0)
+            LOG_REQ("Sent file (mmap): %s [hit rate %lu%%, %ld KB mapped]\n", full_path,
+                   hot_hits * 100 / hot_lookups, hot_bytes / 1024);
+        else
+            req.error = 1;
+        return 0;
+    }
+
+    // Other large files are sent by a bulk worker.
+    if (bulk_download(sock, full_path) == 0)
+        return 1;
+
+    // Serve the file through the io_uring engine when it is available.
+    int sent = uring_ok ? uring_send_file(sock, full_path) : -1;
+    if (sent >= 0) {
+        if (sent == 0)
+            LOG_REQ("Sent file (io_uring): %s\n", full_path);
+        return 0;
+    }
+
+    long t0 = metrics_now();
     FILE *fp = fopen(full_path, "rb");
+    int open_errno = errno;
+    metrics_wait("disk open", t0);
     if (!fp) {
-        // If the file is not found, send a zero file size to inform the client.
-        long zero = 0;
-        send(sock, &zero, sizeof(long), 0);
-        return;
+        // Only a missing file is reported as not found; any other failure (EMFILE, EACCES)
+        // is not, so a replica is never told to drop an object that is still here.
+        if (open_errno == ENOENT || open_errno == ENOTDIR || !framed)
+            reply_size(sock, -1);
+        else
+            reply_status(sock, 0, "Cannot read file.\n");
+        return 0;
     }
 
     // Determine the file size.
@@ -173,15 +2003,19 @@ void send_file(int sock, const char *path) {
     long fsize = ftell(fp);
     fseek(fp, 0, SEEK_SET);
     // Send the file size first.
-    send(sock, &fsize, sizeof(long), 0);
+    reply_size(sock, fsize);
     char buf[BUFSIZE];
     int n;
     // Send file data in chunks.
+    t0 = metrics_now();
     while ((n = fread(buf, 1, BUFSIZE, fp)) > 0) {
+        metrics_wait("disk read", t0);
         send(sock, buf, n, 0);
+        t0 = metrics_now();
     }
     fclose(fp);
-    printf("Sent file: %s\n", full_path);
+    LOG_REQ("Sent file: %s\n", full_path);
+    return 0;
 }
 
 // Deletes a specified file from the server's file system and informs the client of the result.
@@ -191,76 +2025,1868 @@ void delete_file(int sock, const char *path) {
     char full_path[BUFSIZE];
     snprintf(full_path, sizeof(full_path), "%s/%s", home, path);
     // Attempt to delete the file.
-    if (remove(full_path) == 0) {
+    hot_drop(full_path);
+    if (pack_remove(full_path) == 0 || remove(full_path) == 0) {
+        mark_dirty(full_path);
         char *msg = "File removed.\n";
-        send(sock, msg, strlen(msg), 0);
+        reply_status(sock, 1, msg);
     } else {
         char *msg = "File not found.\n";
-        send(sock, msg, strlen(msg), 0);
+        reply_status(sock, 0, msg);
     }
 }
 
-// Packages all .zip files under the $HOME/S4 directory into a tar archive and sends it to the client.
-void send_tar(int sock) {
-    char *home = get_home_dir();
-    // Change directory to $HOME/S4 and create a tar archive of all .zip files found.
-    char cmd[BUFSIZE];
-    snprintf(cmd, sizeof(cmd), "cd %s/S4 && find . -type f -name \"*.zip\" | tar -cf /tmp/zip.tar -T -", home);
-    system(cmd);
-    
-    FILE *fp = fopen("/tmp/zip.tar", "rb");
-    if (!fp) {
-        // If tar file cannot be opened, indicate failure to the client by sending a zero file size.
-        long zero = 0;
-        send(sock, &zero, sizeof(long), 0);
+// mark_dirty: Bumps the namespace generation after a file under $HOME/S4 was
+// stored or removed, remembering the path so send_tar() can patch just that segment.
+void mark_dirty(const char *full_path) {
+    ns_generation++;
+    if (nreplicas > 0)
+        replog_append(full_path);
+    if (tar_dirty_count < TAR_DIRTY_MAX) {
+        strncpy(tar_dirty[tar_dirty_count], full_path, BUFSIZE);
+        tar_dirty[tar_dirty_count][BUFSIZE - 1] = '\0';
+        tar_dirty_count++;
+    } else {
+        tar_dirty_overflow = 1;
+    }
+}
+
+// replica_add: Registers a "host:port" replica given with --replica. Returns -1, after
+// saying why, if the address is unusable.
+int replica_add(const char *spec) {
+    struct replica *r = &replicas[nreplicas];
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    if (nreplicas == REPLICA_MAX || !colon || colon == spec || colon - spec >= (long)sizeof(host) ||
+        atoi(colon + 1) <= 0 || strlen(spec) >= sizeof(r->name)) {
+        printf("Bad or too many replicas: %s\n", spec);
+        return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        printf("Cannot resolve replica %s\n", host);
+        return -1;
+    }
+    memcpy(&r->addr, res->ai_addr, sizeof(r->addr));
+    freeaddrinfo(res);
+    r->addr.sin_port = htons(atoi(colon + 1));
+    strcpy(r->name, spec);
+    nreplicas++;
+    return 0;
+}
+
+// replog_init: Opens the replication log and each replica's saved position, then starts one
+// thread per replica. Changes logged before a restart are still delivered after it.
+void replog_init(void) {
+    char path[BUFSIZE], num[32];
+    snprintf(path, sizeof(path), "%s/S4", get_home_dir());
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/S4/.replog", get_home_dir());
+    replog_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (replog_fd < 0) {
+        perror("replication log");
+        exit(1);
+    }
+    replog_size = lseek(replog_fd, 0, SEEK_END);
+    for (int i = 0; i < nreplicas; i++) {
+        struct replica *r = &replicas[i];
+        snprintf(path, sizeof(path), "%s/S4/.replog.%s", get_home_dir(), r->name);
+        r->pos_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        ssize_t n = r->pos_fd < 0 ? -1 : pread(r->pos_fd, num, sizeof(num) - 1, 0);
+        num[n > 0 ? n : 0] = '\0';
+        r->pos = atol(num);
+        if (r->pos < 0 || r->pos > replog_size)
+            r->pos = 0;
+        LOG(LL_INFO, "Replicating to %s (%ld bytes of log pending)\n", r->name, replog_size - r->pos);
+        pthread_create(&r->tid, NULL, replica_run, r);
+    }
+}
+
+// replog_append: Logs that the object at full_path under $HOME/S4 was stored or removed, and
+// wakes the replication threads. Only the path is logged; its state is read when applied.
+void replog_append(const char *full_path) {
+    char rec[BUFSIZE + 8];
+    const char *home = get_home_dir();
+    size_t hl = strlen(home);
+    if (replog_fd < 0 || strncmp(full_path, home, hl) != 0 || full_path[hl] != '/')
+        return;
+    int n = snprintf(rec, sizeof(rec), "~%s\n", full_path + hl + 1);
+    if (n >= (int)sizeof(rec))
         return;
+    pthread_mutex_lock(&replog_lock);
+    if (write(replog_fd, rec, n) == n)
+        replog_size += n;
+    pthread_cond_broadcast(&replog_cond);
+    pthread_mutex_unlock(&replog_lock);
+}
+
+// replica_connect: Connects to the server at addr, over its AF_UNIX socket when it runs on
+// this host. Returns the socket, or -1 on failure.
+int replica_connect(const struct sockaddr_in *addr) {
+    int sock;
+    if ((ntohl(addr->sin_addr.s_addr) >> 24) == 127) {
+        struct sockaddr_un ua;
+        socklen_t len = local_addr(&ua, ntohs(addr->sin_port));
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&ua, len) == 0)
+            return sock;
+        if (sock >= 0)
+            close(sock);
     }
-    // Determine the tar archive file size.
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    // Send the archive size first.
-    send(sock, &fsize, sizeof(long), 0);
-    char buf[BUFSIZE];
-    int n;
-    // Send tar archive contents in chunks.
-    while ((n = fread(buf, 1, BUFSIZE, fp)) > 0) {
-        send(sock, buf, n, 0);
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock >= 0 && connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == 0)
+        return sock;
+    if (sock >= 0)
+        close(sock);
+    return -1;
+}
+
+// replica_apply: Brings path on replica r up to date with this server: the object is read
+// back through this server's own listener, so the storage engines are only ever touched by
+// the main loop, and is then uploaded to r, or removed from r if it is gone here. Applying
+// a record twice is harmless. Returns -1 if either server could not be reached, 0 otherwise.
+int replica_apply(struct replica *r, const char *path) {
+    char fields[FRAME_FIELDS_MAX], buf[64 * 1024];
+    struct frame f, g;
+    int rc = -1, len = frame_add(fields, 0, FIELD_PATH, path);
+    struct timeval tv = { 30, 0 };
+    struct sockaddr_in self;
+    memset(&self, 0, sizeof(self));
+    self.sin_family = AF_INET;
+    self.sin_port = htons(listen_port);
+    self.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int src = replica_connect(&self), dst = -1;
+    if (len < 0 || src < 0)
+        goto out;
+    setsockopt(src, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (frame_send(src, OP_DOWNLF, 0, 0, fields, len, 0) != 0 || frame_recv(src, &f) != 0)
+        goto out;
+    dst = replica_connect(&r->addr);
+    if (dst < 0)
+        goto out;
+    setsockopt(dst, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // Only a "not found" reply means the object is gone; other failures are retried.
+    char why[64] = "";
+    if (f.flags & FRAME_ERROR)
+        frame_get(&f, FIELD_TEXT, why, sizeof(why));
+    int gone = (f.flags & FRAME_ERROR) && strcmp(why, "File not found.\n") == 0;
+    if ((f.flags & FRAME_ERROR) && !gone) {
+        LOG(LL_WARN, "Cannot read %s back for replica %s: %s", path, r->name, why);
+        goto out;
     }
-    fclose(fp);
-    // Remove the temporary tar file.
-    remove("/tmp/zip.tar");
-    printf("Sent tar: zip.tar\n");
+    if (frame_send(dst, gone ? OP_REMOVEF : OP_UPLOADF, 0, 0, fields, len, gone ? 0 : f.payload_len) != 0)
+        goto out;
+    for (long left = gone ? 0 : f.payload_len; left > 0; ) {
+        ssize_t n = recv(src, buf, left < (long)sizeof(buf) ? left : (long)sizeof(buf), 0);
+        if (n <= 0 || send_all(dst, buf, n) != 0)
+            goto out;
+        left -= n;
+    }
+    if (frame_recv(dst, &g) != 0)
+        goto out;
+    // A remove of an object the replica never had also leaves the two in step.
+    if (!gone && (g.flags & FRAME_ERROR))
+        LOG(LL_ERROR, "Replica %s failed to store %s\n", r->name, path);
+    rc = 0;
+out:
+    if (src >= 0)
+        close(src);
+    if (dst >= 0)
+        close(dst);
+    return rc;
+}
+
+// replica_run: Replication thread for one replica. Applies log records in order, retrying a
+// record every second while the replica is down. Once every replica has applied the whole
+// log it is truncated.
+void *replica_run(void *arg) {
+    struct replica *r = arg;
+    char rec[BUFSIZE + 8], num[32];
+    while (1) {
+        pthread_mutex_lock(&replog_lock);
+        while (r->pos >= replog_size || replog_frozen)
+            pthread_cond_wait(&replog_cond, &replog_lock);
+        long pos = r->pos;
+        ssize_t n = pread(replog_fd, rec, sizeof(rec) - 1, pos);
+        pthread_mutex_unlock(&replog_lock);
+        rec[n > 0 ? n : 0] = '\0';
+        char *nl = strchr(rec, '\n');
+        if (!nl) {
+            sleep(1);   // The record is still being written.
+            continue;
+        }
+        *nl = '\0';
+        while (replica_apply(r, rec) != 0)
+            sleep(1);
+
+        pthread_mutex_lock(&replog_lock);
+        // A successor applies the record again from the saved position.
+        while (replog_frozen)
+            pthread_cond_wait(&replog_cond, &replog_lock);
+        r->pos = pos + (nl - rec) + 1;
+        int caught_up = 1;
+        for (int i = 0; i < nreplicas; i++)
+            caught_up &= replicas[i].pos == replog_size;
+        if (caught_up && ftruncate(replog_fd, 0) == 0) {
+            replog_size = 0;
+            for (int i = 0; i < nreplicas; i++)
+                replicas[i].pos = 0;
+        }
+        for (int i = 0; i < nreplicas; i++) {
+            if (replicas[i].pos_fd < 0)
+                continue;
+            snprintf(num, sizeof(num), "%-20ld\n", replicas[i].pos);
+            if (pwrite(replicas[i].pos_fd, num, strlen(num), 0) < 0)
+                perror("replica position");
+        }
+        pthread_mutex_unlock(&replog_lock);
+    }
+    return NULL;
+}
+
+// tar_fill_header: Builds a ustar header block for the given member name and file status.
+// Names longer than 100 characters are split into the prefix field. Returns -1 if the
+// name cannot be represented.
+int tar_fill_header(char *h, const char *name, const struct stat *st) {
+    size_t len = strlen(name);
+    memset(h, 0, TAR_BLOCK);
+    if (len <= 100) {
+        memcpy(h, name, len);
+    } else {
+        // Find the first '/' that leaves at most 100 characters for the name field.
+        const char *split = NULL;
+        for (const char *p = name; *p; p++) {
+            if (*p == '/' && len - (p - name) - 1 <= 100) {
+                split = p;
+                break;
+            }
+        }
+        if (!split || split - name > 155)
+            return -1;
+        memcpy(h + 345, name, split - name);
+        memcpy(h, split + 1, len - (split - name) - 1);
+    }
+    snprintf(h + 100, 8, "%07o", (unsigned)(st->st_mode & 07777));
+    snprintf(h + 108, 8, "%07o", (unsigned)st->st_uid & 07777777);
+    snprintf(h + 116, 8, "%07o", (unsigned)st->st_gid & 07777777);
+    if (st->st_size < 077777777777L) {
+        snprintf(h + 124, 12, "%011lo", (unsigned long)st->st_size);
+    } else {
+        // GNU base-256 encoding for members of 8 GiB and more.
+        unsigned long long v = st->st_size;
+        h[124] = (char)0x80;
+        for (int i = 11; i > 0; i--) {
+            h[124 + i] = (char)(v & 0xff);
+            v >>= 8;
+        }
+    }
+    snprintf(h + 136, 12, "%011lo", (unsigned long)st->st_mtime);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    // The checksum is computed with the checksum field itself set to spaces.
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+    return 0;
+}
+
+// tar_find: Binary search of the (path-sorted) index.
+// Returns the position of path, or -(insertion point) - 1 when it is not indexed.
+int tar_find(const char *path) {
+    int lo = 0, hi = tar_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(tar_index[mid].path, path);
+        if (c == 0)
+            return mid;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -lo - 1;
+}
+
+// tar_member: Fills in a segment for path if it is a regular .zip file under $HOME/S4.
+// Returns 0 on success, -1 if the path does not belong in the archive.
+int tar_member(struct tar_entry *e, const char *root, const char *path) {
+    struct stat st;
+    size_t rlen = strlen(root);
+    const char *ext = strrchr(path, '.');
+    if (strncmp(path, root, rlen) != 0 || path[rlen] != '/')
+        return -1;
+    if (!ext || strchr(ext, '/'))
+        return -1;
+    struct pack_entry *pe = pack_lookup(path);
+    if (pe) {
+        // Packed objects have no inode of their own; describe them from the pack index.
+        memset(&st, 0, sizeof(st));
+        st.st_mode = S_IFREG | 0644;
+        st.st_uid = getuid();
+        st.st_gid = getgid();
+        st.st_size = pe->len;
+        st.st_mtime = pe->mtime;
+    } else if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    // Member names are relative to $HOME/S4 and start with "./", as find(1) produced them.
+    char name[BUFSIZE];
+    snprintf(name, sizeof(name), ".%s", path + rlen);
+    if (tar_fill_header(e->header, name, &st) != 0)
+        return -1;
+    e->size = st.st_size;
+    return 0;
+}
+
+// tar_update: Regenerates the segment of a single changed path, inserting,
+// refreshing or dropping its index entry as needed.
+void tar_update(const char *root, const char *path) {
+    struct tar_entry e;
+    int pos = tar_find(path);
+    if (tar_member(&e, root, path) == 0) {
+        if (pos >= 0) {
+            tar_index[pos].size = e.size;
+            memcpy(tar_index[pos].header, e.header, TAR_BLOCK);
+            return;
+        }
+        pos = -pos - 1;
+        if (tar_count == tar_cap) {
+            tar_cap = tar_cap ? tar_cap * 2 : 64;
+            tar_index = realloc(tar_index, tar_cap * sizeof(struct tar_entry));
+        }
+        memmove(&tar_index[pos + 1], &tar_index[pos], (tar_count - pos) * sizeof(struct tar_entry));
+        e.path = strdup(path);
+        tar_index[pos] = e;
+        tar_count++;
+    } else if (pos >= 0) {
+        free(tar_index[pos].path);
+        memmove(&tar_index[pos], &tar_index[pos + 1], (tar_count - pos - 1) * sizeof(struct tar_entry));
+        tar_count--;
+    }
+}
+
+// tar_scan_dir: Recursively appends every .zip file below dir to the index (unsorted).
+void tar_scan_dir(const char *root, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char path[BUFSIZE];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            if (strcmp(entry->d_name, ".pack") != 0)
+                tar_scan_dir(root, path);
+            continue;
+        }
+        struct tar_entry e;
+        if (tar_member(&e, root, path) != 0)
+            continue;
+        if (tar_count == tar_cap) {
+            tar_cap = tar_cap ? tar_cap * 2 : 64;
+            tar_index = realloc(tar_index, tar_cap * sizeof(struct tar_entry));
+        }
+        e.path = strdup(path);
+        tar_index[tar_count++] = e;
+    }
+    closedir(d);
+}
+
+int tar_cmp(const void *a, const void *b) {
+    return strcmp(((const struct tar_entry *)a)->path, ((const struct tar_entry *)b)->path);
+}
+
+// tar_refresh: Brings the segment index up to date with the namespace generation.
+// Nothing is done if no file changed; otherwise only the dirty paths are re-examined,
+// falling back to a full rescan the first time or when too many files changed.
+void tar_refresh(void) {
+    if (tar_generation == ns_generation)
+        return;
+    char root[BUFSIZE];
+    snprintf(root, sizeof(root), "%s/S4", get_home_dir());
+    if (tar_generation == 0 || tar_dirty_overflow) {
+        for (int i = 0; i < tar_count; i++)
+            free(tar_index[i].path);
+        tar_count = 0;
+        tar_scan_dir(root, root);
+        for (int i = 0; i < pack_cap && pack_used > 0; i++) {
+            struct tar_entry e;
+            if (!pack_tab[i].path || tar_member(&e, root, pack_tab[i].path) != 0)
+                continue;
+            if (tar_count == tar_cap) {
+                tar_cap = tar_cap ? tar_cap * 2 : 64;
+                tar_index = realloc(tar_index, tar_cap * sizeof(struct tar_entry));
+            }
+            e.path = strdup(pack_tab[i].path);
+            tar_index[tar_count++] = e;
+        }
+        qsort(tar_index, tar_count, sizeof(struct tar_entry), tar_cmp);
+    } else {
+        for (int i = 0; i < tar_dirty_count; i++)
+            tar_update(root, tar_dirty[i]);
+    }
+    tar_dirty_count = 0;
+    tar_dirty_overflow = 0;
+    tar_generation = ns_generation;
+}
+
+// has_type: Returns 1 if path ends in the extension type, such as ".pdf".
+int has_type(const char *path, const char *type) {
+    const char *ext = strrchr(path, '.');
+    return ext && strcmp(ext, type) == 0;
+}
+
+// Streams a tar archive of all .zip files under the $HOME/S4 directory to the client,
+// built from the cached segment index rather than a temporary archive in /tmp.
+// Returns 1 if the archive was handed to a bulk worker.
+int send_tar(int sock, const char *type) {
+    struct bulk_job *job = calloc(1, sizeof(*job));
+    if (!job || tar_snapshot(job, type) != 0) {
+        if (job)
+            bulk_free(job);
+        reply_status(sock, 0, "Out of memory.\n");
+        return 0;
+    }
+    job->sock = sock;
+    // A large archive is streamed by a bulk worker.
+    if (bulk_ok(job->size)) {
+        bulk_submit(job);
+        return 1;
+    }
+    tar_stream(job);
+    bulk_free(job);
+    return 0;
+}
+
+// tar_snapshot: Fills job with the members of the archive of the given type as the index has
+// them now, and with the size of the archive. Returns -1 if out of memory.
+int tar_snapshot(struct bulk_job *job, const char *type) {
+    tar_refresh();
+    job->kind = BULK_TAR;
+    job->fd = -1;
+    job->generation = tar_generation;
+    snprintf(job->type, sizeof(job->type), "%s", type);
+    job->items = malloc((tar_count > 0 ? tar_count : 1) * sizeof(struct tar_item));
+    if (!job->items)
+        return -1;
+    // The archive size is known up front: a header block per member, the data
+    // padded to whole blocks, and two zero blocks marking the end of the archive.
+    for (int i = 0; i < tar_count; i++) {
+        if (!has_type(tar_index[i].path, type))
+            continue;
+        struct tar_item *it = &job->items[job->nitems];
+        it->e = tar_index[i];
+        if (!(it->e.path = strdup(tar_index[i].path)))
+            return -1;
+        // Packed members are read from their segment, which compaction leaves alone while
+        // bulk jobs are running.
+        struct pack_entry *pe = pack_lookup(it->e.path);
+        struct pack_seg *seg = pe && pe->len == it->e.size ? pack_seg_by_id(pe->seg) : NULL;
+        it->pack_fd = seg ? seg->fd : -1;
+        it->pack_off = seg ? pe->off : 0;
+        job->size += TAR_BLOCK + (it->e.size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        job->nitems++;
+    }
+    if (job->nitems > 0)
+        job->size += 2 * TAR_BLOCK;
+    return 0;
+}
+
+// tar_stream: Sends the archive described by job: its size, then each member's header and
+// data, padded to whole blocks, and the two zero blocks.
+void tar_stream(struct bulk_job *job) {
+    static const char zero_block[TAR_BLOCK];
+    char buf[QOS_QUANTUM];
+    int sock = job->sock;
+    reply_size(sock, job->size);
+    for (int i = 0; i < job->nitems; i++) {
+        struct tar_item *it = &job->items[i];
+        send_all(sock, it->e.header, TAR_BLOCK);
+        FILE *fp = NULL;
+        if (it->pack_fd < 0) {
+            long t0 = metrics_now();
+            fp = fopen(it->e.path, "rb");
+            metrics_wait("disk open", t0);
+        }
+        long left = it->e.size;
+        while (left > 0) {
+            int want = left < QOS_QUANTUM ? (int)left : QOS_QUANTUM;
+            qos_charge(want);
+            long t0 = metrics_now();
+            int n;
+            if (it->pack_fd >= 0)
+                n = pread(it->pack_fd, buf, want, it->pack_off + it->e.size - left);
+            else
+                n = fp ? (int)fread(buf, 1, want, fp) : 0;
+            metrics_wait("disk read", t0);
+            if (n <= 0) {
+                // The file shrank or vanished since it was indexed; zero-fill so
+                // the archive stays consistent with the size already announced.
+                memset(buf, 0, want);
+                n = want;
+            }
+            send_all(sock, buf, n);
+            left -= n;
+        }
+        if (fp)
+            fclose(fp);
+        long pad = (TAR_BLOCK - it->e.size % TAR_BLOCK) % TAR_BLOCK;
+        if (pad > 0)
+            send_all(sock, zero_block, pad);
+    }
+    if (job->nitems > 0) {
+        send_all(sock, zero_block, TAR_BLOCK);
+        send_all(sock, zero_block, TAR_BLOCK);
+    }
+
+    LOG_REQ("Sent %s tar archive: %d files (%ld bytes, generation %lu)\n", job->type, job->nitems, job->size, job->generation);
 }
 
 // Lists all files in a given directory under $HOME that have a .zip extension.
 // Sends the list of filenames (each separated by a newline) back to the client.
-void list_files(int sock, const char *dirpath) {
+void list_files(int sock, const char *dirpath, const char *type) {
     char *home = get_home_dir();
     // Construct the full directory path.
     char full_dir[BUFSIZE];
     snprintf(full_dir, sizeof(full_dir), "%s/%s", home, dirpath);
     DIR *dir = opendir(full_dir);
-    if (!dir) {
+    if (!dir && pack_used == 0) {
         // In case the directory does not exist, simply return.
+        reply_text(sock, "");
         return;
     }
     struct dirent *entry;
     char result[BUFSIZE] = "";
     // Iterate over all entries in the directory.
-    while ((entry = readdir(dir)) != NULL) {
+    while (dir && (entry = readdir(dir)) != NULL) {
         // Check if the entry is a regular file.
         if (entry->d_type == DT_REG) {
             // Look for files with a ".zip" extension.
             const char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".zip") == 0) {
+            if (ext && strcmp(ext, type) == 0) {
                 // Append the filename and a newline to the result.
-                strcat(result, entry->d_name);
-                strcat(result, "\n");
+                strncat(result, entry->d_name, BUFSIZE - strlen(result) - 1);
+                strncat(result, "\n", BUFSIZE - strlen(result) - 1);
             }
         }
     }
-    closedir(dir);
+    if (dir)
+        closedir(dir);
+
+    // Packed objects have no directory entry; add those stored directly in this directory.
+    size_t dlen = strlen(full_dir);
+    while (dlen > 0 && full_dir[dlen - 1] == '/')
+        dlen--;
+    for (int i = 0; i < pack_cap && pack_used > 0; i++) {
+        const char *p = pack_tab[i].path;
+        if (!p || strncmp(p, full_dir, dlen) != 0 || p[dlen] != '/' || strchr(p + dlen + 1, '/'))
+            continue;
+        const char *ext = strrchr(p, '.');
+        if (ext && strcmp(ext, type) == 0) {
+            strncat(result, p + dlen + 1, BUFSIZE - strlen(result) - 1);
+            strncat(result, "\n", BUFSIZE - strlen(result) - 1);
+        }
+    }
     // Send the list of filenames back to the client.
-    send(sock, result, strlen(result), 0);
+    reply_text(sock, result);
+}
+
+// list_all: Replies with every stored object of type, one path per line relative to
+// $HOME/S4 (e.g. "/docs/a.zip"). S1's rebalance tool uses it to walk a whole shard.
+void list_all(int sock, const char *type) {
+    char root[BUFSIZE];
+    snprintf(root, sizeof(root), "%s/S4", get_home_dir());
+    // The tar segment index already tracks every stored file, packed or not.
+    tar_refresh();
+    size_t rlen = strlen(root), len = 0, cap = 1;
+    for (int i = 0; i < tar_count; i++)
+        cap += strlen(tar_index[i].path) - rlen + 1;
+    char *result = malloc(cap);
+    if (!result) {
+        reply_status(sock, 0, "Out of memory.\n");
+        return;
+    }
+    for (int i = 0; i < tar_count; i++)
+        if (has_type(tar_index[i].path, type))
+            len += sprintf(result + len, "%s\n", tar_index[i].path + rlen);
+    result[len] = '\0';
+    reply_text(sock, result);
+    free(result);
+}
+
+// stat_file: Replies with the size and modification time of a stored object.
+void stat_file(int sock, const char *filepath) {
+    char full_path[BUFSIZE];
+    struct stat st;
+    struct pack_entry *pe;
+    snprintf(full_path, sizeof(full_path), "%s/%s", get_home_dir(), filepath);
+    if ((pe = pack_lookup(full_path)) != NULL)
+        reply_stat(sock, pe->len, pe->mtime);
+    else if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode))
+        reply_stat(sock, st.st_size, st.st_mtime);
+    else
+        reply_status(sock, 0, "File not found.\n");
+}
+
+// hot_init: Reads the mapped-bytes cap and sets up the pipe used for splicing.
+void hot_init(void) {
+    const char *max = getenv("DFS_MMAP_MAX");
+    if (max)
+        hot_max = atol(max);
+    if (hot_max <= 0)
+        return;
+    if (pipe2(hot_pipe, O_CLOEXEC) == 0)
+        fcntl(hot_pipe[1], F_SETPIPE_SZ, HOT_CHUNK);
+}
+
+// hot_unmap: Releases one cache slot.
+void hot_unmap(struct hot_map *m) {
+    munmap(m->addr, m->len);
+    hot_bytes -= m->len;
+    free(m->path);
+    m->path = NULL;
+}
+
+// hot_drop: Forgets the mapping of full_path; called before the file is rewritten or removed.
+void hot_drop(const char *full_path) {
+    for (int i = 0; i < HOT_SLOTS; i++)
+        if (hot[i].path && strcmp(hot[i].path, full_path) == 0)
+            hot_unmap(&hot[i]);
+}
+
+// hot_get: Returns the mapping for full_path, mapping the file now if it was served
+// recently. Returns NULL if the file should be read the normal way.
+struct hot_map *hot_get(const char *full_path) {
+    struct stat st;
+    if (hot_max <= 0)
+        return NULL;
+    hot_lookups++;
+    if (stat(full_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        hot_drop(full_path);
+        return NULL;
+    }
+    for (int i = 0; i < HOT_SLOTS; i++) {
+        struct hot_map *m = &hot[i];
+        if (!m->path || strcmp(m->path, full_path) != 0)
+            continue;
+        if (m->dev == st.st_dev && m->ino == st.st_ino && m->len == st.st_size &&
+            m->mtime == st.st_mtime) {
+            m->last_use = ++hot_clock;
+            hot_hits++;
+            return m;
+        }
+        // Changed behind our back: map it again below.
+        hot_unmap(m);
+        break;
+    }
+
+    // Only files that were served recently are worth mapping.
+    int seen = 0;
+    for (int i = 0; i < HOT_RECENT; i++)
+        if (hot_recent[i] && strcmp(hot_recent[i], full_path) == 0)
+            seen = 1;
+    if (!seen) {
+        free(hot_recent[hot_recent_pos]);
+        hot_recent[hot_recent_pos] = strdup(full_path);
+        hot_recent_pos = (hot_recent_pos + 1) % HOT_RECENT;
+        return NULL;
+    }
+    if (st.st_size == 0 || st.st_size > hot_max)
+        return NULL;
+
+    // Make room: evict least recently used mappings until the new one fits in a free slot.
+    struct hot_map *slot = NULL;
+    while (1) {
+        struct hot_map *lru = NULL;
+        slot = NULL;
+        for (int i = 0; i < HOT_SLOTS; i++) {
+            if (!hot[i].path)
+                slot = &hot[i];
+            else if (!lru || hot[i].last_use < lru->last_use)
+                lru = &hot[i];
+        }
+        if (slot && hot_bytes + st.st_size <= hot_max)
+            break;
+        LOG(LL_DEBUG, "Unmapping %s (%ld KB)\n", lru->path, lru->len / 1024);
+        hot_unmap(lru);
+    }
+
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    char *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    madvise(addr, st.st_size, MADV_WILLNEED);
+    slot->path = strdup(full_path);
+    slot->addr = addr;
+    slot->len = st.st_size;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtime;
+    slot->last_use = ++hot_clock;
+    hot_bytes += st.st_size;
+    return slot;
+}
+
+// hot_send: Sends the size and then the mapped data. Pages are passed to the socket by
+// reference through vmsplice()+splice(), so nothing is copied in user space; send() from
+// the mapping is the fallback. Each chunk is charged to the request's QoS class first.
+// Returns -1 if the connection failed, possibly after part of the reply was sent.
+int hot_send(int sock, const struct hot_map *m) {
+    long fsize = m->len;
+    if (reply_size(sock, fsize) != 0)
+        return -1;
+    long off = 0;
+    while (off < m->len) {
+        struct iovec iov = { m->addr + off, m->len - off < HOT_CHUNK ? m->len - off : HOT_CHUNK };
+        qos_charge(iov.iov_len);
+        ssize_t n = hot_pipe[1] >= 0 ? vmsplice(hot_pipe[1], &iov, 1, 0) : -1;
+        if (n <= 0)
+            return send_all(sock, m->addr + off, m->len - off);
+        off += n;
+        while (n > 0) {
+            ssize_t k = splice(hot_pipe[0], NULL, sock, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (k < 0 && errno == EINTR)
+                continue;
+            if (k <= 0) {
+                // The pipe still holds pages for this client; start over with a fresh one.
+                close(hot_pipe[0]);
+                close(hot_pipe[1]);
+                hot_pipe[0] = hot_pipe[1] = -1;
+                if (pipe2(hot_pipe, O_CLOEXEC) == 0)
+                    fcntl(hot_pipe[1], F_SETPIPE_SZ, HOT_CHUNK);
+                return -1;
+            }
+            n -= k;
+        }
+    }
+    return 0;
+}
+
+// bench_now: Monotonic time in seconds, used by io_bench().
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// io_bench: Compares the stdio and io_uring paths. For each engine it stores an mb-megabyte
+// object at $HOME/path through save_file() and streams it back through send_file(), using a
+// socketpair whose other end is fed/drained by a child process, and prints the throughput.
+// Set DFS_DIRECT_MIN to include O_DIRECT in the io_uring runs. A last "mmap" run stores the
+// object once and measures repeated reads served from the hot-file cache.
+void io_bench(const char *path, long mb, int iters) {
+    static char chunk[64 * 1024];
+    long fsize = mb * 1024 * 1024;
+    int have_uring = uring_ok;
+    long have_hot = hot_max;
+    for (int engine = 0; engine < 3; engine++) {
+        if (engine == 1 && !have_uring) {
+            printf("io_uring is not available on this kernel; skipped.\n");
+            continue;
+        }
+        if (engine == 2 && (have_hot < fsize || hot_pipe[0] < 0)) {
+            printf("mmap cache is disabled or smaller than the object; skipped.\n");
+            break;
+        }
+        uring_ok = engine == 1 || (engine == 2 && have_uring);
+        hot_max = engine == 2 ? have_hot : 0;
+        double wsec = 0, rsec = 0;
+        // The mmap run writes once and reads iters + 2 times; the first two reads, which
+        // record and map the file, are not timed.
+        for (int it = engine == 2 ? -2 : 0; it < iters; it++) {
+            int sv[2];
+            pid_t pid;
+            double t0;
+            if (engine == 2 && it > -2)
+                goto read;
+            socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+            pid = fork();
+            if (pid == 0) {
+                close(sv[0]);
+                for (long left = fsize; left > 0; left -= sizeof(chunk))
+                    send(sv[1], chunk, left < (long)sizeof(chunk) ? left : (long)sizeof(chunk), 0);
+                _exit(0);
+            }
+            close(sv[1]);
+            t0 = bench_now();
+            save_file(sv[0], path, fsize);
+            wsec += bench_now() - t0;
+            close(sv[0]);
+            waitpid(pid, NULL, 0);
+
+        read:
+            socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+            pid = fork();
+            if (pid == 0) {
+                close(sv[0]);
+                while (recv(sv[1], chunk, sizeof(chunk), 0) > 0)
+                    ;
+                _exit(0);
+            }
+            close(sv[1]);
+            t0 = bench_now();
+            send_file(sv[0], path);
+            close(sv[0]);
+            waitpid(pid, NULL, 0);
+            if (it >= 0)
+                rsec += bench_now() - t0;
+        }
+        if (engine == 2)
+            printf("%-8s write        -       read %8.1f MB/s   (%ld MB x %d)\n",
+                   "mmap", mb * iters / rsec, mb, iters);
+        else
+            printf("%-8s write %8.1f MB/s   read %8.1f MB/s   (%ld MB x %d)\n",
+                   engine ? "io_uring" : "stdio", mb * iters / wsec, mb * iters / rsec, mb, iters);
+    }
+    uring_ok = have_uring;
+    hot_max = have_hot;
+}
+
+// metrics_now: Microseconds on the monotonic clock.
+long metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// hist_record: Adds a value of us microseconds to histogram h. Values below HIST_SUB get a
+// bucket each; above that, each power of two is split into HIST_SUB equal buckets.
+void hist_record(struct hist *h, long us) {
+    unsigned long v = us < 0 ? 0 : us;
+    int i = v;
+    if (v >= HIST_SUB) {
+        int e = 63 - __builtin_clzl(v);
+        i = (e - 3) * HIST_SUB + ((v >> (e - 4)) & (HIST_SUB - 1));
+    }
+    if (i >= HIST_BUCKETS)
+        i = HIST_BUCKETS - 1;
+    __atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, v, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+// hist_quantile: The value, in microseconds, below which a fraction q of the values recorded
+// in h fall. It is reported as the middle of the bucket it lies in.
+double hist_quantile(const struct hist *h, double q) {
+    unsigned long n = h->count, seen = 0, rank = q * n + 0.5;
+    if (n == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen < rank)
+            continue;
+        if (i < HIST_SUB)
+            return i;
+        int shift = i / HIST_SUB - 1;
+        return ((double)(HIST_SUB + i % HIST_SUB) + 0.5) * (1L << shift);
+    }
+    return 0;
+}
+
+// metrics_begin: Starts measuring a request with the given opcode on this thread.
+void metrics_begin(int op) {
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.start = metrics_now();
+}
+
+// metrics_wait: Accounts the time since start, a metrics_now() reading, as a wait on
+// the disk by the current request, and traces it as a span named span.
+void metrics_wait(const char *span, long start) {
+    long now = metrics_now(), us = now - start;
+    if (metrics)
+        hist_record(&metrics->wait, us);
+    req.wait_us += us;
+    trace_span(span, start, now);
+}
+
+// metrics_end: Records the request started by metrics_begin(), if any, and writes out its
+// trace.
+void metrics_end(void) {
+    trace_end();
+    if (!metrics || req.op <= 0 || req.op > OP_STATS)
+        return;
+    long us = metrics_now() - req.start;
+    struct op_metrics *m = &metrics->op[req.op];
+    __atomic_fetch_add(&m->requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->errors, req.error, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->bytes_in, req.bytes_in, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->bytes_out, req.bytes_out, __ATOMIC_RELAXED);
+    hist_record(&m->latency, us);
+    hist_record(&metrics->rest, us > req.wait_us ? us - req.wait_us : 0);
+    req.op = 0;
+}
+
+// metrics_summary: Appends histogram h to out as a Prometheus summary with the p50, p99 and
+// p999 latencies in seconds. labels are the series' labels, without braces.
+int metrics_summary(char *out, int cap, int len, const char *name, const char *labels,
+                    const struct hist *h) {
+    static const double q[] = { 0.5, 0.99, 0.999 };
+    for (int i = 0; i < 3 && len < cap; i++)
+        len += snprintf(out + len, cap - len, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels, q[i],
+                        hist_quantile(h, q[i]) / 1e6);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "%s_sum{%s} %.6f\n%s_count{%s} %lu\n", name, labels,
+                        h->sum_us / 1e6, name, labels, h->count);
+    return len;
+}
+
+// metrics_format: Writes all metrics to out in the Prometheus text format. Returns the length.
+int metrics_format(char *out, int cap) {
+    static const char *counters[] = { "requests", "errors", "bytes_in", "bytes_out" };
+    char labels[64];
+    int len = 0;
+    out[0] = '\0';
+    if (!metrics)
+        return 0;
+    for (int c = 0; c < 4 && len < cap; c++) {
+        len += snprintf(out + len, cap - len, "# TYPE dfs_%s_total counter\n", counters[c]);
+        for (int op = 1; op <= OP_STATS && len < cap; op++) {
+            const struct op_metrics *m = &metrics->op[op];
+            unsigned long v[] = { m->requests, m->errors, m->bytes_in, m->bytes_out };
+            if (op != OP_REPLY)
+                len += snprintf(out + len, cap - len, "dfs_%s_total{server=\"S4\",op=\"%s\"} %lu\n",
+                                counters[c], op_names[op], v[c]);
+        }
+    }
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_request_seconds summary\n");
+    for (int op = 1; op <= OP_STATS && len < cap; op++) {
+        if (op == OP_REPLY || metrics->op[op].latency.count == 0)
+            continue;
+        snprintf(labels, sizeof(labels), "server=\"S4\",op=\"%s\"", op_names[op]);
+        len = metrics_summary(out, cap, len, "dfs_request_seconds", labels, &metrics->op[op].latency);
+    }
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_qos_waits_total counter\n"
+                        "dfs_qos_waits_total{server=\"S4\",class=\"interactive\"} %lu\n"
+                        "dfs_qos_waits_total{server=\"S4\",class=\"bulk\"} %lu\n",
+                        qos->waits[QOS_INTERACTIVE], qos->waits[QOS_BULK]);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_disk_seconds summary\n");
+    len = metrics_summary(out, cap, len, "dfs_disk_seconds", "server=\"S4\"", &metrics->wait);
+    if (len < cap)
+        len += snprintf(out + len, cap - len, "# TYPE dfs_network_seconds summary\n");
+    len = metrics_summary(out, cap, len, "dfs_network_seconds", "server=\"S4\"", &metrics->rest);
+    return len < cap ? len : cap - 1;
+}
+
+// metrics_dump: Writes the metrics to path, replacing it atomically.
+void metrics_dump(const char *path) {
+    char *text = malloc(STATS_MAX), tmp[BUFSIZE + 8];
+    if (!text)
+        return;
+    int len = metrics_format(text, STATS_MAX);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp && fwrite(text, 1, len, fp) == (size_t)len && fclose(fp) == 0)
+        rename(tmp, path);
+    else if (fp)
+        fclose(fp);
+    free(text);
+}
+
+// handle_stats: Answers a stats request with the current metrics.
+void handle_stats(int sock) {
+    char *text = malloc(STATS_MAX);
+    if (!text) {
+        reply_status(sock, 0, "Out of memory.\n");
+        return;
+    }
+    metrics_format(text, STATS_MAX);
+    reply_text(sock, text);
+    free(text);
+}
+
+// metrics_dump_run: Thread that writes the metrics to DFS_STATS_FILE every interval seconds.
+void *metrics_dump_run(void *arg) {
+    int interval = *(int *)arg;
+    while (1) {
+        sleep(interval);
+        metrics_dump(getenv("DFS_STATS_FILE"));
+    }
+    return NULL;
+}
+
+// log_init: Reads DFS_LOG_LEVEL and DFS_LOG_SAMPLE and arranges for lines still in the rings
+// to be written at exit and after fork().
+void log_init(void) {
+    static const char *names[] = { "error", "warn", "info", "debug" };
+    const char *level = getenv("DFS_LOG_LEVEL");
+    if (level) {
+        log_level = -1;   // "off", or anything unknown.
+        for (int i = 0; i < 4; i++)
+            if (strcmp(level, names[i]) == 0)
+                log_level = i;
+    }
+    if (getenv("DFS_LOG_SAMPLE") && atoi(getenv("DFS_LOG_SAMPLE")) > 0)
+        log_sample = atoi(getenv("DFS_LOG_SAMPLE"));
+    pthread_key_create(&log_key, log_release);
+    // What is still printed directly (startup, tools) keeps its place among the log lines.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    pthread_atfork(NULL, NULL, log_forked);
+    atexit(log_exit);
+}
+
+// log_forked: Runs in a new child process. The rings are the parent's to write out, and the
+// flusher thread did not survive the fork, so the child starts over with rings of its own.
+void log_forked(void) {
+    pthread_mutex_init(&log_lock, NULL);
+    pthread_mutex_init(&log_flush_lock, NULL);
+    log_rings = NULL;
+    log_mine = NULL;
+    log_flusher = 0;
+}
+
+// log_release: Thread exit hook that hands the thread's ring to the next thread needing one.
+void log_release(void *ring) {
+    __atomic_store_n(&((struct log_ring *)ring)->free, 1, __ATOMIC_RELEASE);
+}
+
+// log_attach: Gives the calling thread a ring, reusing one left by an exited thread, and
+// starts this process's flusher with the first ring. Returns NULL if out of memory.
+struct log_ring *log_attach(void) {
+    struct log_ring *r;
+    pthread_mutex_lock(&log_lock);
+    for (r = log_rings; r; r = r->next)
+        if (__atomic_load_n(&r->free, __ATOMIC_ACQUIRE)) {
+            r->free = 0;
+            break;
+        }
+    if (!r && (r = calloc(1, sizeof(*r)))) {
+        r->next = log_rings;
+        __atomic_store_n(&log_rings, r, __ATOMIC_RELEASE);
+    }
+    if (r && !log_flusher) {
+        pthread_t tid;
+        log_flusher = pthread_create(&tid, NULL, log_flush_run, NULL) == 0;
+        if (log_flusher)
+            pthread_detach(tid);
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (r)
+        pthread_setspecific(log_key, r);
+    return log_mine = r;
+}
+
+// log_write: Formats a line, prefixed with the time, level and process, into the calling
+// thread's ring. Use LOG() or LOG_REQ(), which skip the call for filtered lines.
+void log_write(int level, const char *fmt, ...) {
+    static const char *names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+    struct log_ring *r = log_mine ? log_mine : log_attach();
+    if (!r)
+        return;
+    unsigned long h = r->head;
+    if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    char *line = r->line[h % LOG_RING];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int n = snprintf(line, LOG_LINE, "%ld.%06ld %-5s S4[%d] ", (long)ts.tv_sec, ts.tv_nsec / 1000,
+                     names[level], (int)getpid());
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line + n, LOG_LINE - n, fmt, ap);
+    va_end(ap);
+    // Every line ends in exactly one newline, even when it was cut.
+    n = strlen(line);
+    if (n == LOG_LINE - 1)
+        n--;
+    while (n > 0 && line[n - 1] == '\n')
+        n--;
+    strcpy(line + n, "\n");
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+// log_request: Starts a new request, deciding whether its LOG_REQ() lines are kept.
+void log_request(void) {
+    log_this = log_sample == 1 || __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED) % log_sample == 0;
+}
+
+// log_flush: Writes out every line waiting in the rings, a batch at a time. Threads taking
+// a ring are never held up by it, even when stdout blocks. Unless wait is set, it gives up
+// at once if the flusher is busy writing.
+void log_flush(int wait) {
+    struct iovec iov[64];
+    char note[64];
+    if (wait)
+        pthread_mutex_lock(&log_flush_lock);
+    else if (pthread_mutex_trylock(&log_flush_lock) != 0)
+        return;
+    for (struct log_ring *r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long t = r->tail, h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (t < h) {
+            int n = 0;
+            for (; t < h && n < 64; n++, t++) {
+                iov[n].iov_base = r->line[t % LOG_RING];
+                iov[n].iov_len = strlen(r->line[t % LOG_RING]);
+            }
+            if (writev(STDOUT_FILENO, iov, n) < 0 && errno != EINTR)
+                t = h;   // stdout is gone; drop the lines rather than spin.
+            __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+        }
+        unsigned long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            int n = snprintf(note, sizeof(note), "(%lu log lines dropped)\n", dropped);
+            if (write(STDOUT_FILENO, note, n) < 0)
+                break;
+        }
+    }
+    pthread_mutex_unlock(&log_flush_lock);
+}
+
+// log_exit: Writes out what is left at exit, unless stdout is blocked.
+void log_exit(void) {
+    log_flush(0);
+}
+
+// log_flush_run: Body of the flusher thread.
+void *log_flush_run(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(LOG_FLUSH_US);
+        log_flush(1);
+    }
+    return NULL;
+}
+
+// trace_init: Opens DFS_TRACE_FILE, if it is set, to append trace events to.
+void trace_init(void) {
+    const char *path = getenv("DFS_TRACE_FILE");
+    if (!path)
+        return;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("S4: DFS_TRACE_FILE");
+        return;
+    }
+    // The array is left open: trace viewers accept a file without the closing bracket.
+    struct stat st;
+    if (fstat(trace_fd, &st) == 0 && st.st_size == 0 && write(trace_fd, "[\n", 2) != 2)
+        perror("S4: DFS_TRACE_FILE");
+}
+
+// trace_begin: Starts tracing the request in f if S1 sent it with a trace. The flow from S1
+// ends here, and the time since the connection was taken is its parse stage.
+void trace_begin(const struct frame *f) {
+    char ctx[48];
+    unsigned long flow;
+    trace.id = 0;
+    trace.nspans = 0;
+    if (trace_fd < 0 || frame_get(f, FIELD_TRACE, ctx, sizeof(ctx)) != 0 ||
+        sscanf(ctx, "%lx:%lx", &trace.id, &flow) != 2) {
+        trace.id = 0;
+        return;
+    }
+    trace.span[trace.nspans++] = (struct span){ "backend", 'f', trace_arrived, 0, 0, 1, flow };
+    trace_span("parse", trace_arrived, metrics_now());
+}
+
+// trace_span: Records that stage name of the traced request, if any, ran from start to end,
+// both metrics_now() readings.
+void trace_span(const char *name, long start, long end) {
+    if (!trace.id)
+        return;
+    for (int i = trace.nspans - 1; i >= 0; i--) {
+        struct span *s = &trace.span[i];
+        if (s->name == name && s->ph == 'X') {
+            s->end = end;
+            s->busy_us += end - start;
+            s->calls++;
+            return;
+        }
+    }
+    if (trace.nspans < TRACE_SPANS)
+        trace.span[trace.nspans++] = (struct span){ name, 'X', start, end, end - start, 1, 0 };
+}
+
+// trace_end: Appends the traced request, if any, and its spans to the trace file.
+void trace_end(void) {
+    char buf[(TRACE_SPANS + 2) * TRACE_EVENT];
+    int len = 0, pid = getpid(), tid = gettid();
+    if (!trace.id)
+        return;
+    if (trace_pid != pid) {
+        // Each process names itself once, so the viewer labels its rows.
+        trace_pid = pid;
+        len += snprintf(buf, TRACE_EVENT, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                        "\"tid\":%d,\"args\":{\"name\":\"S4\"}},\n", pid, tid);
+    }
+    long now = metrics_now();
+    len += snprintf(buf + len, TRACE_EVENT, "{\"name\":\"%s\",\"cat\":\"dfs\",\"ph\":\"X\",\"ts\":%ld,"
+                    "\"dur\":%ld,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":\"%016lx\",\"req\":%u,"
+                    "\"error\":%d}},\n", req.op > 0 && req.op <= OP_STATS ? op_names[req.op] : "request",
+                    trace_arrived, now - trace_arrived, pid, tid, trace.id, frame_req_id, req.error);
+    for (int i = 0; i < trace.nspans; i++) {
+        const struct span *s = &trace.span[i];
+        if (s->ph == 'X')
+            len += snprintf(buf + len, TRACE_EVENT, "{\"name\":\"%s\",\"cat\":\"dfs\",\"ph\":\"X\","
+                            "\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d,\"args\":{\"trace\":"
+                            "\"%016lx\",\"calls\":%d,\"busy_us\":%ld}},\n", s->name, s->start,
+                            s->end - s->start, pid, tid, trace.id, s->calls, s->busy_us);
+        else
+            len += snprintf(buf + len, TRACE_EVENT, "{\"name\":\"%s\",\"cat\":\"dfs\",\"ph\":\"%c\","
+                            "\"id\":\"%lx\",\"ts\":%ld,\"pid\":%d,\"tid\":%d%s},\n", s->name, s->ph,
+                            s->flow, s->start, pid, tid, s->ph == 'f' ? ",\"bp\":\"e\"" : "");
+    }
+    trace.id = 0;
+    if (write(trace_fd, buf, len) < 0)
+        LOG(LL_WARN, "Trace write failed: %s\n", strerror(errno));
+}
+
+// qos_init: Reads the scheduling settings and starts the bulk workers. Without workers,
+// bulk requests are served on the main thread like any other.
+void qos_init(void) {
+    int workers = QOS_BULK_WORKERS, started = 0;
+    if (getenv("DFS_QOS_BULK_MIN") && atol(getenv("DFS_QOS_BULK_MIN")) > 0)
+        qos_bulk_min = atol(getenv("DFS_QOS_BULK_MIN"));
+    if (getenv("DFS_QOS_WEIGHT") && atoi(getenv("DFS_QOS_WEIGHT")) > 0)
+        qos_weight = atoi(getenv("DFS_QOS_WEIGHT"));
+    if (getenv("DFS_BULK_WORKERS"))
+        workers = atoi(getenv("DFS_BULK_WORKERS"));
+    if (workers <= 0 || pipe2(bulk_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        return;
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, bulk_run, NULL) == 0) {
+            pthread_detach(tid);
+            started++;
+        }
+    }
+    if (started == 0) {
+        close(bulk_pipe[0]);
+        close(bulk_pipe[1]);
+        bulk_pipe[0] = bulk_pipe[1] = -1;
+    }
+}
+
+// qos_share: The weight of class cls.
+double qos_share(int cls) {
+    return cls == QOS_INTERACTIVE ? qos_weight : 1;
+}
+
+// qos_ahead: Whether class cls is more than a quantum of another busy class's share ahead of
+// it. Called with the lock held.
+int qos_ahead(int cls) {
+    for (int c = 0; c < QOS_CLASSES; c++)
+        if (c != cls && qos->active[c] > 0 && qos->vtime[cls] - qos->vtime[c] > QOS_QUANTUM / qos_share(c))
+            return 1;
+    return 0;
+}
+
+// qos_begin: Marks a request of class cls as in progress on this thread. A class that was
+// idle rejoins at the virtual time of a busy one, so it cannot bank the time it was idle.
+void qos_begin(int cls) {
+    pthread_mutex_lock(&qos->lock);
+    if (qos->active[cls]++ == 0)
+        for (int c = 0; c < QOS_CLASSES; c++)
+            if (qos->active[c] > 0 && qos->vtime[c] > qos->vtime[cls])
+                qos->vtime[cls] = qos->vtime[c];
+    pthread_mutex_unlock(&qos->lock);
+    qos_class = cls;
+}
+
+// qos_charge: Accounts bytes that this thread's request is about to move. While its class is
+// ahead of another busy class it waits for that one to catch up or go idle, but for no more
+// than QOS_WAIT_MAX_MS, so neither class is ever starved.
+void qos_charge(long bytes) {
+    int cls = qos_class;
+    if (cls < 0)
+        return;
+    pthread_mutex_lock(&qos->lock);
+    if (qos_ahead(cls)) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += QOS_WAIT_MAX_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        qos->waits[cls]++;
+        while (qos_ahead(cls) && pthread_cond_timedwait(&qos->cond, &qos->lock, &until) != ETIMEDOUT)
+            ;
+    }
+    qos->vtime[cls] += bytes / qos_share(cls);
+    pthread_mutex_unlock(&qos->lock);
+}
+
+// qos_end: Ends this thread's request for the scheduler, charging it its quantum, and wakes
+// the transfers held back for it.
+void qos_end(void) {
+    if (qos_class < 0)
+        return;
+    pthread_mutex_lock(&qos->lock);
+    qos->active[qos_class]--;
+    qos->vtime[qos_class] += QOS_QUANTUM / qos_share(qos_class);
+    pthread_cond_broadcast(&qos->cond);
+    pthread_mutex_unlock(&qos->lock);
+    qos_class = -1;
+}
+
+// serve_client: Serves one connection as an interactive request. A request that turns out to
+// be bulk is handed to a worker with its connection, and finished by bulk_finish().
+void serve_client(int sock) {
+    qos_begin(QOS_INTERACTIVE);
+    int handed_off = handle_client(sock);
+    qos_end();
+    if (!handed_off) {
+        metrics_end();
+        close(sock);
+    }
+}
+
+// bulk_ok: Whether a request moving size bytes goes to the bulk workers. Items of a batch
+// are always answered in line, on the batch's own connection.
+int bulk_ok(long size) {
+    return bulk_pipe[1] >= 0 && !batch_path && size >= qos_bulk_min;
+}
+
+// bulk_upload: Hands an upload of fsize bytes to full_path to a bulk worker if it is large
+// enough. Returns 0 if it was handed off, -1 if the caller stores it.
+int bulk_upload(int sock, const char *full_path, long fsize) {
+    static unsigned long seq;
+    if (!bulk_ok(fsize))
+        return -1;
+    struct bulk_job *job = calloc(1, sizeof(*job));
+    if (!job)
+        return -1;
+    job->kind = BULK_UPLOAD;
+    job->sock = sock;
+    job->fd = -1;
+    job->size = fsize;
+    snprintf(job->path, sizeof(job->path), "%s", full_path);
+    snprintf(job->tmp, sizeof(job->tmp), "%s.%lu.part", full_path, ++seq);
+    bulk_submit(job);
+    return 0;
+}
+
+// bulk_download: Hands the download of full_path to a bulk worker if it is large enough.
+// Returns 0 if it was handed off, -1 if the caller serves it.
+int bulk_download(int sock, const char *full_path) {
+    struct stat st;
+    if (bulk_pipe[1] < 0 || stat(full_path, &st) != 0 || !S_ISREG(st.st_mode) || !bulk_ok(st.st_size))
+        return -1;
+    struct bulk_job *job = calloc(1, sizeof(*job));
+    if (!job)
+        return -1;
+    long t0 = metrics_now();
+    job->fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    metrics_wait("disk open", t0);
+    if (job->fd < 0 || fstat(job->fd, &st) != 0) {
+        if (job->fd >= 0)
+            close(job->fd);
+        free(job);
+        return -1;
+    }
+    job->kind = BULK_DOWNLOAD;
+    job->sock = sock;
+    job->size = st.st_size;
+    snprintf(job->path, sizeof(job->path), "%s", full_path);
+    bulk_submit(job);
+    return 0;
+}
+
+// bulk_submit: Queues job for the bulk workers with this thread's request state, which the
+// main thread gives up: the worker now owns the request and its connection.
+void bulk_submit(struct bulk_job *job) {
+    job->framed = framed;
+    job->req_id = frame_req_id;
+    job->log_this = log_this;
+    job->arrived = trace_arrived;
+    job->req = req;
+    job->trace = trace;
+    req.op = 0;
+    trace.id = 0;
+    bulk_active++;
+    pthread_mutex_lock(&bulk_lock);
+    job->next = NULL;
+    *bulk_tail = job;
+    bulk_tail = &job->next;
+    pthread_cond_signal(&bulk_cond);
+    pthread_mutex_unlock(&bulk_lock);
+}
+
+// bulk_run: Bulk worker thread. Takes jobs in order, moves their data as the bulk class and
+// hands them back to the main thread through bulk_pipe.
+void *bulk_run(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&bulk_lock);
+        while (!bulk_queue)
+            pthread_cond_wait(&bulk_cond, &bulk_lock);
+        struct bulk_job *job = bulk_queue;
+        bulk_queue = job->next;
+        if (!bulk_queue)
+            bulk_tail = &bulk_queue;
+        pthread_mutex_unlock(&bulk_lock);
+
+        framed = job->framed;
+        frame_req_id = job->req_id;
+        log_this = job->log_this;
+        trace_arrived = job->arrived;
+        req = job->req;
+        trace = job->trace;
+        qos_begin(QOS_BULK);
+        if (job->kind == BULK_UPLOAD)
+            job->rc = bulk_save(job);
+        else if (job->kind == BULK_DOWNLOAD)
+            bulk_send(job);
+        else
+            tar_stream(job);
+        qos_end();
+        job->req = req;
+        job->trace = trace;
+        trace.id = 0;
+
+        pthread_mutex_lock(&bulk_lock);
+        job->next = bulk_done;
+        bulk_done = job;
+        pthread_mutex_unlock(&bulk_lock);
+        if (write(bulk_pipe[1], "", 1) < 0 && errno != EAGAIN)
+            LOG(LL_WARN, "Bulk worker could not wake the main loop: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+// bulk_save: Receives the job->size bytes of an upload into job->tmp, a quantum at a time.
+// Returns 0 once all of it is written.
+int bulk_save(struct bulk_job *job) {
+    char buf[QOS_QUANTUM];
+    long t0 = metrics_now();
+    int fd = open(job->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    metrics_wait("disk open", t0);
+    int err = fd < 0;
+    long received = 0;
+    while (received < job->size) {
+        long want = job->size - received < QOS_QUANTUM ? job->size - received : QOS_QUANTUM;
+        qos_charge(want);
+        if (recv_all(job->sock, buf, want) != 0)
+            break;
+        // After a failed write the rest is still read, to keep the connection in step.
+        t0 = metrics_now();
+        if (!err && write(fd, buf, want) != want)
+            err = 1;
+        metrics_wait("disk write", t0);
+        received += want;
+    }
+    if (fd >= 0)
+        close(fd);
+    return err || received < job->size ? -1 : 0;
+}
+
+// bulk_send: Sends the object open as job->fd: its size, then the data a quantum at a time
+// with sendfile(), straight from the page cache.
+void bulk_send(struct bulk_job *job) {
+    off_t off = 0;
+    if (reply_size(job->sock, job->size) != 0)
+        return;
+    while (off < job->size) {
+        long want = job->size - off < QOS_QUANTUM ? job->size - off : QOS_QUANTUM;
+        qos_charge(want);
+        ssize_t n = sendfile(job->sock, job->fd, &off, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+    }
+    if (off < job->size)
+        req.error = 1;
+    LOG_REQ("Sent file (bulk): %s\n", job->path);
+}
+
+// bulk_finish: Completes the jobs the workers are done with, on the main thread. A finished
+// upload is put in place and answered; every request is then recorded and its connection
+// closed.
+void bulk_finish(void) {
+    char drain[64];
+    while (read(bulk_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&bulk_lock);
+    struct bulk_job *done = bulk_done;
+    bulk_done = NULL;
+    pthread_mutex_unlock(&bulk_lock);
+    while (done) {
+        struct bulk_job *job = done;
+        done = job->next;
+        framed = job->framed;
+        frame_req_id = job->req_id;
+        log_this = job->log_this;
+        trace_arrived = job->arrived;
+        req = job->req;
+        trace = job->trace;
+        // While draining, the successor owns the store and puts finished uploads in place.
+        if (job->kind == BULK_UPLOAD && !(draining && job->rc == 0 && upgrade_pass(job) == 0))
+            bulk_store(job->sock, job->rc, job->tmp, job->path);
+        metrics_end();
+        close(job->sock);
+        bulk_free(job);
+        bulk_active--;
+    }
+}
+
+// bulk_store: Puts a finished upload received into tmp in place at path and answers it, or
+// drops it if rc is not 0.
+void bulk_store(int sock, int rc, const char *tmp, const char *path) {
+    hot_drop(path);
+    if (rc == 0 && rename(tmp, path) == 0) {
+        // Larger objects are stored as regular files; forget any packed earlier version.
+        pack_remove(path);
+        mark_dirty(path);
+        LOG_REQ("Stored ZIP (bulk): %s\n", path);
+        if (framed)
+            reply_status(sock, 1, "File stored.\n");
+    } else {
+        unlink(tmp);
+        req.error = 1;
+        if (framed)
+            reply_status(sock, 0, "Failed to store file.\n");
+    }
+}
+
+// bulk_free: Releases a job and what it holds.
+void bulk_free(struct bulk_job *job) {
+    if (job->kind == BULK_DOWNLOAD && job->fd >= 0)
+        close(job->fd);
+    for (int i = 0; i < job->nitems; i++)
+        free(job->items[i].e.path);
+    free(job->items);
+    free(job);
+}
+
+// on_sigusr2: Asks the main loop to hand the server over to a new instance.
+void on_sigusr2(int sig) {
+    (void)sig;
+    upgrade_requested = 1;
+}
+
+// upgrade_inherit: Takes over the listeners of the server this one was started to replace, if
+// any: DFS_UPGRADE then holds "<tcp>,<unix>,<peer>". Returns the TCP listener and sets
+// *local_sock, or returns -1 if the listeners are to be opened afresh.
+int upgrade_inherit(int *local_sock) {
+    const char *env = getenv("DFS_UPGRADE");
+    int tcp, local, peer;
+    if (!env || sscanf(env, "%d,%d,%d", &tcp, &local, &peer) != 3)
+        return -1;
+    unsetenv("DFS_UPGRADE");
+    if (local >= 0)
+        fcntl(local, F_SETFD, FD_CLOEXEC);
+    fcntl(peer, F_SETFD, FD_CLOEXEC);
+    *local_sock = local;
+    upgrade_peer = peer;
+    LOG(LL_INFO, "Taking over from the server with pid %d\n", getppid());
+    return tcp;
+}
+
+// upgrade_start: Writes the snapshot and starts the successor with the listeners. Returns 0
+// once it is ready to accept, or -1 if it could not be started, in which case this server
+// carries on as before.
+int upgrade_start(int server_sock, int local_sock) {
+    int sv[2] = { -1, -1 };
+    char env[64], ok;
+    pid_t pid = -1;
+
+    // Replication stops where it is; the successor goes on from the saved positions.
+    pthread_mutex_lock(&replog_lock);
+    replog_frozen = 1;
+    pthread_mutex_unlock(&replog_lock);
+    if (snapshot_write() == 0 && socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == 0) {
+        snprintf(env, sizeof(env), "%d,%d,%d", server_sock, local_sock, sv[1]);
+        log_flush(1);
+        if ((pid = fork()) == 0) {
+            // Only the listeners and the peer socket are kept across the exec.
+            fcntl(server_sock, F_SETFD, 0);
+            if (local_sock >= 0)
+                fcntl(local_sock, F_SETFD, 0);
+            fcntl(sv[1], F_SETFD, 0);
+            setenv("DFS_UPGRADE", env, 1);
+            execvp(upgrade_argv[0], upgrade_argv);
+            _exit(127);
+        }
+        close(sv[1]);
+    }
+    if (pid > 0) {
+        struct pollfd pfd = { sv[0], POLLIN, 0 };
+        int n;
+        while ((n = poll(&pfd, 1, UPGRADE_WAIT_MS)) < 0 && errno == EINTR)
+            ;
+        if (n == 1 && recv(sv[0], &ok, 1, 0) == 1) {
+            upgrade_peer = sv[0];
+            LOG(LL_INFO, "Handed over to pid %d, draining %d bulk jobs\n", pid, bulk_active);
+            return 0;
+        }
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    LOG(LL_ERROR, "Upgrade failed, carrying on: %s\n", pid > 0 ? "the new server did not start" : strerror(errno));
+    if (sv[0] >= 0)
+        close(sv[0]);
+    char path[BUFSIZE];
+    snprintf(path, sizeof(path), "%s/S4/.snapshot", get_home_dir());
+    unlink(path);
+    pthread_mutex_lock(&replog_lock);
+    replog_frozen = 0;
+    pthread_cond_broadcast(&replog_cond);
+    pthread_mutex_unlock(&replog_lock);
+    return -1;
+}
+
+// upgrade_drain: Stops accepting, waits for the bulk jobs still running and exits.
+void upgrade_drain(int server_sock, int local_sock) {
+    close(server_sock);
+    if (local_sock >= 0)
+        close(local_sock);
+    draining = 1;
+    while (bulk_active > 0) {
+        struct pollfd pfd = { bulk_pipe[0], POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == 1)
+            bulk_finish();
+    }
+    LOG(LL_INFO, "Drained, exiting\n");
+    exit(0);
+}
+
+// upgrade_pass: Passes a finished upload and its connection to the successor, which puts it in
+// place and answers it. Returns -1 if it could not be sent.
+int upgrade_pass(const struct bulk_job *job) {
+    struct handover h;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    memset(&h, 0, sizeof(h));
+    h.framed = framed;
+    h.log_this = log_this;
+    h.req_id = frame_req_id;
+    snprintf(h.tmp, sizeof(h.tmp), "%s", job->tmp);
+    snprintf(h.path, sizeof(h.path), "%s", job->path);
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &job->sock, sizeof(int));
+    return sendmsg(upgrade_peer, &msg, 0) == sizeof(h) ? 0 : -1;
+}
+
+// upgrade_receive: Stores an upload the predecessor finished while draining and answers it.
+// Once the predecessor has exited its socket is closed.
+void upgrade_receive(void) {
+    struct handover h;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t n = recvmsg(upgrade_peer, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    int sock = -1;
+    if (n > 0 && cm && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&sock, CMSG_DATA(cm), sizeof(int));
+    if (n <= 0) {
+        LOG(LL_INFO, "The old server has exited\n");
+        close(upgrade_peer);
+        upgrade_peer = -1;
+        return;
+    }
+    if (n != sizeof(h) || sock < 0) {
+        if (sock >= 0)
+            close(sock);
+        return;
+    }
+    framed = h.framed;
+    log_this = h.log_this;
+    frame_req_id = h.req_id;
+    bulk_store(sock, 0, h.tmp, h.path);
+    close(sock);
+}
+
+// snapshot_put: Writes one string to a snapshot, preceded by its length.
+static void snapshot_put(FILE *f, const char *s) {
+    uint16_t len = strlen(s);
+    fwrite(&len, sizeof(len), 1, f);
+    fwrite(s, 1, len, f);
+}
+
+// snapshot_get: Reads a string written by snapshot_put() into buf. Returns -1 at a short read.
+static int snapshot_get(FILE *f, char *buf) {
+    uint16_t len;
+    if (fread(&len, sizeof(len), 1, f) != 1 || len >= BUFSIZE || fread(buf, 1, len, f) != len)
+        return -1;
+    buf[len] = '\0';
+    return 0;
+}
+
+// snapshot_write: Writes the pack index with its segments' sizes, the tar index and the paths
+// served recently to $HOME/S4/.snapshot. Returns -1 if it could not be written.
+int snapshot_write(void) {
+    char path[BUFSIZE], tmp[BUFSIZE + 8];
+    snprintf(path, sizeof(path), "%s/S4", get_home_dir());
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/S4/.snapshot", get_home_dir());
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    uint32_t head[2] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION };
+    fwrite(head, sizeof(head), 1, f);
+    fwrite(&pack_nsegs, sizeof(int), 1, f);
+    for (int i = 0; i < pack_nsegs; i++) {
+        fwrite(&pack_segs[i].id, sizeof(int), 1, f);
+        fwrite(&pack_segs[i].size, sizeof(long), 1, f);
+        fwrite(&pack_segs[i].dead, sizeof(long), 1, f);
+    }
+    fwrite(&pack_used, sizeof(int), 1, f);
+    for (int i = 0; i < pack_cap; i++) {
+        const struct pack_entry *e = &pack_tab[i];
+        if (!e->path)
+            continue;
+        snapshot_put(f, e->path);
+        fwrite(&e->seg, sizeof(int), 1, f);
+        fwrite(&e->off, sizeof(long), 1, f);
+        fwrite(&e->len, sizeof(long), 1, f);
+        fwrite(&e->rec_len, sizeof(long), 1, f);
+        fwrite(&e->mtime, sizeof(time_t), 1, f);
+    }
+    // A tar index that was never built is left to be built on demand; -1 says so.
+    if (tar_generation != 0)
+        tar_refresh();
+    int ntar = tar_generation != 0 ? tar_count : -1;
+    fwrite(&ntar, sizeof(int), 1, f);
+    for (int i = 0; i < ntar; i++) {
+        snapshot_put(f, tar_index[i].path);
+        fwrite(&tar_index[i].size, sizeof(long), 1, f);
+        fwrite(tar_index[i].header, TAR_BLOCK, 1, f);
+    }
+    int nhot = 0;
+    for (int i = 0; i < HOT_RECENT; i++)
+        nhot += hot_recent[i] != NULL;
+    fwrite(&nhot, sizeof(int), 1, f);
+    for (int i = 0; i < HOT_RECENT; i++)
+        if (hot_recent[i])
+            snapshot_put(f, hot_recent[i]);
+    int err = ferror(f);
+    if (fclose(f) != 0 || err || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// snapshot_load: Loads the snapshot left by the server this one replaces. The pack index is
+// only taken if every segment still has the size it had then. Recently served paths become
+// recent here too, so their next download is mapped at once. Returns -1 if there is no
+// usable snapshot.
+int snapshot_load(void) {
+    char path[BUFSIZE], buf[BUFSIZE];
+    if (!getenv("DFS_UPGRADE"))
+        return -1;
+    snprintf(path, sizeof(path), "%s/S4/.snapshot", get_home_dir());
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    unlink(path);
+    uint32_t head[2];
+    int n, ok = 0;
+    if (fread(head, sizeof(head), 1, f) != 1 || head[0] != SNAPSHOT_MAGIC || head[1] != SNAPSHOT_VERSION ||
+        fread(&n, sizeof(int), 1, f) != 1 || n != pack_nsegs)
+        goto out;
+    for (int i = 0; i < n; i++) {
+        int id;
+        long size, dead;
+        if (fread(&id, sizeof(int), 1, f) != 1 || fread(&size, sizeof(long), 1, f) != 1 ||
+            fread(&dead, sizeof(long), 1, f) != 1)
+            goto out;
+        struct pack_seg *s = pack_seg_by_id(id);
+        if (!s || s->size != size)
+            goto out;
+        s->dead = dead;
+    }
+    if (fread(&n, sizeof(int), 1, f) != 1)
+        goto out;
+    for (int i = 0; i < n; i++) {
+        struct pack_entry e;
+        if (snapshot_get(f, buf) != 0 || fread(&e.seg, sizeof(int), 1, f) != 1 ||
+            fread(&e.off, sizeof(long), 1, f) != 1 || fread(&e.len, sizeof(long), 1, f) != 1 ||
+            fread(&e.rec_len, sizeof(long), 1, f) != 1 || fread(&e.mtime, sizeof(time_t), 1, f) != 1)
+            goto out;
+        e.path = buf;
+        pack_insert(&e);
+    }
+    if (fread(&n, sizeof(int), 1, f) != 1)
+        goto out;
+    for (int i = 0; i < n; i++) {
+        struct tar_entry e;
+        if (snapshot_get(f, buf) != 0 || fread(&e.size, sizeof(long), 1, f) != 1 ||
+            fread(e.header, TAR_BLOCK, 1, f) != 1)
+            goto out;
+        if (tar_count == tar_cap) {
+            tar_cap = tar_cap ? tar_cap * 2 : 64;
+            tar_index = realloc(tar_index, tar_cap * sizeof(struct tar_entry));
+        }
+        e.path = strdup(buf);
+        tar_index[tar_count++] = e;
+    }
+    if (n >= 0)
+        tar_generation = ns_generation;
+    if (fread(&n, sizeof(int), 1, f) != 1)
+        goto out;
+    for (int i = 0; i < n && i < HOT_RECENT; i++) {
+        if (snapshot_get(f, buf) != 0)
+            goto out;
+        hot_recent[i] = strdup(buf);
+    }
+    ok = 1;
+    LOG(LL_INFO, "Loaded the snapshot: %d packed objects, %d archive members\n", pack_used,
+        tar_count);
+out:
+    fclose(f);
+    if (!ok)
+        snapshot_reset();
+    return ok ? 0 : -1;
+}
+
+// snapshot_reset: Drops whatever a snapshot that turned out to be unusable had loaded.
+void snapshot_reset(void) {
+    for (int i = 0; i < pack_cap; i++)
+        free(pack_tab[i].path);
+    free(pack_tab);
+    pack_tab = NULL;
+    pack_cap = pack_used = 0;
+    for (int i = 0; i < pack_nsegs; i++)
+        pack_segs[i].dead = 0;
+    for (int i = 0; i < tar_count; i++)
+        free(tar_index[i].path);
+    tar_count = 0;
+    tar_generation = 0;
+    for (int i = 0; i < HOT_RECENT; i++) {
+        free(hot_recent[i]);
+        hot_recent[i] = NULL;
+    }
+    hot_recent_pos = 0;
 }
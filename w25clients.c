@@ -7,42 +7,138 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+#include <pthread.h>
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 7010
 #define BUFSIZE 1024
 #define MAX_RETRIES 3  // Maximum number of connection attempts
+#define PIPELINE_MAX 32   // Requests sent ahead of their replies when reading a script.
 
-// Function prototypes for file transmission operations.
-void send_file(int sock, const char *filename);
-void receive_file(int sock, const char *filename);
+// Binary framing. A framed message is a frame_hdr in network byte order, fields_len bytes
+// of typed fields (type byte, 16-bit length, value), then payload_len bytes of raw data
+// such as file contents. Connections that do not start with FRAME_MAGIC are served with
+// the old text commands.
+#define FRAME_MAGIC 0x44465331u     // "DFS1"
+#define FRAME_VERSION 1
+#define FRAME_FIELDS_MAX 2048       // Largest field area accepted in one message.
+#define FRAME_ERROR 0x01            // Reply flag: the request failed, FIELD_TEXT says why.
+#define FRAME_BATCH 0x02            // Request flag: the payload lists one path per line.
+#define FRAME_MORE 0x04             // Reply flag: one item of a batch, more replies follow.
+#define FRAME_FD 0x08               // Request: a local peer may answer with a descriptor. Reply: the
+                                    // payload is not inline but in the attached descriptor.
+#define FRAME_TREE 0x10             // Request flag on dispfnames: list every file below the path,
+                                    // relative to it, however deep and however many.
+#define BATCH_MAX_BYTES (1024 * 1024)   // Largest path list accepted in one batch.
 
-int main() {
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUFSIZE], recv_buf[BUFSIZE];
+enum { OP_UPLOADF = 1, OP_DOWNLF, OP_REMOVEF, OP_DOWNLTAR, OP_DISPFNAMES, OP_REPLY, OP_STAT, OP_LIST, OP_STATS };
+enum { FIELD_PATH = 1, FIELD_NAME, FIELD_TYPE, FIELD_TEXT, FIELD_SIZE, FIELD_MTIME, FIELD_OFFSET, FIELD_TRACE };
 
-    // Create a TCP socket.
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Client: socket");
-        exit(1);
-    }
+struct frame_hdr {
+    uint32_t magic;
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t version;
+    uint32_t req_id;          // Chosen by the requester and echoed in the reply.
+    uint32_t fields_len;
+    uint64_t payload_len;
+};
 
-    // Set up the server address structure.
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+// A received message: the decoded header and its field area.
+struct frame {
+    int opcode;
+    int flags;
+    uint32_t req_id;
+    long payload_len;
+    int fields_len;
+    char fields[FRAME_FIELDS_MAX];
+};
+
+static uint32_t next_req_id = 1;   // Id of the next request sent to S1.
+
+// Requests sent but not yet answered. When commands come from a file or pipe rather than a
+// terminal, consecutive downlf, removef and dispfnames commands are sent without waiting;
+// S1 answers them in whatever order they finish and the reply's req_id names the request.
+struct pending {
+    uint32_t req_id;
+    int opcode;
+    char path[512];
+    char local[512];    // Where a download is saved; its base name in the current directory if empty.
+};
+static struct pending pending[PIPELINE_MAX];
+static int npending = 0;
 
-    
+// Batch mode. "w25clients --batch <manifest> [--jobs N] [--summary <file>]" runs the
+// commands in the manifest ("-" for stdin) over N connections to S1 at once, then writes a
+// JSON summary to the summary file or stdout, and exits with status 1 if any command failed.
+// The manifest has one command per line: uploadf <file> <~S1/dir>, downlf <~S1/path>
+// [<local file>] or removef <~S1/path>; blank lines and lines starting with '#' are skipped.
+// The commands run in no particular order, so a manifest must not rely on one.
+#define JOBS_DEFAULT 4
+#define JOBS_MAX 64
+
+struct batch_item {
+    int line;                 // Line of the manifest.
+    int opcode;
+    char *arg, *arg2;         // The command's arguments; arg2 may be NULL.
+    char *error;              // Why the command failed, NULL if it succeeded.
+};
+static struct batch_item *items;
+static int nitems;
+static int batch_next;                     // Next item a connection takes.
+static unsigned long bytes_sent, bytes_received;
+
+// Function prototypes for file transmission operations.
+void send_file(int sock, const char *filename, long fsize);
+void receive_file(int sock, const char *filename, long fsize);
+int request(int, int, int, const char*, int, const char*, long);
+long recv_reply(int);
+void print_payload(int, long);
+int collect_reply(int);
+void collect_all(int);
+int conflicts(const struct pending*);
+void batch_request(int, int, char*);
+void upload_dir(int, const char*, const char*);
+int upload_walk(int, const char*, const char*, const char*, int*);
+void download_dir(int, const char*, const char*);
+void make_parents(const char*);
+int send_all(int, const char*, long);
+int recv_all(int, void*, long);
+int frame_add(char*, int, int, const char*);
+int frame_get(const struct frame*, int, char*, int);
+int frame_pack(char*, int, int, uint32_t, const char*, int, long);
+int frame_send(int, int, int, uint32_t, const char*, int, long);
+int frame_recv(int, struct frame*);
+int connect_s1(void);
+int batch_main(int, char*[]);
+int batch_load(FILE*);
+void *batch_worker(void*);
+int batch_op(int, uint32_t, struct batch_item*);
+void batch_summary(FILE*, int, double);
+void json_string(FILE*, const char*);
+
+int main(int argc, char *argv[]) {
+    int sock;
+    char buffer[BUFSIZE];
+    int pipelined = !isatty(STDIN_FILENO);
+
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+        return batch_main(argc, argv);
 
     // Connect to the main server.
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if ((sock = connect_s1()) < 0) {
         perror("Client: connect");
-        close(sock);
         exit(1);
     }
 
@@ -55,12 +151,51 @@ int main() {
         printf("\nw25clients$ ");
         fflush(stdout);
 
-        // Clear and read the user command.
+        // Clear and read the user command; end of input ends the session like "exit".
         memset(buffer, 0, BUFSIZE);
-        fgets(buffer, BUFSIZE, stdin);
+        if (!fgets(buffer, BUFSIZE, stdin))
+            break;
         // Remove the newline character from input.
         buffer[strcspn(buffer, "\n")] = 0;
 
+        // stat, or downlf/removef with several paths or an @file list of them, is sent as a
+        // single batch request.
+        char word[2];
+        if (strncmp(buffer, "stat ", 5) == 0 ||
+            ((strncmp(buffer, "downlf ", 7) == 0 || strncmp(buffer, "removef ", 8) == 0) &&
+             (sscanf(buffer, "%*s %*s %1s", word) == 1 || strstr(buffer, " @")))) {
+            collect_all(sock);
+            batch_request(sock, buffer[0] == 'd' ? OP_DOWNLF : buffer[0] == 'r' ? OP_REMOVEF : OP_STAT,
+                          strchr(buffer, ' ') + 1);
+            continue;
+        }
+
+        // Queue pipelined requests; any other command waits until they are all answered.
+        if (pipelined && (strncmp(buffer, "downlf ", 7) == 0 || strncmp(buffer, "removef ", 8) == 0 ||
+                          strncmp(buffer, "dispfnames ", 11) == 0)) {
+            struct pending *p = &pending[npending];
+            p->opcode = buffer[0] == 'd' && buffer[1] == 'o' ? OP_DOWNLF :
+                        buffer[0] == 'r' ? OP_REMOVEF : OP_DISPFNAMES;
+            if (sscanf(strchr(buffer, ' '), "%511s", p->path) != 1) {
+                printf("Invalid syntax. Use: %.*s <~S1/path>\n", (int)strcspn(buffer, " "), buffer);
+                continue;
+            }
+            // A removal must not overtake, or be overtaken by, another request on its path.
+            if (conflicts(p)) {
+                struct pending next = *p;
+                collect_all(sock);
+                pending[0] = next;
+                p = &pending[0];
+            }
+            p->req_id = next_req_id;
+            p->local[0] = '\0';
+            request(sock, p->opcode, FIELD_PATH, p->path, 0, NULL, 0);
+            if (++npending == PIPELINE_MAX)
+                collect_all(sock);
+            continue;
+        }
+        collect_all(sock);
+
         // If command is "exit", break the loop.
         if (strcmp(buffer, "exit") == 0) break;
 
@@ -68,39 +203,33 @@ int main() {
         if (strncmp(buffer, "uploadf ", 8) == 0) {
             char filename[256], destpath[512];
             // Expecting syntax: uploadf <filename> <~S1/path>
-            if (sscanf(buffer, "uploadf %s %s", filename, destpath) != 2) {
+            if (sscanf(buffer, "uploadf %255s %511s", filename, destpath) != 2) {
                 printf("Invalid syntax. Use: uploadf <filename> <~S1/path>\n");
                 continue;
             }
             // Check if the file exists locally.
-            FILE *fp = fopen(filename, "rb");
-            if (!fp) {
+            struct stat st;
+            if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
                 printf("File not found locally.\n");
                 continue;
             }
-            fclose(fp);
-            // Send the entire command to the server.
-            send(sock, buffer, strlen(buffer), 0);
-            // Call send_file to transmit file data.
-            send_file(sock, filename);
+            // Send the request with the file size in its header, then the file data.
+            request(sock, OP_UPLOADF, FIELD_NAME, filename, FIELD_PATH, destpath, st.st_size);
+            send_file(sock, filename, st.st_size);
 
             // Wait for server acknowledgment.
-            int n = recv(sock, recv_buf, BUFSIZE, 0);
-            if (n > 0) {
-                recv_buf[n] = '\0';
-                printf("%s", recv_buf);
-            }
+            recv_reply(sock);
         }
         // Process the "downlf" command: download an individual file.
         else if (strncmp(buffer, "downlf ", 7) == 0) {
             char filepath[512];
             // Expecting syntax: downlf <~S1/path/file.ext>
-            if (sscanf(buffer, "downlf %s", filepath) != 1) {
+            if (sscanf(buffer, "downlf %511s", filepath) != 1) {
                 printf("Invalid syntax. Use: downlf <~S1/path/file.ext>\n");
                 continue;
             }
             // Send the download request to the server.
-            send(sock, buffer, strlen(buffer), 0);
+            request(sock, OP_DOWNLF, FIELD_PATH, filepath, 0, NULL, 0);
             // Prepare a copy of the filepath and determine a local filename using basename.
             char filepath_copy[512];
             strncpy(filepath_copy, filepath, sizeof(filepath_copy));
@@ -108,18 +237,18 @@ int main() {
 
             char *local_filename = basename(filepath_copy);
             // Receive the file from server and store it locally with the determined name.
-            receive_file(sock, local_filename);
+            long fsize = recv_reply(sock);
+            if (fsize >= 0)
+                receive_file(sock, local_filename, fsize);
         }
         // Process the "downltar" command: download a tar archive of specific file types.
         else if (strncmp(buffer, "downltar ", 9) == 0) {
             char filetype[10];
-            // Expecting syntax: downltar <.c|.pdf|.txt>
-            if (sscanf(buffer, "downltar %s", filetype) != 1) {
-                printf("Invalid syntax. Use: downltar <.c|.pdf|.txt>\n");
+            // Expecting syntax: downltar <.c|.pdf|.txt|.zip|all>
+            if (sscanf(buffer, "downltar %9s", filetype) != 1) {
+                printf("Invalid syntax. Use: downltar <.c|.pdf|.txt|.zip|all>\n");
                 continue;
             }
-            // Send tar download request to server.
-            send(sock, buffer, strlen(buffer), 0);
             // Determine the expected tar archive name based on file type.
             char tar_filename[64];
             if (strcmp(filetype, ".c") == 0)
@@ -128,29 +257,65 @@ int main() {
                 strcpy(tar_filename, "pdf.tar");
             else if (strcmp(filetype, ".txt") == 0)
                 strcpy(tar_filename, "text.tar");
+            else if (strcmp(filetype, ".zip") == 0)
+                strcpy(tar_filename, "zip.tar");
+            else if (strcmp(filetype, "all") == 0)
+                strcpy(tar_filename, "allfiles.tar");
+            else if (filetype[0] == '.' && filetype[1])
+                // Other types may be routed by the server's configuration.
+                snprintf(tar_filename, sizeof(tar_filename), "%s.tar", filetype + 1);
             else {
                 printf("Unsupported file type for tar download.\n");
                 continue;
             }
+            // Send tar download request to server.
+            request(sock, OP_DOWNLTAR, FIELD_TYPE, filetype, 0, NULL, 0);
             // Receive the tar file from the server.
-            receive_file(sock, tar_filename);
+            long fsize = recv_reply(sock);
+            if (fsize >= 0)
+                receive_file(sock, tar_filename, fsize);
         }
-        // Process "removef" and "dispfnames" commands: forward as-is and display server responses.
+        // Process "removef" and "dispfnames" commands: send the path and display server responses.
         else if (strncmp(buffer, "removef ", 8) == 0 ||
                  strncmp(buffer, "dispfnames ", 11) == 0) {
-            send(sock, buffer, strlen(buffer), 0);
-            memset(recv_buf, 0, BUFSIZE);
-            int n = recv(sock, recv_buf, BUFSIZE, 0);
-            if (n > 0) {
-                recv_buf[n] = '\0';
-                printf("%s", recv_buf);
+            char path[512];
+            int remove_cmd = buffer[0] == 'r';
+            if (sscanf(buffer, remove_cmd ? "removef %511s" : "dispfnames %511s", path) != 1) {
+                printf("Invalid syntax. Use: %s <~S1/path>\n", remove_cmd ? "removef" : "dispfnames");
+                continue;
+            }
+            request(sock, remove_cmd ? OP_REMOVEF : OP_DISPFNAMES, FIELD_PATH, path, 0, NULL, 0);
+            // A file list comes back as the reply's payload.
+            print_payload(sock, recv_reply(sock));
+        }
+        // Process "uploaddir" and "downldir": copy a whole directory tree to or from S1.
+        else if (strncmp(buffer, "uploaddir ", 10) == 0) {
+            char dir[512], destpath[512];
+            if (sscanf(buffer, "uploaddir %511s %511s", dir, destpath) != 2) {
+                printf("Invalid syntax. Use: uploaddir <directory> <~S1/path>\n");
+                continue;
+            }
+            upload_dir(sock, dir, destpath);
+        }
+        else if (strncmp(buffer, "downldir ", 9) == 0) {
+            char dirpath[512], dir[512] = "";
+            if (sscanf(buffer, "downldir %511s %511s", dirpath, dir) < 1) {
+                printf("Invalid syntax. Use: downldir <~S1/path> [directory]\n");
+                continue;
             }
+            download_dir(sock, dirpath, dir);
+        }
+        // Process "stats": show S1's request metrics.
+        else if (strcmp(buffer, "stats") == 0) {
+            request(sock, OP_STATS, 0, NULL, 0, NULL, 0);
+            print_payload(sock, recv_reply(sock));
         }
         // Handle unknown commands.
         else {
             printf("Unknown command.\n");
         }
     }
+    collect_all(sock);
     // Close the socket and terminate the client.
     close(sock);
     printf("Client disconnected from S1. Goodbye!\n");
@@ -158,63 +323,57 @@ int main() {
 }
 
 // send_file: Reads a file from the local filesystem and transmits its contents to the server.
-// It first sends the file size and then streams the file in chunks.
-void send_file(int sock, const char *filename) {
+// The size was already announced in the request header; the file is streamed in chunks.
+void send_file(int sock, const char *filename, long fsize) {
     FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("fopen error");
-        return;
-    }
-    // Determine file size.
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    // Send the file size.
-    send(sock, &fsize, sizeof(long), 0);
-
     char buffer[BUFSIZE];
+    long sent = 0;
     int n;
     // Read and send file data in chunks.
-    while ((n = fread(buffer, 1, BUFSIZE, fp)) > 0) {
-        send(sock, buffer, n, 0);
+    while (fp && sent < fsize && (n = fread(buffer, 1, BUFSIZE, fp)) > 0) {
+        if (n > fsize - sent)
+            n = fsize - sent;
+        if (send_all(sock, buffer, n) != 0)
+            break;
+        sent += n;
+    }
+    if (fp)
+        fclose(fp);
+    // The server expects exactly fsize bytes; pad if the file shrank meanwhile.
+    memset(buffer, 0, BUFSIZE);
+    while (sent < fsize) {
+        n = fsize - sent < BUFSIZE ? fsize - sent : BUFSIZE;
+        if (send_all(sock, buffer, n) != 0)
+            break;
+        sent += n;
     }
-    fclose(fp);
 }
 
-// receive_file: Receives a file from the server and writes it to the local filesystem.
-// The function first receives the file size, then reads file data in chunks until completed.
-void receive_file(int sock, const char *filename) {
-    long fsize;
-    int ret = recv(sock, &fsize, sizeof(long), 0);
-    if (ret <= 0) {
-        printf("Error receiving file size from server.\n");
-        return;
-    }
-    // Check for error indicator (non-positive file size)
-    if (fsize <= 0) {
-        printf("Error: File not found on server.\n");
-        return;
-    }
-    
+// receive_file: Receives a file of fsize bytes from the server and writes it to the local
+// filesystem, reading file data in chunks until completed.
+void receive_file(int sock, const char *filename, long fsize) {
     // Open a local file for writing.
     FILE *fp = fopen(filename, "wb");
     if (!fp) {
         perror("Error opening file for writing");
-        return;
     }
     char buffer[BUFSIZE];
     long received = 0;
     int n;
-    // Receive file content until expected size is reached.
+    // Receive file content until expected size is reached. The data is read even if
+    // the file could not be created, so the next reply starts in the right place.
     while (received < fsize) {
-        n = recv(sock, buffer, BUFSIZE, 0);
+        n = recv(sock, buffer, fsize - received < BUFSIZE ? fsize - received : BUFSIZE, 0);
         if (n <= 0) {
             printf("Error receiving file data from server.\n");
             break;
         }
-        fwrite(buffer, 1, n, fp);
+        if (fp)
+            fwrite(buffer, 1, n, fp);
         received += n;
     }
+    if (!fp)
+        return;
     fclose(fp);
     // Check if the entire file was received successfully.
     if (received == fsize)
@@ -224,3 +383,688 @@ void receive_file(int sock, const char *filename) {
         remove(filename);
     }
 }
+
+// request: Sends a framed request to S1 with one or two typed fields (field2 = 0 for none).
+// payload_len announces the upload data the caller sends next.
+int request(int sock, int opcode, int field, const char *value, int field2, const char *value2,
+            long payload_len) {
+    char fields[FRAME_FIELDS_MAX];
+    int len = field ? frame_add(fields, 0, field, value) : 0;
+    if (field2)
+        len = frame_add(fields, len, field2, value2);
+    if (len < 0) {
+        printf("Request arguments are too long.\n");
+        exit(1);
+    }
+    return frame_send(sock, opcode, 0, next_req_id++, fields, len, payload_len);
+}
+
+// recv_reply: Receives the reply to the last request and prints its status text, if any.
+// Returns the size of the payload that follows, or -1 if the request failed.
+long recv_reply(int sock) {
+    struct frame f;
+    char text[BUFSIZE];
+    if (frame_recv(sock, &f) != 0 || f.opcode != OP_REPLY) {
+        printf("Connection to S1 lost.\n");
+        exit(1);
+    }
+    if (frame_get(&f, FIELD_TEXT, text, sizeof(text)) == 0)
+        printf("%s", text);
+    return (f.flags & FRAME_ERROR) ? -1 : f.payload_len;
+}
+
+// print_payload: Prints a reply payload of len bytes, such as a file list.
+void print_payload(int sock, long len) {
+    char buf[BUFSIZE];
+    while (len > 0) {
+        int n = recv(sock, buf, len < BUFSIZE - 1 ? len : BUFSIZE - 1, 0);
+        if (n <= 0)
+            break;
+        buf[n] = '\0';
+        printf("%s", buf);
+        len -= n;
+    }
+}
+
+// collect_reply: Receives the next reply from S1, which may answer any pending request, and
+// completes that request: a downloaded file is saved, a status or file list is printed
+// under the path it belongs to. Returns -1 if the request failed.
+int collect_reply(int sock) {
+    struct frame f;
+    char text[BUFSIZE];
+    int i;
+    if (frame_recv(sock, &f) != 0 || f.opcode != OP_REPLY) {
+        printf("Connection to S1 lost.\n");
+        exit(1);
+    }
+    for (i = 0; i < npending && pending[i].req_id != f.req_id; i++)
+        ;
+    if (i == npending) {
+        // Without a matching request the payload length cannot be trusted.
+        printf("Unexpected reply %u from S1.\n", f.req_id);
+        exit(1);
+    }
+    struct pending *p = &pending[i];
+    printf("%s:\n", p->path);
+    if (frame_get(&f, FIELD_TEXT, text, sizeof(text)) == 0)
+        printf("%s", text);
+    if (f.flags & FRAME_ERROR)
+        print_payload(sock, f.payload_len);
+    else if (p->opcode == OP_DOWNLF)
+        receive_file(sock, p->local[0] ? p->local : basename(p->path), f.payload_len);
+    else
+        print_payload(sock, f.payload_len);
+    pending[i] = pending[--npending];
+    return (f.flags & FRAME_ERROR) ? -1 : 0;
+}
+
+// conflicts: Tells whether a new request must wait for the pending ones because S1 could
+// run them in either order: a removef and another request on the same file, or on a file
+// inside a directory being listed.
+int conflicts(const struct pending *p) {
+    for (int i = 0; i < npending; i++) {
+        const struct pending *q = &pending[i];
+        if (p->opcode != OP_REMOVEF && q->opcode != OP_REMOVEF)
+            continue;
+        if (strcmp(p->path, q->path) == 0 ||
+            (p->opcode == OP_DISPFNAMES && strncmp(q->path, p->path, strlen(p->path)) == 0) ||
+            (q->opcode == OP_DISPFNAMES && strncmp(p->path, q->path, strlen(q->path)) == 0))
+            return 1;
+    }
+    return 0;
+}
+
+// collect_all: Waits for the replies to every pending request.
+void collect_all(int sock) {
+    while (npending > 0)
+        collect_reply(sock);
+}
+
+// batch_request: Sends one downlf, removef or stat request for many paths, given as
+// arguments or read from @file arguments (one path per line), and reports each item's
+// result as it streams back. Downloaded files are saved under their base names.
+void batch_request(int sock, int opcode, char *args) {
+    char *list = NULL, *save, line[BUFSIZE];
+    long len = 0, cap = 0;
+    int n = 0, failed = 0;
+    for (char *arg = strtok_r(args, " \t", &save); arg; arg = strtok_r(NULL, " \t", &save)) {
+        FILE *fp = NULL;
+        if (arg[0] == '@' && !(fp = fopen(arg + 1, "r"))) {
+            perror(arg + 1);
+            free(list);
+            return;
+        }
+        // A plain argument is a list of one.
+        while (fp ? fgets(line, sizeof(line), fp) != NULL : arg != NULL) {
+            if (!fp) {
+                snprintf(line, sizeof(line), "%s", arg);
+                arg = NULL;
+            }
+            line[strcspn(line, "\r\n")] = '\0';
+            long l = strlen(line);
+            if (l == 0)
+                continue;
+            if (len + l + 1 > BATCH_MAX_BYTES) {
+                printf("Too many paths for one batch.\n");
+                if (fp)
+                    fclose(fp);
+                free(list);
+                return;
+            }
+            if (len + l + 1 > cap) {
+                cap = cap ? cap * 2 : 4096;
+                list = realloc(list, cap);
+                if (!list) {
+                    printf("Out of memory.\n");
+                    exit(1);
+                }
+            }
+            memcpy(list + len, line, l);
+            list[len + l] = '\n';
+            len += l + 1;
+            n++;
+        }
+        if (fp)
+            fclose(fp);
+    }
+    if (n == 0) {
+        printf("Invalid syntax. Use: %s <~S1/path|@listfile>...\n",
+               opcode == OP_DOWNLF ? "downlf" : opcode == OP_REMOVEF ? "removef" : "stat");
+        free(list);
+        return;
+    }
+
+    uint32_t id = next_req_id++;
+    if (frame_send(sock, opcode, FRAME_BATCH, id, NULL, 0, len) != 0 || send_all(sock, list, len) != 0) {
+        printf("Connection to S1 lost.\n");
+        exit(1);
+    }
+    free(list);
+
+    // Item replies carry FRAME_MORE; the last reply closes the batch.
+    while (1) {
+        struct frame f;
+        char text[BUFSIZE] = "", path[512] = "", size[24] = "", mtime[24] = "";
+        if (frame_recv(sock, &f) != 0 || f.opcode != OP_REPLY || f.req_id != id) {
+            printf("Connection to S1 lost.\n");
+            exit(1);
+        }
+        frame_get(&f, FIELD_TEXT, text, sizeof(text));
+        if (!(f.flags & FRAME_MORE)) {
+            printf("%s", text);
+            print_payload(sock, f.payload_len);
+            break;
+        }
+        frame_get(&f, FIELD_PATH, path, sizeof(path));
+        if (f.flags & FRAME_ERROR) {
+            failed++;
+            printf("%s: %s", path, text);
+            print_payload(sock, f.payload_len);
+        } else if (opcode == OP_DOWNLF) {
+            receive_file(sock, basename(path), f.payload_len);
+        } else if (opcode == OP_STAT) {
+            frame_get(&f, FIELD_SIZE, size, sizeof(size));
+            frame_get(&f, FIELD_MTIME, mtime, sizeof(mtime));
+            time_t t = atol(mtime);
+            printf("%s  %s bytes  %s", path, size, ctime(&t));
+        } else {
+            printf("%s: %s", path, text);
+            print_payload(sock, f.payload_len);
+        }
+    }
+    if (failed > 0)
+        printf("%d of %d failed.\n", failed, n);
+}
+
+// upload_dir: Uploads every file below local directory dir to the same place below the ~S1
+// directory dest. The files go as one stream of upload requests, each sent without waiting
+// for the replies to the ones before it; S1 passes each on to its backend as it arrives.
+void upload_dir(int sock, const char *dir, const char *dest) {
+    struct stat st;
+    int failed = 0;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("Directory not found locally.\n");
+        return;
+    }
+    int count = upload_walk(sock, dir, "", dest, &failed);
+    while (npending > 0)
+        failed += collect_reply(sock) != 0;
+    printf("Uploaded %d files to %s", count - failed, dest);
+    if (failed > 0)
+        printf(", %d failed", failed);
+    printf(".\n");
+}
+
+// upload_walk: Sends an upload request for each file below dir, whose path relative to the
+// top of the upload is rel ("" at the top), collecting replies whenever PIPELINE_MAX are
+// outstanding. Failed replies are counted in failed. Returns the number of files sent.
+int upload_walk(int sock, const char *dir, const char *rel, const char *dest, int *failed) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[1024], name[1024];
+    struct stat st;
+    int count = 0;
+    if (!d) {
+        perror(dir);
+        return 0;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name);
+        if (stat(path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            count += upload_walk(sock, path, name, dest, failed);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+            continue;
+        if (strlen(name) >= sizeof(pending[0].path)) {
+            printf("%s: path too long, skipped.\n", name);
+            continue;
+        }
+        while (npending == PIPELINE_MAX)
+            *failed += collect_reply(sock) != 0;
+        struct pending *p = &pending[npending++];
+        p->req_id = next_req_id;
+        p->opcode = OP_UPLOADF;
+        strcpy(p->path, name);
+        p->local[0] = '\0';
+        request(sock, OP_UPLOADF, FIELD_NAME, name, FIELD_PATH, dest, st.st_size);
+        send_file(sock, path, st.st_size);
+        count++;
+    }
+    closedir(d);
+    return count;
+}
+
+// download_dir: Downloads every file below the ~S1 directory dirpath into local directory dir
+// (by default one named after dirpath), recreating its subdirectories. S1 lists the tree in
+// one request, then the files are fetched with up to PIPELINE_MAX requests outstanding.
+void download_dir(int sock, const char *dirpath, const char *dir) {
+    char fields[FRAME_FIELDS_MAX], top[512];
+    int len = frame_add(fields, 0, FIELD_PATH, dirpath), count = 0, failed = 0;
+    if (!dir[0]) {
+        snprintf(top, sizeof(top), "%s", dirpath);
+        dir = basename(top);
+    }
+    if (len < 0 || frame_send(sock, OP_DISPFNAMES, FRAME_TREE, next_req_id++, fields, len, 0) != 0) {
+        printf("Connection to S1 lost.\n");
+        exit(1);
+    }
+    long n = recv_reply(sock);
+    if (n < 0)
+        return;
+    char *list = malloc(n + 1), *save;
+    if (!list || recv_all(sock, list, n) != 0) {
+        printf("Connection to S1 lost.\n");
+        exit(1);
+    }
+    list[n] = '\0';
+    for (char *rel = strtok_r(list, "\n", &save); rel; rel = strtok_r(NULL, "\n", &save)) {
+        while (npending == PIPELINE_MAX)
+            failed += collect_reply(sock) != 0;
+        struct pending *p = &pending[npending];
+        snprintf(p->path, sizeof(p->path), "%s/%s", dirpath, rel);
+        snprintf(p->local, sizeof(p->local), "%s/%s", dir, rel);
+        make_parents(p->local);
+        p->req_id = next_req_id;
+        p->opcode = OP_DOWNLF;
+        request(sock, OP_DOWNLF, FIELD_PATH, p->path, 0, NULL, 0);
+        npending++;
+        count++;
+    }
+    free(list);
+    while (npending > 0)
+        failed += collect_reply(sock) != 0;
+    printf("Downloaded %d files into %s", count - failed, dir);
+    if (failed > 0)
+        printf(", %d failed", failed);
+    printf(".\n");
+}
+
+// make_parents: Creates the directories leading to path, as mkdir -p would.
+void make_parents(const char *path) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
+
+// send_all: Sends all len bytes, retrying after short writes.
+int send_all(int sock, const char *buf, long len) {
+    long sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, buf + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// recv_all: Receives exactly len bytes. Returns 0 on success, -1 if the peer went away.
+int recv_all(int sock, void *buf, long len) {
+    long got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// frame_add: Appends a typed field to a field area of len bytes and returns the new length,
+// or -1 if it does not fit.
+int frame_add(char *fields, int len, int type, const char *value) {
+    int vlen = strlen(value);
+    if (len < 0 || vlen > 0xffff || len + 3 + vlen > FRAME_FIELDS_MAX)
+        return -1;
+    fields[len] = type;
+    fields[len + 1] = vlen >> 8;
+    fields[len + 2] = vlen & 0xff;
+    memcpy(fields + len + 3, value, vlen);
+    return len + 3 + vlen;
+}
+
+// frame_get: Copies the value of a field into out as a string. Returns -1 if the field is
+// missing, malformed or longer than outsz - 1.
+int frame_get(const struct frame *f, int type, char *out, int outsz) {
+    int off = 0;
+    while (off + 3 <= f->fields_len) {
+        int vlen = ((unsigned char)f->fields[off + 1] << 8) | (unsigned char)f->fields[off + 2];
+        if (off + 3 + vlen > f->fields_len)
+            return -1;
+        if (f->fields[off] == type) {
+            if (vlen >= outsz || memchr(f->fields + off + 3, '\0', vlen))
+                return -1;
+            memcpy(out, f->fields + off + 3, vlen);
+            out[vlen] = '\0';
+            return 0;
+        }
+        off += 3 + vlen;
+    }
+    return -1;
+}
+
+// frame_pack: Encodes a message header and its field area into out, which must have room for
+// a header and FRAME_FIELDS_MAX bytes. Returns the encoded length, or -1 if the fields are
+// too long.
+int frame_pack(char *out, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    struct frame_hdr h;
+    if (fields_len < 0 || fields_len > FRAME_FIELDS_MAX)
+        return -1;
+    h.magic = htonl(FRAME_MAGIC);
+    h.opcode = opcode;
+    h.flags = flags;
+    h.version = htons(FRAME_VERSION);
+    h.req_id = htonl(req_id);
+    h.fields_len = htonl(fields_len);
+    h.payload_len = htobe64(payload_len);
+    memcpy(out, &h, sizeof(h));
+    if (fields_len > 0)
+        memcpy(out + sizeof(h), fields, fields_len);
+    return sizeof(h) + fields_len;
+}
+
+// frame_send: Sends a message header and its field area in one write; the caller sends
+// the payload_len bytes of payload after it.
+int frame_send(int sock, int opcode, int flags, uint32_t req_id, const char *fields, int fields_len,
+               long payload_len) {
+    char out[sizeof(struct frame_hdr) + FRAME_FIELDS_MAX];
+    long len = frame_pack(out, opcode, flags, req_id, fields, fields_len, payload_len), sent = 0;
+    if (len < 0)
+        return -1;
+    // With a payload to follow, MSG_MORE holds the header back so the two share a segment
+    // instead of the payload waiting on Nagle for the header's delayed ACK.
+    while (sent < len) {
+        ssize_t n = send(sock, out + sent, len - sent, payload_len > 0 ? MSG_MORE : 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// frame_recv: Receives a message header and its field area, leaving the payload on the
+// socket. Returns -1 at end of stream or if the header is not a valid frame.
+int frame_recv(int sock, struct frame *f) {
+    struct frame_hdr h;
+    if (recv_all(sock, &h, sizeof(h)) != 0)
+        return -1;
+    if (ntohl(h.magic) != FRAME_MAGIC || ntohs(h.version) != FRAME_VERSION ||
+        ntohl(h.fields_len) > FRAME_FIELDS_MAX || (int64_t)be64toh(h.payload_len) < 0)
+        return -1;
+    f->opcode = h.opcode;
+    f->flags = h.flags;
+    f->req_id = ntohl(h.req_id);
+    f->fields_len = ntohl(h.fields_len);
+    f->payload_len = be64toh(h.payload_len);
+    return recv_all(sock, f->fields, f->fields_len);
+}
+
+// connect_s1: Opens a connection to S1. Returns the socket, or -1.
+int connect_s1(void) {
+    int one = 1;
+    struct sockaddr_in server_addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    // The end of an upload must not wait on Nagle for the ACK of the data before it, which
+    // S1 may delay until the upload is complete.
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+// batch_main: Runs batch mode with the command line in argv.
+int batch_main(int argc, char *argv[]) {
+    const char *manifest = NULL, *summary = NULL;
+    int jobs = JOBS_DEFAULT;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--batch") == 0)
+            manifest = argv[i + 1];
+        else if (strcmp(argv[i], "--jobs") == 0)
+            jobs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--summary") == 0)
+            summary = argv[i + 1];
+        else
+            manifest = NULL;
+    }
+    if (!manifest || jobs < 1 || jobs > JOBS_MAX || argc % 2 == 0) {
+        fprintf(stderr, "Usage: w25clients --batch <manifest|-> [--jobs 1-%d] [--summary <file>]\n", JOBS_MAX);
+        return 2;
+    }
+    FILE *in = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!in) {
+        perror(manifest);
+        return 2;
+    }
+    if (batch_load(in) != 0) {
+        fprintf(stderr, "Out of memory.\n");
+        return 2;
+    }
+    if (in != stdin)
+        fclose(in);
+
+    // Each connection takes the next command as soon as it is done with its last one.
+    struct timespec t0, t1;
+    pthread_t tids[JOBS_MAX];
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (jobs > nitems)
+        jobs = nitems > 0 ? nitems : 1;
+    for (int i = 0; i < jobs; i++)
+        if (pthread_create(&tids[i], NULL, batch_worker, NULL) != 0) {
+            perror("pthread_create");
+            return 2;
+        }
+    for (int i = 0; i < jobs; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    FILE *out = summary ? fopen(summary, "w") : stdout;
+    if (!out) {
+        perror(summary);
+        out = stdout;
+    }
+    int failed = 0;
+    for (int i = 0; i < nitems; i++)
+        failed += items[i].error != NULL;
+    batch_summary(out, jobs, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    if (out != stdout)
+        fclose(out);
+    return failed > 0;
+}
+
+// batch_load: Reads the commands of a manifest into items. A line that is not a valid
+// command becomes an item that has already failed. Returns -1 if memory ran out.
+int batch_load(FILE *in) {
+    char *line = NULL, *save;
+    size_t linecap = 0;
+    int cap = 0, lineno = 0;
+    while (getline(&line, &linecap, in) > 0) {
+        lineno++;
+        char *cmd = strtok_r(line, " \t\r\n", &save);
+        if (!cmd || cmd[0] == '#')
+            continue;
+        char *arg = strtok_r(NULL, " \t\r\n", &save), *arg2 = strtok_r(NULL, " \t\r\n", &save);
+        if (nitems == cap) {
+            cap = cap ? cap * 2 : 1024;
+            struct batch_item *grown = realloc(items, cap * sizeof(*items));
+            if (!grown)
+                return -1;
+            items = grown;
+        }
+        struct batch_item *it = &items[nitems++];
+        it->line = lineno;
+        it->opcode = strcmp(cmd, "uploadf") == 0 ? OP_UPLOADF : strcmp(cmd, "downlf") == 0 ? OP_DOWNLF :
+                     strcmp(cmd, "removef") == 0 ? OP_REMOVEF : 0;
+        it->arg = strdup(arg ? arg : cmd);
+        it->arg2 = arg2 ? strdup(arg2) : NULL;
+        it->error = NULL;
+        if (!it->opcode || !arg || (it->opcode == OP_UPLOADF) != (arg2 != NULL) ||
+            strtok_r(NULL, " \t\r\n", &save))
+            it->error = strdup("Invalid command.");
+    }
+    free(line);
+    return 0;
+}
+
+// batch_worker: Thread body for one connection to S1. It runs commands until there are none
+// left, and opens a new connection if S1 closes this one.
+void *batch_worker(void *arg) {
+    int sock = -1, i;
+    uint32_t id = 1;
+    (void)arg;
+    while ((i = __atomic_fetch_add(&batch_next, 1, __ATOMIC_RELAXED)) < nitems) {
+        struct batch_item *it = &items[i];
+        if (it->error)
+            continue;
+        if (sock < 0 && (sock = connect_s1()) < 0) {
+            it->error = strdup("Cannot connect to S1.");
+            continue;
+        }
+        if (batch_op(sock, id++, it) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock >= 0)
+        close(sock);
+    return NULL;
+}
+
+// batch_op: Runs one command of the manifest on connection sock, as request id, and records
+// its error, if any. Returns -1 if the connection can no longer be used.
+int batch_op(int sock, uint32_t id, struct batch_item *it) {
+    char fields[FRAME_FIELDS_MAX], text[BUFSIZE] = "", buf[BUFSIZE], name[512];
+    struct frame f;
+    struct stat st;
+    long size = 0;
+    int len;
+    if (it->opcode == OP_UPLOADF) {
+        if (stat(it->arg, &st) != 0 || !S_ISREG(st.st_mode)) {
+            it->error = strdup("File not found locally.");
+            return 0;
+        }
+        size = st.st_size;
+        len = frame_add(fields, frame_add(fields, 0, FIELD_NAME, it->arg), FIELD_PATH, it->arg2);
+    } else {
+        len = frame_add(fields, 0, FIELD_PATH, it->arg);
+    }
+    if (len < 0) {
+        it->error = strdup("Arguments are too long.");
+        return 0;
+    }
+    if (frame_send(sock, it->opcode, 0, id, fields, len, size) != 0) {
+        it->error = strdup("Connection to S1 lost.");
+        return -1;
+    }
+    if (it->opcode == OP_UPLOADF) {
+        send_file(sock, it->arg, size);
+        __atomic_fetch_add(&bytes_sent, size, __ATOMIC_RELAXED);
+    }
+    if (frame_recv(sock, &f) != 0 || f.opcode != OP_REPLY || f.req_id != id) {
+        it->error = strdup("Connection to S1 lost.");
+        return -1;
+    }
+    frame_get(&f, FIELD_TEXT, text, sizeof(text));
+    text[strcspn(text, "\n")] = '\0';
+
+    // A download is saved to its local name, or under its base name; anything else is
+    // read and dropped.
+    FILE *fp = NULL;
+    if (it->opcode == OP_DOWNLF && !(f.flags & FRAME_ERROR)) {
+        snprintf(name, sizeof(name), "%s", it->arg2 ? it->arg2 : basename(it->arg));
+        if (!(fp = fopen(name, "wb")))
+            snprintf(text, sizeof(text), "%s: %s", name, strerror(errno));
+    }
+    long left = f.payload_len;
+    while (left > 0) {
+        int n = recv(sock, buf, left < BUFSIZE ? left : BUFSIZE, 0);
+        if (n <= 0)
+            break;
+        if (fp)
+            fwrite(buf, 1, n, fp);
+        left -= n;
+    }
+    __atomic_fetch_add(&bytes_received, f.payload_len - left, __ATOMIC_RELAXED);
+    if (fp && (fclose(fp) != 0 || left > 0)) {
+        remove(name);
+        snprintf(text, sizeof(text), "%s: incomplete download", name);
+        fp = NULL;
+    }
+    if ((f.flags & FRAME_ERROR) || (it->opcode == OP_DOWNLF && !fp) || left > 0)
+        it->error = strdup(text[0] ? text : "Failed.");
+    return left > 0 ? -1 : 0;
+}
+
+// batch_summary: Writes the outcome of a batch as JSON: totals, counts per command and the
+// manifest line and error of every command that failed.
+void batch_summary(FILE *out, int jobs, double seconds) {
+    static const char *names[] = { "", "uploadf", "downlf", "removef" };
+    int ok[4] = { 0 }, failed[4] = { 0 }, total_failed = 0, first = 1;
+    for (int i = 0; i < nitems; i++) {
+        if (items[i].error)
+            failed[items[i].opcode]++;
+        else
+            ok[items[i].opcode]++;
+    }
+    for (int op = 0; op < 4; op++)
+        total_failed += failed[op];
+    fprintf(out, "{\n  \"commands\": %d,\n  \"succeeded\": %d,\n  \"failed\": %d,\n", nitems,
+            nitems - total_failed, total_failed);
+    fprintf(out, "  \"jobs\": %d,\n  \"seconds\": %.3f,\n  \"bytes_sent\": %lu,\n  \"bytes_received\": %lu,\n",
+            jobs, seconds, bytes_sent, bytes_received);
+    fprintf(out, "  \"by_command\": {");
+    for (int op = 1; op < 4; op++)
+        fprintf(out, "%s\n    \"%s\": {\"succeeded\": %d, \"failed\": %d}", op > 1 ? "," : "", names[op],
+                ok[op], failed[op]);
+    fprintf(out, "\n  },\n  \"failures\": [");
+    for (int i = 0; i < nitems; i++) {
+        if (!items[i].error)
+            continue;
+        fprintf(out, "%s\n    {\"line\": %d, \"command\": ", first ? "" : ",", items[i].line);
+        json_string(out, items[i].opcode ? names[items[i].opcode] : "");
+        fprintf(out, ", \"path\": ");
+        json_string(out, items[i].arg);
+        fprintf(out, ", \"error\": ");
+        json_string(out, items[i].error);
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "%s]\n}\n", first ? "" : "\n  ");
+}
+
+// json_string: Writes s as a JSON string literal.
+void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}